@@ -0,0 +1,1863 @@
+/*
+ * sphinx_api.c
+ *
+ * Client of the native searchd protocol (SphinxAPI, listen = host:9312),
+ * used instead of SphinxQL by connections opened with protocol=api.
+ *
+ * sphinx_query() and sphinx_query_batch() on such a connection translate
+ * their statements into search queries: the select list goes as it is, the
+ * index list, MATCH(), filters on attributes, ORDER BY, LIMIT and some of
+ * the OPTIONs become the fields of the query, and anything else is refused.
+ * All the statements of a call go out in one multi-query request.  searchd
+ * answers with attributes in binary, which are turned into Datums without
+ * printing and parsing numbers; values a column can't take that way get the
+ * text SphinxQL would have sent, so both protocols give the same results.
+ * SHOW META is answered from the last result received.
+ *
+ * A request that fails halfway, is cancelled or times out leaves the
+ * connection out of step with searchd, so it is closed and opened again for
+ * the next request.
+ *
+ * contrib/sphinxlink/sphinx_api.c
+ */
+#include "postgres.h"
+
+#include <float.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "miscadmin.h"
+#include "nodes/pg_list.h"
+#include "parser/scansup.h"
+#include "portability/instr_time.h"
+#include "storage/latch.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+#include <sphinxlink.h>
+
+/* commands and their versions */
+#define SEARCHD_COMMAND_SEARCH	0
+#define SEARCHD_COMMAND_PERSIST 4
+#define VER_COMMAND_SEARCH		0x11E
+
+/* status of a response and of each query result */
+#define SEARCHD_OK		0
+#define SEARCHD_ERROR	1
+#define SEARCHD_RETRY	2
+#define SEARCHD_WARNING 3
+
+/* largest response accepted; searchd's max_packet_size is at most 128M */
+#define API_MAX_RESPONSE	((uint32) MaxAllocSize)
+
+#define SPH_MATCH_EXTENDED2 6
+#define SPH_SORT_RELEVANCE	0
+#define SPH_SORT_EXTENDED	4
+#define SPH_GROUPBY_DAY		0
+
+#define SPH_FILTER_VALUES		0
+#define SPH_FILTER_RANGE		1
+#define SPH_FILTER_FLOATRANGE	2
+#define SPH_FILTER_STRING		3
+
+#define SPH_ATTR_INTEGER	1
+#define SPH_ATTR_TIMESTAMP	2
+#define SPH_ATTR_BOOL		4
+#define SPH_ATTR_FLOAT		5
+#define SPH_ATTR_BIGINT		6
+#define SPH_ATTR_STRING		7
+#define SPH_ATTR_FACTORS	1001
+#define SPH_ATTR_MULTI		0x40000001
+#define SPH_ATTR_MULTI64	0x40000002
+
+/* sources of result columns other than attributes */
+#define API_COLUMN_DOCID	(-1)
+#define API_COLUMN_WEIGHT	(-2)
+
+/* defaults SphinxQL uses too */
+#define DEFAULT_LIMIT		20
+#define DEFAULT_MAX_MATCHES 1000
+
+/* rankers by their SPH_RANK_* number; expression rankers need SphinxQL */
+static const char *const rankers[] = {
+	"proximity_bm25", "bm25", "none", "wordcount", "proximity", "matchany",
+	"fieldmask", "sph04", NULL
+};
+
+struct sphinxApiConn
+{
+	pgsocket	sock;			/* PGINVALID_SOCKET until (re)connected */
+	char		host[MAXHOSTLEN];
+	int			port;
+	sphinxConnOptions options;
+	MemoryContext metacxt;		/* holds meta */
+	int			nmeta;
+	char	  **meta;			/* SHOW META of the last query, name and value pairs */
+};
+
+typedef enum apiTokenKind
+{
+	TOKEN_END = 0,
+	TOKEN_IDENT,
+	TOKEN_NUMBER,
+	TOKEN_STRING,
+	TOKEN_OP
+} apiTokenKind;
+
+typedef struct apiToken
+{
+	apiTokenKind kind;
+	int			start;			/* offset in the statement */
+	int			len;
+	char	   *value;			/* unescaped string, or the token as written */
+} apiToken;
+
+typedef struct apiParser
+{
+	const char *sql;
+	apiToken   *tokens;			/* ends with TOKEN_END */
+	int			pos;
+} apiParser;
+
+typedef struct apiNumber
+{
+	bool		isfloat;
+	int64		ival;
+	float		fval;
+} apiNumber;
+
+typedef struct apiFilter
+{
+	const char *attr;
+	int			type;			/* SPH_FILTER_* */
+	List	   *values;			/* int64 pointers, for SPH_FILTER_VALUES */
+	int64		min;
+	int64		max;
+	float		fmin;
+	float		fmax;
+	const char *str;
+	bool		exclude;
+} apiFilter;
+
+/* A statement translated into a search query */
+typedef struct apiQuery
+{
+	char	   *select;			/* select list as written */
+	List	   *items;			/* name of each select item, NULL for * */
+	StringInfoData indexes;
+	const char *query;			/* full-text query, or NULL for a full scan */
+	List	   *filters;
+	int			sort;
+	StringInfoData sortby;
+	int			offset;
+	int			limit;
+	int			max_matches;
+	int			ranker;
+	int			cutoff;
+	int			max_query_time;
+	const char *comment;
+} apiQuery;
+
+typedef struct apiReader
+{
+	const char *pos;
+	const char *end;
+} apiReader;
+
+static bool openConnection(sphinxApiConn *conn, char **errmsg);
+static bool connectTo(sphinxApiConn *conn, const struct sockaddr *addr, socklen_t addrlen,
+					  TimestampTz deadline, char **errmsg);
+static void closeSocket(sphinxApiConn *conn);
+static TimestampTz timeoutDeadline(int timeout);
+static bool waitSocket(sphinxApiConn *conn, int event, TimestampTz deadline);
+static bool sendAll(sphinxApiConn *conn, const char *data, size_t len, TimestampTz deadline,
+					char **errmsg);
+static bool recvAll(sphinxApiConn *conn, char *data, size_t len, TimestampTz deadline,
+					char **errmsg);
+static void requestFailed(int timeout, char *msg) pg_attribute_noreturn();
+static apiReader sendRequest(sphinxApiConn *conn, StringInfo req, sphinxQueryStats *stats);
+static sphinxApiResult *readResult(sphinxApiConn *conn, apiReader *r, apiQuery *q,
+								   sphinxQueryStats *stats);
+static sphinxApiResult *metaResult(sphinxApiConn *conn);
+static void resolveColumns(sphinxApiResult *res, apiQuery *q, char **names);
+static void skipAttr(apiReader *r, uint32 type);
+static Datum attrDatum(convPlan *plan, int attnum, uint32 type, apiReader *r);
+static Datum intDatum(convPlan *plan, int attnum, int64 value);
+static Datum floatDatum(convPlan *plan, int attnum, float value);
+static apiQuery *parseStatement(const char *sql);
+static void parseSelectList(apiParser *p, apiQuery *q);
+static void parseCondition(apiParser *p, apiQuery *q);
+static void parseOrder(apiParser *p, apiQuery *q);
+static void parseOptions(apiParser *p, apiQuery *q);
+static void parseInList(apiParser *p, apiQuery *q, const char *attr, bool exclude);
+static void addRange(apiQuery *q, const char *attr, apiNumber *lo, apiNumber *hi, bool exclude);
+static void parseNumber(apiParser *p, apiNumber *num);
+static int	parseCount(apiParser *p);
+static apiToken *tokenize(const char *sql);
+static int64 *int64Value(int64 value);
+static bool isKeywordToken(apiToken *tok, const char *keyword);
+static bool isOpToken(apiToken *tok, const char *op);
+static bool acceptKeyword(apiParser *p, const char *keyword);
+static void expectKeyword(apiParser *p, const char *keyword);
+static bool acceptOp(apiParser *p, const char *op);
+static void expectOp(apiParser *p, const char *op);
+static char *expectIdent(apiParser *p);
+static void unsupportedQuery(const char *sql, apiToken *tok) pg_attribute_noreturn();
+static void appendQuery(StringInfo buf, apiQuery *q);
+static void appendUInt32(StringInfo buf, uint32 value);
+static void appendUInt64(StringInfo buf, uint64 value);
+static void appendFloat(StringInfo buf, float value);
+static void appendString(StringInfo buf, const char *value);
+static uint32 readUInt32(apiReader *r);
+static uint64 readUInt64(apiReader *r);
+static const char *readBytes(apiReader *r, uint32 *len);
+static char *readCString(apiReader *r);
+static uint32 readCount(apiReader *r, int size);
+static void malformedResponse(void) pg_attribute_noreturn();
+
+#define TOKEN(p) (&(p)->tokens[(p)->pos])
+
+
+/*
+ * Open a SphinxAPI connection.  On failure returns NULL and sets *errmsg, as
+ * sphinxConnect() does.
+ */
+sphinxApiConn *
+sphinxApiConnect(const char *host, int port, const sphinxConnOptions *options, char **errmsg)
+{
+	sphinxApiConn *conn;
+
+	conn = (sphinxApiConn *) MemoryContextAllocZero(TopMemoryContext, sizeof(sphinxApiConn));
+	conn->sock = PGINVALID_SOCKET;
+	strlcpy(conn->host, host, MAXHOSTLEN);
+	conn->port = port;
+	if (options)
+		conn->options = *options;
+	conn->metacxt = AllocSetContextCreate(TopMemoryContext,
+										  "sphinxlink SphinxAPI meta",
+										  ALLOCSET_SMALL_SIZES);
+
+	if (!openConnection(conn, errmsg))
+	{
+		sphinxApiClose(conn);
+		return NULL;
+	}
+
+	return conn;
+}
+
+
+void
+sphinxApiClose(sphinxApiConn *conn)
+{
+	closeSocket(conn);
+	MemoryContextDelete(conn->metacxt);
+	pfree(conn);
+}
+
+
+/*
+ * Run the statements as one request.  Returns a result per statement; those
+ * of failed queries carry the error of searchd.
+ */
+sphinxApiResult **
+sphinxApiSearch(sphinxApiConn *conn, char **queries, int nqueries, sphinxQueryStats *stats)
+{
+	sphinxApiResult **results;
+	apiQuery  **parsed;
+	StringInfoData body;
+	StringInfoData req;
+	apiReader	r;
+	int			nremote = 0;
+	int			i;
+
+	/* translate everything before anything is sent */
+	parsed = (apiQuery **) palloc(nqueries * sizeof(apiQuery *));
+	for (i = 0; i < nqueries; i++)
+	{
+		if ((parsed[i] = parseStatement(queries[i])))
+			nremote++;
+	}
+
+	if (nremote > 0)
+	{
+		initStringInfo(&body);
+		appendUInt32(&body, 0);
+		appendUInt32(&body, nremote);
+		for (i = 0; i < nqueries; i++)
+		{
+			if (parsed[i])
+				appendQuery(&body, parsed[i]);
+		}
+
+		initStringInfo(&req);
+		appendUInt32(&req, (SEARCHD_COMMAND_SEARCH << 16) | VER_COMMAND_SEARCH);
+		appendUInt32(&req, body.len);
+		appendBinaryStringInfo(&req, body.data, body.len);
+		pfree(body.data);
+
+		PG_TRY();
+		{
+			r = sendRequest(conn, &req, stats);
+		}
+		PG_CATCH();
+		{
+			/* the rest of the answer would be taken for the next one */
+			closeSocket(conn);
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+	}
+
+	/* SHOW META in a batch describes the query before it */
+	results = (sphinxApiResult **) palloc(nqueries * sizeof(sphinxApiResult *));
+	for (i = 0; i < nqueries; i++)
+	{
+		if (parsed[i])
+			results[i] = readResult(conn, &r, parsed[i], stats);
+		else
+			results[i] = metaResult(conn);
+	}
+
+	return results;
+}
+
+
+/*
+ * Convert the next match of res into plan->values and plan->nulls, from
+ * column first on.  Returns false after the last match.
+ */
+bool
+sphinxApiNextRow(sphinxApiResult *res, convPlan *plan, int first)
+{
+	apiReader	r;
+	const char **attrs;
+	int64		docid;
+	uint32		weight;
+	int			i;
+
+	if (res->match >= res->nmatches)
+		return false;
+
+	if (res->meta)
+	{
+		for (i = 0; i < 2; i++)
+		{
+			char	   *value = res->meta[res->match * 2 + i];
+
+			plan->values[first + i] = sphinxConvertValue(plan, first + i, value, strlen(value));
+			plan->nulls[first + i] = false;
+		}
+		res->match++;
+		return true;
+	}
+
+	/* attributes come in schema order, columns in select list order */
+	r.pos = res->pos;
+	r.end = res->end;
+	docid = res->id64 ? (int64) readUInt64(&r) : readUInt32(&r);
+	weight = readUInt32(&r);
+	attrs = (const char **) palloc(res->nattrs * sizeof(char *));
+	for (i = 0; i < res->nattrs; i++)
+	{
+		attrs[i] = r.pos;
+		skipAttr(&r, res->types[i]);
+	}
+	res->pos = r.pos;
+	res->match++;
+
+	for (i = 0; i < res->ncolumns; i++)
+	{
+		int			attnum = first + i;
+		int			col = res->columns[i];
+
+		if (col == API_COLUMN_DOCID)
+			plan->values[attnum] = intDatum(plan, attnum, docid);
+		else if (col == API_COLUMN_WEIGHT)
+			plan->values[attnum] = intDatum(plan, attnum, weight);
+		else
+		{
+			r.pos = attrs[col];
+			plan->values[attnum] = attrDatum(plan, attnum, res->types[col], &r);
+		}
+		plan->nulls[attnum] = false;
+	}
+
+	return true;
+}
+
+
+/*
+ * Connect to searchd and exchange protocol versions.  Returns false and sets
+ * *errmsg on failure.
+ */
+static bool
+openConnection(sphinxApiConn *conn, char **errmsg)
+{
+	TimestampTz deadline = timeoutDeadline(conn->options.connect_timeout);
+	StringInfoData req;
+	char		version[4];
+	apiReader	r;
+	bool		result = false;
+
+	*errmsg = NULL;
+
+	PG_TRY();
+	{
+		if (conn->options.socket[0])
+		{
+			struct sockaddr_un addr;
+
+			memset(&addr, 0, sizeof(addr));
+			addr.sun_family = AF_UNIX;
+			strlcpy(addr.sun_path, conn->options.socket, sizeof(addr.sun_path));
+			result = connectTo(conn, (struct sockaddr *) &addr, sizeof(addr), deadline, errmsg);
+		}
+		else
+		{
+			struct addrinfo hints;
+			struct addrinfo *addrs;
+			struct addrinfo *addr;
+			char		port[16];
+			int			rc;
+
+			memset(&hints, 0, sizeof(hints));
+			hints.ai_family = AF_UNSPEC;
+			hints.ai_socktype = SOCK_STREAM;
+			snprintf(port, sizeof(port), "%d", conn->port);
+			if ((rc = getaddrinfo(conn->host, port, &hints, &addrs)) != 0)
+				*errmsg = pstrdup(gai_strerror(rc));
+			else
+			{
+				for (addr = addrs; addr && !result; addr = addr->ai_next)
+					result = connectTo(conn, addr->ai_addr, addr->ai_addrlen, deadline, errmsg);
+				freeaddrinfo(addrs);
+			}
+			if (result && !sphinxSetKeepalives(conn->sock, &conn->options, errmsg))
+				result = false;
+		}
+
+		/*
+		 * Both sides start with their protocol version; the client then asks
+		 * for the connection to stay open after the first request.
+		 */
+		if (result)
+		{
+			initStringInfo(&req);
+			appendUInt32(&req, 1);
+			appendUInt32(&req, (SEARCHD_COMMAND_PERSIST << 16) | 0);
+			appendUInt32(&req, 4);
+			appendUInt32(&req, 1);
+			result = sendAll(conn, req.data, req.len, deadline, errmsg) &&
+				recvAll(conn, version, sizeof(version), deadline, errmsg);
+			pfree(req.data);
+		}
+		if (result)
+		{
+			r.pos = version;
+			r.end = version + sizeof(version);
+			if (readUInt32(&r) < 1)
+			{
+				*errmsg = pstrdup("expected searchd protocol version 1 or later");
+				result = false;
+			}
+		}
+	}
+	PG_CATCH();
+	{
+		closeSocket(conn);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	if (!result)
+	{
+		closeSocket(conn);
+		*errmsg = psprintf("failed to connect to Sphinx at %s:%d: %s",
+						   conn->options.socket[0] ? conn->options.socket : conn->host, conn->port,
+						   *errmsg ? *errmsg : "timeout expired");
+	}
+
+	return result;
+}
+
+
+/*
+ * Connect conn->sock to addr without blocking past deadline.
+ */
+static bool
+connectTo(sphinxApiConn *conn, const struct sockaddr *addr, socklen_t addrlen,
+		  TimestampTz deadline, char **errmsg)
+{
+	int			err = 0;
+	socklen_t	errlen = sizeof(err);
+	int			on = 1;
+
+	closeSocket(conn);
+	if ((conn->sock = socket(addr->sa_family, SOCK_STREAM, 0)) == PGINVALID_SOCKET)
+		goto fail;
+	if (!pg_set_noblock(conn->sock))
+		goto fail;
+	/* requests are small and each waits for its answer */
+	if (addr->sa_family != AF_UNIX &&
+		setsockopt(conn->sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+		goto fail;
+
+	if (connect(conn->sock, addr, addrlen) < 0)
+	{
+		if (errno != EINPROGRESS && errno != EINTR)
+			goto fail;
+		if (!waitSocket(conn, WL_SOCKET_WRITEABLE, deadline))
+		{
+			*errmsg = NULL;
+			closeSocket(conn);
+			return false;
+		}
+		if (getsockopt(conn->sock, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+			goto fail;
+		if (err)
+		{
+			errno = err;
+			goto fail;
+		}
+	}
+
+	return true;
+
+fail:
+	*errmsg = psprintf("%m");
+	closeSocket(conn);
+	return false;
+}
+
+
+static void
+closeSocket(sphinxApiConn *conn)
+{
+	if (conn->sock != PGINVALID_SOCKET)
+		closesocket(conn->sock);
+	conn->sock = PGINVALID_SOCKET;
+}
+
+
+/*
+ * End of a timeout in seconds starting now, or 0 for none
+ */
+static TimestampTz
+timeoutDeadline(int timeout)
+{
+	if (timeout <= 0)
+		return 0;
+	return TimestampTzPlusMilliseconds(GetCurrentTimestamp(), timeout * 1000L);
+}
+
+
+/*
+ * Wait for event on the socket, serving interrupts meanwhile.  Returns false
+ * when deadline passes first.
+ */
+static bool
+waitSocket(sphinxApiConn *conn, int event, TimestampTz deadline)
+{
+	for (;;)
+	{
+		int			events = WL_LATCH_SET | event | WL_EXIT_ON_PM_DEATH;
+		long		timeout = -1;
+		int			rc;
+
+		if (deadline)
+		{
+			timeout = (deadline - GetCurrentTimestamp()) / 1000;
+			if (timeout <= 0)
+				return false;
+			events |= WL_TIMEOUT;
+		}
+
+		rc = WaitLatchOrSocket(MyLatch, events, conn->sock, timeout, sphinxWaitEvent());
+
+		if (rc & event)
+			return true;
+
+		if (rc & WL_LATCH_SET)
+		{
+			ResetLatch(MyLatch);
+			CHECK_FOR_INTERRUPTS();
+		}
+	}
+}
+
+
+/*
+ * Send or receive len bytes.  On failure *errmsg tells why, or is NULL if
+ * deadline passed.
+ */
+static bool
+sendAll(sphinxApiConn *conn, const char *data, size_t len, TimestampTz deadline, char **errmsg)
+{
+	while (len > 0)
+	{
+		ssize_t		n = send(conn->sock, data, len, 0);
+
+		if (n > 0)
+		{
+			data += n;
+			len -= n;
+		}
+		else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			if (!waitSocket(conn, WL_SOCKET_WRITEABLE, deadline))
+			{
+				*errmsg = NULL;
+				return false;
+			}
+		}
+		else if (n < 0 && errno != EINTR)
+		{
+			*errmsg = psprintf("%m");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+static bool
+recvAll(sphinxApiConn *conn, char *data, size_t len, TimestampTz deadline, char **errmsg)
+{
+	while (len > 0)
+	{
+		ssize_t		n = recv(conn->sock, data, len, 0);
+
+		if (n > 0)
+		{
+			data += n;
+			len -= n;
+		}
+		else if (n == 0)
+		{
+			*errmsg = pstrdup("connection closed by searchd");
+			return false;
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			if (!waitSocket(conn, WL_SOCKET_READABLE, deadline))
+			{
+				*errmsg = NULL;
+				return false;
+			}
+		}
+		else if (errno != EINTR)
+		{
+			*errmsg = psprintf("%m");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+static void
+requestFailed(int timeout, char *msg)
+{
+	if (!msg)
+		ereport(ERROR,
+				(errcode(ERRCODE_QUERY_CANCELED),
+				 errmsg("Sphinx query timed out after %d s", timeout)));
+	ereport(ERROR,
+			(errcode(ERRCODE_CONNECTION_FAILURE),
+			 errmsg("lost connection to Sphinx: %s", msg)));
+}
+
+
+/*
+ * Send a request and receive the answer, reconnecting first if an earlier
+ * request broke the connection.  Returns a reader positioned at the first
+ * query result.
+ */
+static apiReader
+sendRequest(sphinxApiConn *conn, StringInfo req, sphinxQueryStats *stats)
+{
+	char		header[8];
+	char	   *body;
+	char	   *msg;
+	apiReader	r;
+	uint32		status;
+	uint32		len;
+	instr_time	start;
+
+	if (conn->sock == PGINVALID_SOCKET && !openConnection(conn, &msg))
+		ereport(ERROR,
+				(errcode(ERRCODE_CONNECTION_FAILURE),
+				 errmsg("%s", msg)));
+
+	if (!sendAll(conn, req->data, req->len, timeoutDeadline(conn->options.write_timeout), &msg))
+		requestFailed(conn->options.write_timeout, msg);
+
+	INSTR_TIME_SET_CURRENT(start);
+	if (!recvAll(conn, header, sizeof(header), timeoutDeadline(conn->options.read_timeout), &msg))
+		requestFailed(conn->options.read_timeout, msg);
+	if (stats)
+	{
+		instr_time	now;
+
+		INSTR_TIME_SET_CURRENT(now);
+		INSTR_TIME_SUBTRACT(now, start);
+		stats->wait_time += INSTR_TIME_GET_MILLISEC(now);
+		INSTR_TIME_SET_CURRENT(start);
+	}
+
+	r.pos = header;
+	r.end = header + sizeof(header);
+	status = readUInt32(&r) >> 16;
+	len = readUInt32(&r);
+
+	/* don't let a corrupt header make us allocate gigabytes */
+	if (len > API_MAX_RESPONSE)
+		malformedResponse();
+
+	/* the whole answer is read before any of it is converted */
+	body = palloc(len > 0 ? len : 1);
+	if (!recvAll(conn, body, len, timeoutDeadline(conn->options.read_timeout), &msg))
+		requestFailed(conn->options.read_timeout, msg);
+	if (stats)
+	{
+		instr_time	now;
+
+		INSTR_TIME_SET_CURRENT(now);
+		INSTR_TIME_SUBTRACT(now, start);
+		stats->fetch_time += INSTR_TIME_GET_MILLISEC(now);
+		stats->bytes += len;
+	}
+
+	r.pos = body;
+	r.end = body + len;
+	if (status == SEARCHD_WARNING)
+		readCString(&r);
+	else if (status != SEARCHD_OK)
+		ereport(ERROR,
+				(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+				 errmsg("Error when send query to Sphinx: %s", readCString(&r))));
+
+	return r;
+}
+
+
+/*
+ * Read the result of query q.  The matches are only stepped over here;
+ * sphinxApiNextRow() converts them.
+ */
+static sphinxApiResult *
+readResult(sphinxApiConn *conn, apiReader *r, apiQuery *q, sphinxQueryStats *stats)
+{
+	sphinxApiResult *res = (sphinxApiResult *) palloc0(sizeof(sphinxApiResult));
+	MemoryContext oldcontext;
+	char	  **names;
+	uint32		status;
+	uint32		total;
+	uint32		total_found;
+	uint32		msecs;
+	uint32		nwords;
+	uint32		i;
+	int			j;
+
+	status = readUInt32(r);
+	if (status != SEARCHD_OK)
+	{
+		char	   *message = readCString(r);
+
+		if (status != SEARCHD_WARNING)
+		{
+			res->error = message;
+			return res;
+		}
+	}
+
+	/* full-text fields */
+	for (i = readCount(r, 4); i > 0; i--)
+		readCString(r);
+
+	res->nattrs = readCount(r, 8);
+	names = (char **) palloc((res->nattrs + 1) * sizeof(char *));
+	res->types = (uint32 *) palloc((res->nattrs + 1) * sizeof(uint32));
+	for (j = 0; j < res->nattrs; j++)
+	{
+		names[j] = readCString(r);
+		res->types[j] = readUInt32(r);
+	}
+
+	res->nmatches = readCount(r, 8);
+	res->id64 = readUInt32(r) != 0;
+	res->pos = r->pos;
+	for (j = 0; j < res->nmatches; j++)
+	{
+		if (res->id64)
+			readUInt64(r);
+		else
+			readUInt32(r);
+		readUInt32(r);
+		for (i = 0; i < res->nattrs; i++)
+			skipAttr(r, res->types[i]);
+	}
+	res->end = r->pos;
+
+	total = readUInt32(r);
+	total_found = readUInt32(r);
+	msecs = readUInt32(r);
+	nwords = readCount(r, 12);
+
+	/* keep what SHOW META would tell, in the form SphinxQL has it */
+	MemoryContextReset(conn->metacxt);
+	oldcontext = MemoryContextSwitchTo(conn->metacxt);
+	conn->nmeta = 3 + 3 * nwords;
+	conn->meta = (char **) palloc(conn->nmeta * 2 * sizeof(char *));
+	conn->meta[0] = "total";
+	conn->meta[1] = psprintf("%u", total);
+	conn->meta[2] = "total_found";
+	conn->meta[3] = psprintf("%u", total_found);
+	conn->meta[4] = "time";
+	conn->meta[5] = psprintf("%.3f", msecs / 1000.0);
+	for (i = 0; i < nwords; i++)
+	{
+		char	  **meta = &conn->meta[6 + i * 6];
+
+		meta[0] = psprintf("keyword[%u]", i);
+		meta[1] = readCString(r);
+		meta[2] = psprintf("docs[%u]", i);
+		meta[3] = psprintf("%u", readUInt32(r));
+		meta[4] = psprintf("hits[%u]", i);
+		meta[5] = psprintf("%u", readUInt32(r));
+	}
+	MemoryContextSwitchTo(oldcontext);
+
+	if (stats)
+		stats->meta_time = msecs;
+
+	resolveColumns(res, q, names);
+
+	return res;
+}
+
+
+/*
+ * A result holding the SHOW META of the last query received
+ */
+static sphinxApiResult *
+metaResult(sphinxApiConn *conn)
+{
+	sphinxApiResult *res = (sphinxApiResult *) palloc0(sizeof(sphinxApiResult));
+	int			i;
+
+	res->ncolumns = 2;
+	res->nmatches = conn->nmeta;
+	res->meta = (char **) palloc((conn->nmeta * 2 + 1) * sizeof(char *));
+	for (i = 0; i < conn->nmeta * 2; i++)
+		res->meta[i] = pstrdup(conn->meta[i]);
+
+	return res;
+}
+
+
+/*
+ * Map the select items of q to the attributes of the result.  id and
+ * weight() come with every match rather than as attributes; * stands for
+ * the id and every attribute not selected under a name of its own.
+ */
+static void
+resolveColumns(sphinxApiResult *res, apiQuery *q, char **names)
+{
+	ListCell   *lc;
+	int			n = 0;
+	int			i;
+
+	res->columns = (int *) palloc((list_length(q->items) + res->nattrs + 1) * sizeof(int));
+	foreach(lc, q->items)
+	{
+		const char *name = (const char *) lfirst(lc);
+
+		if (!name)
+		{
+			res->columns[n++] = API_COLUMN_DOCID;
+			for (i = 0; i < res->nattrs; i++)
+			{
+				ListCell   *other;
+				bool		named = pg_strcasecmp(names[i], "id") == 0;
+
+				foreach(other, q->items)
+				{
+					if (lfirst(other) && pg_strcasecmp(names[i], (char *) lfirst(other)) == 0)
+						named = true;
+				}
+				if (!named)
+					res->columns[n++] = i;
+			}
+			continue;
+		}
+
+		for (i = 0; i < res->nattrs; i++)
+		{
+			if (pg_strcasecmp(names[i], name) == 0)
+				break;
+		}
+		if (i < res->nattrs)
+			res->columns[n++] = i;
+		else if (pg_strcasecmp(name, "id") == 0 || pg_strcasecmp(name, "@id") == 0)
+			res->columns[n++] = API_COLUMN_DOCID;
+		else if (pg_strcasecmp(name, "weight()") == 0 || pg_strcasecmp(name, "@weight") == 0)
+			res->columns[n++] = API_COLUMN_WEIGHT;
+		else
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_COLUMN),
+					 errmsg("searchd returned no attribute \"%s\"", name)));
+	}
+	res->ncolumns = n;
+}
+
+
+static void
+skipAttr(apiReader *r, uint32 type)
+{
+	uint32		len;
+
+	switch (type)
+	{
+		case SPH_ATTR_BIGINT:
+			readUInt64(r);
+			break;
+		case SPH_ATTR_STRING:
+		case SPH_ATTR_FACTORS:
+			readBytes(r, &len);
+			break;
+		case SPH_ATTR_MULTI:
+		case SPH_ATTR_MULTI64:
+			for (len = readCount(r, 4); len > 0; len--)
+				readUInt32(r);
+			break;
+		default:
+			readUInt32(r);
+			break;
+	}
+}
+
+
+/*
+ * Convert the attribute value at r to a Datum for column attnum
+ */
+static Datum
+attrDatum(convPlan *plan, int attnum, uint32 type, apiReader *r)
+{
+	switch (type)
+	{
+		case SPH_ATTR_BIGINT:
+			return intDatum(plan, attnum, (int64) readUInt64(r));
+
+		case SPH_ATTR_FLOAT:
+			{
+				uint32		bits = readUInt32(r);
+				float		value;
+
+				memcpy(&value, &bits, sizeof(value));
+				return floatDatum(plan, attnum, value);
+			}
+
+		case SPH_ATTR_STRING:
+		case SPH_ATTR_FACTORS:
+			{
+				uint32		len;
+				const char *data = readBytes(r, &len);
+				char	   *value = palloc(len + 1);
+
+				memcpy(value, data, len);
+				value[len] = '\0';
+				return sphinxConvertValue(plan, attnum, value, len);
+			}
+
+		case SPH_ATTR_MULTI:
+		case SPH_ATTR_MULTI64:
+			{
+				/* the comma separated list SphinxQL sends */
+				StringInfoData buf;
+				uint32		n = readCount(r, 4);
+				uint32		i;
+
+				initStringInfo(&buf);
+				for (i = 0; i < n; i++)
+				{
+					if (i > 0)
+						appendStringInfoChar(&buf, ',');
+					if (type == SPH_ATTR_MULTI64)
+					{
+						appendStringInfo(&buf, INT64_FORMAT, (int64) readUInt64(r));
+						i++;
+					}
+					else
+						appendStringInfo(&buf, "%u", readUInt32(r));
+				}
+				return sphinxConvertValue(plan, attnum, buf.data, buf.len);
+			}
+
+		default:
+			/* integer, timestamp, bool and the like */
+			return intDatum(plan, attnum, readUInt32(r));
+	}
+}
+
+
+static Datum
+intDatum(convPlan *plan, int attnum, int64 value)
+{
+	char		buf[32];
+
+	switch (plan->kinds[attnum])
+	{
+		case CONV_INT4:
+			if (value >= PG_INT32_MIN && value <= PG_INT32_MAX)
+				return Int32GetDatum((int32) value);
+			break;
+		case CONV_INT8:
+			return Int64GetDatum(value);
+		case CONV_FLOAT4:
+			return Float4GetDatum((float4) value);
+		case CONV_FLOAT8:
+			return Float8GetDatum((float8) value);
+		case CONV_BOOL:
+			if (value == 0 || value == 1)
+				return BoolGetDatum(value == 1);
+			break;
+		default:
+			break;
+	}
+
+	/* timestamps, text and out of range values go the SphinxQL way */
+	snprintf(buf, sizeof(buf), INT64_FORMAT, value);
+	return sphinxConvertValue(plan, attnum, buf, strlen(buf));
+}
+
+
+static Datum
+floatDatum(convPlan *plan, int attnum, float value)
+{
+	char		buf[64];
+
+	if (plan->kinds[attnum] == CONV_FLOAT4)
+		return Float4GetDatum(value);
+
+	/*
+	 * A wider column gets the digits SphinxQL prints, 9.99 rather than
+	 * 9.98999977111816 for a float attribute set to 9.99.
+	 */
+	snprintf(buf, sizeof(buf), "%f", value);
+	return sphinxConvertValue(plan, attnum, buf, strlen(buf));
+}
+
+
+/*
+ * Translate a statement into a search query, or return NULL for SHOW META.
+ *
+ *	SELECT items FROM index [, ...]
+ *		[WHERE cond [AND cond ...]]
+ *		[ORDER BY attr [ASC | DESC] [, ...]]
+ *		[LIMIT [offset,] count | LIMIT count OFFSET offset]
+ *		[OPTION name = value [, ...]]
+ *
+ * where cond is MATCH('query'), attr {= | != | <> | < | <= | > | >=} value,
+ * attr [NOT] IN (values) or attr BETWEEN value AND value.
+ */
+static apiQuery *
+parseStatement(const char *sql)
+{
+	apiParser	p;
+	apiQuery   *q;
+
+	p.sql = sql;
+	p.tokens = tokenize(sql);
+	p.pos = 0;
+
+	if (isKeywordToken(TOKEN(&p), "SHOW") && isKeywordToken(&p.tokens[1], "META"))
+	{
+		p.pos = 2;
+		acceptOp(&p, ";");
+		if (TOKEN(&p)->kind != TOKEN_END)
+			unsupportedQuery(sql, TOKEN(&p));
+		return NULL;
+	}
+
+	q = (apiQuery *) palloc0(sizeof(apiQuery));
+	initStringInfo(&q->indexes);
+	initStringInfo(&q->sortby);
+	q->sort = SPH_SORT_RELEVANCE;
+	q->limit = DEFAULT_LIMIT;
+	q->max_matches = DEFAULT_MAX_MATCHES;
+	q->comment = "";
+
+	expectKeyword(&p, "SELECT");
+	parseSelectList(&p, q);
+
+	expectKeyword(&p, "FROM");
+	do
+	{
+		if (q->indexes.len > 0)
+			appendStringInfoChar(&q->indexes, ',');
+		appendStringInfoString(&q->indexes, expectIdent(&p));
+	} while (acceptOp(&p, ","));
+
+	if (acceptKeyword(&p, "WHERE"))
+	{
+		do
+		{
+			parseCondition(&p, q);
+		} while (acceptKeyword(&p, "AND"));
+	}
+
+	if (acceptKeyword(&p, "ORDER"))
+	{
+		expectKeyword(&p, "BY");
+		parseOrder(&p, q);
+	}
+
+	if (acceptKeyword(&p, "LIMIT"))
+	{
+		int			count = parseCount(&p);
+
+		if (acceptOp(&p, ","))
+		{
+			q->offset = count;
+			q->limit = parseCount(&p);
+		}
+		else
+		{
+			q->limit = count;
+			if (acceptKeyword(&p, "OFFSET"))
+				q->offset = parseCount(&p);
+		}
+	}
+
+	if (acceptKeyword(&p, "OPTION"))
+		parseOptions(&p, q);
+
+	acceptOp(&p, ";");
+	if (TOKEN(&p)->kind != TOKEN_END)
+		unsupportedQuery(sql, TOKEN(&p));
+
+	return q;
+}
+
+
+/*
+ * Select items are split at top-level commas; each is named by its alias or
+ * else by its text, which is how searchd names the attributes it returns.
+ */
+static void
+parseSelectList(apiParser *p, apiQuery *q)
+{
+	int			start = TOKEN(p)->start;
+	int			end = start;
+
+	do
+	{
+		int			first = p->pos;
+		int			last = -1;
+		int			depth = 0;
+		apiToken   *tok;
+		char	   *name;
+
+		while ((tok = TOKEN(p))->kind != TOKEN_END)
+		{
+			if (depth == 0 && (isOpToken(tok, ",") || isKeywordToken(tok, "FROM")))
+				break;
+			if (isOpToken(tok, "("))
+				depth++;
+			else if (isOpToken(tok, ")"))
+				depth--;
+			last = p->pos++;
+		}
+		if (last < 0)
+			unsupportedQuery(p->sql, tok);
+
+		tok = &p->tokens[last];
+		if (last == first && isOpToken(tok, "*"))
+			name = NULL;
+		else if (last >= first + 2 && tok->kind == TOKEN_IDENT && isKeywordToken(tok - 1, "AS"))
+			name = tok->value;
+		else
+			name = pnstrdup(p->sql + p->tokens[first].start,
+							tok->start + tok->len - p->tokens[first].start);
+		q->items = lappend(q->items, name);
+		end = tok->start + tok->len;
+	} while (acceptOp(p, ","));
+
+	q->select = pnstrdup(p->sql + start, end - start);
+}
+
+
+static void
+parseCondition(apiParser *p, apiQuery *q)
+{
+	apiToken   *tok = TOKEN(p);
+	apiFilter  *filter;
+	const char *attr;
+	const char *op;
+	apiNumber	value;
+
+	if (isKeywordToken(tok, "MATCH") && isOpToken(&p->tokens[p->pos + 1], "("))
+	{
+		/* searchd takes a single full-text query */
+		if (q->query)
+			unsupportedQuery(p->sql, tok);
+		p->pos += 2;
+		if (TOKEN(p)->kind != TOKEN_STRING)
+			unsupportedQuery(p->sql, TOKEN(p));
+		q->query = TOKEN(p)->value;
+		p->pos++;
+		expectOp(p, ")");
+		return;
+	}
+
+	attr = expectIdent(p);
+	if (isOpToken(TOKEN(p), "("))
+		unsupportedQuery(p->sql, tok);
+	if (pg_strcasecmp(attr, "id") == 0)
+		attr = "@id";
+
+	if (acceptKeyword(p, "NOT"))
+	{
+		expectKeyword(p, "IN");
+		parseInList(p, q, attr, true);
+		return;
+	}
+	if (acceptKeyword(p, "IN"))
+	{
+		parseInList(p, q, attr, false);
+		return;
+	}
+	if (acceptKeyword(p, "BETWEEN"))
+	{
+		apiNumber	hi;
+
+		parseNumber(p, &value);
+		expectKeyword(p, "AND");
+		parseNumber(p, &hi);
+		addRange(q, attr, &value, &hi, false);
+		return;
+	}
+
+	tok = TOKEN(p);
+	if (tok->kind != TOKEN_OP)
+		unsupportedQuery(p->sql, tok);
+	op = tok->value;
+	p->pos++;
+
+	if (strcmp(op, "=") == 0 || strcmp(op, "!=") == 0 || strcmp(op, "<>") == 0)
+	{
+		bool		exclude = op[0] != '=';
+
+		if (TOKEN(p)->kind == TOKEN_STRING)
+		{
+			filter = (apiFilter *) palloc0(sizeof(apiFilter));
+			filter->attr = attr;
+			filter->type = SPH_FILTER_STRING;
+			filter->str = TOKEN(p)->value;
+			filter->exclude = exclude;
+			q->filters = lappend(q->filters, filter);
+			p->pos++;
+			return;
+		}
+
+		parseNumber(p, &value);
+		if (value.isfloat)
+		{
+			addRange(q, attr, &value, &value, exclude);
+			return;
+		}
+		filter = (apiFilter *) palloc0(sizeof(apiFilter));
+		filter->attr = attr;
+		filter->type = SPH_FILTER_VALUES;
+		filter->values = list_make1(int64Value(value.ival));
+		filter->exclude = exclude;
+		q->filters = lappend(q->filters, filter);
+	}
+	else if (strcmp(op, "<") == 0)
+	{
+		parseNumber(p, &value);
+		addRange(q, attr, &value, NULL, true);
+	}
+	else if (strcmp(op, "<=") == 0)
+	{
+		parseNumber(p, &value);
+		addRange(q, attr, NULL, &value, false);
+	}
+	else if (strcmp(op, ">") == 0)
+	{
+		parseNumber(p, &value);
+		addRange(q, attr, NULL, &value, true);
+	}
+	else if (strcmp(op, ">=") == 0)
+	{
+		parseNumber(p, &value);
+		addRange(q, attr, &value, NULL, false);
+	}
+	else
+		unsupportedQuery(p->sql, tok);
+}
+
+
+static void
+parseInList(apiParser *p, apiQuery *q, const char *attr, bool exclude)
+{
+	apiFilter  *filter = (apiFilter *) palloc0(sizeof(apiFilter));
+
+	filter->attr = attr;
+	filter->type = SPH_FILTER_VALUES;
+	filter->exclude = exclude;
+
+	expectOp(p, "(");
+	do
+	{
+		apiToken   *tok = TOKEN(p);
+		apiNumber	value;
+
+		parseNumber(p, &value);
+		if (value.isfloat)
+			unsupportedQuery(p->sql, tok);
+		filter->values = lappend(filter->values, int64Value(value.ival));
+	} while (acceptOp(p, ","));
+	expectOp(p, ")");
+
+	q->filters = lappend(q->filters, filter);
+}
+
+
+/*
+ * Add a filter on attr between lo and hi, or outside them if exclude.  A
+ * missing bound is the smallest or largest value there is.
+ */
+static void
+addRange(apiQuery *q, const char *attr, apiNumber *lo, apiNumber *hi, bool exclude)
+{
+	apiFilter  *filter = (apiFilter *) palloc0(sizeof(apiFilter));
+
+	filter->attr = attr;
+	filter->exclude = exclude;
+	if ((lo && lo->isfloat) || (hi && hi->isfloat))
+	{
+		filter->type = SPH_FILTER_FLOATRANGE;
+		filter->fmin = !lo ? -FLT_MAX : lo->isfloat ? lo->fval : (float) lo->ival;
+		filter->fmax = !hi ? FLT_MAX : hi->isfloat ? hi->fval : (float) hi->ival;
+	}
+	else
+	{
+		filter->type = SPH_FILTER_RANGE;
+		filter->min = lo ? lo->ival : PG_INT64_MIN;
+		filter->max = hi ? hi->ival : PG_INT64_MAX;
+	}
+	q->filters = lappend(q->filters, filter);
+}
+
+
+static void
+parseOrder(apiParser *p, apiQuery *q)
+{
+	q->sort = SPH_SORT_EXTENDED;
+	do
+	{
+		apiToken   *tok = TOKEN(p);
+		const char *key = expectIdent(p);
+		bool		desc;
+
+		if (acceptOp(p, "("))
+		{
+			if (pg_strcasecmp(key, "weight") != 0)
+				unsupportedQuery(p->sql, tok);
+			expectOp(p, ")");
+			key = "@weight";
+		}
+		else if (pg_strcasecmp(key, "id") == 0)
+			key = "@id";
+
+		desc = acceptKeyword(p, "DESC");
+		if (!desc)
+			acceptKeyword(p, "ASC");
+
+		if (q->sortby.len > 0)
+			appendStringInfoString(&q->sortby, ", ");
+		appendStringInfo(&q->sortby, "%s %s", key, desc ? "DESC" : "ASC");
+	} while (acceptOp(p, ","));
+}
+
+
+static void
+parseOptions(apiParser *p, apiQuery *q)
+{
+	do
+	{
+		apiToken   *tok = TOKEN(p);
+		const char *name = expectIdent(p);
+
+		expectOp(p, "=");
+		if (pg_strcasecmp(name, "max_matches") == 0)
+			q->max_matches = parseCount(p);
+		else if (pg_strcasecmp(name, "cutoff") == 0)
+			q->cutoff = parseCount(p);
+		else if (pg_strcasecmp(name, "max_query_time") == 0)
+			q->max_query_time = parseCount(p);
+		else if (pg_strcasecmp(name, "comment") == 0 && TOKEN(p)->kind == TOKEN_STRING)
+		{
+			q->comment = TOKEN(p)->value;
+			p->pos++;
+		}
+		else if (pg_strcasecmp(name, "ranker") == 0 && TOKEN(p)->kind == TOKEN_IDENT)
+		{
+			int			i;
+
+			for (i = 0; rankers[i]; i++)
+			{
+				if (pg_strcasecmp(TOKEN(p)->value, rankers[i]) == 0)
+					break;
+			}
+			if (!rankers[i])
+				unsupportedQuery(p->sql, TOKEN(p));
+			q->ranker = i;
+			p->pos++;
+		}
+		else
+			unsupportedQuery(p->sql, tok);
+	} while (acceptOp(p, ","));
+}
+
+
+static void
+parseNumber(apiParser *p, apiNumber *num)
+{
+	apiToken   *tok = TOKEN(p);
+	bool		negative = acceptOp(p, "-");
+	const char *value = TOKEN(p)->value;
+
+	if (TOKEN(p)->kind != TOKEN_NUMBER)
+		unsupportedQuery(p->sql, tok);
+
+	num->isfloat = strpbrk(value, ".eE") != NULL;
+	errno = 0;
+	if (num->isfloat)
+	{
+		num->fval = strtof(value, NULL);
+		if (negative)
+			num->fval = -num->fval;
+	}
+	else
+	{
+		num->ival = strtoll(value, NULL, 10);
+		if (negative)
+			num->ival = -num->ival;
+	}
+	if (errno == ERANGE)
+		unsupportedQuery(p->sql, tok);
+	p->pos++;
+}
+
+
+static int
+parseCount(apiParser *p)
+{
+	apiToken   *tok = TOKEN(p);
+	apiNumber	num;
+
+	parseNumber(p, &num);
+	if (num.isfloat || num.ival < 0 || num.ival > PG_INT32_MAX)
+		unsupportedQuery(p->sql, tok);
+
+	return (int) num.ival;
+}
+
+
+/* filter values are kept in lists, which hold pointers */
+static int64 *
+int64Value(int64 value)
+{
+	int64	   *result = (int64 *) palloc(sizeof(int64));
+
+	*result = value;
+	return result;
+}
+
+
+/*
+ * Split sql into identifiers, numbers, quoted strings and operators
+ */
+static apiToken *
+tokenize(const char *sql)
+{
+	int			ntokens = 0;
+	int			maxtokens = 32;
+	apiToken   *tokens = (apiToken *) palloc(maxtokens * sizeof(apiToken));
+	const char *s = sql;
+
+	for (;;)
+	{
+		apiToken   *tok;
+		const char *start;
+
+		while (scanner_isspace(*s))
+			s++;
+
+		if (ntokens == maxtokens)
+		{
+			maxtokens *= 2;
+			tokens = (apiToken *) repalloc(tokens, maxtokens * sizeof(apiToken));
+		}
+		tok = &tokens[ntokens++];
+		tok->start = s - sql;
+		start = s;
+
+		if (*s == '\0')
+		{
+			tok->kind = TOKEN_END;
+			tok->len = 0;
+			tok->value = "";
+			break;
+		}
+
+		if (isalpha((unsigned char) *s) || *s == '_' || *s == '@')
+		{
+			while (isalnum((unsigned char) *s) || *s == '_' || *s == '@' || *s == '.')
+				s++;
+			tok->kind = TOKEN_IDENT;
+		}
+		else if (isdigit((unsigned char) *s) || (*s == '.' && isdigit((unsigned char) s[1])))
+		{
+			while (isdigit((unsigned char) *s) || *s == '.')
+				s++;
+			if ((*s == 'e' || *s == 'E') &&
+				(isdigit((unsigned char) s[1]) ||
+				 ((s[1] == '+' || s[1] == '-') && isdigit((unsigned char) s[2]))))
+			{
+				s += 2;
+				while (isdigit((unsigned char) *s))
+					s++;
+			}
+			tok->kind = TOKEN_NUMBER;
+		}
+		else if (*s == '\'')
+		{
+			StringInfoData buf;
+
+			initStringInfo(&buf);
+			for (s++; *s; s++)
+			{
+				if (*s == '\\' && s[1])
+				{
+					s++;
+					appendStringInfoChar(&buf, *s == 'n' ? '\n' : *s == 't' ? '\t' :
+										 *s == 'r' ? '\r' : *s);
+				}
+				else if (*s == '\'' && s[1] == '\'')
+					appendStringInfoChar(&buf, *s++);
+				else if (*s == '\'')
+					break;
+				else
+					appendStringInfoChar(&buf, *s);
+			}
+			if (*s == '\0')
+			{
+				/* unterminated, left for the parser to refuse */
+				tok->kind = TOKEN_OP;
+				tok->len = 1;
+				tok->value = "'";
+				s = start + 1;
+				continue;
+			}
+			s++;
+			tok->kind = TOKEN_STRING;
+			tok->len = s - start;
+			tok->value = buf.data;
+			continue;
+		}
+		else
+		{
+			static const char *const ops[] = {"<=", ">=", "!=", "<>", NULL};
+			int			i;
+
+			for (i = 0; ops[i]; i++)
+			{
+				if (strncmp(s, ops[i], 2) == 0)
+					break;
+			}
+			s += ops[i] ? 2 : 1;
+			tok->kind = TOKEN_OP;
+		}
+
+		tok->len = s - start;
+		tok->value = pnstrdup(start, tok->len);
+	}
+
+	return tokens;
+}
+
+
+static bool
+isKeywordToken(apiToken *tok, const char *keyword)
+{
+	return tok->kind == TOKEN_IDENT && pg_strcasecmp(tok->value, keyword) == 0;
+}
+
+
+static bool
+acceptKeyword(apiParser *p, const char *keyword)
+{
+	if (!isKeywordToken(TOKEN(p), keyword))
+		return false;
+	p->pos++;
+	return true;
+}
+
+
+static void
+expectKeyword(apiParser *p, const char *keyword)
+{
+	if (!acceptKeyword(p, keyword))
+		unsupportedQuery(p->sql, TOKEN(p));
+}
+
+
+static bool
+isOpToken(apiToken *tok, const char *op)
+{
+	return tok->kind == TOKEN_OP && strcmp(tok->value, op) == 0;
+}
+
+
+static bool
+acceptOp(apiParser *p, const char *op)
+{
+	if (!isOpToken(TOKEN(p), op))
+		return false;
+	p->pos++;
+	return true;
+}
+
+
+static void
+expectOp(apiParser *p, const char *op)
+{
+	if (!acceptOp(p, op))
+		unsupportedQuery(p->sql, TOKEN(p));
+}
+
+
+static char *
+expectIdent(apiParser *p)
+{
+	if (TOKEN(p)->kind != TOKEN_IDENT)
+		unsupportedQuery(p->sql, TOKEN(p));
+	return p->tokens[p->pos++].value;
+}
+
+
+static void
+unsupportedQuery(const char *sql, apiToken *tok)
+{
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("query cannot be sent over the SphinxAPI protocol"),
+			 tok->kind == TOKEN_END ?
+			 errdetail("Unexpected end of query.") :
+			 errdetail("Unsupported SphinxQL near \"%.30s\".", sql + tok->start),
+			 errhint("SphinxAPI connections run SELECT with MATCH(), attribute filters, ORDER BY, LIMIT and OPTION, and SHOW META.")));
+}
+
+
+/*
+ * Append q in the format of version 0x11E of the search command
+ */
+static void
+appendQuery(StringInfo buf, apiQuery *q)
+{
+	ListCell   *lc;
+
+	appendUInt32(buf, 0);		/* query flags */
+	appendUInt32(buf, q->offset);
+	appendUInt32(buf, q->limit);
+	appendUInt32(buf, SPH_MATCH_EXTENDED2);
+	appendUInt32(buf, q->ranker);
+	appendUInt32(buf, q->sort);
+	appendString(buf, q->sortby.data);
+	appendString(buf, q->query ? q->query : "");
+	appendUInt32(buf, 0);		/* field weights, old style */
+	appendString(buf, q->indexes.data);
+
+	/* the whole range of 64-bit document ids */
+	appendUInt32(buf, 1);
+	appendUInt64(buf, 0);
+	appendUInt64(buf, 0);
+
+	appendUInt32(buf, list_length(q->filters));
+	foreach(lc, q->filters)
+	{
+		apiFilter  *filter = (apiFilter *) lfirst(lc);
+		ListCell   *value;
+
+		appendString(buf, filter->attr);
+		appendUInt32(buf, filter->type);
+		switch (filter->type)
+		{
+			case SPH_FILTER_VALUES:
+				appendUInt32(buf, list_length(filter->values));
+				foreach(value, filter->values)
+					appendUInt64(buf, *(int64 *) lfirst(value));
+				break;
+			case SPH_FILTER_RANGE:
+				appendUInt64(buf, filter->min);
+				appendUInt64(buf, filter->max);
+				break;
+			case SPH_FILTER_FLOATRANGE:
+				appendFloat(buf, filter->fmin);
+				appendFloat(buf, filter->fmax);
+				break;
+			case SPH_FILTER_STRING:
+				appendString(buf, filter->str);
+				break;
+		}
+		appendUInt32(buf, filter->exclude);
+	}
+
+	appendUInt32(buf, SPH_GROUPBY_DAY);
+	appendString(buf, "");		/* group by */
+	appendUInt32(buf, q->max_matches);
+	appendString(buf, "@group desc");
+	appendUInt32(buf, q->cutoff);
+	appendUInt32(buf, 0);		/* retry count */
+	appendUInt32(buf, 0);		/* retry delay */
+	appendString(buf, "");		/* group distinct */
+	appendUInt32(buf, 0);		/* geo anchor */
+	appendUInt32(buf, 0);		/* index weights */
+	appendUInt32(buf, q->max_query_time);
+	appendUInt32(buf, 0);		/* field weights */
+	appendString(buf, q->comment);
+	appendUInt32(buf, 0);		/* attribute overrides */
+	appendString(buf, q->select);
+
+	/* no outer select */
+	appendString(buf, "");
+	appendUInt32(buf, 0);
+	appendUInt32(buf, 0);
+	appendUInt32(buf, 0);
+}
+
+
+/* Numbers go in network byte order */
+static void
+appendUInt32(StringInfo buf, uint32 value)
+{
+	char		bytes[4];
+
+	bytes[0] = (value >> 24) & 0xFF;
+	bytes[1] = (value >> 16) & 0xFF;
+	bytes[2] = (value >> 8) & 0xFF;
+	bytes[3] = value & 0xFF;
+	appendBinaryStringInfo(buf, bytes, sizeof(bytes));
+}
+
+
+static void
+appendUInt64(StringInfo buf, uint64 value)
+{
+	appendUInt32(buf, (uint32) (value >> 32));
+	appendUInt32(buf, (uint32) value);
+}
+
+
+static void
+appendFloat(StringInfo buf, float value)
+{
+	uint32		bits;
+
+	memcpy(&bits, &value, sizeof(bits));
+	appendUInt32(buf, bits);
+}
+
+
+static void
+appendString(StringInfo buf, const char *value)
+{
+	size_t		len = strlen(value);
+
+	appendUInt32(buf, len);
+	appendBinaryStringInfo(buf, value, len);
+}
+
+
+static uint32
+readUInt32(apiReader *r)
+{
+	const unsigned char *p = (const unsigned char *) r->pos;
+
+	if (r->end - r->pos < 4)
+		malformedResponse();
+	r->pos += 4;
+
+	return ((uint32) p[0] << 24) | ((uint32) p[1] << 16) | ((uint32) p[2] << 8) | p[3];
+}
+
+
+static uint64
+readUInt64(apiReader *r)
+{
+	uint64		high = readUInt32(r);
+
+	return (high << 32) | readUInt32(r);
+}
+
+
+/*
+ * Step over a string, returning where its *len bytes start
+ */
+static const char *
+readBytes(apiReader *r, uint32 *len)
+{
+	const char *data;
+
+	*len = readUInt32(r);
+	if (*len > (size_t) (r->end - r->pos))
+		malformedResponse();
+	data = r->pos;
+	r->pos += *len;
+
+	return data;
+}
+
+
+static char *
+readCString(apiReader *r)
+{
+	uint32		len;
+	const char *data = readBytes(r, &len);
+
+	return pnstrdup(data, len);
+}
+
+
+/*
+ * Read the number of items that follow, each taking at least size bytes, so
+ * a broken count can't make anything allocate or loop for long
+ */
+static uint32
+readCount(apiReader *r, int size)
+{
+	uint32		count = readUInt32(r);
+
+	if (count > (size_t) (r->end - r->pos) / size)
+		malformedResponse();
+
+	return count;
+}
+
+
+static void
+malformedResponse(void)
+{
+	ereport(ERROR,
+			(errcode(ERRCODE_PROTOCOL_VIOLATION),
+			 errmsg("malformed SphinxAPI response from searchd")));
+}
@@ -0,0 +1,464 @@
+/*
+ * sphinx_bulk.c
+ *
+ * sphinx_bulk_replace(): load the result of a query into a Sphinx RT index.
+ *
+ * Rows are read through an SPI cursor and written as multi-row REPLACE (or
+ * INSERT) statements, each holding up to batch_size rows and never more than
+ * max_allowed_packet bytes.  A statement is sent as soon as it is complete,
+ * and the next one is built while searchd executes it.  sphinxBulkLoad() is
+ * also used by the change feed worker, see sphinx_sync.c.
+ *
+ * contrib/sphinxlink/sphinx_bulk.c
+ */
+#include "postgres.h"
+
+#include "miscadmin.h"
+#include "funcapi.h"
+#include "access/htup_details.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "portability/instr_time.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include <sphinxlink.h>
+
+/* used when searchd doesn't report max_allowed_packet */
+#define DEFAULT_MAX_PACKET	(8 * 1024 * 1024)
+
+typedef struct bulkState
+{
+	remoteConn *rconn;
+	int			max_packet;
+	StringInfoData stmt;		/* statement being built */
+	StringInfoData row;			/* row being serialized */
+	int			header_len;		/* length of "REPLACE INTO ... VALUES " */
+	int			stmt_rows;		/* rows in stmt */
+	bool		inflight;		/* a statement was sent and not answered yet */
+	int64		rows;
+	int64		affected;
+	int64		statements;
+	int64		bytes;
+	double		wait_time;		/* ms blocked on searchd */
+} bulkState;
+
+static void sendStatement(bulkState *state);
+static void finishStatement(bulkState *state);
+
+
+PG_FUNCTION_INFO_V1(sphinx_bulk_replace);
+Datum
+sphinx_bulk_replace(PG_FUNCTION_ARGS)
+{
+	char	   *conname = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char	   *index = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	Oid			sourcetype = get_fn_expr_argtype(fcinfo->flinfo, 2);
+	int			batch_size = PG_GETARG_INT32(3);
+	bool		replace = PG_GETARG_BOOL(4);
+	remoteConn *rconn;
+	TupleDesc	restupdesc;
+	sphinxBulkResult result;
+	Portal		portal;
+	bool		own_portal = false;
+	instr_time	start;
+	instr_time	elapsed;
+	Datum		values[6];
+	bool		nulls[6];
+
+	if (batch_size <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("batch_size must be greater than zero")));
+
+	if (get_call_result_type(fcinfo, NULL, &restupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	rconn = sphinxGetNamedConnection(conname);
+
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+
+	if (sourcetype == REFCURSOROID)
+	{
+		char	   *name = text_to_cstring(PG_GETARG_TEXT_PP(2));
+
+		if (!(portal = SPI_cursor_find(name)))
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_CURSOR),
+					 errmsg("cursor \"%s\" does not exist", name)));
+	}
+	else
+	{
+		char	   *query = text_to_cstring(PG_GETARG_TEXT_PP(2));
+		SPIPlanPtr	plan;
+
+		if (!(plan = SPI_prepare(query, 0, NULL)))
+			elog(ERROR, "SPI_prepare(\"%s\") failed: %s", query,
+				 SPI_result_code_string(SPI_result));
+		if (!(portal = SPI_cursor_open(NULL, plan, NULL, NULL, true)))
+			elog(ERROR, "SPI_cursor_open(\"%s\") failed: %s", query,
+				 SPI_result_code_string(SPI_result));
+		own_portal = true;
+	}
+
+	sphinxBulkLoad(rconn, index, portal, batch_size, replace, &result);
+
+	if (own_portal)
+		SPI_cursor_close(portal);
+	SPI_finish();
+
+	INSTR_TIME_SET_CURRENT(elapsed);
+	INSTR_TIME_SUBTRACT(elapsed, start);
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = Int64GetDatum(result.rows);
+	values[1] = Int64GetDatum(result.affected);
+	values[2] = Int64GetDatum(result.statements);
+	values[3] = Int64GetDatum(result.bytes);
+	values[4] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(elapsed));
+	values[5] = Float8GetDatum(result.wait_time);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(restupdesc),
+													  values, nulls)));
+}
+
+
+/*
+ * Write all rows of portal into index on rconn.  The caller is connected to
+ * SPI; the portal is left open.
+ */
+void
+sphinxBulkLoad(remoteConn *rconn, const char *index, Portal portal, int batch_size,
+			   bool replace, sphinxBulkResult *result)
+{
+	MemoryContext rowcontext;
+	bulkState  *state;
+	bulkColumn *columns = NULL;
+
+	/* not a local variable, so it survives the longjmp to PG_CATCH */
+	state = (bulkState *) palloc0(sizeof(bulkState));
+	state->rconn = rconn;
+	state->max_packet = sphinxGetMaxPacket(state->rconn);
+	/* all statements go to the same replica */
+	sphinxGroupChooseReplica(state->rconn, NULL);
+	initStringInfo(&state->stmt);
+	initStringInfo(&state->row);
+
+	rowcontext = AllocSetContextCreate(CurrentMemoryContext,
+									   "sphinxlink bulk row context",
+									   ALLOCSET_DEFAULT_SIZES);
+
+	PG_TRY();
+	{
+		for (;;)
+		{
+			SPITupleTable *tuptable;
+			uint64		i;
+
+			SPI_cursor_fetch(portal, true, batch_size);
+			if (SPI_processed == 0)
+				break;
+			tuptable = SPI_tuptable;
+
+			/* the statement header comes from the first batch of rows */
+			if (!columns)
+			{
+				appendStringInfo(&state->stmt, "%s INTO ", replace ? "REPLACE" : "INSERT");
+				sphinxAppendIdentifier(&state->stmt, index);
+				appendStringInfoString(&state->stmt, " (");
+				columns = sphinxBulkColumns(tuptable->tupdesc, &state->stmt);
+				appendStringInfoString(&state->stmt, ") VALUES ");
+				state->header_len = state->stmt.len;
+			}
+
+			for (i = 0; i < SPI_processed; i++)
+			{
+				MemoryContext oldcontext;
+
+				CHECK_FOR_INTERRUPTS();
+
+				oldcontext = MemoryContextSwitchTo(rowcontext);
+				sphinxFormatBulkRow(&state->row, columns, tuptable->tupdesc, tuptable->vals[i]);
+				MemoryContextSwitchTo(oldcontext);
+				MemoryContextReset(rowcontext);
+
+				if (state->row.len + state->header_len > state->max_packet)
+					ereport(ERROR,
+							(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+							 errmsg("row " INT64_FORMAT " does not fit into max_allowed_packet of %d bytes",
+									state->rows + 1, state->max_packet)));
+
+				if (state->stmt_rows > 0 &&
+					state->stmt.len + 1 + state->row.len > state->max_packet)
+					sendStatement(state);
+
+				if (state->stmt_rows > 0)
+					appendStringInfoChar(&state->stmt, ',');
+				appendBinaryStringInfo(&state->stmt, state->row.data, state->row.len);
+				state->stmt_rows++;
+				state->rows++;
+
+				if (state->stmt_rows >= batch_size)
+					sendStatement(state);
+			}
+
+			SPI_freetuptable(tuptable);
+		}
+
+		if (state->stmt_rows > 0)
+			sendStatement(state);
+		if (state->inflight)
+			finishStatement(state);
+	}
+	PG_CATCH();
+	{
+		/* rows sent so far stay in the index, just stop the one in flight */
+		if (state->inflight)
+			sphinxCancelQuery(state->rconn);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	MemoryContextDelete(rowcontext);
+
+	result->rows = state->rows;
+	result->affected = state->affected;
+	result->statements = state->statements;
+	result->bytes = state->bytes;
+	result->wait_time = state->wait_time;
+}
+
+
+/*
+ * Largest statement searchd accepts, asked once per connection
+ */
+int
+sphinxGetMaxPacket(remoteConn *rconn)
+{
+	MYSQL_RES  *res;
+	MYSQL_ROW	row;
+	int			result = DEFAULT_MAX_PACKET;
+
+	if (rconn->max_packet > 0)
+		return rconn->max_packet;
+
+	if (sphinxExecQuery(rconn, "SHOW VARIABLES LIKE 'max_allowed_packet'") ||
+		!(res = mysql_store_result(rconn->conn)))
+		return result;
+
+	if ((row = mysql_fetch_row(res)) && row[1])
+	{
+		long		value = strtol(row[1], NULL, 10);
+
+		if (value > 0)
+			result = (int) Min(value, (long) (MaxAllocSize / 2));
+	}
+	mysql_free_result(res);
+	rconn->max_packet = result;
+
+	return result;
+}
+
+
+/*
+ * Decide how each column of tupdesc is written, and append the column list
+ * ("id, title, ...") to names.
+ */
+bulkColumn *
+sphinxBulkColumns(TupleDesc tupdesc, StringInfo names)
+{
+	bulkColumn *columns;
+	bool		first = true;
+	int			i;
+
+	columns = (bulkColumn *) palloc0(tupdesc->natts * sizeof(bulkColumn));
+
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		Form_pg_attribute att = TupleDescAttr(tupdesc, i);
+		Oid			outfunc;
+		bool		isvarlena;
+
+		if (att->attisdropped)
+			continue;
+
+		if (!first)
+			appendStringInfoString(names, ", ");
+		sphinxAppendIdentifier(names, NameStr(att->attname));
+		first = false;
+
+		columns[i].type = att->atttypid;
+		switch (att->atttypid)
+		{
+			case INT2OID:
+			case INT4OID:
+			case INT8OID:
+				columns[i].kind = BULK_INT;
+				break;
+			case BOOLOID:
+				columns[i].kind = BULK_BOOL;
+				break;
+			case FLOAT4OID:
+			case FLOAT8OID:
+			case NUMERICOID:
+			case TIMESTAMPOID:
+			case TIMESTAMPTZOID:
+				columns[i].kind = BULK_OTHER;
+				break;
+			default:
+				if (type_is_array(att->atttypid))
+					columns[i].kind = BULK_ARRAY;
+				else
+				{
+					columns[i].kind = BULK_STRING;
+					getTypeOutputInfo(att->atttypid, &outfunc, &isvarlena);
+					fmgr_info(outfunc, &columns[i].outfunc);
+				}
+				break;
+		}
+	}
+
+	return columns;
+}
+
+
+/*
+ * Serialize a row as "(value, ...)" into buf.  Sphinx attributes have no
+ * NULL, so NULL numbers are sent as 0 and other NULLs as empty strings.
+ */
+void
+sphinxFormatBulkRow(StringInfo buf, bulkColumn *columns, TupleDesc tupdesc, HeapTuple tuple)
+{
+	bool		first = true;
+	char		num[32];
+	int			i;
+
+	resetStringInfo(buf);
+	appendStringInfoChar(buf, '(');
+
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		bulkColumn *col = &columns[i];
+		Datum		value;
+		bool		isnull;
+
+		if (TupleDescAttr(tupdesc, i)->attisdropped)
+			continue;
+
+		if (!first)
+			appendStringInfoString(buf, ", ");
+		first = false;
+
+		value = heap_getattr(tuple, i + 1, tupdesc, &isnull);
+		if (isnull)
+		{
+			if (col->kind == BULK_STRING)
+				appendStringInfoString(buf, "''");
+			else if (col->kind == BULK_ARRAY)
+				appendStringInfoString(buf, "()");
+			else
+				appendStringInfoChar(buf, '0');
+			continue;
+		}
+
+		switch (col->kind)
+		{
+			case BULK_INT:
+				if (col->type == INT2OID)
+					pg_lltoa(DatumGetInt16(value), num);
+				else if (col->type == INT4OID)
+					pg_lltoa(DatumGetInt32(value), num);
+				else
+					pg_lltoa(DatumGetInt64(value), num);
+				appendStringInfoString(buf, num);
+				break;
+			case BULK_BOOL:
+				appendStringInfoChar(buf, DatumGetBool(value) ? '1' : '0');
+				break;
+			case BULK_STRING:
+				/* numbers never need conversion, strings go to UTF8 */
+				sphinxAppendEscapedString(buf,
+										  sphinxDatabaseToUTF8(OutputFunctionCall(&col->outfunc, value)));
+				break;
+			case BULK_ARRAY:
+				{
+					ArrayType  *array = DatumGetArrayTypeP(value);
+
+					appendStringInfoChar(buf, '(');
+					if (ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array)) > 0)
+						sphinxAppendValue(buf, PointerGetDatum(array), col->type);
+					appendStringInfoChar(buf, ')');
+					break;
+				}
+			case BULK_OTHER:
+				sphinxAppendValue(buf, value, col->type);
+				break;
+		}
+	}
+
+	appendStringInfoChar(buf, ')');
+}
+
+
+/*
+ * Send the statement built so far.  The answer to the previous one is read
+ * first, so searchd works on one statement while we build the next.
+ */
+static void
+sendStatement(bulkState *state)
+{
+	MYSQL	   *conn = state->rconn->conn;
+
+	if (state->inflight)
+		finishStatement(state);
+
+	sphinxCheckIdle(state->rconn);
+	/* values are escaped, so the statement has no NUL bytes */
+	if (sphinxSendQuery(conn, &state->rconn->options, state->stmt.data))
+	{
+		sphinxGroupReportError(state->rconn);
+		ereport(ERROR,
+				(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+				 errmsg("Could not execute query: %s", mysql_error(conn))));
+	}
+
+	state->inflight = true;
+	state->statements++;
+	state->bytes += state->stmt.len;
+
+	/* keep the header for the next statement */
+	state->stmt.len = state->header_len;
+	state->stmt.data[state->stmt.len] = '\0';
+	state->stmt_rows = 0;
+}
+
+
+static void
+finishStatement(bulkState *state)
+{
+	MYSQL	   *conn = state->rconn->conn;
+	instr_time	start;
+	instr_time	end;
+	int			ret;
+
+	INSTR_TIME_SET_CURRENT(start);
+	ret = sphinxReadQueryResult(state->rconn);
+	state->inflight = false;
+	INSTR_TIME_SET_CURRENT(end);
+	INSTR_TIME_SUBTRACT(end, start);
+	state->wait_time += INSTR_TIME_GET_MILLISEC(end);
+
+	if (ret)
+	{
+		sphinxGroupReportError(state->rconn);
+		ereport(ERROR,
+				(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+				 errmsg("Could not execute statement " INT64_FORMAT ": %s",
+						state->statements, mysql_error(conn))));
+	}
+	state->affected += mysql_affected_rows(conn);
+}
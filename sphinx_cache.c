@@ -0,0 +1,512 @@
+/*
+ * sphinx_cache.c
+ *
+ * Shared result cache for sphinx_query().
+ *
+ * With sphinxlink in shared_preload_libraries and sphinxlink.cache_size > 0,
+ * results of SELECT statements are kept in a DSA area living in the main
+ * shared memory segment, indexed by a shared hash of (host, port, query).
+ * Entries expire after sphinxlink.cache_ttl, and the least recently used
+ * ones are evicted when the area or the index is full.
+ *
+ * contrib/sphinxlink/sphinx_cache.c
+ */
+#include "postgres.h"
+
+#include "miscadmin.h"
+#include "funcapi.h"
+#include "lib/ilist.h"
+#include "parser/scansup.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/dsa.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+#if (PG_VERSION_NUM >= 130000)
+#include "common/hashfn.h"
+#else
+#include "utils/hashutils.h"
+#define hash_bytes_extended(k, len, seed) DatumGetUInt64(hash_any_extended((k), (len), (seed)))
+#endif
+#include <sphinxlink.h>
+
+#define CACHE_MIN_SIZE		(1024 * 1024)
+
+/* Index entry, keyed by a hash of the cache key */
+typedef struct cacheEntry
+{
+	uint64		hash;			/* hash key, must be first */
+	dsa_pointer data;			/* cacheData */
+	Size		size;
+	TimestampTz expires;
+	dlist_node	lru;
+} cacheEntry;
+
+/* Cached result, followed by the key and the rows */
+typedef struct cacheData
+{
+	int32		keylen;
+	int32		nfields;
+	Size		rowslen;
+} cacheData;
+
+typedef struct cacheShared
+{
+	LWLock	   *lock;			/* protects everything here and the entries */
+	int			dsa_tranche;
+	dlist_head	lru;			/* most recently used first */
+	int64		entries;
+	int64		bytes;
+	int64		hits;
+	int64		misses;
+	int64		inserts;
+	int64		evictions;
+	int64		invalidations;
+} cacheShared;
+
+/* GUC variables */
+static int	sphinx_cache_size = 0;
+static int	sphinx_cache_max_entries = 10000;
+static int	sphinx_cache_ttl = 60000;
+
+static cacheShared *cacheState = NULL;
+static HTAB *cacheIndex = NULL;
+static void *cachePlace = NULL;	/* in-place DSA area */
+static dsa_area *cacheArea = NULL;
+
+#if (PG_VERSION_NUM >= 150000)
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static Size cacheAreaSize(void);
+static void cacheShmemRequest(void);
+static void cacheShmemStartup(void);
+static void cacheAttach(void);
+static char *cacheKey(const char *host, int port, const char *query, int *keylen);
+static void removeEntry(cacheEntry *entry);
+static bool evictOne(void);
+
+
+/*
+ * Define the cache GUCs and, if the cache is enabled, request shared memory
+ * for it.  Only does anything from shared_preload_libraries.
+ */
+void
+sphinxCacheInit(void)
+{
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	DefineCustomIntVariable("sphinxlink.cache_size",
+							"Amount of shared memory for cached Sphinx results.",
+							"Zero disables the result cache.",
+							&sphinx_cache_size,
+							0,
+							0,
+							MAX_KILOBYTES,
+							PGC_POSTMASTER,
+							GUC_UNIT_KB,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("sphinxlink.cache_max_entries",
+							"Maximum number of cached Sphinx results.",
+							NULL,
+							&sphinx_cache_max_entries,
+							10000,
+							16,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("sphinxlink.cache_ttl",
+							"Time a cached Sphinx result stays valid.",
+							"Zero bypasses the result cache.",
+							&sphinx_cache_ttl,
+							60000,
+							0,
+							INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	if (sphinx_cache_size == 0)
+		return;
+
+#if (PG_VERSION_NUM >= 150000)
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = cacheShmemRequest;
+#else
+	cacheShmemRequest();
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = cacheShmemStartup;
+}
+
+
+static Size
+cacheAreaSize(void)
+{
+	return Max((Size) sphinx_cache_size * 1024, CACHE_MIN_SIZE);
+}
+
+
+static void
+cacheShmemRequest(void)
+{
+#if (PG_VERSION_NUM >= 150000)
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	RequestAddinShmemSpace(MAXALIGN(sizeof(cacheShared)));
+	RequestAddinShmemSpace(cacheAreaSize());
+	RequestAddinShmemSpace(hash_estimate_size(sphinx_cache_max_entries, sizeof(cacheEntry)));
+	RequestNamedLWLockTranche("sphinxlink_cache", 1);
+}
+
+
+static void
+cacheShmemStartup(void)
+{
+	HASHCTL		info;
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	cacheState = ShmemInitStruct("sphinxlink cache", sizeof(cacheShared), &found);
+	cachePlace = ShmemInitStruct("sphinxlink cache area", cacheAreaSize(), &found);
+	if (!found)
+	{
+		dsa_area   *area;
+
+		memset(cacheState, 0, sizeof(cacheShared));
+		cacheState->lock = &(GetNamedLWLockTranche("sphinxlink_cache"))->lock;
+		cacheState->dsa_tranche = LWLockNewTrancheId();
+		dlist_init(&cacheState->lru);
+
+		/* the area never grows beyond the memory reserved for it */
+		area = dsa_create_in_place(cachePlace, cacheAreaSize(), cacheState->dsa_tranche, NULL);
+		dsa_set_size_limit(area, cacheAreaSize());
+		dsa_pin(area);
+		dsa_detach(area);
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(uint64);
+	info.entrysize = sizeof(cacheEntry);
+	cacheIndex = ShmemInitHash("sphinxlink cache index",
+							   sphinx_cache_max_entries, sphinx_cache_max_entries,
+							   &info, HASH_ELEM | HASH_BLOBS);
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+
+static void
+cacheAttach(void)
+{
+	MemoryContext oldcontext;
+
+	if (cacheArea)
+		return;
+
+	LWLockRegisterTranche(cacheState->dsa_tranche, "sphinxlink_cache_area");
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	cacheArea = dsa_attach_in_place(cachePlace, NULL);
+	dsa_pin_mapping(cacheArea);
+	MemoryContextSwitchTo(oldcontext);
+}
+
+
+/*
+ * Is the result of query worth looking up in the cache?  Only single SELECT
+ * statements are cached: other statements change data or report on the
+ * state of the connection.
+ */
+bool
+sphinxCacheUsable(const char *query)
+{
+	if (!cacheState || sphinx_cache_ttl == 0)
+		return false;
+
+	while (scanner_isspace(*query))
+		query++;
+
+	return pg_strncasecmp(query, "SELECT", 6) == 0 && !strchr(query, ';');
+}
+
+
+/*
+ * Largest result worth capturing for the cache
+ */
+Size
+sphinxCacheMaxEntrySize(void)
+{
+	return cacheAreaSize() / 4;
+}
+
+
+/*
+ * Key of a cached result: host, port and the final query text
+ */
+static char *
+cacheKey(const char *host, int port, const char *query, int *keylen)
+{
+	StringInfoData key;
+
+	initStringInfo(&key);
+	appendStringInfo(&key, "%s:%d", host, port);
+	appendStringInfoChar(&key, '\0');
+	appendStringInfoString(&key, query);
+	*keylen = key.len;
+
+	return key.data;
+}
+
+
+/*
+ * Look up a cached result.  Returns a copy of its rows, each an int32 length
+ * followed by a row serialized with sphinxSerializeRow(), or NULL on a miss.
+ */
+char *
+sphinxCacheLookup(const char *host, int port, const char *query,
+				  unsigned int *nfields, Size *rowslen)
+{
+	int			keylen;
+	char	   *key = cacheKey(host, port, query, &keylen);
+	uint64		hash = hash_bytes_extended((unsigned char *) key, keylen, 0);
+	cacheEntry *entry;
+	char	   *rows = NULL;
+
+	cacheAttach();
+
+	LWLockAcquire(cacheState->lock, LW_EXCLUSIVE);
+
+	entry = (cacheEntry *) hash_search(cacheIndex, &hash, HASH_FIND, NULL);
+	if (entry)
+	{
+		cacheData  *data = (cacheData *) dsa_get_address(cacheArea, entry->data);
+		char	   *dkey = (char *) data + MAXALIGN(sizeof(cacheData));
+
+		if (entry->expires <= GetCurrentTimestamp())
+		{
+			removeEntry(entry);
+			entry = NULL;
+		}
+		else if (data->keylen != keylen || memcmp(dkey, key, keylen) != 0)
+			entry = NULL;		/* hash collision */
+		else
+		{
+			dlist_move_head(&cacheState->lru, &entry->lru);
+			*nfields = data->nfields;
+			*rowslen = data->rowslen;
+			rows = palloc(data->rowslen + 1);
+			memcpy(rows, dkey + keylen, data->rowslen);
+		}
+	}
+
+	if (entry)
+		cacheState->hits++;
+	else
+		cacheState->misses++;
+
+	LWLockRelease(cacheState->lock);
+
+	pfree(key);
+	return rows;
+}
+
+
+/*
+ * Store the rows of a result, in the format sphinxCacheLookup() returns,
+ * replacing any older entry for the same key.  Gives up quietly if the
+ * result doesn't fit.
+ */
+void
+sphinxCacheStore(const char *host, int port, const char *query,
+				 unsigned int nfields, const char *rows, Size rowslen)
+{
+	int			keylen;
+	char	   *key = cacheKey(host, port, query, &keylen);
+	uint64		hash = hash_bytes_extended((unsigned char *) key, keylen, 0);
+	Size		size = MAXALIGN(sizeof(cacheData)) + keylen + rowslen;
+	cacheEntry *entry;
+	cacheData  *data;
+	dsa_pointer dp;
+	bool		found;
+
+	if (size > sphinxCacheMaxEntrySize())
+		return;
+
+	cacheAttach();
+
+	LWLockAcquire(cacheState->lock, LW_EXCLUSIVE);
+
+	if ((entry = (cacheEntry *) hash_search(cacheIndex, &hash, HASH_FIND, NULL)))
+		removeEntry(entry);
+
+	/* make room, least recently used first */
+	while (cacheState->entries >= sphinx_cache_max_entries)
+	{
+		if (!evictOne())
+			break;
+	}
+	while (!DsaPointerIsValid(dp = dsa_allocate_extended(cacheArea, size, DSA_ALLOC_NO_OOM)))
+	{
+		if (!evictOne())
+		{
+			LWLockRelease(cacheState->lock);
+			return;
+		}
+	}
+
+	entry = (cacheEntry *) hash_search(cacheIndex, &hash, HASH_ENTER_NULL, &found);
+	if (!entry)
+	{
+		dsa_free(cacheArea, dp);
+		LWLockRelease(cacheState->lock);
+		return;
+	}
+
+	data = (cacheData *) dsa_get_address(cacheArea, dp);
+	data->keylen = keylen;
+	data->nfields = nfields;
+	data->rowslen = rowslen;
+	memcpy((char *) data + MAXALIGN(sizeof(cacheData)), key, keylen);
+	memcpy((char *) data + MAXALIGN(sizeof(cacheData)) + keylen, rows, rowslen);
+
+	entry->data = dp;
+	entry->size = size;
+	entry->expires = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), sphinx_cache_ttl);
+	dlist_push_head(&cacheState->lru, &entry->lru);
+
+	cacheState->entries++;
+	cacheState->bytes += size;
+	cacheState->inserts++;
+
+	LWLockRelease(cacheState->lock);
+
+	pfree(key);
+}
+
+
+/*
+ * Drop an entry.  Caller must hold the lock exclusively.
+ */
+static void
+removeEntry(cacheEntry *entry)
+{
+	uint64		hash = entry->hash;
+
+	dsa_free(cacheArea, entry->data);
+	dlist_delete(&entry->lru);
+	cacheState->entries--;
+	cacheState->bytes -= entry->size;
+	hash_search(cacheIndex, &hash, HASH_REMOVE, NULL);
+}
+
+
+/*
+ * Drop the least recently used entry.  Returns false if the cache is empty.
+ */
+static bool
+evictOne(void)
+{
+	if (dlist_is_empty(&cacheState->lru))
+		return false;
+
+	removeEntry(dlist_tail_element(cacheEntry, lru, &cacheState->lru));
+	cacheState->evictions++;
+
+	return true;
+}
+
+
+PG_FUNCTION_INFO_V1(sphinx_cache_invalidate);
+Datum
+sphinx_cache_invalidate(PG_FUNCTION_ARGS)
+{
+	char	   *pattern = PG_ARGISNULL(0) ? NULL : text_to_cstring(PG_GETARG_TEXT_PP(0));
+	dlist_mutable_iter iter;
+	int64		count = 0;
+
+	if (!cacheState)
+		PG_RETURN_INT64(0);
+
+	cacheAttach();
+
+	LWLockAcquire(cacheState->lock, LW_EXCLUSIVE);
+	dlist_foreach_modify(iter, &cacheState->lru)
+	{
+		cacheEntry *entry = dlist_container(cacheEntry, lru, iter.cur);
+
+		if (pattern)
+		{
+			cacheData  *data = (cacheData *) dsa_get_address(cacheArea, entry->data);
+			char	   *key = (char *) data + MAXALIGN(sizeof(cacheData));
+			char	   *query = key + strlen(key) + 1;
+
+			if (!strstr(query, pattern))
+				continue;
+		}
+
+		removeEntry(entry);
+		count++;
+	}
+	cacheState->invalidations += count;
+	LWLockRelease(cacheState->lock);
+
+	PG_RETURN_INT64(count);
+}
+
+
+PG_FUNCTION_INFO_V1(sphinx_cache_stats);
+Datum
+sphinx_cache_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[7];
+	bool		nulls[7];
+	int64		counters[7] = {0};
+	int			i;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (cacheState)
+	{
+		LWLockAcquire(cacheState->lock, LW_SHARED);
+		counters[0] = cacheState->entries;
+		counters[1] = cacheState->bytes;
+		counters[2] = cacheState->hits;
+		counters[3] = cacheState->misses;
+		counters[4] = cacheState->inserts;
+		counters[5] = cacheState->evictions;
+		counters[6] = cacheState->invalidations;
+		LWLockRelease(cacheState->lock);
+	}
+
+	for (i = 0; i < 7; i++)
+	{
+		values[i] = Int64GetDatum(counters[i]);
+		nulls[i] = false;
+	}
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
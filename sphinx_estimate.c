@@ -0,0 +1,300 @@
+/*
+ * sphinx_estimate.c
+ *
+ * Planner support for sphinx_query() and sphinx_query_params(): row and cost
+ * estimates learned from earlier calls.
+ *
+ * Every call records the number of rows it returned and how long it took,
+ * under its query text and match clause, and under the shape of the query,
+ * the text with its string and number literals blanked out.  When a call is
+ * planned, the support function looks up the text if the arguments are
+ * constants, then the shape, and falls back to sphinxlink.estimated_rows and
+ * the cost of the function.  Estimates are moving averages kept per backend.
+ *
+ * contrib/sphinxlink/sphinx_estimate.c
+ */
+#include "postgres.h"
+
+#include "fmgr.h"
+#include "catalog/pg_type.h"
+#include "nodes/nodeFuncs.h"
+#if (PG_VERSION_NUM >= 120000)
+#include "nodes/supportnodes.h"
+#endif
+#include "optimizer/cost.h"
+#include "parser/scansup.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#if (PG_VERSION_NUM >= 130000)
+#include "common/hashfn.h"
+#else
+#include "utils/hashutils.h"
+#define hash_bytes_extended(k, len, seed) DatumGetUInt64(hash_any_extended((k), (len), (seed)))
+#endif
+#include <sphinxlink.h>
+
+/* queries remembered before the estimates start over */
+#define ESTIMATE_MAX_ENTRIES 4096
+
+/* weight of the newest call in the estimates */
+#define ESTIMATE_ALPHA 0.3
+
+/*
+ * Cost of a millisecond spent waiting for searchd.  A round trip to a nearby
+ * searchd takes about a millisecond, which postgres_fdw's default
+ * fdw_startup_cost puts at 100.
+ */
+#define COST_PER_MS 100.0
+
+/* hash seeds keeping query texts and shapes apart */
+#define TEXT_SEED	0
+#define SHAPE_SEED	1
+
+typedef struct estimateEntry
+{
+	uint64		key;			/* hash of the query text or shape, must be first */
+	double		rows;
+	double		time;			/* ms, or -1 if no call reached Sphinx */
+} estimateEntry;
+
+static int	sphinx_estimated_rows = 1000;
+static HTAB *estimates = NULL;
+
+static void recordEstimate(uint64 key, double rows, double time);
+static estimateEntry *lookupEstimate(Node *node);
+static uint64 textKey(const char *sql, const char *match_clause);
+static uint64 shapeKey(const char *sql);
+
+
+void
+sphinxEstimateInit(void)
+{
+	DefineCustomIntVariable("sphinxlink.estimated_rows",
+							"Rows the planner expects from a Sphinx query it knows nothing about.",
+							"Queries run before in the session are estimated from their results.",
+							&sphinx_estimated_rows,
+							1000,
+							1,
+							INT_MAX,
+							PGC_USERSET,
+							0,
+							NULL,
+							NULL,
+							NULL);
+}
+
+
+/*
+ * Remember the result of a sphinx_query() call: rows returned in time ms,
+ * or a negative time for a call answered by the result cache.
+ */
+void
+sphinxEstimateRecord(const char *sql, const char *match_clause, double rows, double time)
+{
+	recordEstimate(textKey(sql, match_clause), rows, time);
+	recordEstimate(shapeKey(sql), rows, time);
+}
+
+
+static void
+recordEstimate(uint64 key, double rows, double time)
+{
+	estimateEntry *entry;
+	bool		found;
+
+	/* starting over is simpler than eviction, and relearning is quick */
+	if (estimates && hash_get_num_entries(estimates) >= ESTIMATE_MAX_ENTRIES)
+	{
+		hash_destroy(estimates);
+		estimates = NULL;
+	}
+	if (!estimates)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(uint64);
+		ctl.entrysize = sizeof(estimateEntry);
+		ctl.hcxt = TopMemoryContext;
+		estimates = hash_create("sphinxlink estimates", 256, &ctl,
+								HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+	}
+
+	entry = (estimateEntry *) hash_search(estimates, &key, HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->rows = rows;
+		entry->time = time;
+		return;
+	}
+
+	entry->rows = ESTIMATE_ALPHA * rows + (1 - ESTIMATE_ALPHA) * entry->rows;
+	if (time >= 0)
+		entry->time = entry->time < 0 ? time :
+			ESTIMATE_ALPHA * time + (1 - ESTIMATE_ALPHA) * entry->time;
+}
+
+
+/*
+ * Estimate of the sphinx_query() or sphinx_query_params() call node, or NULL
+ */
+static estimateEntry *
+lookupEstimate(Node *node)
+{
+	List	   *args;
+	Const	   *sql;
+	Const	   *match = NULL;
+	estimateEntry *entry;
+	uint64		key;
+	int			first;
+
+	if (!estimates || !node || !IsA(node, FuncExpr))
+		return NULL;
+
+	/* (conname, sql [, match]) or (host, port, sql [, match]) */
+	args = ((FuncExpr *) node)->args;
+	if (list_length(args) < 2)
+		return NULL;
+	first = exprType((Node *) lsecond(args)) == INT4OID ? 2 : 1;
+	if (list_length(args) <= first || !IsA(list_nth(args, first), Const))
+		return NULL;
+	sql = (Const *) list_nth(args, first);
+	if (sql->constisnull)
+		return NULL;
+	if (list_length(args) > first + 1)
+	{
+		if (IsA(list_nth(args, first + 1), Const))
+			match = (Const *) list_nth(args, first + 1);
+		if (match && match->constisnull)
+			return NULL;
+	}
+
+	/* a match clause only known at run time leaves the shape */
+	if (list_length(args) == first + 1 || match)
+	{
+		key = textKey(TextDatumGetCString(sql->constvalue),
+					  match ? TextDatumGetCString(match->constvalue) : NULL);
+		if ((entry = hash_search(estimates, &key, HASH_FIND, NULL)))
+			return entry;
+	}
+
+	key = shapeKey(TextDatumGetCString(sql->constvalue));
+	return hash_search(estimates, &key, HASH_FIND, NULL);
+}
+
+
+static uint64
+textKey(const char *sql, const char *match_clause)
+{
+	StringInfoData buf;
+	uint64		key;
+
+	initStringInfo(&buf);
+	appendStringInfoString(&buf, sql);
+	if (match_clause)
+	{
+		/* the terminating zero keeps "a" + "bc" apart from "ab" + "c" */
+		appendStringInfoChar(&buf, '\0');
+		appendStringInfoString(&buf, match_clause);
+	}
+	key = hash_bytes_extended((const unsigned char *) buf.data, buf.len, TEXT_SEED);
+	pfree(buf.data);
+
+	return key;
+}
+
+
+/*
+ * Hash of sql with every quoted string and number replaced by ? and runs of
+ * white space by a single space
+ */
+static uint64
+shapeKey(const char *sql)
+{
+	StringInfoData buf;
+	const char *p = sql;
+	uint64		key;
+
+	initStringInfo(&buf);
+	while (*p)
+	{
+		if (*p == '\'' || *p == '"')
+		{
+			char		quote = *p++;
+
+			while (*p && *p != quote)
+			{
+				if (*p == '\\' && p[1])
+					p++;
+				p++;
+			}
+			if (*p)
+				p++;
+			appendStringInfoChar(&buf, '?');
+		}
+		else if (isdigit((unsigned char) *p) &&
+				 (p == sql || !(isalnum((unsigned char) p[-1]) || p[-1] == '_')))
+		{
+			while (isdigit((unsigned char) *p) || *p == '.')
+				p++;
+			appendStringInfoChar(&buf, '?');
+		}
+		else if (scanner_isspace(*p))
+		{
+			while (scanner_isspace(*p))
+				p++;
+			appendStringInfoChar(&buf, ' ');
+		}
+		else
+			appendStringInfoChar(&buf, *p++);
+	}
+	key = hash_bytes_extended((const unsigned char *) buf.data, buf.len, SHAPE_SEED);
+	pfree(buf.data);
+
+	return key;
+}
+
+
+/*
+ * sphinx_query_support(internal): support function of sphinx_query() and
+ * sphinx_query_params(), answering row count and cost requests
+ */
+PG_FUNCTION_INFO_V1(sphinx_query_support);
+Datum
+sphinx_query_support(PG_FUNCTION_ARGS)
+{
+#if (PG_VERSION_NUM >= 120000)
+	Node	   *rawreq = (Node *) PG_GETARG_POINTER(0);
+	estimateEntry *entry;
+
+	if (IsA(rawreq, SupportRequestRows))
+	{
+		SupportRequestRows *req = (SupportRequestRows *) rawreq;
+
+		entry = lookupEstimate(req->node);
+		req->rows = entry ? entry->rows : sphinx_estimated_rows;
+		PG_RETURN_POINTER(req);
+	}
+
+	if (IsA(rawreq, SupportRequestCost))
+	{
+		SupportRequestCost *req = (SupportRequestCost *) rawreq;
+
+		/*
+		 * The whole query runs before the first row comes back; rows cost
+		 * what the default procost of 1 charges for them.
+		 */
+		entry = lookupEstimate(req->node);
+		if (entry && entry->time >= 0)
+		{
+			req->startup = entry->time * COST_PER_MS;
+			req->per_tuple = cpu_operator_cost;
+			PG_RETURN_POINTER(req);
+		}
+	}
+#endif
+
+	PG_RETURN_POINTER(NULL);
+}
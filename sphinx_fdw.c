@@ -0,0 +1,1721 @@
+/*
+ * sphinx_fdw.c
+ *
+ * Foreign data wrapper for SphinxSearch (ManticoreSearch) indexes
+ *
+ * Foreign servers describe a searchd SphinxQL listener (host, port), foreign
+ * tables map to Sphinx indexes.  Full-text conditions written with the ==>
+ * operator, simple attribute comparisons, ORDER BY on attributes and LIMIT
+ * are sent to searchd; everything else is evaluated locally.  A table can be
+ * split into shards and id ranges, scanned one after another or shared by
+ * parallel workers.
+ *
+ * contrib/sphinxlink/sphinx_fdw.c
+ * Copyright (c) 2017 - 2022, Dmitry Voronin
+ * ALL RIGHTS RESERVED;
+ *
+ */
+#include "postgres.h"
+
+#include "access/parallel.h"
+#include "access/reloptions.h"
+#include "access/stratnum.h"
+#include "access/sysattr.h"
+#include "access/transam.h"
+#include "catalog/pg_foreign_data_wrapper.h"
+#include "catalog/pg_foreign_server.h"
+#include "catalog/pg_foreign_table.h"
+#include "catalog/pg_type.h"
+#include "catalog/pg_user_mapping.h"
+#include "commands/defrem.h"
+#include "commands/explain.h"
+#include "foreign/fdwapi.h"
+#include "foreign/foreign.h"
+#include "miscadmin.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/cost.h"
+#include "optimizer/pathnode.h"
+#include "optimizer/paths.h"
+#include "optimizer/planmain.h"
+#include "optimizer/restrictinfo.h"
+#include "optimizer/optimizer.h"
+#include "port/atomics.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/timestamp.h"
+#include <sphinxlink.h>
+
+/* Defaults for options */
+#define DEFAULT_HOST			"127.0.0.1"
+#define DEFAULT_PORT			9306
+#define DEFAULT_MAX_MATCHES		1000
+
+/* Upper limit of the id_partitions option */
+#define MAX_ID_PARTITIONS		1024
+
+/* Cost constants, in the same units as postgres_fdw uses */
+#define DEFAULT_FDW_STARTUP_COST	100.0
+#define DEFAULT_FDW_TUPLE_COST		0.01
+#define COST_PER_REMOTE_MSEC		10.0
+
+/* Selectivity assumed for a MATCH() condition without remote estimates */
+#define DEFAULT_MATCH_SELECTIVITY	0.1
+
+/* characters of a column name that is a plain attribute */
+#define ATTRIBUTE_CHARS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_@"
+
+/* Valid options for sphinx_fdw objects */
+typedef struct sphinxFdwOption
+{
+	const char *optname;
+	Oid			optcontext;		/* catalog in which option may appear */
+} sphinxFdwOption;
+
+static const sphinxFdwOption valid_options[] =
+{
+	{"host", ForeignServerRelationId},
+	{"port", ForeignServerRelationId},
+	{"use_remote_estimate", ForeignServerRelationId},
+	{"index", ForeignTableRelationId},
+	{"max_matches", ForeignTableRelationId},
+	{"use_remote_estimate", ForeignTableRelationId},
+	{"shards", ForeignTableRelationId},
+	{"id_partitions", ForeignTableRelationId},
+	{"column_name", AttributeRelationId},
+	{NULL, InvalidOid}
+};
+
+
+/*
+ * Planner state for a foreign table, kept in baserel->fdw_private.
+ */
+typedef struct sphinxFdwRelationInfo
+{
+	char	   *host;
+	int			port;
+	char	   *index;
+	int			max_matches;
+	bool		use_remote_estimate;
+	List	   *shards;			/* indexes scanned instead of index, or NIL */
+	int			id_partitions;	/* id ranges each index is split into */
+	int			nparts;			/* queries sent by a full scan */
+
+	char	   *match;			/* combined MATCH() query, or NULL */
+	List	   *match_conds;	/* RestrictInfos turned into MATCH() */
+	List	   *remote_conds;	/* RestrictInfos sent as attribute filters */
+	List	   *local_conds;	/* RestrictInfos checked locally */
+	char	   *where_sql;		/* deparsed remote conditions, or NULL */
+
+	Bitmapset  *attrs_used;		/* columns fetched from searchd */
+
+	double		remote_rows;	/* rows searchd would send without LIMIT */
+	double		remote_msec;	/* searchd query time, if known */
+} sphinxFdwRelationInfo;
+
+
+/*
+ * Indexes of fdw_private list items of a ForeignScan plan.
+ */
+enum sphinxFdwScanPrivateIndex
+{
+	FdwScanPrivateSelectSql,	/* SphinxQL statement */
+	FdwScanPrivateRetrievedAttrs,	/* attnums of retrieved columns */
+	/* pieces of the statement of a partitioned scan */
+	FdwScanPrivateColumns,		/* "SELECT <columns>" */
+	FdwScanPrivateConds,		/* WHERE conditions, or "" */
+	FdwScanPrivateTail,			/* ORDER BY, LIMIT and OPTION */
+	FdwScanPrivateShards,		/* indexes to scan */
+	FdwScanPrivateIdPartitions,	/* id ranges per index */
+	FdwScanPrivateMaxMatches	/* rows a query stops at without LIMIT, or 0 */
+};
+
+
+/*
+ * One query of a partitioned scan: an index of the shards list, and the id
+ * range to fetch from it if the index is split by id.
+ */
+typedef struct sphinxFdwPartition
+{
+	int			shard;
+	int64		min_id;			/* empty range if min_id > max_id */
+	int64		max_id;
+} sphinxFdwPartition;
+
+
+/*
+ * Shared state of a parallel scan: participants take partitions in turn.
+ */
+typedef struct sphinxFdwParallelState
+{
+	pg_atomic_uint32 next_part;
+	sphinxFdwPartition parts[FLEXIBLE_ARRAY_MEMBER];
+} sphinxFdwParallelState;
+
+
+/*
+ * Execution state of a foreign scan.
+ */
+typedef struct sphinxFdwScanState
+{
+	char	   *query;			/* SphinxQL statement */
+	List	   *retrieved_attrs;	/* attnums in result column order */
+	remoteConn *rconn;
+	MYSQL_RES  *res;			/* current result, or NULL if not sent yet */
+	convPlan   *plan;			/* conversion plan for the foreign table */
+	MemoryContext batch_cxt;	/* per-row conversion memory */
+
+	/* partitioned scans */
+	bool		partitioned;
+	char	   *index;
+	char	   *columns;
+	char	   *conds;
+	char	   *tail;
+	int			max_matches;	/* see checkTruncated() */
+	List	   *shards;
+	int			id_partitions;
+	int			nparts;
+	sphinxFdwPartition *parts;
+	bool		parts_ready;	/* false until the id ranges are known */
+	int			next_part;		/* next partition of a non-parallel scan */
+	sphinxFdwParallelState *pstate; /* shared state, if parallel */
+} sphinxFdwScanState;
+
+
+PG_FUNCTION_INFO_V1(sphinx_fdw_handler);
+PG_FUNCTION_INFO_V1(sphinx_fdw_validator);
+PG_FUNCTION_INFO_V1(sphinx_match);
+
+/* FDW callbacks */
+static void sphinxGetForeignRelSize(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid);
+static void sphinxGetForeignPaths(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid);
+static ForeignScan *sphinxGetForeignPlan(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid,
+										 ForeignPath *best_path, List *tlist, List *scan_clauses,
+										 Plan *outer_plan);
+static void sphinxBeginForeignScan(ForeignScanState *node, int eflags);
+static TupleTableSlot *sphinxIterateForeignScan(ForeignScanState *node);
+static void sphinxReScanForeignScan(ForeignScanState *node);
+static void sphinxEndForeignScan(ForeignScanState *node);
+static void sphinxExplainForeignScan(ForeignScanState *node, ExplainState *es);
+static bool sphinxIsForeignScanParallelSafe(PlannerInfo *root, RelOptInfo *rel, RangeTblEntry *rte);
+static Size sphinxEstimateDSMForeignScan(ForeignScanState *node, ParallelContext *pcxt);
+static void sphinxInitializeDSMForeignScan(ForeignScanState *node, ParallelContext *pcxt,
+										   void *coordinate);
+static void sphinxReInitializeDSMForeignScan(ForeignScanState *node, ParallelContext *pcxt,
+											 void *coordinate);
+static void sphinxInitializeWorkerForeignScan(ForeignScanState *node, shm_toc *toc,
+											  void *coordinate);
+
+/* Static functions declaration */
+static bool isValidOption(const char *option, Oid context);
+static void getTableOptions(Oid foreigntableid, sphinxFdwRelationInfo *fpinfo);
+static char *getColumnName(Oid relid, AttrNumber attnum);
+static char *getAttributeName(Oid relid, AttrNumber attnum);
+static bool isNullableColumn(const char *colname);
+static bool isSphinxMatchExpr(Expr *expr, Index relid, char **query);
+static bool deparseRemoteCond(Expr *expr, Index relid, Oid foreigntableid, StringInfo buf);
+static bool deparseConst(Const *node, StringInfo buf);
+static Var *getForeignVar(Expr *expr, Index relid);
+static bool isPushableType(Oid typid);
+static bool deparsePathKeys(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid,
+							List *pathkeys, StringInfo buf);
+static void deparseSelectSql(StringInfo buf, sphinxFdwRelationInfo *fpinfo, Oid foreigntableid,
+							 Relation rel, List **retrieved_attrs);
+static void deparseConds(StringInfo buf, sphinxFdwRelationInfo *fpinfo);
+static void deparseLimit(StringInfo buf, sphinxFdwRelationInfo *fpinfo, int limit);
+static void estimateRemoteRows(Oid foreigntableid, sphinxFdwRelationInfo *fpinfo);
+static double getPushedLimit(PlannerInfo *root, RelOptInfo *baserel, List *pathkeys);
+static ForeignPath *makeForeignPath(PlannerInfo *root, RelOptInfo *baserel, double rows,
+									Cost startup_cost, Cost total_cost, List *pathkeys, int limit);
+static void executeRemoteQuery(remoteConn *rconn, const char *query);
+static void releaseScanResult(void *arg);
+static List *parseShards(const char *value);
+static double getParallelDivisor(int workers);
+static bool beginNextPartition(sphinxFdwScanState *fsstate);
+static void checkTruncated(sphinxFdwScanState *fsstate, const char *query);
+static void computePartitions(sphinxFdwScanState *fsstate, sphinxFdwPartition *parts);
+static bool fetchIdBound(sphinxFdwScanState *fsstate, const char *index, bool max, int64 *id);
+
+
+/*
+ * Foreign-data wrapper handler function: return a struct with pointers
+ * to my callback routines.
+ */
+Datum
+sphinx_fdw_handler(PG_FUNCTION_ARGS)
+{
+	FdwRoutine *routine = makeNode(FdwRoutine);
+
+	routine->GetForeignRelSize = sphinxGetForeignRelSize;
+	routine->GetForeignPaths = sphinxGetForeignPaths;
+	routine->GetForeignPlan = sphinxGetForeignPlan;
+	routine->BeginForeignScan = sphinxBeginForeignScan;
+	routine->IterateForeignScan = sphinxIterateForeignScan;
+	routine->ReScanForeignScan = sphinxReScanForeignScan;
+	routine->EndForeignScan = sphinxEndForeignScan;
+	routine->ExplainForeignScan = sphinxExplainForeignScan;
+
+	routine->IsForeignScanParallelSafe = sphinxIsForeignScanParallelSafe;
+	routine->EstimateDSMForeignScan = sphinxEstimateDSMForeignScan;
+	routine->InitializeDSMForeignScan = sphinxInitializeDSMForeignScan;
+	routine->ReInitializeDSMForeignScan = sphinxReInitializeDSMForeignScan;
+	routine->InitializeWorkerForeignScan = sphinxInitializeWorkerForeignScan;
+
+	PG_RETURN_POINTER(routine);
+}
+
+
+/*
+ * Validate the generic options given to a FOREIGN DATA WRAPPER, SERVER,
+ * USER MAPPING or FOREIGN TABLE that uses sphinx_fdw.
+ */
+Datum
+sphinx_fdw_validator(PG_FUNCTION_ARGS)
+{
+	List	   *options_list = untransformRelOptions(PG_GETARG_DATUM(0));
+	Oid			catalog = PG_GETARG_OID(1);
+	ListCell   *cell;
+
+	foreach(cell, options_list)
+	{
+		DefElem    *def = (DefElem *) lfirst(cell);
+
+		if (!isValidOption(def->defname, catalog))
+		{
+			StringInfoData buf;
+			const sphinxFdwOption *opt;
+
+			initStringInfo(&buf);
+			for (opt = valid_options; opt->optname; opt++)
+			{
+				if (catalog == opt->optcontext)
+					appendStringInfo(&buf, "%s%s", (buf.len > 0) ? ", " : "",
+									 opt->optname);
+			}
+
+			ereport(ERROR,
+					(errcode(ERRCODE_FDW_INVALID_OPTION_NAME),
+					 errmsg("invalid option \"%s\"", def->defname),
+					 buf.len > 0
+					 ? errhint("Valid options in this context are: %s", buf.data)
+					 : errhint("There are no valid options in this context.")));
+		}
+
+		if (strcmp(def->defname, "port") == 0 ||
+			strcmp(def->defname, "max_matches") == 0 ||
+			strcmp(def->defname, "id_partitions") == 0)
+		{
+			char	   *value = defGetString(def);
+			char	   *end;
+			long		num;
+
+			errno = 0;
+			num = strtol(value, &end, 10);
+			if (errno != 0 || *end != '\0' || num <= 0 || num > PG_INT32_MAX)
+				ereport(ERROR,
+						(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+						 errmsg("\"%s\" must be a positive integer", def->defname)));
+			if (strcmp(def->defname, "id_partitions") == 0 && num > MAX_ID_PARTITIONS)
+				ereport(ERROR,
+						(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+						 errmsg("\"id_partitions\" must not be greater than %d", MAX_ID_PARTITIONS)));
+		}
+		else if (strcmp(def->defname, "use_remote_estimate") == 0)
+		{
+			/* defGetBoolean() complains about anything but a boolean */
+			(void) defGetBoolean(def);
+		}
+		else if (strcmp(def->defname, "shards") == 0)
+			(void) parseShards(defGetString(def));
+	}
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * Full-text match operator.  It only makes sense inside a query on a
+ * sphinx_fdw foreign table, where it is turned into MATCH().
+ */
+Datum
+sphinx_match(PG_FUNCTION_ARGS)
+{
+	ereport(ERROR,
+			(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+			 errmsg("operator ==> can only be used in WHERE conditions on sphinx_fdw foreign tables"),
+			 errhint("The right operand must be a constant full-text query.")));
+
+	PG_RETURN_BOOL(false);
+}
+
+
+/*
+ * sphinxGetForeignRelSize
+ *		Classify restriction clauses and estimate the number of rows
+ */
+static void
+sphinxGetForeignRelSize(PlannerInfo *root,
+						RelOptInfo *baserel,
+						Oid foreigntableid)
+{
+	sphinxFdwRelationInfo *fpinfo;
+	StringInfoData match;
+	StringInfoData where;
+	ListCell   *lc;
+	Selectivity local_sel;
+	Selectivity remote_sel;
+
+	fpinfo = (sphinxFdwRelationInfo *) palloc0(sizeof(sphinxFdwRelationInfo));
+	baserel->fdw_private = (void *) fpinfo;
+
+	getTableOptions(foreigntableid, fpinfo);
+
+	/*
+	 * Split restriction clauses into the ones sent to searchd and the ones
+	 * we have to check locally.  Several full-text conditions are combined
+	 * into a single MATCH(), which is an implicit AND in Sphinx syntax.
+	 */
+	initStringInfo(&match);
+	initStringInfo(&where);
+	foreach(lc, baserel->baserestrictinfo)
+	{
+		RestrictInfo *ri = lfirst_node(RestrictInfo, lc);
+		char	   *query;
+		int			saved_len = where.len;
+
+		if (isSphinxMatchExpr(ri->clause, baserel->relid, &query))
+		{
+			appendStringInfo(&match, "%s(%s)", match.len > 0 ? " " : "", query);
+			fpinfo->match_conds = lappend(fpinfo->match_conds, ri);
+			continue;
+		}
+
+		if (where.len > 0)
+			appendStringInfoString(&where, " AND ");
+		if (deparseRemoteCond(ri->clause, baserel->relid, foreigntableid, &where))
+			fpinfo->remote_conds = lappend(fpinfo->remote_conds, ri);
+		else
+		{
+			/* roll back partially deparsed text */
+			where.len = saved_len;
+			where.data[where.len] = '\0';
+			fpinfo->local_conds = lappend(fpinfo->local_conds, ri);
+		}
+	}
+	fpinfo->match = match.len > 0 ? match.data : NULL;
+	fpinfo->where_sql = where.len > 0 ? where.data : NULL;
+
+	/* Identify which attributes will need to be retrieved from searchd */
+	pull_varattnos((Node *) baserel->reltarget->exprs, baserel->relid,
+				   &fpinfo->attrs_used);
+	foreach(lc, fpinfo->local_conds)
+	{
+		RestrictInfo *ri = lfirst_node(RestrictInfo, lc);
+
+		pull_varattnos((Node *) ri->clause, baserel->relid,
+					   &fpinfo->attrs_used);
+	}
+
+	remote_sel = clauselist_selectivity(root,
+										extract_actual_clauses(fpinfo->remote_conds, false),
+										baserel->relid,
+										JOIN_INNER,
+										NULL);
+	local_sel = clauselist_selectivity(root,
+									   extract_actual_clauses(fpinfo->local_conds, false),
+									   baserel->relid,
+									   JOIN_INNER,
+									   NULL);
+
+	/*
+	 * searchd never returns more than max_matches rows per query, so that
+	 * times the number of partitions is the upper bound for the estimate.
+	 * With use_remote_estimate we ask searchd for total_found, otherwise
+	 * guess from the conditions.
+	 */
+	if (fpinfo->use_remote_estimate)
+		estimateRemoteRows(foreigntableid, fpinfo);
+	else
+	{
+		fpinfo->remote_rows = (double) fpinfo->max_matches * fpinfo->nparts * remote_sel;
+		if (fpinfo->match)
+			fpinfo->remote_rows *= DEFAULT_MATCH_SELECTIVITY;
+		fpinfo->remote_msec = 0;
+	}
+	fpinfo->remote_rows = clamp_row_est(Min(fpinfo->remote_rows,
+											(double) fpinfo->max_matches * fpinfo->nparts));
+
+	baserel->tuples = fpinfo->remote_rows;
+	baserel->rows = clamp_row_est(fpinfo->remote_rows * local_sel);
+}
+
+
+/*
+ * sphinxGetForeignPaths
+ *		Create a plain path, a sorted one if ORDER BY can be sent to searchd,
+ *		and a partial one if the scan is partitioned
+ */
+static void
+sphinxGetForeignPaths(PlannerInfo *root,
+					  RelOptInfo *baserel,
+					  Oid foreigntableid)
+{
+	sphinxFdwRelationInfo *fpinfo = (sphinxFdwRelationInfo *) baserel->fdw_private;
+	double		limit;
+	double		rows;
+	Cost		startup_cost;
+	Cost		run_cost;
+	ForeignPath *path;
+
+	startup_cost = DEFAULT_FDW_STARTUP_COST + fpinfo->remote_msec * COST_PER_REMOTE_MSEC;
+
+	/* unsorted path; LIMIT can only go remote if no ordering is needed */
+	limit = (root->query_pathkeys == NIL) ? getPushedLimit(root, baserel, NIL) : -1;
+	rows = (limit > 0) ? Min(baserel->rows, limit) : baserel->rows;
+	run_cost = rows * (cpu_tuple_cost + DEFAULT_FDW_TUPLE_COST);
+
+	path = makeForeignPath(root, baserel, rows, startup_cost, startup_cost + run_cost,
+						   NIL, (int) limit);
+	add_path(baserel, (Path *) path);
+
+	/*
+	 * Partitions are scanned one after another, so a partitioned scan can be
+	 * shared by parallel workers, but can't return rows in searchd's order.
+	 */
+	if (fpinfo->nparts > 1)
+	{
+		int			workers = Min(fpinfo->nparts, max_parallel_workers_per_gather);
+		double		divisor;
+
+		if (!baserel->consider_parallel || workers <= 0)
+			return;
+
+		divisor = getParallelDivisor(workers);
+		path = makeForeignPath(root, baserel, clamp_row_est(rows / divisor), startup_cost,
+							   startup_cost + run_cost / divisor, NIL, (int) limit);
+		path->path.parallel_aware = true;
+		path->path.parallel_workers = workers;
+		add_partial_path(baserel, (Path *) path);
+		return;
+	}
+
+	/* sorted path, if every sort key is a column searchd can order by */
+	if (root->query_pathkeys != NIL &&
+		deparsePathKeys(root, baserel, foreigntableid, root->query_pathkeys, NULL))
+	{
+		limit = getPushedLimit(root, baserel, root->query_pathkeys);
+		rows = (limit > 0) ? Min(baserel->rows, limit) : baserel->rows;
+		run_cost = rows * (cpu_tuple_cost + DEFAULT_FDW_TUPLE_COST);
+
+		path = makeForeignPath(root, baserel, rows, startup_cost, startup_cost + run_cost,
+							   root->query_pathkeys, (int) limit);
+		add_path(baserel, (Path *) path);
+	}
+}
+
+
+/*
+ * Create a ForeignPath, remembering the LIMIT sent with it (-1 for none).
+ */
+static ForeignPath *
+makeForeignPath(PlannerInfo *root, RelOptInfo *baserel, double rows,
+				Cost startup_cost, Cost total_cost, List *pathkeys, int limit)
+{
+#if (PG_VERSION_NUM >= 180000)
+	return create_foreignscan_path(root, baserel, NULL, rows, 0,
+								   startup_cost, total_cost,
+								   pathkeys, baserel->lateral_relids, NULL, NIL,
+								   list_make1(makeInteger(limit)));
+#elif (PG_VERSION_NUM >= 170000)
+	return create_foreignscan_path(root, baserel, NULL, rows,
+								   startup_cost, total_cost,
+								   pathkeys, baserel->lateral_relids, NULL, NIL,
+								   list_make1(makeInteger(limit)));
+#else
+	return create_foreignscan_path(root, baserel, NULL, rows,
+								   startup_cost, total_cost,
+								   pathkeys, baserel->lateral_relids, NULL,
+								   list_make1(makeInteger(limit)));
+#endif
+}
+
+
+/*
+ * sphinxGetForeignPlan
+ *		Build the SphinxQL statement for the chosen path
+ */
+static ForeignScan *
+sphinxGetForeignPlan(PlannerInfo *root,
+					 RelOptInfo *baserel,
+					 Oid foreigntableid,
+					 ForeignPath *best_path,
+					 List *tlist,
+					 List *scan_clauses,
+					 Plan *outer_plan)
+{
+	sphinxFdwRelationInfo *fpinfo = (sphinxFdwRelationInfo *) baserel->fdw_private;
+	int			limit = intVal(linitial(best_path->fdw_private));
+	List	   *local_exprs = NIL;
+	List	   *retrieved_attrs = NIL;
+	List	   *shards = NIL;
+	List	   *fdw_private;
+	StringInfoData columns;
+	StringInfoData conds;
+	StringInfoData tail;
+	char	   *sql;
+	Relation	rel;
+	ListCell   *lc;
+
+	/*
+	 * Keep only the clauses that were not sent to searchd.  Pseudoconstant
+	 * clauses are handled by a gating Result node above us.
+	 */
+	foreach(lc, scan_clauses)
+	{
+		RestrictInfo *ri = lfirst_node(RestrictInfo, lc);
+
+		if (ri->pseudoconstant)
+			continue;
+		if (list_member_ptr(fpinfo->remote_conds, ri) ||
+			list_member_ptr(fpinfo->match_conds, ri))
+			continue;
+		local_exprs = lappend(local_exprs, ri->clause);
+	}
+
+	/* The planner already holds a lock on the relation */
+	rel = RelationIdGetRelation(foreigntableid);
+
+	initStringInfo(&columns);
+	deparseSelectSql(&columns, fpinfo, foreigntableid, rel, &retrieved_attrs);
+	initStringInfo(&conds);
+	deparseConds(&conds, fpinfo);
+	initStringInfo(&tail);
+	if (best_path->path.pathkeys != NIL)
+	{
+		appendStringInfoString(&tail, " ORDER BY ");
+		deparsePathKeys(root, baserel, foreigntableid, best_path->path.pathkeys, &tail);
+	}
+	deparseLimit(&tail, fpinfo, limit);
+
+	RelationClose(rel);
+
+	/* a partitioned scan shows the statement sent to its first index */
+	foreach(lc, fpinfo->shards)
+		shards = lappend(shards, makeString((char *) lfirst(lc)));
+	sql = psprintf("%s FROM %s%s%s%s", columns.data,
+				   shards ? strVal(linitial(shards)) : fpinfo->index,
+				   conds.len > 0 ? " WHERE " : "", conds.data, tail.data);
+
+	fdw_private = list_make5(makeString(sql), retrieved_attrs, makeString(columns.data),
+							 makeString(conds.data), makeString(tail.data));
+	fdw_private = lappend(fdw_private, shards);
+	fdw_private = lappend(fdw_private, makeInteger(fpinfo->id_partitions));
+	fdw_private = lappend(fdw_private, makeInteger(limit > 0 ? 0 : fpinfo->max_matches));
+
+	return make_foreignscan(tlist,
+							local_exprs,
+							baserel->relid,
+							NIL,
+							fdw_private,
+							NIL,
+							NIL,
+							outer_plan);
+}
+
+
+/*
+ * sphinxBeginForeignScan
+ *		Resolve the connection and prepare row conversion
+ */
+static void
+sphinxBeginForeignScan(ForeignScanState *node, int eflags)
+{
+	ForeignScan *fsplan = (ForeignScan *) node->ss.ps.plan;
+	EState	   *estate = node->ss.ps.state;
+	Relation	rel = node->ss.ss_currentRelation;
+	sphinxFdwScanState *fsstate;
+	sphinxFdwRelationInfo options;
+	MemoryContextCallback *cb;
+
+	fsstate = (sphinxFdwScanState *) palloc0(sizeof(sphinxFdwScanState));
+	node->fdw_state = (void *) fsstate;
+
+	fsstate->query = strVal(list_nth(fsplan->fdw_private, FdwScanPrivateSelectSql));
+	fsstate->retrieved_attrs = (List *) list_nth(fsplan->fdw_private,
+												 FdwScanPrivateRetrievedAttrs);
+	fsstate->columns = strVal(list_nth(fsplan->fdw_private, FdwScanPrivateColumns));
+	fsstate->conds = strVal(list_nth(fsplan->fdw_private, FdwScanPrivateConds));
+	fsstate->tail = strVal(list_nth(fsplan->fdw_private, FdwScanPrivateTail));
+	fsstate->shards = (List *) list_nth(fsplan->fdw_private, FdwScanPrivateShards);
+	fsstate->id_partitions = intVal(list_nth(fsplan->fdw_private, FdwScanPrivateIdPartitions));
+	fsstate->max_matches = intVal(list_nth(fsplan->fdw_private, FdwScanPrivateMaxMatches));
+	fsstate->nparts = Max(list_length(fsstate->shards), 1) * fsstate->id_partitions;
+	fsstate->partitioned = (fsstate->nparts > 1);
+
+	/* Nothing else to do for EXPLAIN without ANALYZE */
+	if (eflags & EXEC_FLAG_EXPLAIN_ONLY)
+		return;
+
+	memset(&options, 0, sizeof(options));
+	getTableOptions(RelationGetRelid(rel), &options);
+	fsstate->rconn = sphinxGetConnection(options.host, options.port);
+	fsstate->index = options.index;
+
+	fsstate->plan = sphinxCreateConvPlan(RelationGetDescr(rel));
+	fsstate->batch_cxt = AllocSetContextCreate(estate->es_query_cxt,
+											   "sphinx_fdw tuple data",
+											   ALLOCSET_DEFAULT_SIZES);
+
+	/* without id ranges the partitions are known already */
+	if (fsstate->partitioned)
+	{
+		fsstate->parts = (sphinxFdwPartition *) palloc(fsstate->nparts * sizeof(sphinxFdwPartition));
+		if (fsstate->id_partitions == 1)
+		{
+			computePartitions(fsstate, fsstate->parts);
+			fsstate->parts_ready = true;
+		}
+	}
+
+	/* make sure the client-side result is released even on error */
+	cb = (MemoryContextCallback *) MemoryContextAlloc(estate->es_query_cxt,
+													  sizeof(MemoryContextCallback));
+	cb->func = releaseScanResult;
+	cb->arg = (void *) fsstate;
+	MemoryContextRegisterResetCallback(estate->es_query_cxt, cb);
+}
+
+
+/*
+ * sphinxIterateForeignScan
+ *		Send the query on first call, then return one row per call.  A
+ *		partitioned scan goes on with the next partition when one is done.
+ */
+static TupleTableSlot *
+sphinxIterateForeignScan(ForeignScanState *node)
+{
+	sphinxFdwScanState *fsstate = (sphinxFdwScanState *) node->fdw_state;
+	TupleTableSlot *slot = node->ss.ss_ScanTupleSlot;
+	MYSQL_ROW	row;
+	unsigned long *lengths;
+	ListCell   *lc;
+	int			i;
+
+	ExecClearTuple(slot);
+
+	while (!fsstate->res || !(row = mysql_fetch_row(fsstate->res)))
+	{
+		releaseScanResult(fsstate);
+		if (!beginNextPartition(fsstate))
+			return slot;
+	}
+	lengths = mysql_fetch_lengths(fsstate->res);
+
+	MemoryContextReset(fsstate->batch_cxt);
+
+	memset(slot->tts_values, 0, slot->tts_tupleDescriptor->natts * sizeof(Datum));
+	memset(slot->tts_isnull, true, slot->tts_tupleDescriptor->natts * sizeof(bool));
+
+	i = 0;
+	foreach(lc, fsstate->retrieved_attrs)
+	{
+		int			attnum = lfirst_int(lc);
+		MemoryContext oldcontext;
+
+		if (row[i])
+		{
+			oldcontext = MemoryContextSwitchTo(fsstate->batch_cxt);
+			slot->tts_values[attnum - 1] = sphinxConvertValue(fsstate->plan, attnum - 1,
+															  row[i], lengths[i]);
+			slot->tts_isnull[attnum - 1] = false;
+			MemoryContextSwitchTo(oldcontext);
+		}
+		i++;
+	}
+
+	ExecStoreVirtualTuple(slot);
+
+	return slot;
+}
+
+
+/*
+ * sphinxReScanForeignScan
+ *		Drop the current result; the query is sent again on the next fetch
+ */
+static void
+sphinxReScanForeignScan(ForeignScanState *node)
+{
+	sphinxFdwScanState *fsstate = (sphinxFdwScanState *) node->fdw_state;
+
+	releaseScanResult(fsstate);
+	fsstate->next_part = 0;
+}
+
+
+/*
+ * sphinxEndForeignScan
+ *		Release the client-side result
+ */
+static void
+sphinxEndForeignScan(ForeignScanState *node)
+{
+	if (node->fdw_state)
+		releaseScanResult(node->fdw_state);
+}
+
+
+/*
+ * sphinxExplainForeignScan
+ *		Show the SphinxQL statement sent to searchd
+ */
+static void
+sphinxExplainForeignScan(ForeignScanState *node, ExplainState *es)
+{
+	sphinxFdwScanState *fsstate = (sphinxFdwScanState *) node->fdw_state;
+
+	ExplainPropertyText("Sphinx Query", fsstate->query, es);
+	if (fsstate->partitioned)
+	{
+		if (fsstate->shards)
+		{
+			StringInfoData shards;
+			ListCell   *lc;
+
+			initStringInfo(&shards);
+			foreach(lc, fsstate->shards)
+				appendStringInfo(&shards, "%s%s", shards.len > 0 ? ", " : "", strVal(lfirst(lc)));
+			ExplainPropertyText("Shards", shards.data, es);
+		}
+		ExplainPropertyInteger("Partitions", NULL, fsstate->nparts, es);
+	}
+}
+
+
+/*
+ * sphinxIsForeignScanParallelSafe
+ *		Workers open connections of their own, so any scan can run in one
+ */
+static bool
+sphinxIsForeignScanParallelSafe(PlannerInfo *root, RelOptInfo *rel, RangeTblEntry *rte)
+{
+	return true;
+}
+
+
+/*
+ * sphinxEstimateDSMForeignScan
+ *		Room for the partitions of a parallel scan
+ */
+static Size
+sphinxEstimateDSMForeignScan(ForeignScanState *node, ParallelContext *pcxt)
+{
+	sphinxFdwScanState *fsstate = (sphinxFdwScanState *) node->fdw_state;
+
+	return add_size(offsetof(sphinxFdwParallelState, parts),
+					mul_size(fsstate->nparts, sizeof(sphinxFdwPartition)));
+}
+
+
+/*
+ * sphinxInitializeDSMForeignScan
+ *		Work out the partitions once, in the leader
+ */
+static void
+sphinxInitializeDSMForeignScan(ForeignScanState *node, ParallelContext *pcxt,
+							   void *coordinate)
+{
+	sphinxFdwScanState *fsstate = (sphinxFdwScanState *) node->fdw_state;
+	sphinxFdwParallelState *pstate = (sphinxFdwParallelState *) coordinate;
+
+	pg_atomic_init_u32(&pstate->next_part, 0);
+	if (fsstate->parts_ready)
+		memcpy(pstate->parts, fsstate->parts, fsstate->nparts * sizeof(sphinxFdwPartition));
+	else
+		computePartitions(fsstate, pstate->parts);
+	fsstate->parts = pstate->parts;
+	fsstate->parts_ready = true;
+	fsstate->pstate = pstate;
+}
+
+
+/*
+ * sphinxReInitializeDSMForeignScan
+ *		Start over for a rescan
+ */
+static void
+sphinxReInitializeDSMForeignScan(ForeignScanState *node, ParallelContext *pcxt,
+								 void *coordinate)
+{
+	sphinxFdwParallelState *pstate = (sphinxFdwParallelState *) coordinate;
+
+	pg_atomic_write_u32(&pstate->next_part, 0);
+}
+
+
+/*
+ * sphinxInitializeWorkerForeignScan
+ *		Attach to the partitions set up by the leader
+ */
+static void
+sphinxInitializeWorkerForeignScan(ForeignScanState *node, shm_toc *toc,
+								  void *coordinate)
+{
+	sphinxFdwScanState *fsstate = (sphinxFdwScanState *) node->fdw_state;
+	sphinxFdwParallelState *pstate = (sphinxFdwParallelState *) coordinate;
+
+	fsstate->parts = pstate->parts;
+	fsstate->parts_ready = true;
+	fsstate->pstate = pstate;
+}
+
+
+static void
+releaseScanResult(void *arg)
+{
+	sphinxFdwScanState *fsstate = (sphinxFdwScanState *) arg;
+
+	if (fsstate->res)
+		mysql_free_result(fsstate->res);
+	fsstate->res = NULL;
+}
+
+
+/*
+ * Send the query of the next partition nobody has taken yet and receive its
+ * result.  Returns false when all partitions are taken.
+ *
+ * The result is bounded by max_matches, so we let the client library buffer
+ * it; that way another scan can use the same connection while this one is
+ * still being read, as happens in nested loops.
+ */
+static bool
+beginNextPartition(sphinxFdwScanState *fsstate)
+{
+	MYSQL	   *conn = fsstate->rconn->conn;
+	char	   *query = fsstate->query;
+
+	if (fsstate->partitioned)
+	{
+		sphinxFdwPartition *part;
+		StringInfoData buf;
+		int			n;
+
+		if (!fsstate->parts_ready)
+		{
+			computePartitions(fsstate, fsstate->parts);
+			fsstate->parts_ready = true;
+		}
+
+		/* skip the id ranges that are empty */
+		do
+		{
+			if (fsstate->pstate)
+				n = (int) pg_atomic_fetch_add_u32(&fsstate->pstate->next_part, 1);
+			else
+				n = fsstate->next_part++;
+			if (n >= fsstate->nparts)
+				return false;
+			part = &fsstate->parts[n];
+		} while (part->min_id > part->max_id);
+
+		initStringInfo(&buf);
+		appendStringInfo(&buf, "%s FROM %s", fsstate->columns,
+						 fsstate->shards ? strVal(list_nth(fsstate->shards, part->shard)) :
+						 fsstate->index);
+		if (fsstate->conds[0])
+			appendStringInfo(&buf, " WHERE %s", fsstate->conds);
+		if (fsstate->id_partitions > 1)
+			appendStringInfo(&buf, "%s id BETWEEN " INT64_FORMAT " AND " INT64_FORMAT,
+							 fsstate->conds[0] ? " AND" : " WHERE",
+							 part->min_id, part->max_id);
+		appendStringInfoString(&buf, fsstate->tail);
+		query = buf.data;
+	}
+	else if (fsstate->next_part++ > 0)
+		return false;
+
+	executeRemoteQuery(fsstate->rconn, query);
+	fsstate->res = mysql_store_result(conn);
+	if (!fsstate->res)
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_REPLY),
+				 errmsg("Could not fetch result: %s", mysql_error(conn)),
+				 errcontext("remote SQL command: %s", query)));
+	if (fsstate->retrieved_attrs != NIL &&
+		mysql_num_fields(fsstate->res) != list_length(fsstate->retrieved_attrs))
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_INVALID_DATA_TYPE),
+				 errmsg("remote query returned %u columns, expected %d",
+						mysql_num_fields(fsstate->res),
+						list_length(fsstate->retrieved_attrs))));
+	if (fsstate->max_matches > 0 &&
+		mysql_num_rows(fsstate->res) >= (my_ulonglong) fsstate->max_matches)
+		checkTruncated(fsstate, query);
+
+	return true;
+}
+
+
+/*
+ * A query without a pushed-down LIMIT returned max_matches rows.  Fail if
+ * searchd found more, rather than silently return part of the table.
+ */
+static void
+checkTruncated(sphinxFdwScanState *fsstate, const char *query)
+{
+	MYSQL	   *conn = fsstate->rconn->conn;
+	MYSQL_RES  *res;
+	MYSQL_ROW	row;
+	double		total_found = 0;
+
+	executeRemoteQuery(fsstate->rconn, "SHOW META");
+	if (!(res = mysql_store_result(conn)))
+		return;
+	while ((row = mysql_fetch_row(res)))
+	{
+		if (row[0] && row[1] && strcmp(row[0], "total_found") == 0)
+			total_found = strtod(row[1], NULL);
+	}
+	mysql_free_result(res);
+
+	if (total_found > fsstate->max_matches)
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_ERROR),
+				 errmsg("sphinx_fdw query found %.0f matches, more than max_matches %d",
+						total_found, fsstate->max_matches),
+				 errhint("Raise the max_matches option of the foreign table, or add a LIMIT."),
+				 errcontext("remote SQL command: %s", query)));
+}
+
+
+/*
+ * Fill parts with the partitions of the scan: every shard, each split into
+ * id_partitions ranges of about the same width between its lowest and
+ * highest id.
+ */
+static void
+computePartitions(sphinxFdwScanState *fsstate, sphinxFdwPartition *parts)
+{
+	int			nshards = Max(list_length(fsstate->shards), 1);
+	int			shard;
+	int			i;
+
+	for (shard = 0; shard < nshards; shard++)
+	{
+		sphinxFdwPartition *part = &parts[shard * fsstate->id_partitions];
+		int64		min_id = 0;
+		int64		max_id = 0;
+		uint64		width = 0;
+
+		if (fsstate->id_partitions > 1)
+		{
+			const char *index = fsstate->shards ?
+				strVal(list_nth(fsstate->shards, shard)) : fsstate->index;
+
+			if (!fetchIdBound(fsstate, index, false, &min_id) ||
+				!fetchIdBound(fsstate, index, true, &max_id))
+			{
+				/* nothing in this index */
+				min_id = 1;
+				max_id = 0;
+			}
+			else
+				width = ((uint64) max_id - (uint64) min_id) / fsstate->id_partitions + 1;
+		}
+
+		for (i = 0; i < fsstate->id_partitions; i++)
+		{
+			part[i].shard = shard;
+			if (fsstate->id_partitions == 1 || min_id > max_id)
+			{
+				part[i].min_id = min_id;
+				part[i].max_id = max_id;
+				continue;
+			}
+			/* with fewer ids than partitions, the last ranges stay empty */
+			if (i * width > (uint64) max_id - (uint64) min_id)
+			{
+				part[i].min_id = 1;
+				part[i].max_id = 0;
+				continue;
+			}
+			part[i].min_id = (int64) ((uint64) min_id + i * width);
+			part[i].max_id = (i == fsstate->id_partitions - 1) ? max_id :
+				(int64) ((uint64) part[i].min_id + width - 1);
+		}
+	}
+}
+
+
+/*
+ * Lowest or highest document id in an index.  Returns false if it is empty.
+ */
+static bool
+fetchIdBound(sphinxFdwScanState *fsstate, const char *index, bool max, int64 *id)
+{
+	MYSQL	   *conn = fsstate->rconn->conn;
+	MYSQL_RES  *res;
+	MYSQL_ROW	row;
+	char	   *query;
+	bool		found = false;
+
+	query = psprintf("SELECT id FROM %s ORDER BY id %s LIMIT 1", index, max ? "DESC" : "ASC");
+	executeRemoteQuery(fsstate->rconn, query);
+	if (!(res = mysql_store_result(conn)))
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_REPLY),
+				 errmsg("Could not fetch result: %s", mysql_error(conn)),
+				 errcontext("remote SQL command: %s", query)));
+
+	if ((row = mysql_fetch_row(res)) && row[0])
+	{
+		*id = strtoi64(row[0], NULL, 10);
+		found = true;
+	}
+	mysql_free_result(res);
+	pfree(query);
+
+	return found;
+}
+
+
+/*
+ * Split the shards option, a comma-separated list of index names.
+ */
+static List *
+parseShards(const char *value)
+{
+	List	   *shards = NIL;
+	char	   *buf = pstrdup(value);
+	char	   *shard;
+	char	   *saveptr = NULL;
+
+	for (shard = strtok_r(buf, ", \t\n", &saveptr); shard; shard = strtok_r(NULL, ", \t\n", &saveptr))
+		shards = lappend(shards, shard);
+
+	if (shards == NIL)
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_INVALID_ATTRIBUTE_VALUE),
+				 errmsg("\"shards\" must be a list of index names")));
+
+	return shards;
+}
+
+
+/*
+ * Share of the rows of a parallel scan one participant gets, as costsize.c
+ * works it out: the leader helps less the more workers there are.
+ */
+static double
+getParallelDivisor(int workers)
+{
+	double		divisor = workers;
+
+	if (parallel_leader_participation)
+	{
+		double		leader_contribution = 1.0 - (0.3 * workers);
+
+		if (leader_contribution > 0)
+			divisor += leader_contribution;
+	}
+
+	return divisor;
+}
+
+
+static bool
+isValidOption(const char *option, Oid context)
+{
+	const sphinxFdwOption *opt;
+
+	for (opt = valid_options; opt->optname; opt++)
+	{
+		if (context == opt->optcontext && strcmp(opt->optname, option) == 0)
+			return true;
+	}
+	return false;
+}
+
+
+/*
+ * Fetch server and table options, applying defaults.
+ */
+static void
+getTableOptions(Oid foreigntableid, sphinxFdwRelationInfo *fpinfo)
+{
+	ForeignTable *table = GetForeignTable(foreigntableid);
+	ForeignServer *server = GetForeignServer(table->serverid);
+	ListCell   *lc;
+
+	fpinfo->host = DEFAULT_HOST;
+	fpinfo->port = DEFAULT_PORT;
+	fpinfo->index = get_rel_name(foreigntableid);
+	fpinfo->max_matches = DEFAULT_MAX_MATCHES;
+	fpinfo->use_remote_estimate = false;
+	fpinfo->shards = NIL;
+	fpinfo->id_partitions = 1;
+
+	foreach(lc, server->options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "host") == 0)
+			fpinfo->host = defGetString(def);
+		else if (strcmp(def->defname, "port") == 0)
+			fpinfo->port = atoi(defGetString(def));
+		else if (strcmp(def->defname, "use_remote_estimate") == 0)
+			fpinfo->use_remote_estimate = defGetBoolean(def);
+	}
+
+	/* table options override server ones */
+	foreach(lc, table->options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "index") == 0)
+			fpinfo->index = defGetString(def);
+		else if (strcmp(def->defname, "max_matches") == 0)
+			fpinfo->max_matches = atoi(defGetString(def));
+		else if (strcmp(def->defname, "use_remote_estimate") == 0)
+			fpinfo->use_remote_estimate = defGetBoolean(def);
+		else if (strcmp(def->defname, "shards") == 0)
+			fpinfo->shards = parseShards(defGetString(def));
+		else if (strcmp(def->defname, "id_partitions") == 0)
+			fpinfo->id_partitions = atoi(defGetString(def));
+	}
+
+	fpinfo->nparts = Max(list_length(fpinfo->shards), 1) * fpinfo->id_partitions;
+}
+
+
+/*
+ * Remote name of a column: the column_name option, or the column name.
+ * column_name may also be an expression such as weight().
+ */
+static char *
+getColumnName(Oid relid, AttrNumber attnum)
+{
+	List	   *options = GetForeignColumnOptions(relid, attnum);
+	ListCell   *lc;
+
+	foreach(lc, options)
+	{
+		DefElem    *def = (DefElem *) lfirst(lc);
+
+		if (strcmp(def->defname, "column_name") == 0)
+			return defGetString(def);
+	}
+
+	return get_attname(relid, attnum, false);
+}
+
+
+/*
+ * Remote name of a column if it is an attribute or a JSON field, NULL if it
+ * is an expression such as weight(), which can't be filtered on.
+ */
+static char *
+getAttributeName(Oid relid, AttrNumber attnum)
+{
+	char	   *colname = getColumnName(relid, attnum);
+
+	return colname[strspn(colname, ATTRIBUTE_CHARS ".")] ? NULL : colname;
+}
+
+
+/*
+ * Can searchd return NULL for a column?  Attributes and weight() always
+ * have a value; JSON fields and other expressions may not.
+ */
+static bool
+isNullableColumn(const char *colname)
+{
+	if (pg_strcasecmp(colname, "weight()") == 0)
+		return false;
+
+	return colname[strspn(colname, ATTRIBUTE_CHARS)] != '\0';
+}
+
+
+/*
+ * Is this "<column of our table> ==> '<constant query>'"?
+ */
+static bool
+isSphinxMatchExpr(Expr *expr, Index relid, char **query)
+{
+	OpExpr	   *op;
+	Node	   *left;
+	Node	   *right;
+	FmgrInfo	finfo;
+
+	if (!IsA(expr, OpExpr))
+		return false;
+	op = (OpExpr *) expr;
+	set_opfuncid(op);
+	if (list_length(op->args) != 2 || op->opfuncid < FirstNormalObjectId)
+		return false;
+
+	left = (Node *) linitial(op->args);
+	right = (Node *) lsecond(op->args);
+
+	if (!IsA(left, Var) ||
+		((Var *) left)->varno != relid ||
+		((Var *) left)->varlevelsup != 0)
+		return false;
+	if (!IsA(right, Const) ||
+		((Const *) right)->constisnull ||
+		((Const *) right)->consttype != TEXTOID)
+		return false;
+
+	/* compare by C entry point, so the schema we live in doesn't matter */
+	fmgr_info(op->opfuncid, &finfo);
+	if (finfo.fn_addr != sphinx_match)
+		return false;
+
+	*query = TextDatumGetCString(((Const *) right)->constvalue);
+	return true;
+}
+
+
+/*
+ * Return the Var if expr is a plain column of the foreign table, NULL
+ * otherwise.  Its remote name may still be an expression, see
+ * getAttributeName().
+ */
+static Var *
+getForeignVar(Expr *expr, Index relid)
+{
+	Var		   *var;
+
+	if (!IsA(expr, Var))
+		return NULL;
+	var = (Var *) expr;
+	if (var->varno != relid || var->varlevelsup != 0 || var->varattno <= 0)
+		return NULL;
+	return var;
+}
+
+
+/*
+ * Types searchd compares and sorts the same way we do.  Strings are left
+ * out on purpose: full-text fields can't be filtered on, and string
+ * attributes use their own collation.
+ */
+static bool
+isPushableType(Oid typid)
+{
+	switch (typid)
+	{
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+		case FLOAT4OID:
+		case FLOAT8OID:
+		case NUMERICOID:
+		case BOOLOID:
+		case TIMESTAMPTZOID:
+			return true;
+		default:
+			return false;
+	}
+}
+
+
+/*
+ * Append a constant as a SphinxQL literal.  Timestamps become unix time,
+ * which is how Sphinx stores them.
+ */
+static bool
+deparseConst(Const *node, StringInfo buf)
+{
+	Oid			typoutput;
+	bool		typIsVarlena;
+
+	if (node->constisnull || !isPushableType(node->consttype))
+		return false;
+
+	switch (node->consttype)
+	{
+		case BOOLOID:
+			appendStringInfoChar(buf, DatumGetBool(node->constvalue) ? '1' : '0');
+			return true;
+
+		case TIMESTAMPTZOID:
+			{
+				TimestampTz ts = DatumGetTimestampTz(node->constvalue);
+
+				/* only whole seconds compare the same on both sides */
+				if (TIMESTAMP_NOT_FINITE(ts) || ts % USECS_PER_SEC != 0)
+					return false;
+				appendStringInfo(buf, INT64_FORMAT,
+								 ts / USECS_PER_SEC +
+								 (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY);
+				return true;
+			}
+
+		default:
+			{
+				char	   *str;
+
+				getTypeOutputInfo(node->consttype, &typoutput, &typIsVarlena);
+				str = OidOutputFunctionCall(typoutput, node->constvalue);
+
+				/* NaN and Infinity have no SphinxQL spelling */
+				if (strspn(str, "0123456789+-.eE") != strlen(str))
+					return false;
+				appendStringInfoString(buf, str);
+				return true;
+			}
+	}
+}
+
+
+/*
+ * Try to deparse a restriction clause as a SphinxQL attribute filter.
+ * Supported are "column <op> constant" with the usual comparison
+ * operators, "column = ANY(constant array)" and boolean columns.
+ */
+static bool
+deparseRemoteCond(Expr *expr, Index relid, Oid foreigntableid, StringInfo buf)
+{
+	Var		   *var;
+	char	   *colname;
+
+	/* boolean column, possibly negated */
+	if ((var = getForeignVar(expr, relid)) != NULL && var->vartype == BOOLOID)
+	{
+		if (!(colname = getAttributeName(foreigntableid, var->varattno)))
+			return false;
+		appendStringInfo(buf, "%s = 1", colname);
+		return true;
+	}
+	if (IsA(expr, BoolExpr) && ((BoolExpr *) expr)->boolop == NOT_EXPR)
+	{
+		var = getForeignVar((Expr *) linitial(((BoolExpr *) expr)->args), relid);
+		if (var && var->vartype == BOOLOID &&
+			(colname = getAttributeName(foreigntableid, var->varattno)))
+		{
+			appendStringInfo(buf, "%s = 0", colname);
+			return true;
+		}
+		return false;
+	}
+
+	if (IsA(expr, OpExpr))
+	{
+		OpExpr	   *op = (OpExpr *) expr;
+		Node	   *left;
+		Node	   *right;
+		char	   *opname;
+		bool		commuted = false;
+
+		if (list_length(op->args) != 2 || op->opno >= FirstNormalObjectId)
+			return false;
+
+		left = (Node *) linitial(op->args);
+		right = (Node *) lsecond(op->args);
+		if (IsA(left, Const))
+		{
+			Node	   *tmp = left;
+
+			left = right;
+			right = tmp;
+			commuted = true;
+		}
+		if (!(var = getForeignVar((Expr *) left, relid)) ||
+			!isPushableType(var->vartype) || !IsA(right, Const))
+			return false;
+
+		if (!(colname = getAttributeName(foreigntableid, var->varattno)))
+			return false;
+
+		opname = get_opname(commuted ? get_commutator(op->opno) : op->opno);
+		if (opname == NULL)
+			return false;
+		if (strcmp(opname, "<>") == 0)
+			opname = "!=";
+		else if (strcmp(opname, "=") != 0 && strcmp(opname, "<") != 0 &&
+				 strcmp(opname, "<=") != 0 && strcmp(opname, ">") != 0 &&
+				 strcmp(opname, ">=") != 0)
+			return false;
+
+		/* Sphinx floats are single precision, so don't rely on equality */
+		if ((var->vartype == FLOAT4OID || var->vartype == FLOAT8OID) &&
+			(strcmp(opname, "=") == 0 || strcmp(opname, "!=") == 0))
+			return false;
+
+		appendStringInfo(buf, "%s %s ", colname, opname);
+		return deparseConst((Const *) right, buf);
+	}
+
+	if (IsA(expr, ScalarArrayOpExpr))
+	{
+		ScalarArrayOpExpr *saop = (ScalarArrayOpExpr *) expr;
+		Const	   *arrconst;
+		ArrayType  *arr;
+		Datum	   *elems;
+		bool	   *nulls;
+		int			nelems;
+		int16		elmlen;
+		bool		elmbyval;
+		char		elmalign;
+		char	   *opname;
+		int			i;
+
+		if (!saop->useOr || saop->opno >= FirstNormalObjectId)
+			return false;
+		opname = get_opname(saop->opno);
+		if (!opname || strcmp(opname, "=") != 0)
+			return false;
+
+		var = getForeignVar((Expr *) linitial(saop->args), relid);
+		if (!var || !isPushableType(var->vartype) ||
+			var->vartype == FLOAT4OID || var->vartype == FLOAT8OID ||
+			!IsA(lsecond(saop->args), Const))
+			return false;
+		if (!(colname = getAttributeName(foreigntableid, var->varattno)))
+			return false;
+
+		arrconst = (Const *) lsecond(saop->args);
+		if (arrconst->constisnull)
+			return false;
+		arr = DatumGetArrayTypeP(arrconst->constvalue);
+		get_typlenbyvalalign(ARR_ELEMTYPE(arr), &elmlen, &elmbyval, &elmalign);
+		deconstruct_array(arr, ARR_ELEMTYPE(arr), elmlen, elmbyval, elmalign,
+						  &elems, &nulls, &nelems);
+		if (nelems == 0)
+			return false;
+
+		appendStringInfo(buf, "%s IN (", colname);
+		for (i = 0; i < nelems; i++)
+		{
+			Const	   *c;
+
+			if (nulls[i])
+				return false;
+			c = makeConst(ARR_ELEMTYPE(arr), -1, InvalidOid, elmlen,
+						  elems[i], false, elmbyval);
+			if (i > 0)
+				appendStringInfoString(buf, ", ");
+			if (!deparseConst(c, buf))
+				return false;
+		}
+		appendStringInfoChar(buf, ')');
+		return true;
+	}
+
+	return false;
+}
+
+
+/*
+ * Check that every pathkey is a column of our table searchd can sort by, and
+ * if buf is given, append the ORDER BY list.
+ */
+static bool
+deparsePathKeys(PlannerInfo *root, RelOptInfo *baserel, Oid foreigntableid,
+				List *pathkeys, StringInfo buf)
+{
+	ListCell   *lc;
+	bool		first = true;
+
+	foreach(lc, pathkeys)
+	{
+		PathKey    *pathkey = (PathKey *) lfirst(lc);
+		EquivalenceClass *ec = pathkey->pk_eclass;
+		Var		   *var = NULL;
+		char	   *colname;
+		bool		ascending;
+		ListCell   *lc2;
+
+		if (ec->ec_has_volatile)
+			return false;
+
+		foreach(lc2, ec->ec_members)
+		{
+			EquivalenceMember *em = (EquivalenceMember *) lfirst(lc2);
+
+			if (em->em_is_child || !bms_equal(em->em_relids, baserel->relids))
+				continue;
+			if ((var = getForeignVar(em->em_expr, baserel->relid)) != NULL)
+				break;
+		}
+		if (!var || !isPushableType(var->vartype))
+			return false;
+
+#if (PG_VERSION_NUM >= 180000)
+		ascending = (pathkey->pk_cmptype == COMPARE_LT);
+#else
+		ascending = (pathkey->pk_strategy == BTLessStrategyNumber);
+#endif
+		colname = getColumnName(foreigntableid, var->varattno);
+
+		/* searchd sorts NULL below any value, as MySQL does */
+		if (pathkey->pk_nulls_first != ascending && isNullableColumn(colname))
+			return false;
+
+		if (buf)
+			appendStringInfo(buf, "%s%s %s",
+							 first ? "" : ", ", colname,
+							 ascending ? "ASC" : "DESC");
+		first = false;
+	}
+
+	return true;
+}
+
+
+/*
+ * Build "SELECT <columns>" for the columns the query needs.
+ */
+static void
+deparseSelectSql(StringInfo buf, sphinxFdwRelationInfo *fpinfo, Oid foreigntableid,
+				 Relation rel, List **retrieved_attrs)
+{
+	TupleDesc	tupdesc = RelationGetDescr(rel);
+	bool		have_wholerow;
+	bool		first = true;
+	int			i;
+
+	have_wholerow = bms_is_member(0 - FirstLowInvalidHeapAttributeNumber,
+								  fpinfo->attrs_used);
+
+	appendStringInfoString(buf, "SELECT ");
+	for (i = 1; i <= tupdesc->natts; i++)
+	{
+		if (TupleDescAttr(tupdesc, i - 1)->attisdropped)
+			continue;
+		if (!have_wholerow &&
+			!bms_is_member(i - FirstLowInvalidHeapAttributeNumber, fpinfo->attrs_used))
+			continue;
+
+		appendStringInfo(buf, "%s%s", first ? "" : ", ",
+						 getColumnName(foreigntableid, i));
+		*retrieved_attrs = lappend_int(*retrieved_attrs, i);
+		first = false;
+	}
+
+	/* searchd needs something in the select list */
+	if (first)
+		appendStringInfoString(buf, "id");
+}
+
+
+/*
+ * Append the conditions sent to searchd, MATCH() first, without WHERE.
+ */
+static void
+deparseConds(StringInfo buf, sphinxFdwRelationInfo *fpinfo)
+{
+	if (fpinfo->match)
+	{
+		appendStringInfoString(buf, "MATCH(");
+		sphinxAppendEscapedString(buf, fpinfo->match);
+		appendStringInfoChar(buf, ')');
+	}
+	if (fpinfo->match && fpinfo->where_sql)
+		appendStringInfoString(buf, " AND ");
+	if (fpinfo->where_sql)
+		appendStringInfoString(buf, fpinfo->where_sql);
+}
+
+
+/*
+ * Append LIMIT and max_matches.  Without a pushed-down LIMIT we ask for
+ * max_matches rows, since searchd would otherwise stop at 20.
+ */
+static void
+deparseLimit(StringInfo buf, sphinxFdwRelationInfo *fpinfo, int limit)
+{
+	int			count = (limit > 0) ? limit : fpinfo->max_matches;
+
+	appendStringInfo(buf, " LIMIT %d OPTION max_matches=%d",
+					 count, Max(count, 1));
+}
+
+
+/*
+ * LIMIT (plus OFFSET) that can be sent with a path having the given
+ * pathkeys, or -1.  That is only safe when the foreign table is the only
+ * relation in the query and all conditions are checked remotely.
+ */
+static double
+getPushedLimit(PlannerInfo *root, RelOptInfo *baserel, List *pathkeys)
+{
+	sphinxFdwRelationInfo *fpinfo = (sphinxFdwRelationInfo *) baserel->fdw_private;
+
+	if (root->limit_tuples <= 0 || root->limit_tuples > PG_INT32_MAX)
+		return -1;
+	if (root->parse->commandType != CMD_SELECT || root->parse->rowMarks != NIL)
+		return -1;
+	if (fpinfo->local_conds != NIL)
+		return -1;
+	if (bms_membership(root->all_baserels) != BMS_SINGLETON)
+		return -1;
+	if (!pathkeys_contained_in(root->query_pathkeys, pathkeys))
+		return -1;
+
+	return root->limit_tuples;
+}
+
+
+/*
+ * Ask searchd how many documents match the pushed-down conditions, using
+ * total_found and time from SHOW META.
+ */
+static void
+estimateRemoteRows(Oid foreigntableid, sphinxFdwRelationInfo *fpinfo)
+{
+	remoteConn *rconn = sphinxGetConnection(fpinfo->host, fpinfo->port);
+	MYSQL	   *conn = rconn->conn;
+	MYSQL_RES  *res;
+	MYSQL_ROW	row;
+	StringInfoData sql;
+
+	/* shards are assumed to be of about the same size */
+	initStringInfo(&sql);
+	appendStringInfo(&sql, "SELECT id FROM %s",
+					 fpinfo->shards ? (char *) linitial(fpinfo->shards) : fpinfo->index);
+	if (fpinfo->match || fpinfo->where_sql)
+	{
+		appendStringInfoString(&sql, " WHERE ");
+		deparseConds(&sql, fpinfo);
+	}
+	appendStringInfoString(&sql, " LIMIT 1");
+
+	executeRemoteQuery(rconn, sql.data);
+	if ((res = mysql_store_result(conn)))
+		mysql_free_result(res);
+
+	fpinfo->remote_rows = fpinfo->max_matches;
+	fpinfo->remote_msec = 0;
+
+	executeRemoteQuery(rconn, "SHOW META");
+	if (!(res = mysql_store_result(conn)))
+		return;
+	while ((row = mysql_fetch_row(res)))
+	{
+		if (!row[0] || !row[1])
+			continue;
+		if (strcmp(row[0], "total_found") == 0)
+			fpinfo->remote_rows = strtod(row[1], NULL) * Max(list_length(fpinfo->shards), 1);
+		else if (strcmp(row[0], "time") == 0)
+			fpinfo->remote_msec = strtod(row[1], NULL) * 1000.0;
+	}
+	mysql_free_result(res);
+}
+
+
+static void
+executeRemoteQuery(remoteConn *rconn, const char *query)
+{
+	if (sphinxExecQuery(rconn, sphinxToUTF8Encoding(query)))
+		ereport(ERROR,
+				(errcode(ERRCODE_FDW_UNABLE_TO_CREATE_EXECUTION),
+				 errmsg("Could not execute query: %s", mysql_error(rconn->conn)),
+				 errcontext("remote SQL command: %s", query)));
+}
@@ -0,0 +1,774 @@
+/*
+ * sphinx_group.c
+ *
+ * Replica groups, opened by sphinx_connect_group(): one connection name for
+ * several searchd replicas of the same indexes.
+ *
+ * Every query goes to the healthy replica with the lowest moving average of
+ * its query time; a replica not measured yet counts as the fastest, so all
+ * of them get measured.  A read statement (SELECT, CALL, DESCRIBE, SHOW,
+ * EXPLAIN) that fails with a client error, such as a lost connection, is
+ * retried on the next replica.  With hedge_delay set, a read statement still
+ * unanswered after that time is sent to the second-best replica as well and
+ * the first answer wins; the slower replica throws its answer away before it
+ * is used again.  eject_errors client errors or read timeouts in a row eject
+ * a replica for eject_time seconds.  Errors reported by searchd, such as a
+ * syntax error, don't count.
+ *
+ * SET and the statements about the previous query of the session (SHOW META,
+ * SHOW PROFILE, ...) stay on the replica used last.  Latencies and counters
+ * are kept per backend.
+ *
+ * Functions that send on the connection themselves (sphinx_send_query(),
+ * sphinx_query_multi(), sphinx_query_all(), sphinx_bulk_replace() and
+ * sphinx_snippets()) pick the replica with sphinxGroupChooseReplica() and
+ * report client errors with sphinxGroupReportError(); their queries are
+ * neither hedged nor retried.
+ *
+ * contrib/sphinxlink/sphinx_group.c
+ */
+#include "postgres.h"
+
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "catalog/pg_type.h"
+#include "parser/scansup.h"
+#include "storage/latch.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+#include <sys/socket.h>
+#include <sphinxlink.h>
+#include <errmsg.h>
+
+/* defaults of the eject_errors and eject_time options */
+#define DEFAULT_EJECT_ERRORS 3
+#define DEFAULT_EJECT_TIME 30
+
+/* weight of the newest sample in the latency average */
+#define LATENCY_ALPHA 0.2
+
+/* Replicas a query was sent to, see runQuery() */
+typedef struct inflightQuery
+{
+	int			nreplicas;
+	int			replicas[2];
+	TimestampTz sent[2];
+	TimestampTz hedge_at;		/* when to send a duplicate, or 0 */
+	TimestampTz deadline;		/* read_timeout, or 0 */
+	const char *query;
+} inflightQuery;
+
+static int	runQuery(remoteConn *rconn, const char *query, bool hedge);
+static int	waitForReplica(remoteConn *rconn, inflightQuery *inflight);
+static void sendHedge(remoteConn *rconn, inflightQuery *inflight);
+static void removeInflight(inflightQuery *inflight, int n);
+static void cancelInflight(sphinxGroup *group, inflightQuery *inflight,
+						   const sphinxConnOptions *options);
+static int	chooseReplica(remoteConn *rconn, int exclude, bool *skip);
+static bool replicaReady(sphinxReplica *replica, TimestampTz now);
+static bool connectReplica(sphinxReplica *replica, const sphinxConnOptions *options);
+static void useReplica(remoteConn *rconn, int n);
+static void drainReplica(sphinxReplica *replica);
+static void recordLatency(sphinxReplica *replica, TimestampTz sent);
+static void recordFailure(sphinxReplica *replica, const sphinxConnOptions *options,
+						  const char *msg);
+static bool isClientError(MYSQL *conn);
+static bool isReadQuery(const char *query);
+static bool isSessionQuery(const char *query);
+static const char *skipKeyword(const char *str, const char *keyword);
+
+
+/*
+ * Set up a group of replicas, connecting to each of them.  Replicas that
+ * can't be reached are ejected right away; it is an error if none can.
+ */
+sphinxGroup *
+sphinxCreateGroup(int nreplicas, char **hosts, int *ports,
+				  const sphinxConnOptions *options)
+{
+	sphinxGroup *group;
+	int			eject_time = options->eject_time > 0 ? options->eject_time : DEFAULT_EJECT_TIME;
+	int			i;
+
+	group = (sphinxGroup *) MemoryContextAllocZero(TopMemoryContext,
+												   offsetof(sphinxGroup, replicas) +
+												   nreplicas * sizeof(sphinxReplica));
+	group->nreplicas = nreplicas;
+	group->current = -1;
+
+	for (i = 0; i < nreplicas; i++)
+	{
+		sphinxReplica *replica = &group->replicas[i];
+		char	   *msg;
+
+		strlcpy(replica->host, hosts[i], MAXHOSTLEN);
+		replica->port = ports[i];
+
+		if (!(replica->conn = sphinxConnect(replica->host, replica->port, options, &msg)))
+		{
+			replica->failures++;
+			replica->ejected_until = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+																 eject_time * 1000L);
+			ereport(WARNING,
+					(errcode(ERRCODE_CONNECTION_FAILURE),
+					 errmsg("replica %s:%d is ejected for %d s", replica->host, replica->port,
+							eject_time),
+					 errdetail("%s", msg)));
+		}
+		else if (group->current < 0)
+			group->current = i;
+	}
+
+	if (group->current < 0)
+	{
+		pfree(group);
+		ereport(ERROR,
+				(errcode(ERRCODE_CONNECTION_FAILURE),
+				 errmsg("could not connect to any replica of the group")));
+	}
+
+	return group;
+}
+
+
+void
+sphinxFreeGroup(sphinxGroup *group)
+{
+	int			i;
+
+	for (i = 0; i < group->nreplicas; i++)
+	{
+		if (group->replicas[i].conn)
+			mysql_close(group->replicas[i].conn);
+	}
+	pfree(group);
+}
+
+
+/*
+ * sphinxExecQuery() of a replica group.  Leaves rconn on the replica whose
+ * answer is to be read.
+ */
+int
+sphinxGroupExecQuery(remoteConn *rconn, const char *query)
+{
+	sphinxGroup *group = rconn->group;
+	bool		read = isReadQuery(query);
+	bool	   *tried;
+	int			result;
+	int			n;
+
+	if (!isSessionQuery(query) && (n = chooseReplica(rconn, -1, NULL)) >= 0)
+		useReplica(rconn, n);
+
+	tried = (bool *) palloc0(group->nreplicas * sizeof(bool));
+	for (;;)
+	{
+		result = runQuery(rconn, query, read);
+		if (result == 0 || !read || !isClientError(rconn->conn))
+			break;
+
+		/* try the query on another replica */
+		tried[group->current] = true;
+		if ((n = chooseReplica(rconn, -1, tried)) < 0)
+			break;
+		useReplica(rconn, n);
+	}
+	pfree(tried);
+
+	return result;
+}
+
+
+/*
+ * Point rconn at the replica query should go to, for callers that send it on
+ * rconn->conn themselves; query may be NULL for writes.  A no-op for
+ * connections that aren't groups.
+ */
+void
+sphinxGroupChooseReplica(remoteConn *rconn, const char *query)
+{
+	int			n;
+
+	if (!rconn->group || (query && isSessionQuery(query)))
+		return;
+
+	if ((n = chooseReplica(rconn, -1, NULL)) < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_CONNECTION_FAILURE),
+				 errmsg("could not connect to any replica of the group")));
+	useReplica(rconn, n);
+	rconn->group->replicas[n].queries++;
+}
+
+
+/*
+ * Count the last error of the replica rconn is on towards its ejection, if
+ * it is a client error
+ */
+void
+sphinxGroupReportError(remoteConn *rconn)
+{
+	sphinxGroup *group = rconn->group;
+
+	if (!group || group->current < 0 || !isClientError(rconn->conn))
+		return;
+
+	recordFailure(&group->replicas[group->current], &rconn->options,
+				  mysql_error(rconn->conn));
+}
+
+
+/*
+ * Send query to the current replica and wait for the answer, sending it to
+ * a second replica as well when hedge is set and the first one takes longer
+ * than hedge_delay.  Returns zero on success, like sphinxExecQuery().
+ */
+static int
+runQuery(remoteConn *rconn, const char *query, bool hedge)
+{
+	sphinxGroup *group = rconn->group;
+	sphinxReplica *replica = &group->replicas[group->current];
+	inflightQuery inflight;
+	int			result = 1;
+	int			n;
+
+	memset(&inflight, 0, sizeof(inflight));
+	inflight.query = query;
+
+	replica->queries++;
+	if (sphinxSendQuery(replica->conn, &rconn->options, query))
+	{
+		recordFailure(replica, &rconn->options, mysql_error(replica->conn));
+		return 1;
+	}
+
+	inflight.nreplicas = 1;
+	inflight.replicas[0] = group->current;
+	inflight.sent[0] = GetCurrentTimestamp();
+	if (hedge && rconn->options.hedge_delay > 0 && group->nreplicas > 1)
+		inflight.hedge_at = TimestampTzPlusMilliseconds(inflight.sent[0],
+														rconn->options.hedge_delay);
+	if (rconn->options.read_timeout > 0)
+		inflight.deadline = TimestampTzPlusMilliseconds(inflight.sent[0],
+														rconn->options.read_timeout * 1000L);
+
+	while (inflight.nreplicas > 0)
+	{
+		PG_TRY();
+		{
+			n = waitForReplica(rconn, &inflight);
+		}
+		PG_CATCH();
+		{
+			cancelInflight(group, &inflight, &rconn->options);
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+
+		if (n < 0)
+		{
+			int			i;
+
+			for (i = 0; i < inflight.nreplicas; i++)
+				recordFailure(&group->replicas[inflight.replicas[i]], &rconn->options,
+							  "read timeout");
+			cancelInflight(group, &inflight, &rconn->options);
+			ereport(ERROR,
+					(errcode(ERRCODE_QUERY_CANCELED),
+					 errmsg("Sphinx query timed out after %d s", rconn->options.read_timeout)));
+		}
+
+		replica = &group->replicas[inflight.replicas[n]];
+		useReplica(rconn, inflight.replicas[n]);
+		recordLatency(replica, inflight.sent[n]);
+		removeInflight(&inflight, n);
+
+		if ((result = mysql_read_query_result(replica->conn)) == 0 ||
+			!isClientError(replica->conn))
+		{
+			replica->errors = 0;
+			break;
+		}
+
+		/* the other replica may still answer */
+		recordFailure(replica, &rconn->options, mysql_error(replica->conn));
+		inflight.hedge_at = 0;
+	}
+
+	/* the slower replica's answer is thrown away before its next query */
+	for (n = 0; n < inflight.nreplicas; n++)
+	{
+		sphinxReplica *loser = &group->replicas[inflight.replicas[n]];
+
+		recordLatency(loser, inflight.sent[n]);
+		loser->draining = true;
+	}
+
+	return result;
+}
+
+
+/*
+ * Wait until one of the replicas a query was sent to answers, sending the
+ * hedged duplicate when it is due.  Returns the position of the replica in
+ * inflight, or -1 if read_timeout ran out.
+ */
+static int
+waitForReplica(remoteConn *rconn, inflightQuery *inflight)
+{
+	sphinxGroup *group = rconn->group;
+
+	for (;;)
+	{
+		TimestampTz now = GetCurrentTimestamp();
+		WaitEventSet *set;
+		WaitEvent	event;
+		long		timeout = -1;
+		int			rc;
+		int			i;
+
+		if (inflight->hedge_at && now >= inflight->hedge_at)
+		{
+			inflight->hedge_at = 0;
+			sendHedge(rconn, inflight);
+			continue;
+		}
+		if (inflight->deadline && now >= inflight->deadline)
+			return -1;
+
+		if (inflight->hedge_at)
+			timeout = (inflight->hedge_at - now + 999) / 1000;
+		if (inflight->deadline &&
+			(timeout < 0 || inflight->deadline - now < timeout * 1000))
+			timeout = (inflight->deadline - now + 999) / 1000;
+
+#if (PG_VERSION_NUM >= 170000)
+		set = CreateWaitEventSet(CurrentResourceOwner, 4);
+#else
+		set = CreateWaitEventSet(CurrentMemoryContext, 4);
+#endif
+		AddWaitEventToSet(set, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+		AddWaitEventToSet(set, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET, NULL, NULL);
+		for (i = 0; i < inflight->nreplicas; i++)
+			AddWaitEventToSet(set, WL_SOCKET_READABLE,
+							  sphinxGetSocket(group->replicas[inflight->replicas[i]].conn),
+							  NULL, &inflight->replicas[i]);
+
+		rc = WaitEventSetWait(set, timeout, &event, 1, sphinxWaitEvent());
+		FreeWaitEventSet(set);
+
+		if (rc > 0 && (event.events & WL_SOCKET_READABLE))
+			return (int *) event.user_data - inflight->replicas;
+
+		if (rc > 0 && (event.events & WL_LATCH_SET))
+		{
+			ResetLatch(MyLatch);
+			CHECK_FOR_INTERRUPTS();
+		}
+	}
+}
+
+
+/*
+ * Send the query of inflight to the best replica it wasn't sent to, if any
+ */
+static void
+sendHedge(remoteConn *rconn, inflightQuery *inflight)
+{
+	sphinxGroup *group = rconn->group;
+	sphinxReplica *replica;
+	int			n;
+
+	if ((n = chooseReplica(rconn, inflight->replicas[0], NULL)) < 0)
+		return;
+
+	replica = &group->replicas[n];
+	replica->queries++;
+	replica->hedges++;
+	if (sphinxSendQuery(replica->conn, &rconn->options, inflight->query))
+	{
+		recordFailure(replica, &rconn->options, mysql_error(replica->conn));
+		return;
+	}
+
+	inflight->replicas[inflight->nreplicas] = n;
+	inflight->sent[inflight->nreplicas] = GetCurrentTimestamp();
+	inflight->nreplicas++;
+}
+
+
+static void
+removeInflight(inflightQuery *inflight, int n)
+{
+	inflight->nreplicas--;
+	if (n < inflight->nreplicas)
+	{
+		inflight->replicas[n] = inflight->replicas[inflight->nreplicas];
+		inflight->sent[n] = inflight->sent[inflight->nreplicas];
+	}
+}
+
+
+/*
+ * Stop the query on every replica it is still running on, like
+ * sphinxCancelQuery().  Doesn't throw.
+ */
+static void
+cancelInflight(sphinxGroup *group, inflightQuery *inflight, const sphinxConnOptions *options)
+{
+	int			i;
+
+	for (i = 0; i < inflight->nreplicas; i++)
+	{
+		sphinxReplica *replica = &group->replicas[inflight->replicas[i]];
+
+		if (sphinxKillQuery(replica->host, replica->port, mysql_thread_id(replica->conn),
+							options))
+			drainReplica(replica);
+		else
+			shutdown(sphinxGetSocket(replica->conn), SHUT_RDWR);
+	}
+	inflight->nreplicas = 0;
+}
+
+
+/*
+ * Pick the replica for the next query: the ready one with the lowest
+ * latency, or if every replica is ejected, the one whose ejection ends
+ * first, except for a hedge.  Replicas connect on first use.  exclude and
+ * the replicas marked in skip (which may be NULL) are left out.  Returns -1
+ * if no replica can be used.
+ */
+static int
+chooseReplica(remoteConn *rconn, int exclude, bool *skip)
+{
+	sphinxGroup *group = rconn->group;
+	bool	   *failed = (bool *) palloc0(group->nreplicas * sizeof(bool));
+	int			best;
+
+	for (;;)
+	{
+		TimestampTz now = GetCurrentTimestamp();
+		bool		ejected = false;
+		int			i;
+
+		best = -1;
+		for (i = 0; i < group->nreplicas; i++)
+		{
+			sphinxReplica *replica = &group->replicas[i];
+
+			if (i == exclude || failed[i] || (skip && skip[i]))
+				continue;
+			if (!replicaReady(replica, now))
+			{
+				ejected |= (replica->ejected_until > now);
+				continue;
+			}
+			if (best < 0 || replica->latency < group->replicas[best].latency)
+				best = i;
+		}
+
+		/* a hedge isn't worth waking up an ejected replica */
+		if (best < 0 && ejected && exclude < 0)
+		{
+			for (i = 0; i < group->nreplicas; i++)
+			{
+				sphinxReplica *replica = &group->replicas[i];
+
+				if (i == exclude || failed[i] || (skip && skip[i]) ||
+					replica->ejected_until <= now)
+					continue;
+				if (best < 0 || replica->ejected_until < group->replicas[best].ejected_until)
+					best = i;
+			}
+			if (best >= 0 && group->replicas[best].draining)
+				drainReplica(&group->replicas[best]);
+		}
+
+		if (best < 0 || connectReplica(&group->replicas[best], &rconn->options))
+			break;
+		failed[best] = true;
+	}
+	pfree(failed);
+
+	return best;
+}
+
+
+/*
+ * Whether a replica that isn't ejected can take a query right away: one that
+ * lost a hedge can once its answer has arrived and is thrown away.
+ */
+static bool
+replicaReady(sphinxReplica *replica, TimestampTz now)
+{
+	int			rc;
+
+	if (replica->ejected_until > now)
+		return false;
+	if (!replica->draining)
+		return true;
+
+	rc = WaitLatchOrSocket(NULL, WL_SOCKET_READABLE | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						   sphinxGetSocket(replica->conn), 0, sphinxWaitEvent());
+	if (!(rc & WL_SOCKET_READABLE))
+		return false;
+
+	drainReplica(replica);
+	return true;
+}
+
+
+static bool
+connectReplica(sphinxReplica *replica, const sphinxConnOptions *options)
+{
+	char	   *msg;
+
+	if (replica->conn)
+		return true;
+
+	if (!(replica->conn = sphinxConnect(replica->host, replica->port, options, &msg)))
+	{
+		recordFailure(replica, options, msg);
+		return false;
+	}
+
+	return true;
+}
+
+
+static void
+useReplica(remoteConn *rconn, int n)
+{
+	sphinxReplica *replica = &rconn->group->replicas[n];
+
+	rconn->group->current = n;
+	rconn->conn = replica->conn;
+	strlcpy(rconn->host, replica->host, MAXHOSTLEN);
+	rconn->port = replica->port;
+}
+
+
+/*
+ * Read and throw away the answer to a query sent to a replica
+ */
+static void
+drainReplica(sphinxReplica *replica)
+{
+	MYSQL_RES  *res;
+
+	replica->draining = false;
+	if (mysql_read_query_result(replica->conn))
+		return;
+
+	do
+	{
+		if ((res = mysql_store_result(replica->conn)))
+			mysql_free_result(res);
+	} while (mysql_next_result(replica->conn) == 0);
+}
+
+
+/*
+ * Add the time since sent to the latency average of a replica
+ */
+static void
+recordLatency(sphinxReplica *replica, TimestampTz sent)
+{
+	double		ms = (GetCurrentTimestamp() - sent) / 1000.0;
+
+	if (replica->latency == 0)
+		replica->latency = Max(ms, 0.001);
+	else
+		replica->latency = LATENCY_ALPHA * ms + (1 - LATENCY_ALPHA) * replica->latency;
+}
+
+
+/*
+ * Count a failure of a replica, ejecting it after eject_errors of them in
+ * a row
+ */
+static void
+recordFailure(sphinxReplica *replica, const sphinxConnOptions *options, const char *msg)
+{
+	int			eject_errors = options->eject_errors > 0 ? options->eject_errors : DEFAULT_EJECT_ERRORS;
+	int			eject_time = options->eject_time > 0 ? options->eject_time : DEFAULT_EJECT_TIME;
+
+	replica->failures++;
+	if (++replica->errors < eject_errors)
+		return;
+
+	replica->errors = 0;
+	replica->ejected_until = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+														 eject_time * 1000L);
+	ereport(WARNING,
+			(errcode(ERRCODE_CONNECTION_FAILURE),
+			 errmsg("replica %s:%d is ejected for %d s", replica->host, replica->port, eject_time),
+			 errdetail("It failed %d times in a row, last with: %s", eject_errors, msg)));
+}
+
+
+/*
+ * Whether the last error of a connection comes from the client library, as
+ * opposed to searchd
+ */
+static bool
+isClientError(MYSQL *conn)
+{
+	unsigned int err = mysql_errno(conn);
+
+	return err >= CR_MIN_ERROR && err <= CR_MAX_ERROR;
+}
+
+
+/*
+ * Whether every statement of query only reads, so that it can be sent to
+ * more than one replica
+ */
+static bool
+isReadQuery(const char *query)
+{
+	static const char *const keywords[] = {"SELECT", "CALL", "DESCRIBE", "DESC", "SHOW", "EXPLAIN"};
+	const char *p = query;
+	char		quote = 0;
+
+	for (;;)
+	{
+		int			i;
+
+		while (scanner_isspace(*p))
+			p++;
+		if (*p == '\0')
+			return true;
+		for (i = 0; i < lengthof(keywords); i++)
+		{
+			if (skipKeyword(p, keywords[i]))
+				break;
+		}
+		if (i == lengthof(keywords))
+			return false;
+
+		/* on to the next statement of a batch */
+		for (; *p && (quote || *p != ';'); p++)
+		{
+			if (*p == '\\' && quote && p[1])
+				p++;
+			else if (*p == quote)
+				quote = 0;
+			else if (!quote && (*p == '\'' || *p == '"'))
+				quote = *p;
+		}
+		if (*p == '\0')
+			return true;
+		p++;
+	}
+}
+
+
+/*
+ * Whether query is about the session rather than the indexes, so it must go
+ * to the replica used last
+ */
+static bool
+isSessionQuery(const char *query)
+{
+	const char *p;
+
+	if (skipKeyword(query, "SET"))
+		return true;
+	if (!(p = skipKeyword(query, "SHOW")))
+		return false;
+
+	return skipKeyword(p, "META") || skipKeyword(p, "PROFILE") ||
+		skipKeyword(p, "PLAN") || skipKeyword(p, "WARNINGS");
+}
+
+
+/*
+ * If str starts with keyword, ignoring case and leading white space, return
+ * the position after it, else NULL
+ */
+static const char *
+skipKeyword(const char *str, const char *keyword)
+{
+	int			len = strlen(keyword);
+
+	while (scanner_isspace(*str))
+		str++;
+	if (pg_strncasecmp(str, keyword, len) != 0 ||
+		isalnum((unsigned char) str[len]) || str[len] == '_')
+		return NULL;
+
+	return str + len;
+}
+
+
+/*
+ * sphinx_replicas(conname): the replicas of a group with their latency and
+ * health as seen by this backend
+ */
+PG_FUNCTION_INFO_V1(sphinx_replicas);
+Datum
+sphinx_replicas(PG_FUNCTION_ARGS)
+{
+	char	   *conname = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	remoteConn *rconn = sphinxGetNamedConnection(conname);
+	sphinxGroup *group = rconn->group;
+	TimestampTz now = GetCurrentTimestamp();
+	MemoryContext oldcontext;
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	int			n;
+
+	if (!group)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("connection \"%s\" is not a replica group", conname),
+				 errhint("Open one with sphinx_connect_group().")));
+
+	if (!rsinfo || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	for (n = 0; n < group->nreplicas; n++)
+	{
+		sphinxReplica *replica = &group->replicas[n];
+		Datum		values[9];
+		bool		nulls[9];
+		int			i = 0;
+
+		memset(nulls, 0, sizeof(nulls));
+		values[i++] = CStringGetTextDatum(replica->host);
+		values[i++] = Int32GetDatum(replica->port);
+		values[i++] = BoolGetDatum(n == group->current);
+		values[i++] = BoolGetDatum(replica->ejected_until <= now);
+		if (replica->latency > 0)
+			values[i++] = Float8GetDatum(replica->latency);
+		else
+			nulls[i++] = true;
+		values[i++] = Int32GetDatum(replica->errors);
+		values[i++] = Int64GetDatum(replica->queries);
+		values[i++] = Int64GetDatum(replica->failures);
+		values[i++] = Int64GetDatum(replica->hedges);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
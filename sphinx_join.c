@@ -0,0 +1,655 @@
+/*
+ * sphinx_join.c
+ *
+ * Custom scan joining a Sphinx search result to a table by document id.
+ *
+ * For an inner join of sphinx_query() (or sphinx_execute(),
+ * sphinx_query_multi(), sphinx_query_all()) with a table on an equality between a result
+ * column and an indexed table column, the planner is offered a SphinxJoin
+ * path.  It runs the search first, sorted by ORDER BY when that only uses
+ * result columns, and then looks each id up in the table's btree index in
+ * that order.  Rows come out already sorted, so a LIMIT above stops the scan
+ * after the first matches instead of joining and sorting the whole table.
+ *
+ * contrib/sphinxlink/sphinx_join.c
+ */
+#include "postgres.h"
+
+#include "access/genam.h"
+#include "access/stratnum.h"
+#include "access/table.h"
+#include "access/tableam.h"
+#include "catalog/pg_am.h"
+#include "catalog/pg_language.h"
+#include "catalog/pg_proc.h"
+#include "commands/explain.h"
+#if (PG_VERSION_NUM >= 180000)
+#include "commands/explain_format.h"
+#endif
+#include "executor/executor.h"
+#include "miscadmin.h"
+#include "nodes/extensible.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/cost.h"
+#include "optimizer/optimizer.h"
+#include "optimizer/pathnode.h"
+#include "optimizer/paths.h"
+#include "optimizer/restrictinfo.h"
+#include "optimizer/tlist.h"
+#include "parser/parse_coerce.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+#include "utils/syscache.h"
+#include <sphinxlink.h>
+
+/* Position of the plan-time facts in CustomScan.custom_private */
+#define JOIN_PRIVATE_HEAP		0
+#define JOIN_PRIVATE_INDEX		1
+#define JOIN_PRIVATE_OPERATOR	2
+#define JOIN_PRIVATE_IDRESNO	3
+
+typedef struct joinScanState
+{
+	CustomScanState css;
+	Oid			heapoid;
+	Oid			indexoid;
+	int			idresno;		/* id column in the search result */
+	int			ncols;
+	int		   *colmap;			/* per scan column: result resno, or -attno */
+	Relation	heaprel;
+	Relation	indexrel;
+	IndexScanDesc scan;
+	ScanKeyData key;
+	TupleTableSlot *heapslot;
+	TupleTableSlot *resultslot; /* current search result row */
+	bool		done;
+	int64		probes;
+} joinScanState;
+
+/* GUC variables */
+static bool sphinx_enable_join_scan = true;
+
+static set_join_pathlist_hook_type prev_set_join_pathlist_hook = NULL;
+
+static CustomPathMethods joinPathMethods;
+static CustomScanMethods joinScanMethods;
+static CustomExecMethods joinExecMethods;
+
+static void joinPathlistHook(PlannerInfo *root, RelOptInfo *joinrel, RelOptInfo *outerrel,
+							 RelOptInfo *innerrel, JoinType jointype, JoinPathExtraData *extra);
+static bool isSearchFunction(RangeTblEntry *rte);
+static bool matchJoinClause(RestrictInfo *rinfo, Index srelid, Index trelid,
+							Var **svar, Var **tvar, Oid *opno);
+static Node *stripRelabel(Node *node);
+static bool hasUnsupportedVars(Node *node);
+static List *searchPathKeys(PlannerInfo *root, RelOptInfo *srel);
+static Plan *planJoinPath(PlannerInfo *root, RelOptInfo *rel, CustomPath *best_path,
+						  List *tlist, List *clauses, List *custom_plans);
+static int	findResultColumn(Plan *plan, Index relid, AttrNumber attno);
+static Node *createJoinScanState(CustomScan *cscan);
+static void beginJoinScan(CustomScanState *node, EState *estate, int eflags);
+static TupleTableSlot *execJoinScan(CustomScanState *node);
+static bool nextSearchRow(joinScanState *state);
+static void endJoinScan(CustomScanState *node);
+static void rescanJoinScan(CustomScanState *node);
+static void explainJoinScan(CustomScanState *node, List *ancestors, ExplainState *es);
+
+
+/*
+ * Install the planner hook.  Unlike the other modules this works in every
+ * backend that has loaded the library.
+ */
+void
+sphinxJoinInit(void)
+{
+	DefineCustomBoolVariable("sphinxlink.enable_join_scan",
+							 "Let the planner join Sphinx search results to tables with index lookups in result order.",
+							 NULL,
+							 &sphinx_enable_join_scan,
+							 true,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	joinPathMethods.CustomName = "SphinxJoin";
+	joinPathMethods.PlanCustomPath = planJoinPath;
+
+	joinScanMethods.CustomName = "SphinxJoin";
+	joinScanMethods.CreateCustomScanState = createJoinScanState;
+	RegisterCustomScanMethods(&joinScanMethods);
+
+	joinExecMethods.CustomName = "SphinxJoin";
+	joinExecMethods.BeginCustomScan = beginJoinScan;
+	joinExecMethods.ExecCustomScan = execJoinScan;
+	joinExecMethods.EndCustomScan = endJoinScan;
+	joinExecMethods.ReScanCustomScan = rescanJoinScan;
+	joinExecMethods.ExplainCustomScan = explainJoinScan;
+
+	prev_set_join_pathlist_hook = set_join_pathlist_hook;
+	set_join_pathlist_hook = joinPathlistHook;
+}
+
+
+/*
+ * Add a SphinxJoin path for "search result JOIN table ON result.col =
+ * table.col" when the table has a btree index on col.
+ */
+static void
+joinPathlistHook(PlannerInfo *root, RelOptInfo *joinrel, RelOptInfo *outerrel,
+				 RelOptInfo *innerrel, JoinType jointype, JoinPathExtraData *extra)
+{
+	RangeTblEntry *trte;
+	Path	   *subpath;
+	CustomPath *cpath;
+	RestrictInfo *joinclause = NULL;
+	Var		   *svar = NULL;
+	Var		   *tvar = NULL;
+	Oid			opno = InvalidOid;
+	IndexOptInfo *index = NULL;
+	List	   *pathkeys;
+	List	   *quals;
+	QualCost	qcost;
+	double		probe_cost;
+	ListCell   *lc;
+
+	if (prev_set_join_pathlist_hook)
+		prev_set_join_pathlist_hook(root, joinrel, outerrel, innerrel, jointype, extra);
+
+	/* the hook sees both join orders; take the one with the search outside */
+	if (!sphinx_enable_join_scan || jointype != JOIN_INNER ||
+		outerrel->reloptkind != RELOPT_BASEREL || innerrel->reloptkind != RELOPT_BASEREL ||
+		root->parse->rowMarks != NIL)
+		return;
+
+	if (!isSearchFunction(root->simple_rte_array[outerrel->relid]))
+		return;
+	trte = root->simple_rte_array[innerrel->relid];
+	if (trte->rtekind != RTE_RELATION || trte->inh ||
+		(trte->relkind != RELKIND_RELATION && trte->relkind != RELKIND_MATVIEW))
+		return;
+
+	subpath = outerrel->cheapest_total_path;
+	if (!subpath || subpath->param_info ||
+		!bms_is_empty(outerrel->lateral_relids) || !bms_is_empty(innerrel->lateral_relids))
+		return;
+
+	foreach(lc, innerrel->baserestrictinfo)
+	{
+		RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc);
+
+		if (rinfo->pseudoconstant || rinfo->security_level > 0)
+			return;
+	}
+	foreach(lc, extra->restrictlist)
+	{
+		RestrictInfo *rinfo = lfirst_node(RestrictInfo, lc);
+
+		if (rinfo->pseudoconstant)
+			return;
+		if (!joinclause &&
+			matchJoinClause(rinfo, outerrel->relid, innerrel->relid, &svar, &tvar, &opno))
+			joinclause = rinfo;
+	}
+	if (!joinclause)
+		return;
+
+	/* the table's own conditions are checked here, the join clause rechecked */
+	quals = list_concat(extract_actual_clauses(extra->restrictlist, false),
+						extract_actual_clauses(innerrel->baserestrictinfo, false));
+
+	/* whole-row and system columns of the join aren't built */
+	if (hasUnsupportedVars((Node *) joinrel->reltarget->exprs) ||
+		hasUnsupportedVars((Node *) quals))
+		return;
+
+	foreach(lc, innerrel->indexlist)
+	{
+		IndexOptInfo *candidate = (IndexOptInfo *) lfirst(lc);
+
+		if (candidate->relam != BTREE_AM_OID || !candidate->amhasgettuple ||
+			candidate->indexkeys[0] != tvar->varattno ||
+			(candidate->indpred != NIL && !candidate->predOK) ||
+			get_op_opfamily_strategy(opno, candidate->opfamily[0]) != BTEqualStrategyNumber)
+			continue;
+		if (!index || candidate->pages < index->pages)
+			index = candidate;
+	}
+	if (!index)
+		return;
+
+	pathkeys = searchPathKeys(root, outerrel);
+	if (pathkeys != NIL)
+		subpath = (Path *) create_sort_path(root, outerrel, subpath, pathkeys, -1.0);
+
+	cost_qual_eval(&qcost, quals, root);
+
+	/* a descent to the leaf, mostly cached, and a heap page per probe */
+	probe_cost = random_page_cost + cpu_index_tuple_cost +
+		cpu_operator_cost * (ceil(log(Max(index->tuples, 2.0)) / log(2.0)) + 1);
+
+	cpath = makeNode(CustomPath);
+	cpath->path.pathtype = T_CustomScan;
+	cpath->path.parent = joinrel;
+	cpath->path.pathtarget = joinrel->reltarget;
+	cpath->path.param_info = NULL;
+	cpath->path.parallel_aware = false;
+	cpath->path.parallel_safe = false;
+	cpath->path.parallel_workers = 0;
+	cpath->path.rows = joinrel->rows;
+	cpath->path.startup_cost = subpath->startup_cost + qcost.startup;
+	cpath->path.total_cost = subpath->total_cost + qcost.startup +
+		subpath->rows * probe_cost +
+		joinrel->rows * (cpu_tuple_cost + qcost.per_tuple);
+	cpath->path.pathkeys = pathkeys;
+	cpath->flags = 0;
+	cpath->custom_paths = list_make1(subpath);
+	cpath->custom_private = list_make5(quals,
+									   makeInteger((int) innerrel->relid),
+									   makeInteger((int) index->indexoid),
+									   makeInteger((int) opno),
+									   svar);
+	cpath->methods = &joinPathMethods;
+
+	add_path(joinrel, (Path *) cpath);
+}
+
+
+/*
+ * Is rte a call of one of our search functions?
+ */
+static bool
+isSearchFunction(RangeTblEntry *rte)
+{
+	RangeTblFunction *rtfunc;
+	HeapTuple	tuple;
+	bool		result = false;
+
+	if (rte->rtekind != RTE_FUNCTION || rte->funcordinality ||
+		list_length(rte->functions) != 1)
+		return false;
+
+	rtfunc = (RangeTblFunction *) linitial(rte->functions);
+	if (!IsA(rtfunc->funcexpr, FuncExpr))
+		return false;
+
+	tuple = SearchSysCache1(PROCOID, ObjectIdGetDatum(((FuncExpr *) rtfunc->funcexpr)->funcid));
+	if (!HeapTupleIsValid(tuple))
+		return false;
+
+	if (((Form_pg_proc) GETSTRUCT(tuple))->prolang == ClanguageId)
+	{
+		bool		isnull;
+		Datum		prosrc = SysCacheGetAttr(PROCOID, tuple, Anum_pg_proc_prosrc, &isnull);
+		Datum		probin;
+
+		if (!isnull)
+		{
+			char	   *src = TextDatumGetCString(prosrc);
+
+			result = (strcmp(src, "sphinx_query") == 0 ||
+					  strcmp(src, "sphinx_execute") == 0 ||
+					  strcmp(src, "sphinx_query_multi") == 0 ||
+					  strcmp(src, "sphinx_query_all") == 0);
+		}
+		probin = SysCacheGetAttr(PROCOID, tuple, Anum_pg_proc_probin, &isnull);
+		result = result && !isnull && strstr(TextDatumGetCString(probin), "sphinxlink") != NULL;
+	}
+	ReleaseSysCache(tuple);
+
+	return result;
+}
+
+
+/*
+ * Is rinfo "svar = tvar" with svar from the search and tvar from the table?
+ * *opno is set to the operator with the table column on the left.
+ */
+static bool
+matchJoinClause(RestrictInfo *rinfo, Index srelid, Index trelid,
+				Var **svar, Var **tvar, Oid *opno)
+{
+	OpExpr	   *op = (OpExpr *) rinfo->clause;
+	Node	   *left;
+	Node	   *right;
+	Oid			lefttype;
+	Oid			righttype;
+
+	if (!IsA(op, OpExpr) || list_length(op->args) != 2)
+		return false;
+
+	/*
+	 * Only binary-compatible casts are looked through: the search column is
+	 * handed to the operator as it comes, so a cast function in between
+	 * would feed it a Datum of the wrong type.
+	 */
+	left = stripRelabel(linitial(op->args));
+	right = stripRelabel(lsecond(op->args));
+	if (!IsA(left, Var) || !IsA(right, Var) ||
+		((Var *) left)->varlevelsup != 0 || ((Var *) right)->varlevelsup != 0)
+		return false;
+
+	if (((Var *) left)->varno == trelid && ((Var *) right)->varno == srelid)
+	{
+		*tvar = (Var *) left;
+		*svar = (Var *) right;
+		*opno = op->opno;
+	}
+	else if (((Var *) left)->varno == srelid && ((Var *) right)->varno == trelid)
+	{
+		*svar = (Var *) left;
+		*tvar = (Var *) right;
+		*opno = get_commutator(op->opno);
+	}
+	else
+		return false;
+
+	if (!OidIsValid(*opno) || (*tvar)->varattno <= 0 || (*svar)->varattno <= 0)
+		return false;
+
+	op_input_types(*opno, &lefttype, &righttype);
+	return IsBinaryCoercible((*tvar)->vartype, lefttype) &&
+		IsBinaryCoercible((*svar)->vartype, righttype);
+}
+
+
+static Node *
+stripRelabel(Node *node)
+{
+	while (node && IsA(node, RelabelType))
+		node = (Node *) ((RelabelType *) node)->arg;
+
+	return node;
+}
+
+
+static bool
+hasUnsupportedVars(Node *node)
+{
+	List	   *vars = pull_var_clause(node, PVC_INCLUDE_PLACEHOLDERS);
+	ListCell   *lc;
+
+	foreach(lc, vars)
+	{
+		if (!IsA(lfirst(lc), Var) || ((Var *) lfirst(lc))->varattno <= 0)
+			return true;
+	}
+
+	return false;
+}
+
+
+/*
+ * The query's ORDER BY, if the search result alone can be sorted by it
+ */
+static List *
+searchPathKeys(PlannerInfo *root, RelOptInfo *srel)
+{
+	ListCell   *lc;
+
+	foreach(lc, root->query_pathkeys)
+	{
+		EquivalenceClass *ec = ((PathKey *) lfirst(lc))->pk_eclass;
+		bool		found = false;
+		ListCell   *lc2;
+
+		if (ec->ec_has_volatile)
+			return NIL;
+
+		foreach(lc2, ec->ec_members)
+		{
+			EquivalenceMember *em = (EquivalenceMember *) lfirst(lc2);
+
+			if (!em->em_is_child && !em->em_is_const &&
+				bms_equal(em->em_relids, srel->relids))
+			{
+				found = true;
+				break;
+			}
+		}
+		if (!found)
+			return NIL;
+	}
+
+	return root->query_pathkeys;
+}
+
+
+static Plan *
+planJoinPath(PlannerInfo *root, RelOptInfo *rel, CustomPath *best_path,
+			 List *tlist, List *clauses, List *custom_plans)
+{
+	List	   *quals = (List *) copyObject(linitial(best_path->custom_private));
+	Index		trelid = (Index) intVal(lsecond(best_path->custom_private));
+	Var		   *svar = (Var *) list_nth(best_path->custom_private, 4);
+	Plan	   *subplan = (Plan *) linitial(custom_plans);
+	CustomScan *cscan = makeNode(CustomScan);
+	List	   *vars;
+	List	   *scan_tlist;
+	List	   *colmap = NIL;
+	ListCell   *lc;
+
+	/* the scan tuple holds every column the target list and quals use */
+	vars = pull_var_clause((Node *) tlist, PVC_RECURSE_PLACEHOLDERS);
+	vars = list_concat(vars, pull_var_clause((Node *) quals, PVC_RECURSE_PLACEHOLDERS));
+	scan_tlist = add_to_flat_tlist(NIL, vars);
+	foreach(lc, scan_tlist)
+	{
+		Var		   *var = (Var *) ((TargetEntry *) lfirst(lc))->expr;
+
+		if (var->varno == trelid)
+			colmap = lappend_int(colmap, -var->varattno);
+		else
+			colmap = lappend_int(colmap, findResultColumn(subplan, var->varno, var->varattno));
+	}
+
+	cscan->scan.plan.targetlist = tlist;
+	cscan->scan.plan.qual = quals;
+	cscan->scan.scanrelid = 0;
+	cscan->flags = best_path->flags;
+	cscan->custom_plans = custom_plans;
+	cscan->custom_scan_tlist = scan_tlist;
+	cscan->custom_private = list_make2(list_make4(makeInteger((int) root->simple_rte_array[trelid]->relid),
+												  lthird(best_path->custom_private),
+												  lfourth(best_path->custom_private),
+												  makeInteger(findResultColumn(subplan, svar->varno,
+																			   svar->varattno))),
+									   colmap);
+	cscan->methods = &joinScanMethods;
+
+	return &cscan->scan.plan;
+}
+
+
+static int
+findResultColumn(Plan *plan, Index relid, AttrNumber attno)
+{
+	ListCell   *lc;
+
+	foreach(lc, plan->targetlist)
+	{
+		TargetEntry *tle = (TargetEntry *) lfirst(lc);
+		Var		   *var = (Var *) tle->expr;
+
+		if (IsA(var, Var) && var->varno == relid && var->varattno == attno)
+			return tle->resno;
+	}
+
+	elog(ERROR, "column %d of the search result is not in its target list", attno);
+	return 0;					/* keep compiler quiet */
+}
+
+
+static Node *
+createJoinScanState(CustomScan *cscan)
+{
+	joinScanState *state = (joinScanState *) palloc0(sizeof(joinScanState));
+	List	   *facts = (List *) linitial(cscan->custom_private);
+	List	   *colmap = (List *) lsecond(cscan->custom_private);
+	Oid			opno = (Oid) intVal(list_nth(facts, JOIN_PRIVATE_OPERATOR));
+	Oid			lefttype;
+	Oid			righttype;
+	ListCell   *lc;
+	int			i = 0;
+
+	NodeSetTag(state, T_CustomScanState);
+	state->css.methods = &joinExecMethods;
+	state->heapoid = (Oid) intVal(list_nth(facts, JOIN_PRIVATE_HEAP));
+	state->indexoid = (Oid) intVal(list_nth(facts, JOIN_PRIVATE_INDEX));
+	state->idresno = intVal(list_nth(facts, JOIN_PRIVATE_IDRESNO));
+
+	state->ncols = list_length(colmap);
+	state->colmap = (int *) palloc(Max(state->ncols, 1) * sizeof(int));
+	foreach(lc, colmap)
+		state->colmap[i++] = lfirst_int(lc);
+
+	/* the index column is always on the left of the operator */
+	op_input_types(opno, &lefttype, &righttype);
+	ScanKeyEntryInitialize(&state->key, 0, 1, BTEqualStrategyNumber, righttype,
+						   InvalidOid, get_opcode(opno), (Datum) 0);
+
+	return (Node *) state;
+}
+
+
+static void
+beginJoinScan(CustomScanState *node, EState *estate, int eflags)
+{
+	joinScanState *state = (joinScanState *) node;
+	CustomScan *cscan = (CustomScan *) node->ss.ps.plan;
+
+	state->heaprel = table_open(state->heapoid, AccessShareLock);
+	state->indexrel = index_open(state->indexoid, AccessShareLock);
+	state->key.sk_collation = state->indexrel->rd_indcollation[0];
+	state->heapslot = ExecInitExtraTupleSlot(estate, RelationGetDescr(state->heaprel),
+											 table_slot_callbacks(state->heaprel));
+
+	node->custom_ps = list_make1(ExecInitNode((Plan *) linitial(cscan->custom_plans),
+											  estate, eflags));
+}
+
+
+static TupleTableSlot *
+execJoinScan(CustomScanState *node)
+{
+	joinScanState *state = (joinScanState *) node;
+	ExprContext *econtext = node->ss.ps.ps_ExprContext;
+	TupleTableSlot *scanslot = node->ss.ss_ScanTupleSlot;
+	int			i;
+
+	for (;;)
+	{
+		CHECK_FOR_INTERRUPTS();
+
+		if (!state->resultslot ||
+			!index_getnext_slot(state->scan, ForwardScanDirection, state->heapslot))
+		{
+			if (!nextSearchRow(state))
+				return NULL;
+			continue;
+		}
+
+		ExecClearTuple(scanslot);
+		for (i = 0; i < state->ncols; i++)
+		{
+			int			src = state->colmap[i];
+
+			if (src > 0)
+				scanslot->tts_values[i] = slot_getattr(state->resultslot, src,
+													   &scanslot->tts_isnull[i]);
+			else
+				scanslot->tts_values[i] = slot_getattr(state->heapslot, -src,
+													   &scanslot->tts_isnull[i]);
+		}
+		ExecStoreVirtualTuple(scanslot);
+
+		ResetExprContext(econtext);
+		econtext->ecxt_scantuple = scanslot;
+		if (node->ss.ps.qual && !ExecQual(node->ss.ps.qual, econtext))
+		{
+			InstrCountFiltered1(node, 1);
+			continue;
+		}
+
+		return node->ss.ps.ps_ProjInfo ? ExecProject(node->ss.ps.ps_ProjInfo) : scanslot;
+	}
+}
+
+
+/*
+ * Move to the next search result row and start the index lookup of its id
+ */
+static bool
+nextSearchRow(joinScanState *state)
+{
+	while (!state->done)
+	{
+		TupleTableSlot *slot = ExecProcNode((PlanState *) linitial(state->css.custom_ps));
+		bool		isnull;
+
+		if (TupIsNull(slot))
+			break;
+
+		state->key.sk_argument = slot_getattr(slot, state->idresno, &isnull);
+		if (isnull)
+			continue;
+
+		if (!state->scan)
+		{
+#if (PG_VERSION_NUM >= 180000)
+			state->scan = index_beginscan(state->heaprel, state->indexrel,
+										  state->css.ss.ps.state->es_snapshot, NULL, 1, 0);
+#else
+			state->scan = index_beginscan(state->heaprel, state->indexrel,
+										  state->css.ss.ps.state->es_snapshot, 1, 0);
+#endif
+		}
+		index_rescan(state->scan, &state->key, 1, NULL, 0);
+		state->resultslot = slot;
+		state->probes++;
+		return true;
+	}
+
+	state->done = true;
+	state->resultslot = NULL;
+	return false;
+}
+
+
+static void
+endJoinScan(CustomScanState *node)
+{
+	joinScanState *state = (joinScanState *) node;
+
+	if (state->scan)
+		index_endscan(state->scan);
+	ExecEndNode((PlanState *) linitial(node->custom_ps));
+	index_close(state->indexrel, NoLock);
+	table_close(state->heaprel, NoLock);
+}
+
+
+static void
+rescanJoinScan(CustomScanState *node)
+{
+	joinScanState *state = (joinScanState *) node;
+
+	ExecReScan((PlanState *) linitial(node->custom_ps));
+	state->resultslot = NULL;
+	state->done = false;
+}
+
+
+static void
+explainJoinScan(CustomScanState *node, List *ancestors, ExplainState *es)
+{
+	joinScanState *state = (joinScanState *) node;
+
+	ExplainPropertyText("Index", get_rel_name(state->indexoid), es);
+	if (es->analyze)
+		ExplainPropertyInteger("Index Probes", NULL, state->probes, es);
+}
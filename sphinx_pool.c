@@ -0,0 +1,1235 @@
+/*
+ * sphinx_pool.c
+ *
+ * Shared pool of searchd connections owned by a background worker.
+ *
+ * With sphinxlink in shared_preload_libraries and sphinxlink.pool_size > 0,
+ * queries by host and port (sphinx_query_params() and friends) don't open
+ * per-backend connections.  A backend takes a free slot in shared memory,
+ * sends the query through the slot's request queue and reads the rows back
+ * from its response queue.  The worker runs the query on one of at most
+ * pool_size connections it keeps per host and port, so the number of
+ * searchd connections follows the load rather than max_connections.
+ *
+ * The worker waits for the answers of all running queries at once, but it
+ * reads a result in one go once its first bytes have arrived, and opens new
+ * connections synchronously.  POOL_TIMEOUT bounds how long either can hold
+ * up the other clients.
+ *
+ * contrib/sphinxlink/sphinx_pool.c
+ */
+#include "postgres.h"
+
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "postmaster/postmaster.h"
+#include "storage/condition_variable.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "storage/shmem.h"
+#include "tcop/tcopprot.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+#include <sphinxlink.h>
+
+#define POOL_QUEUE_SIZE		65536	/* size of each slot queue */
+#define POOL_TICK_MS		1000L	/* worker housekeeping period */
+#define POOL_TIMEOUT		5		/* connect, and stalled read or write, in s */
+
+/* Response messages, tagged by their first byte */
+#define POOL_MSG_HEADER		'T'		/* int32 number of columns */
+#define POOL_MSG_ROW		'D'		/* row, see sphinxSerializeRow() */
+#define POOL_MSG_DONE		'C'		/* end of result */
+#define POOL_MSG_ERROR		'E'		/* error message, ends the result */
+
+#if (PG_VERSION_NUM >= 150000)
+#define poolSend(mqh, len, data) shm_mq_send((mqh), (len), (data), true, true)
+#else
+#define poolSend(mqh, len, data) shm_mq_send((mqh), (len), (data), true)
+#endif
+
+typedef enum poolSlotState
+{
+	SLOT_FREE = 0,
+	SLOT_BUSY,					/* claimed by a backend */
+	SLOT_CLOSING				/* backend is done, worker has to let it go */
+} poolSlotState;
+
+typedef struct poolSlot
+{
+	poolSlotState state;
+	int			backend_pid;
+	uint64		generation;		/* worker generation the slot was claimed in */
+} poolSlot;
+
+/* Shared state, followed by two queues per slot */
+typedef struct poolShared
+{
+	LWLock	   *lock;			/* protects everything but the queues */
+	ConditionVariable slot_cv;	/* signalled when a slot becomes free */
+	int			worker_pid;		/* 0 if the worker is not running */
+	Latch	   *worker_latch;
+	uint64		generation;		/* bumped at each worker start */
+	int			nslots;
+	poolSlot	slots[FLEXIBLE_ARRAY_MEMBER];
+} poolShared;
+
+/* Backend side of a request */
+struct sphinxPoolRequest
+{
+	int			slot;
+	uint64		generation;
+	shm_mq_handle *reqh;
+	shm_mq_handle *resph;
+	unsigned int nfields;
+	char	  **values;			/* current row */
+	unsigned long *lengths;
+	bool		done;
+};
+
+/* Worker side of a slot */
+typedef enum clientPhase
+{
+	PHASE_IDLE = 0,				/* not attached */
+	PHASE_REQUEST,				/* waiting for the request message */
+	PHASE_CONN,					/* waiting for a free connection */
+	PHASE_QUERY,				/* query sent, waiting for the answer */
+	PHASE_RESULT,				/* sending the result back */
+	PHASE_DONE					/* all sent, waiting for the backend to let go */
+} clientPhase;
+
+typedef struct poolClient
+{
+	clientPhase phase;
+	int			pid;
+	MemoryContext cxt;
+	shm_mq_handle *reqh;
+	shm_mq_handle *resph;
+	char	   *host;
+	int			port;
+	char	   *query;
+	int			conn;			/* index in conns while the query runs */
+	MYSQL_RES  *res;
+	char	   *errmsg;
+	bool		header_sent;
+	bool		final_sent;
+	StringInfoData msg;			/* message being sent */
+	bool		msg_pending;
+} poolClient;
+
+/* A searchd connection of the worker */
+typedef struct pooledConn
+{
+	char		host[MAXHOSTLEN];
+	int			port;
+	MYSQL	   *conn;			/* NULL if the entry is unused */
+	int			client;			/* slot using it, -1 if none */
+	bool		inflight;		/* answer to a query not read yet */
+	int			last_pid;		/* backend of the last query, for SHOW META */
+	TimestampTz last_used;
+	TimestampTz last_check;
+} pooledConn;
+
+/* GUC variables */
+static int	sphinx_pool_size = 0;
+static int	sphinx_pool_max_clients = 32;
+static int	sphinx_pool_idle_timeout = 60000;
+static int	sphinx_pool_health_check_interval = 10000;
+
+static poolShared *poolState = NULL;
+
+/* backend state */
+static sphinxPoolRequest *activeRequest = NULL;
+static bool exitCallbackRegistered = false;
+
+/* worker state */
+static poolClient *clients = NULL;
+static pooledConn *conns = NULL;
+static int	nconns = 0;
+
+#if (PG_VERSION_NUM >= 150000)
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+PGDLLEXPORT void sphinx_pool_main(Datum main_arg);
+
+static Size poolShmemSize(void);
+static void poolShmemRequest(void);
+static void poolShmemStartup(void);
+static shm_mq *slotQueue(int slot, int which);
+static void poolWait(sphinxPoolRequest *req);
+static void poolBackendExit(int code, Datum arg);
+static void poolWorkerExit(int code, Datum arg);
+static void serveClients(void);
+static void attachClient(int i);
+static void releaseClient(int i);
+static bool advanceClient(int i);
+static bool nextMessage(poolClient *client);
+static void killAbandoned(int ci);
+static int	getPooledConnection(poolClient *client);
+static void readAnswer(int ci);
+static void putConnection(int ci, bool failed);
+static void closeConnection(int ci);
+static void maintainConnections(void);
+static void waitForWork(void);
+
+
+/*
+ * Define the pool GUCs and, if the pool is enabled, request shared memory and
+ * register the worker.  Only does anything from shared_preload_libraries.
+ */
+void
+sphinxPoolInit(void)
+{
+	BackgroundWorker worker;
+
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	DefineCustomIntVariable("sphinxlink.pool_size",
+							"Maximum number of pooled connections per Sphinx host and port.",
+							"Zero disables the connection pool.",
+							&sphinx_pool_size,
+							0,
+							0,
+							1000,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("sphinxlink.pool_max_clients",
+							"Maximum number of queries in flight through the connection pool.",
+							"Further backends wait for a free slot.",
+							&sphinx_pool_max_clients,
+							32,
+							1,
+							MAX_BACKENDS,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("sphinxlink.pool_idle_timeout",
+							"Close pooled connections unused for this long.",
+							"Zero keeps idle connections open.",
+							&sphinx_pool_idle_timeout,
+							60000,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("sphinxlink.pool_health_check_interval",
+							"Ping idle pooled connections this often.",
+							"Zero disables health checks.",
+							&sphinx_pool_health_check_interval,
+							10000,
+							0,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	if (sphinx_pool_size == 0)
+		return;
+
+#if (PG_VERSION_NUM >= 150000)
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = poolShmemRequest;
+#else
+	poolShmemRequest();
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = poolShmemStartup;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+	worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+	worker.bgw_restart_time = 5;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "sphinxlink");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "sphinx_pool_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "sphinxlink pool");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "sphinxlink pool");
+	RegisterBackgroundWorker(&worker);
+}
+
+
+bool
+sphinxPoolEnabled(void)
+{
+	return poolState != NULL && sphinx_pool_size > 0;
+}
+
+
+static Size
+poolShmemSize(void)
+{
+	Size		size;
+
+	size = MAXALIGN(add_size(offsetof(poolShared, slots),
+							 mul_size(sizeof(poolSlot), sphinx_pool_max_clients)));
+	return add_size(size, mul_size(2 * POOL_QUEUE_SIZE, sphinx_pool_max_clients));
+}
+
+
+static void
+poolShmemRequest(void)
+{
+#if (PG_VERSION_NUM >= 150000)
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	RequestAddinShmemSpace(poolShmemSize());
+	RequestNamedLWLockTranche("sphinxlink_pool", 1);
+}
+
+
+static void
+poolShmemStartup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	poolState = ShmemInitStruct("sphinxlink pool", poolShmemSize(), &found);
+	if (!found)
+	{
+		memset(poolState, 0, offsetof(poolShared, slots) +
+			   sizeof(poolSlot) * sphinx_pool_max_clients);
+		poolState->lock = &(GetNamedLWLockTranche("sphinxlink_pool"))->lock;
+		ConditionVariableInit(&poolState->slot_cv);
+		poolState->nslots = sphinx_pool_max_clients;
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+
+/*
+ * Request (which = 0) or response (which = 1) queue of a slot.
+ */
+static shm_mq *
+slotQueue(int slot, int which)
+{
+	char	   *base;
+
+	base = (char *) poolState +
+		MAXALIGN(offsetof(poolShared, slots) + sizeof(poolSlot) * poolState->nslots);
+	return (shm_mq *) (base + (Size) (2 * slot + which) * POOL_QUEUE_SIZE);
+}
+
+
+/*
+ * Row serialization used to pass rows between processes: for each column an
+ * int32 length (-1 for NULL), then the value and a terminating zero byte, so
+ * values can be used in place as C strings.
+ */
+void
+sphinxSerializeRow(StringInfo buf, MYSQL_ROW row, unsigned long *lengths,
+				   unsigned int nfields)
+{
+	unsigned int i;
+
+	for (i = 0; i < nfields; i++)
+	{
+		int32		len = row[i] ? (int32) lengths[i] : -1;
+
+		appendBinaryStringInfo(buf, (char *) &len, sizeof(len));
+		if (row[i])
+		{
+			appendBinaryStringInfo(buf, row[i], lengths[i]);
+			appendStringInfoChar(buf, '\0');
+		}
+	}
+}
+
+
+/*
+ * Inverse of sphinxSerializeRow().  values point into data.
+ */
+void
+sphinxDeserializeRow(const char *data, Size len, unsigned int nfields,
+					 char **values, unsigned long *lengths)
+{
+	const char *end = data + len;
+	unsigned int i;
+
+	for (i = 0; i < nfields; i++)
+	{
+		int32		vlen;
+
+		if (end - data < (ptrdiff_t) sizeof(vlen))
+			elog(ERROR, "malformed serialized row");
+		memcpy(&vlen, data, sizeof(vlen));
+		data += sizeof(vlen);
+
+		if (vlen < 0)
+		{
+			values[i] = NULL;
+			lengths[i] = 0;
+			continue;
+		}
+
+		if (end - data < (ptrdiff_t) vlen + 1)
+			elog(ERROR, "malformed serialized row");
+		values[i] = (char *) data;
+		lengths[i] = vlen;
+		data += vlen + 1;
+	}
+}
+
+
+/*
+ * Hand a query over to the pool worker.  query must already be in UTF8.
+ */
+sphinxPoolRequest *
+sphinxPoolSend(const char *host, int port, const char *query)
+{
+	sphinxPoolRequest *req;
+	MemoryContext oldcontext;
+	StringInfoData msg;
+	int32		port32 = port;
+	int			slot = -1;
+	uint64		generation = 0;
+	Latch	   *latch = NULL;
+	int			i;
+
+	if (!exitCallbackRegistered)
+	{
+		before_shmem_exit(poolBackendExit, (Datum) 0);
+		exitCallbackRegistered = true;
+	}
+
+	if (activeRequest)
+		sphinxPoolRelease(activeRequest);
+
+	/* wait for a free slot */
+	ConditionVariablePrepareToSleep(&poolState->slot_cv);
+	for (;;)
+	{
+		bool		running;
+
+		LWLockAcquire(poolState->lock, LW_EXCLUSIVE);
+		running = (poolState->worker_pid != 0);
+		if (running)
+		{
+			for (i = 0; i < poolState->nslots; i++)
+			{
+				poolSlot   *s = &poolState->slots[i];
+
+				if (s->state != SLOT_FREE)
+					continue;
+
+				s->state = SLOT_BUSY;
+				s->backend_pid = MyProcPid;
+				s->generation = generation = poolState->generation;
+
+				shm_mq_create(slotQueue(i, 0), POOL_QUEUE_SIZE);
+				shm_mq_create(slotQueue(i, 1), POOL_QUEUE_SIZE);
+				shm_mq_set_sender(slotQueue(i, 0), MyProc);
+				shm_mq_set_receiver(slotQueue(i, 1), MyProc);
+				latch = poolState->worker_latch;
+				slot = i;
+				break;
+			}
+		}
+		LWLockRelease(poolState->lock);
+
+		if (!running)
+		{
+			ConditionVariableCancelSleep();
+			ereport(ERROR,
+					(errcode(ERRCODE_CONNECTION_FAILURE),
+					 errmsg("sphinxlink pool worker is not running")));
+		}
+		if (slot >= 0)
+			break;
+
+		ConditionVariableSleep(&poolState->slot_cv, sphinxWaitEvent());
+	}
+	ConditionVariableCancelSleep();
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	req = (sphinxPoolRequest *) palloc0(sizeof(sphinxPoolRequest));
+	req->slot = slot;
+	req->generation = generation;
+	req->reqh = shm_mq_attach(slotQueue(slot, 0), NULL, NULL);
+	req->resph = shm_mq_attach(slotQueue(slot, 1), NULL, NULL);
+	MemoryContextSwitchTo(oldcontext);
+	activeRequest = req;
+
+	/* a worker that exited since then has cleared it, and a new one polls */
+	if (latch)
+		SetLatch(latch);
+
+	/* request: int32 port, host, query */
+	initStringInfo(&msg);
+	appendBinaryStringInfo(&msg, (char *) &port32, sizeof(port32));
+	appendBinaryStringInfo(&msg, host, strlen(host) + 1);
+	appendBinaryStringInfo(&msg, query, strlen(query) + 1);
+
+	for (;;)
+	{
+		shm_mq_result res = poolSend(req->reqh, msg.len, msg.data);
+
+		if (res == SHM_MQ_SUCCESS)
+			break;
+		if (res == SHM_MQ_DETACHED)
+			ereport(ERROR,
+					(errcode(ERRCODE_CONNECTION_FAILURE),
+					 errmsg("sphinxlink pool worker exited while running the query")));
+		poolWait(req);
+	}
+	pfree(msg.data);
+
+	return req;
+}
+
+
+/*
+ * Fetch the next row of a pooled query.  Returns false at the end of the
+ * result.  The row is valid until the next call.
+ */
+bool
+sphinxPoolNextRow(sphinxPoolRequest *req, unsigned int *nfields,
+				  char ***values, unsigned long **lengths)
+{
+	while (!req->done)
+	{
+		Size		nbytes;
+		void	   *data;
+		char	   *msg;
+		shm_mq_result res;
+
+		res = shm_mq_receive(req->resph, &nbytes, &data, true);
+		if (res == SHM_MQ_WOULD_BLOCK)
+		{
+			poolWait(req);
+			continue;
+		}
+		if (res == SHM_MQ_DETACHED || nbytes < 1)
+			ereport(ERROR,
+					(errcode(ERRCODE_CONNECTION_FAILURE),
+					 errmsg("sphinxlink pool worker exited while running the query")));
+
+		msg = (char *) data;
+		switch (msg[0])
+		{
+			case POOL_MSG_HEADER:
+				{
+					int32		n;
+
+					memcpy(&n, msg + 1, sizeof(n));
+					req->nfields = n;
+					if (req->values)
+						pfree(req->values);
+					if (req->lengths)
+						pfree(req->lengths);
+					req->values = MemoryContextAlloc(TopMemoryContext, (n + 1) * sizeof(char *));
+					req->lengths = MemoryContextAlloc(TopMemoryContext, (n + 1) * sizeof(unsigned long));
+					break;
+				}
+			case POOL_MSG_ROW:
+				sphinxDeserializeRow(msg + 1, nbytes - 1, req->nfields,
+									 req->values, req->lengths);
+				*nfields = req->nfields;
+				*values = req->values;
+				*lengths = req->lengths;
+				return true;
+			case POOL_MSG_DONE:
+				req->done = true;
+				break;
+			case POOL_MSG_ERROR:
+				req->done = true;
+				ereport(ERROR,
+						(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+						 errmsg("Could not execute query: %s", pnstrdup(msg + 1, nbytes - 1))));
+				break;
+			default:
+				elog(ERROR, "unexpected sphinxlink pool message type %d", msg[0]);
+		}
+	}
+
+	return false;
+}
+
+
+/*
+ * Give the slot of a request back to the worker.  Also used on error, in
+ * which case the worker throws the rest of the result away.
+ */
+void
+sphinxPoolRelease(sphinxPoolRequest *req)
+{
+	poolSlot   *s = &poolState->slots[req->slot];
+
+	shm_mq_detach(req->reqh);
+	shm_mq_detach(req->resph);
+
+	LWLockAcquire(poolState->lock, LW_EXCLUSIVE);
+	if (s->state == SLOT_BUSY && s->backend_pid == MyProcPid)
+		s->state = SLOT_CLOSING;
+	if (poolState->worker_pid != 0)
+		SetLatch(poolState->worker_latch);
+	LWLockRelease(poolState->lock);
+
+	if (req->values)
+		pfree(req->values);
+	if (req->lengths)
+		pfree(req->lengths);
+	pfree(req);
+	if (activeRequest == req)
+		activeRequest = NULL;
+}
+
+
+/*
+ * Wait for the worker to make progress on our request.
+ */
+static void
+poolWait(sphinxPoolRequest *req)
+{
+	bool		gone;
+	int			rc;
+
+	rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+				   POOL_TICK_MS, sphinxWaitEvent());
+	if (rc & WL_LATCH_SET)
+		ResetLatch(MyLatch);
+	CHECK_FOR_INTERRUPTS();
+
+	/* the worker may have died without detaching from our queues */
+	LWLockAcquire(poolState->lock, LW_SHARED);
+	gone = (poolState->worker_pid == 0 || poolState->generation != req->generation);
+	LWLockRelease(poolState->lock);
+
+	if (gone)
+		ereport(ERROR,
+				(errcode(ERRCODE_CONNECTION_FAILURE),
+				 errmsg("sphinxlink pool worker exited while running the query")));
+}
+
+
+static void
+poolBackendExit(int code, Datum arg)
+{
+	if (activeRequest)
+		sphinxPoolRelease(activeRequest);
+}
+
+
+/*
+ * Pool worker entry point
+ */
+void
+sphinx_pool_main(Datum main_arg)
+{
+	int			i;
+
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	clients = (poolClient *) MemoryContextAllocZero(TopMemoryContext,
+													poolState->nslots * sizeof(poolClient));
+	for (i = 0; i < poolState->nslots; i++)
+	{
+		clients[i].conn = -1;
+		clients[i].cxt = AllocSetContextCreate(TopMemoryContext,
+											   "sphinxlink pool client",
+											   ALLOCSET_SMALL_SIZES);
+	}
+
+	LWLockAcquire(poolState->lock, LW_EXCLUSIVE);
+	poolState->generation++;
+	poolState->worker_pid = MyProcPid;
+	poolState->worker_latch = MyLatch;
+	/* slots released while no worker was running */
+	for (i = 0; i < poolState->nslots; i++)
+	{
+		if (poolState->slots[i].state == SLOT_CLOSING)
+			poolState->slots[i].state = SLOT_FREE;
+	}
+	LWLockRelease(poolState->lock);
+	ConditionVariableBroadcast(&poolState->slot_cv);
+
+	before_shmem_exit(poolWorkerExit, (Datum) 0);
+
+	for (;;)
+	{
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		serveClients();
+		maintainConnections();
+		waitForWork();
+	}
+}
+
+
+static void
+poolWorkerExit(int code, Datum arg)
+{
+	int			i;
+
+	/* let backends waiting on us see the queues detached */
+	for (i = 0; i < poolState->nslots; i++)
+	{
+		if (clients[i].phase != PHASE_IDLE)
+		{
+			shm_mq_detach(clients[i].reqh);
+			shm_mq_detach(clients[i].resph);
+		}
+	}
+
+	LWLockAcquire(poolState->lock, LW_EXCLUSIVE);
+	poolState->worker_pid = 0;
+	poolState->worker_latch = NULL;
+	LWLockRelease(poolState->lock);
+	ConditionVariableBroadcast(&poolState->slot_cv);
+}
+
+
+/*
+ * Pick up new and finished slots and move every client as far as it goes.
+ */
+static void
+serveClients(void)
+{
+	int			i;
+
+	for (i = 0; i < poolState->nslots; i++)
+	{
+		poolSlot   *s = &poolState->slots[i];
+		bool		freed = false;
+		int			abandoned = -1;
+
+		LWLockAcquire(poolState->lock, LW_EXCLUSIVE);
+		if (s->state == SLOT_CLOSING)
+		{
+			if (clients[i].phase == PHASE_QUERY)
+				abandoned = clients[i].conn;
+			releaseClient(i);
+			s->state = SLOT_FREE;
+			freed = true;
+		}
+		else if (s->state == SLOT_BUSY && clients[i].phase == PHASE_IDLE &&
+				 s->generation == poolState->generation)
+			attachClient(i);
+		LWLockRelease(poolState->lock);
+
+		if (freed)
+			ConditionVariableBroadcast(&poolState->slot_cv);
+
+		if (abandoned >= 0 && conns[abandoned].inflight)
+			killAbandoned(abandoned);
+
+		while (advanceClient(i))
+			;
+	}
+}
+
+
+static void
+attachClient(int i)
+{
+	poolClient *client = &clients[i];
+	MemoryContext oldcontext;
+
+	shm_mq_set_receiver(slotQueue(i, 0), MyProc);
+	shm_mq_set_sender(slotQueue(i, 1), MyProc);
+
+	oldcontext = MemoryContextSwitchTo(client->cxt);
+	client->reqh = shm_mq_attach(slotQueue(i, 0), NULL, NULL);
+	client->resph = shm_mq_attach(slotQueue(i, 1), NULL, NULL);
+	initStringInfo(&client->msg);
+	MemoryContextSwitchTo(oldcontext);
+
+	client->pid = poolState->slots[i].backend_pid;
+	client->phase = PHASE_REQUEST;
+}
+
+
+static void
+releaseClient(int i)
+{
+	poolClient *client = &clients[i];
+
+	if (client->phase == PHASE_IDLE)
+		return;
+
+	/* an answer still on its way is dropped when it arrives */
+	if (client->conn >= 0)
+		conns[client->conn].client = -1;
+	if (client->res)
+		mysql_free_result(client->res);
+
+	shm_mq_detach(client->reqh);
+	shm_mq_detach(client->resph);
+	MemoryContextReset(client->cxt);
+
+	client->phase = PHASE_IDLE;
+	client->conn = -1;
+	client->res = NULL;
+	client->errmsg = NULL;
+	client->header_sent = false;
+	client->final_sent = false;
+	client->msg_pending = false;
+}
+
+
+/*
+ * Do whatever the client is ready for.  Returns true if it's worth calling
+ * again right away.
+ */
+static bool
+advanceClient(int i)
+{
+	poolClient *client = &clients[i];
+
+	switch (client->phase)
+	{
+		case PHASE_REQUEST:
+			{
+				Size		nbytes;
+				void	   *data;
+				char	   *msg;
+				int32		port;
+				shm_mq_result res;
+
+				res = shm_mq_receive(client->reqh, &nbytes, &data, true);
+				if (res == SHM_MQ_WOULD_BLOCK)
+					return false;
+				if (res == SHM_MQ_DETACHED || nbytes <= sizeof(port))
+				{
+					client->phase = PHASE_DONE;
+					return false;
+				}
+
+				msg = (char *) data;
+				memcpy(&port, msg, sizeof(port));
+				client->port = port;
+				client->host = MemoryContextStrdup(client->cxt, msg + sizeof(port));
+				client->query = MemoryContextStrdup(client->cxt,
+													msg + sizeof(port) + strlen(client->host) + 1);
+				client->phase = PHASE_CONN;
+				return true;
+			}
+
+		case PHASE_CONN:
+			{
+				int			ci = getPooledConnection(client);
+				pooledConn *pc;
+
+				if (ci == -1)
+					return false;
+				if (ci < 0)
+				{
+					client->phase = PHASE_RESULT;
+					return true;
+				}
+
+				pc = &conns[ci];
+				if (mysql_send_query(pc->conn, client->query, strlen(client->query)))
+				{
+					client->errmsg = MemoryContextStrdup(client->cxt, mysql_error(pc->conn));
+					putConnection(ci, true);
+					client->phase = PHASE_RESULT;
+					return true;
+				}
+
+				pc->client = i;
+				pc->inflight = true;
+				pc->last_pid = client->pid;
+				client->conn = ci;
+				client->phase = PHASE_QUERY;
+				return false;
+			}
+
+		case PHASE_RESULT:
+			for (;;)
+			{
+				shm_mq_result res;
+
+				if (!client->msg_pending && !nextMessage(client))
+				{
+					if (client->res)
+						mysql_free_result(client->res);
+					client->res = NULL;
+					client->phase = PHASE_DONE;
+					return false;
+				}
+
+				res = poolSend(client->resph, client->msg.len, client->msg.data);
+				if (res == SHM_MQ_WOULD_BLOCK)
+					return false;
+				client->msg_pending = false;
+				if (res == SHM_MQ_DETACHED)
+					client->final_sent = true;
+			}
+
+		case PHASE_IDLE:
+		case PHASE_QUERY:
+		case PHASE_DONE:
+			break;
+	}
+
+	return false;
+}
+
+
+/*
+ * The backend gave up on the query running on a connection: don't keep
+ * searchd busy with it.  KILL QUERY is sent over an idle connection to the
+ * same searchd and its answer thrown away like any abandoned one, so the
+ * worker doesn't wait for it.  Without an idle connection the query's own
+ * connection is closed instead.
+ */
+static void
+killAbandoned(int ci)
+{
+	pooledConn *pc = &conns[ci];
+	char		query[64];
+	int			ki;
+
+	for (ki = 0; ki < nconns; ki++)
+	{
+		pooledConn *kc = &conns[ki];
+
+		if (kc->conn && kc->client < 0 && !kc->inflight &&
+			kc->port == pc->port && strcmp(kc->host, pc->host) == 0)
+			break;
+	}
+
+	if (ki < nconns)
+	{
+		snprintf(query, sizeof(query), "KILL QUERY %lu", mysql_thread_id(pc->conn));
+		if (mysql_send_query(conns[ki].conn, query, strlen(query)) == 0)
+		{
+			conns[ki].inflight = true;
+			conns[ki].last_used = GetCurrentTimestamp();
+			return;
+		}
+		closeConnection(ki);
+	}
+
+	closeConnection(ci);
+}
+
+
+/*
+ * Build the next response message of a client in client->msg.  Returns false
+ * once the whole result has been sent.
+ */
+static bool
+nextMessage(poolClient *client)
+{
+	MYSQL_ROW	row;
+
+	if (client->final_sent)
+		return false;
+
+	resetStringInfo(&client->msg);
+	if (client->errmsg)
+	{
+		appendStringInfoChar(&client->msg, POOL_MSG_ERROR);
+		appendStringInfoString(&client->msg, client->errmsg);
+		client->final_sent = true;
+	}
+	else if (client->res && !client->header_sent)
+	{
+		int32		nfields = mysql_num_fields(client->res);
+
+		appendStringInfoChar(&client->msg, POOL_MSG_HEADER);
+		appendBinaryStringInfo(&client->msg, (char *) &nfields, sizeof(nfields));
+		client->header_sent = true;
+	}
+	else if (client->res && (row = mysql_fetch_row(client->res)))
+	{
+		appendStringInfoChar(&client->msg, POOL_MSG_ROW);
+		sphinxSerializeRow(&client->msg, row, mysql_fetch_lengths(client->res),
+						   mysql_num_fields(client->res));
+	}
+	else
+	{
+		appendStringInfoChar(&client->msg, POOL_MSG_DONE);
+		client->final_sent = true;
+	}
+	client->msg_pending = true;
+
+	return true;
+}
+
+
+/*
+ * Find an idle connection for the client's host and port, opening a new one
+ * if the pool for it isn't full.  Returns -1 if the client has to wait, or
+ * -2 if connecting failed (client->errmsg is set).
+ *
+ * SHOW statements (SHOW META in particular) prefer the connection that ran
+ * the backend's previous query, since they report on it.
+ */
+static int
+getPooledConnection(poolClient *client)
+{
+	bool		sticky = (pg_strncasecmp(client->query, "SHOW", 4) == 0);
+	int			idle = -1;
+	int			unused = -1;
+	int			count = 0;
+	sphinxConnOptions options;
+	char	   *errmsg;
+	MYSQL	   *conn;
+	int			ci;
+
+	for (ci = 0; ci < nconns; ci++)
+	{
+		pooledConn *pc = &conns[ci];
+
+		if (!pc->conn)
+		{
+			if (unused < 0)
+				unused = ci;
+			continue;
+		}
+		if (pc->port != client->port || strcmp(pc->host, client->host) != 0)
+			continue;
+
+		count++;
+		if (pc->client >= 0 || pc->inflight)
+			continue;
+		if (idle < 0 || (sticky && pc->last_pid == client->pid))
+			idle = ci;
+	}
+
+	if (idle >= 0)
+		return idle;
+	if (count >= sphinx_pool_size)
+		return -1;
+
+	memset(&options, 0, sizeof(options));
+	options.connect_timeout = options.read_timeout = options.write_timeout = POOL_TIMEOUT;
+	if (!(conn = sphinxConnect(client->host, client->port, &options, &errmsg)))
+	{
+		client->errmsg = MemoryContextStrdup(client->cxt, errmsg);
+		pfree(errmsg);
+		return -2;
+	}
+
+	if (unused < 0)
+	{
+		if (conns)
+			conns = (pooledConn *) repalloc(conns, (nconns + 1) * sizeof(pooledConn));
+		else
+			conns = (pooledConn *) MemoryContextAlloc(TopMemoryContext, sizeof(pooledConn));
+		unused = nconns++;
+	}
+
+	ci = unused;
+	strlcpy(conns[ci].host, client->host, MAXHOSTLEN);
+	conns[ci].port = client->port;
+	conns[ci].conn = conn;
+	conns[ci].client = -1;
+	conns[ci].inflight = false;
+	conns[ci].last_pid = 0;
+	conns[ci].last_used = conns[ci].last_check = GetCurrentTimestamp();
+
+	return ci;
+}
+
+
+/*
+ * The answer to a query has arrived on a connection: read the whole result
+ * and give the connection back to the pool before sending the rows.
+ */
+static void
+readAnswer(int ci)
+{
+	pooledConn *pc = &conns[ci];
+	poolClient *client;
+	MYSQL_RES  *res;
+
+	pc->inflight = false;
+
+	if (pc->client < 0)
+	{
+		/* backend went away, throw the answer away */
+		if (mysql_read_query_result(pc->conn) == 0)
+		{
+			do
+			{
+				if ((res = mysql_store_result(pc->conn)))
+					mysql_free_result(res);
+			} while (mysql_next_result(pc->conn) == 0);
+		}
+		putConnection(ci, mysql_errno(pc->conn) != 0);
+		return;
+	}
+
+	client = &clients[pc->client];
+	client->conn = -1;
+	client->phase = PHASE_RESULT;
+
+	if (mysql_read_query_result(pc->conn))
+	{
+		client->errmsg = MemoryContextStrdup(client->cxt, mysql_error(pc->conn));
+		putConnection(ci, true);
+		return;
+	}
+
+	/* like sphinx_query(), keep the last result set only */
+	res = mysql_store_result(pc->conn);
+	while (res || mysql_field_count(pc->conn) == 0)
+	{
+		if (mysql_next_result(pc->conn) != 0)
+			break;
+		if (res)
+			mysql_free_result(res);
+		res = mysql_store_result(pc->conn);
+	}
+
+	if (mysql_errno(pc->conn))
+	{
+		if (res)
+			mysql_free_result(res);
+		client->errmsg = MemoryContextStrdup(client->cxt, mysql_error(pc->conn));
+		putConnection(ci, true);
+		return;
+	}
+
+	client->res = res;
+	putConnection(ci, false);
+}
+
+
+/*
+ * Return a connection to the idle pool, or close it if it looks broken.
+ */
+static void
+putConnection(int ci, bool failed)
+{
+	pooledConn *pc = &conns[ci];
+
+	pc->client = -1;
+	pc->last_used = pc->last_check = GetCurrentTimestamp();
+
+	if (failed && mysql_ping(pc->conn))
+		closeConnection(ci);
+}
+
+
+static void
+closeConnection(int ci)
+{
+	pooledConn *pc = &conns[ci];
+
+	mysql_close(pc->conn);
+	pc->conn = NULL;
+	pc->client = -1;
+	pc->inflight = false;
+}
+
+
+/*
+ * Reap idle connections and ping the rest now and then.
+ */
+static void
+maintainConnections(void)
+{
+	TimestampTz now = GetCurrentTimestamp();
+	int			ci;
+
+	for (ci = 0; ci < nconns; ci++)
+	{
+		pooledConn *pc = &conns[ci];
+
+		if (!pc->conn || pc->client >= 0 || pc->inflight)
+			continue;
+
+		if (sphinx_pool_idle_timeout > 0 &&
+			TimestampDifferenceExceeds(pc->last_used, now, sphinx_pool_idle_timeout))
+			closeConnection(ci);
+		else if (sphinx_pool_health_check_interval > 0 &&
+				 TimestampDifferenceExceeds(pc->last_check, now, sphinx_pool_health_check_interval))
+		{
+			pc->last_check = now;
+			if (mysql_ping(pc->conn))
+			{
+				ereport(LOG,
+						(errmsg("closing broken Sphinx connection to %s:%d: %s",
+								pc->host, pc->port, mysql_error(pc->conn))));
+				closeConnection(ci);
+			}
+		}
+	}
+}
+
+
+/*
+ * Sleep until a backend or searchd needs attention, and read any answers
+ * that have arrived.
+ */
+static void
+waitForWork(void)
+{
+	WaitEventSet *set;
+	WaitEvent  *events;
+	int			nevents = 2;
+	int			n;
+	int			ci;
+	int			i;
+
+	for (ci = 0; ci < nconns; ci++)
+	{
+		if (conns[ci].conn && conns[ci].inflight)
+			nevents++;
+	}
+
+#if (PG_VERSION_NUM >= 170000)
+	set = CreateWaitEventSet(NULL, nevents);
+#else
+	set = CreateWaitEventSet(CurrentMemoryContext, nevents);
+#endif
+	AddWaitEventToSet(set, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+	AddWaitEventToSet(set, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET, NULL, NULL);
+	for (ci = 0; ci < nconns; ci++)
+	{
+		if (conns[ci].conn && conns[ci].inflight)
+			AddWaitEventToSet(set, WL_SOCKET_READABLE,
+							  sphinxGetSocket(conns[ci].conn), NULL, &conns[ci]);
+	}
+
+	events = (WaitEvent *) palloc(nevents * sizeof(WaitEvent));
+	n = WaitEventSetWait(set, POOL_TICK_MS, events, nevents, PG_WAIT_EXTENSION);
+	FreeWaitEventSet(set);
+
+	for (i = 0; i < n; i++)
+	{
+		if (events[i].events & WL_LATCH_SET)
+			ResetLatch(MyLatch);
+		else if (events[i].events & WL_SOCKET_READABLE)
+			readAnswer((pooledConn *) events[i].user_data - conns);
+	}
+	pfree(events);
+}
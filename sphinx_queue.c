@@ -0,0 +1,546 @@
+/*
+ * sphinx_queue.c
+ *
+ * sphinx_queue_write() and sphinx_queue_delete(): writes to Sphinx that wait
+ * for the commit of the PostgreSQL transaction.
+ *
+ * Queued writes are kept in memory of the transaction and sent just before
+ * it commits, so a trigger doesn't wait for searchd on every row and a
+ * rollback leaves the index alone.  A document written several times is
+ * sent once, in its last version.  Row writes are sent as multi-row REPLACE
+ * and DELETE ... WHERE id IN (...) statements per index; statements queued
+ * as text are run in their place between them.  Writes of a subtransaction
+ * that rolls back are forgotten.  A failing write makes the commit fail.
+ * Sphinx has no two-phase commit, so if the commit fails after the writes
+ * were sent, they stay in the index.
+ *
+ * contrib/sphinxlink/sphinx_queue.c
+ */
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "catalog/pg_type.h"
+#include "miscadmin.h"
+#include "parser/scansup.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/typcache.h"
+#include <sphinxlink.h>
+
+/* most rows written by one statement */
+#define QUEUE_BATCH_SIZE 1000
+
+typedef enum queueKind
+{
+	QUEUE_STATEMENT = 0,		/* text of a statement */
+	QUEUE_REPLACE,				/* a row */
+	QUEUE_DELETE				/* a document id */
+} queueKind;
+
+typedef struct queuedWrite
+{
+	queueKind	kind;
+	char	   *conname;
+	char	   *index;
+	int64		id;
+	char	   *columns;		/* column list of a row */
+	char	   *data;			/* the statement, or the row as "(value, ...)" */
+	int			level;			/* transaction nesting level that queued it */
+	bool		superseded;		/* a later write of the document replaced it */
+	struct queuedWrite *prev;	/* the write this one superseded, or NULL */
+} queuedWrite;
+
+/* Latest write of a document, the entry of queueDocs */
+typedef struct queueKey
+{
+	char		conname[NAMEDATALEN];
+	char		index[NAMEDATALEN];
+	int64		id;
+} queueKey;
+
+typedef struct queueDocEnt
+{
+	queueKey	key;
+	queuedWrite *write;
+} queueDocEnt;
+
+/* How rows of a rowtype are written, cached in fn_extra */
+typedef struct queueRowFormat
+{
+	Oid			type;
+	int32		typmod;
+	bulkColumn *columns;
+	char	   *names;
+	int			idattno;		/* 1-based, or 0 without an integer id */
+} queueRowFormat;
+
+/* The queue of the current transaction; all of it is in queueContext */
+static MemoryContext queueContext = NULL;
+static queuedWrite **queue = NULL;
+static int	queueLength = 0;
+static int	queueSize = 0;
+static HTAB *queueDocs = NULL;
+static bool callbacksRegistered = false;
+
+static void queueWrite(queueKind kind, const char *conname, const char *index, int64 id,
+					   const char *columns, const char *data);
+static void documentKey(queueKey *key, queuedWrite *write);
+static queueRowFormat *getRowFormat(FunctionCallInfo fcinfo, TupleDesc tupdesc);
+static void flushQueue(void);
+static void flushRows(queuedWrite **writes, int nwrites);
+static void execQueued(remoteConn *rconn, const char *query);
+static void queueXactCallback(XactEvent event, void *arg);
+static void queueSubXactCallback(SubXactEvent event, SubTransactionId mySubid,
+								 SubTransactionId parentSubid, void *arg);
+
+
+/*
+ * sphinx_queue_write(conname, query): run query at commit
+ * sphinx_queue_write(conname, index, document record): replace the document
+ * at commit
+ */
+PG_FUNCTION_INFO_V1(sphinx_queue_write);
+Datum
+sphinx_queue_write(PG_FUNCTION_ARGS)
+{
+	char	   *conname = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	HeapTupleHeader td;
+	HeapTupleData tuple;
+	TupleDesc	tupdesc;
+	queueRowFormat *format;
+	StringInfoData row;
+	char	   *index;
+	Datum		id;
+	bool		isnull;
+
+	sphinxGetNamedConnection(conname);
+
+	if (PG_NARGS() == 2)
+	{
+		queueWrite(QUEUE_STATEMENT, conname, NULL, 0, NULL,
+				   sphinxDatabaseToUTF8(text_to_cstring(PG_GETARG_TEXT_PP(1))));
+		PG_RETURN_VOID();
+	}
+
+	index = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	td = PG_GETARG_HEAPTUPLEHEADER(2);
+	tupdesc = lookup_rowtype_tupdesc(HeapTupleHeaderGetTypeId(td), HeapTupleHeaderGetTypMod(td));
+	tuple.t_len = HeapTupleHeaderGetDatumLength(td);
+	ItemPointerSetInvalid(&tuple.t_self);
+	tuple.t_tableOid = InvalidOid;
+	tuple.t_data = td;
+
+	format = getRowFormat(fcinfo, tupdesc);
+	if (!format->idattno)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("document written to index \"%s\" has no integer id column", index)));
+
+	id = heap_getattr(&tuple, format->idattno, tupdesc, &isnull);
+	if (isnull)
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("id of a document written to index \"%s\" is NULL", index)));
+
+	initStringInfo(&row);
+	sphinxFormatBulkRow(&row, format->columns, tupdesc, &tuple);
+
+	switch (format->columns[format->idattno - 1].type)
+	{
+		case INT2OID:
+			queueWrite(QUEUE_REPLACE, conname, index, DatumGetInt16(id), format->names, row.data);
+			break;
+		case INT4OID:
+			queueWrite(QUEUE_REPLACE, conname, index, DatumGetInt32(id), format->names, row.data);
+			break;
+		default:
+			queueWrite(QUEUE_REPLACE, conname, index, DatumGetInt64(id), format->names, row.data);
+			break;
+	}
+
+	ReleaseTupleDesc(tupdesc);
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * sphinx_queue_delete(conname, index, id): delete the document at commit
+ */
+PG_FUNCTION_INFO_V1(sphinx_queue_delete);
+Datum
+sphinx_queue_delete(PG_FUNCTION_ARGS)
+{
+	char	   *conname = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char	   *index = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	int64		id = PG_GETARG_INT64(2);
+
+	sphinxGetNamedConnection(conname);
+
+	queueWrite(QUEUE_DELETE, conname, index, id, NULL, NULL);
+
+	PG_RETURN_VOID();
+}
+
+
+/*
+ * Append a write to the queue of the transaction.  A write of a document
+ * supersedes the previous one, which is kept in case the subtransaction of
+ * the new one rolls back.
+ */
+static void
+queueWrite(queueKind kind, const char *conname, const char *index, int64 id,
+		   const char *columns, const char *data)
+{
+	MemoryContext oldcontext;
+	queuedWrite *write;
+
+	if (!callbacksRegistered)
+	{
+		RegisterXactCallback(queueXactCallback, NULL);
+		RegisterSubXactCallback(queueSubXactCallback, NULL);
+		callbacksRegistered = true;
+	}
+
+	if (index && strlen(index) >= NAMEDATALEN)
+		ereport(ERROR,
+				(errcode(ERRCODE_NAME_TOO_LONG),
+				 errmsg("index name \"%s\" is too long", index)));
+
+	if (!queueContext)
+	{
+		HASHCTL		ctl;
+
+		queueContext = AllocSetContextCreate(TopTransactionContext,
+											 "sphinxlink write queue",
+											 ALLOCSET_DEFAULT_SIZES);
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(queueKey);
+		ctl.entrysize = sizeof(queueDocEnt);
+		ctl.hcxt = queueContext;
+		queueDocs = hash_create("sphinxlink queued documents", 256, &ctl,
+								HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+		queueSize = 64;
+		queue = (queuedWrite **) MemoryContextAlloc(queueContext,
+													queueSize * sizeof(queuedWrite *));
+	}
+
+	oldcontext = MemoryContextSwitchTo(queueContext);
+
+	write = (queuedWrite *) palloc0(sizeof(queuedWrite));
+	write->kind = kind;
+	write->conname = pstrdup(conname);
+	write->index = index ? pstrdup(index) : NULL;
+	write->id = id;
+	write->columns = columns ? pstrdup(columns) : NULL;
+	write->data = data ? pstrdup(data) : NULL;
+	write->level = GetCurrentTransactionNestLevel();
+
+	if (kind != QUEUE_STATEMENT)
+	{
+		queueKey	key;
+		queueDocEnt *entry;
+		bool		found;
+
+		documentKey(&key, write);
+		entry = (queueDocEnt *) hash_search(queueDocs, &key, HASH_ENTER, &found);
+		if (found)
+		{
+			entry->write->superseded = true;
+			write->prev = entry->write;
+		}
+		entry->write = write;
+	}
+
+	if (queueLength >= queueSize)
+	{
+		queueSize *= 2;
+		queue = (queuedWrite **) repalloc(queue, queueSize * sizeof(queuedWrite *));
+	}
+	queue[queueLength++] = write;
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+
+static void
+documentKey(queueKey *key, queuedWrite *write)
+{
+	MemSet(key, 0, sizeof(queueKey));
+	strlcpy(key->conname, write->conname, NAMEDATALEN);
+	truncate_identifier(key->conname, strlen(key->conname), false);
+	strlcpy(key->index, write->index, NAMEDATALEN);
+	key->id = write->id;
+}
+
+
+/*
+ * Column list and formats of the rowtype of tupdesc, kept across calls of
+ * the same call site.  The document id is the integer column "id".
+ */
+static queueRowFormat *
+getRowFormat(FunctionCallInfo fcinfo, TupleDesc tupdesc)
+{
+	queueRowFormat *format = (queueRowFormat *) fcinfo->flinfo->fn_extra;
+	MemoryContext oldcontext;
+	StringInfoData names;
+	int			i;
+
+	if (format && format->type == tupdesc->tdtypeid && format->typmod == tupdesc->tdtypmod)
+		return format;
+
+	oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+
+	if (!format)
+		format = (queueRowFormat *) palloc0(sizeof(queueRowFormat));
+	format->type = tupdesc->tdtypeid;
+	format->typmod = tupdesc->tdtypmod;
+
+	initStringInfo(&names);
+	format->columns = sphinxBulkColumns(tupdesc, &names);
+	format->names = names.data;
+
+	format->idattno = 0;
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		Form_pg_attribute att = TupleDescAttr(tupdesc, i);
+
+		if (!att->attisdropped && strcmp(NameStr(att->attname), "id") == 0 &&
+			format->columns[i].kind == BULK_INT)
+			format->idattno = i + 1;
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+
+	fcinfo->flinfo->fn_extra = format;
+
+	return format;
+}
+
+
+/*
+ * Send the queue: statements in order, and the row writes between two of
+ * them grouped into statements per connection and index.
+ */
+static void
+flushQueue(void)
+{
+	int			start = 0;
+	int			i;
+
+	for (i = 0; i <= queueLength; i++)
+	{
+		if (i < queueLength && queue[i]->kind != QUEUE_STATEMENT)
+			continue;
+
+		if (i > start)
+			flushRows(queue + start, i - start);
+		if (i < queueLength)
+			execQueued(sphinxGetNamedConnection(queue[i]->conname), queue[i]->data);
+		start = i + 1;
+	}
+}
+
+
+/*
+ * Send row writes, one REPLACE or DELETE per connection, index and column
+ * list, split to fit into max_allowed_packet.  Only the latest write of a
+ * document is among them, so the order of documents doesn't matter.
+ */
+static void
+flushRows(queuedWrite **writes, int nwrites)
+{
+	bool	   *done = (bool *) palloc0(nwrites * sizeof(bool));
+	StringInfoData stmt;
+	int			i;
+	int			j;
+
+	initStringInfo(&stmt);
+
+	for (i = 0; i < nwrites; i++)
+	{
+		queuedWrite *first = writes[i];
+		remoteConn *rconn;
+		int			max_packet;
+		int			header_len;
+		int			closing;
+		int			rows = 0;
+
+		if (done[i] || first->superseded)
+			continue;
+
+		rconn = sphinxGetNamedConnection(first->conname);
+		max_packet = sphinxGetMaxPacket(rconn);
+
+		resetStringInfo(&stmt);
+		if (first->kind == QUEUE_REPLACE)
+		{
+			appendStringInfoString(&stmt, "REPLACE INTO ");
+			sphinxAppendIdentifier(&stmt, first->index);
+			appendStringInfo(&stmt, " (%s) VALUES ", first->columns);
+			closing = 0;
+		}
+		else
+		{
+			appendStringInfoString(&stmt, "DELETE FROM ");
+			sphinxAppendIdentifier(&stmt, first->index);
+			appendStringInfoString(&stmt, " WHERE id IN (");
+			closing = 1;
+		}
+		header_len = stmt.len;
+
+		for (j = i; j < nwrites; j++)
+		{
+			queuedWrite *write = writes[j];
+			char		num[32];
+			const char *value;
+			int			len;
+
+			if (done[j] || write->superseded || write->kind != first->kind ||
+				strcmp(write->conname, first->conname) != 0 ||
+				strcmp(write->index, first->index) != 0 ||
+				(write->kind == QUEUE_REPLACE && strcmp(write->columns, first->columns) != 0))
+				continue;
+			done[j] = true;
+
+			if (write->kind == QUEUE_REPLACE)
+				value = write->data;
+			else
+			{
+				pg_lltoa(write->id, num);
+				value = num;
+			}
+			len = strlen(value);
+
+			if (header_len + len + closing > max_packet)
+				ereport(ERROR,
+						(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+						 errmsg("queued document " INT64_FORMAT " does not fit into max_allowed_packet of %d bytes",
+								write->id, max_packet)));
+
+			if (rows > 0 &&
+				(rows >= QUEUE_BATCH_SIZE || stmt.len + 1 + len + closing > max_packet))
+			{
+				if (closing)
+					appendStringInfoChar(&stmt, ')');
+				execQueued(rconn, stmt.data);
+				stmt.len = header_len;
+				stmt.data[stmt.len] = '\0';
+				rows = 0;
+			}
+
+			if (rows > 0)
+				appendStringInfoChar(&stmt, ',');
+			appendBinaryStringInfo(&stmt, value, len);
+			rows++;
+		}
+
+		if (closing)
+			appendStringInfoChar(&stmt, ')');
+		execQueued(rconn, stmt.data);
+	}
+
+	pfree(stmt.data);
+	pfree(done);
+}
+
+
+static void
+execQueued(remoteConn *rconn, const char *query)
+{
+	MYSQL_RES  *res;
+
+	CHECK_FOR_INTERRUPTS();
+
+	if (sphinxExecQuery(rconn, query))
+		ereport(ERROR,
+				(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+				 errmsg("Could not execute queued write: %s", mysql_error(rconn->conn))));
+
+	/* a queued statement may also return rows, nobody reads them */
+	if (mysql_field_count(rconn->conn) > 0 && (res = mysql_store_result(rconn->conn)))
+		mysql_free_result(res);
+}
+
+
+static void
+queueXactCallback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_PRE_COMMIT:
+			if (queueLength > 0)
+				flushQueue();
+			break;
+		case XACT_EVENT_PRE_PREPARE:
+			if (queueLength > 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("cannot prepare a transaction that has queued Sphinx writes")));
+			break;
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+		case XACT_EVENT_PREPARE:
+			/* the memory goes away with TopTransactionContext */
+			queueContext = NULL;
+			queue = NULL;
+			queueLength = 0;
+			queueSize = 0;
+			queueDocs = NULL;
+			break;
+		default:
+			break;
+	}
+}
+
+
+/*
+ * Writes of a committed subtransaction now belong to its parent; those of a
+ * rolled back one are dropped and the writes they superseded come back.
+ * Either are at the end of the queue.
+ */
+static void
+queueSubXactCallback(SubXactEvent event, SubTransactionId mySubid,
+					 SubTransactionId parentSubid, void *arg)
+{
+	int			level = GetCurrentTransactionNestLevel();
+
+	if (queueLength == 0)
+		return;
+
+	if (event == SUBXACT_EVENT_COMMIT_SUB)
+	{
+		int			i;
+
+		for (i = queueLength - 1; i >= 0 && queue[i]->level >= level; i--)
+			queue[i]->level = level - 1;
+	}
+	else if (event == SUBXACT_EVENT_ABORT_SUB)
+	{
+		while (queueLength > 0 && queue[queueLength - 1]->level >= level)
+		{
+			queuedWrite *write = queue[--queueLength];
+			queueKey	key;
+			queueDocEnt *entry;
+
+			if (write->kind == QUEUE_STATEMENT)
+				continue;
+
+			documentKey(&key, write);
+			if (write->prev)
+			{
+				entry = (queueDocEnt *) hash_search(queueDocs, &key, HASH_FIND, NULL);
+				write->prev->superseded = false;
+				entry->write = write->prev;
+			}
+			else
+				hash_search(queueDocs, &key, HASH_REMOVE, NULL);
+		}
+	}
+}
@@ -0,0 +1,407 @@
+/*
+ * sphinx_snippets.c
+ *
+ * sphinx_snippets(): build excerpts for a set of documents with CALL SNIPPETS.
+ *
+ * All documents go into one CALL SNIPPETS with a list of strings, so that
+ * highlighting a page of search results takes a single round trip.  When the
+ * documents don't fit into max_allowed_packet they are split over several
+ * calls; each is sent as soon as it is complete and the next one is built
+ * while searchd works on it.  Excerpts are returned in the order of the
+ * documents, NULL for a NULL document.
+ *
+ * contrib/sphinxlink/sphinx_snippets.c
+ */
+#include "postgres.h"
+
+#include "miscadmin.h"
+#include "funcapi.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/jsonb.h"
+#include "utils/numeric.h"
+#include <sphinxlink.h>
+
+/* length of "CALL SNIPPETS((" and the ")" closing the document list */
+#define SNIPPETS_HEADER_LEN 16
+
+/* documents read at a time from the query of sphinx_snippets() */
+#define SNIPPETS_FETCH_SIZE 100
+
+typedef struct snippetState
+{
+	remoteConn *rconn;
+	int			max_packet;
+	char	   *tail;			/* ", 'index', 'match', ... AS option)" */
+	int			tail_len;
+	StringInfoData docs;		/* quoted documents of the call being built */
+	int			ndocs;
+	StringInfoData doc;			/* document being quoted */
+	StringInfoData order;		/* 'd' per document and 'n' per NULL, in order */
+	StringInfoData sent_order;	/* the same for the call in flight */
+	StringInfoData stmt;
+	bool		inflight;		/* a call was sent and not answered yet */
+	int64		position;		/* documents seen so far, for errors */
+	Tuplestorestate *tupstore;
+	TupleDesc	tupdesc;
+	convPlan   *plan;
+} snippetState;
+
+static void appendSnippetOptions(StringInfo buf, Jsonb *options);
+static void addDocument(snippetState *state, const char *doc);
+static void sendSnippets(snippetState *state);
+static void finishSnippets(snippetState *state);
+static void storeNulls(snippetState *state, const char *order);
+
+
+PG_FUNCTION_INFO_V1(sphinx_snippets);
+Datum
+sphinx_snippets(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	char	   *conname = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char	   *index = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	Oid			sourcetype = get_fn_expr_argtype(fcinfo->flinfo, 2);
+	char	   *match = text_to_cstring(PG_GETARG_TEXT_PP(3));
+	Jsonb	   *options = PG_GETARG_JSONB_P(4);
+	snippetState *state;
+	StringInfoData tail;
+	MemoryContext oldcontext;
+
+	if (!rsinfo || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	initStringInfo(&tail);
+	appendStringInfoString(&tail, ", ");
+	sphinxAppendEscapedString(&tail, sphinxDatabaseToUTF8(index));
+	appendStringInfoString(&tail, ", ");
+	sphinxAppendEscapedString(&tail, sphinxDatabaseToUTF8(match));
+	appendSnippetOptions(&tail, options);
+	appendStringInfoChar(&tail, ')');
+
+	/* not a local variable, so it survives the longjmp to PG_CATCH */
+	state = (snippetState *) palloc0(sizeof(snippetState));
+	state->rconn = sphinxGetNamedConnection(conname);
+	state->max_packet = sphinxGetMaxPacket(state->rconn);
+	/* all calls go to the same replica */
+	sphinxGroupChooseReplica(state->rconn, NULL);
+	state->tail = tail.data;
+	state->tail_len = tail.len;
+	initStringInfo(&state->docs);
+	initStringInfo(&state->doc);
+	initStringInfo(&state->order);
+	initStringInfo(&state->sent_order);
+	initStringInfo(&state->stmt);
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+#if (PG_VERSION_NUM >= 120000)
+	state->tupdesc = CreateTemplateTupleDesc(1);
+#else
+	state->tupdesc = CreateTemplateTupleDesc(1, false);
+#endif
+	TupleDescInitEntry(state->tupdesc, (AttrNumber) 1, "sphinx_snippets", TEXTOID, -1, 0);
+	state->tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = state->tupstore;
+	rsinfo->setDesc = state->tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	state->plan = sphinxCreateConvPlan(state->tupdesc);
+
+	PG_TRY();
+	{
+		if (sourcetype == TEXTOID)
+		{
+			char	   *query = text_to_cstring(PG_GETARG_TEXT_PP(2));
+			SPIPlanPtr	plan;
+			Portal		portal;
+
+			if (SPI_connect() != SPI_OK_CONNECT)
+				elog(ERROR, "SPI_connect failed");
+			if (!(plan = SPI_prepare(query, 0, NULL)))
+				elog(ERROR, "SPI_prepare(\"%s\") failed: %s", query,
+					 SPI_result_code_string(SPI_result));
+			if (!(portal = SPI_cursor_open(NULL, plan, NULL, NULL, true)))
+				elog(ERROR, "SPI_cursor_open(\"%s\") failed: %s", query,
+					 SPI_result_code_string(SPI_result));
+
+			for (;;)
+			{
+				uint64		i;
+
+				SPI_cursor_fetch(portal, true, SNIPPETS_FETCH_SIZE);
+				if (SPI_processed == 0)
+					break;
+				if (SPI_tuptable->tupdesc->natts != 1)
+					ereport(ERROR,
+							(errcode(ERRCODE_DATATYPE_MISMATCH),
+							 errmsg("query of sphinx_snippets() must return one column")));
+
+				for (i = 0; i < SPI_processed; i++)
+				{
+					CHECK_FOR_INTERRUPTS();
+					addDocument(state, SPI_getvalue(SPI_tuptable->vals[i],
+													SPI_tuptable->tupdesc, 1));
+				}
+				SPI_freetuptable(SPI_tuptable);
+			}
+
+			SPI_cursor_close(portal);
+			SPI_finish();
+		}
+		else
+		{
+			ArrayType  *docs = PG_GETARG_ARRAYTYPE_P(2);
+			Datum	   *elems;
+			bool	   *nulls;
+			int			nelems;
+			int			i;
+
+			deconstruct_array(docs, TEXTOID, -1, false, 'i',
+							  &elems, &nulls, &nelems);
+			for (i = 0; i < nelems; i++)
+			{
+				CHECK_FOR_INTERRUPTS();
+				addDocument(state, nulls[i] ? NULL : TextDatumGetCString(elems[i]));
+			}
+		}
+
+		sendSnippets(state);
+		if (state->inflight)
+			finishSnippets(state);
+		storeNulls(state, state->order.data);
+	}
+	PG_CATCH();
+	{
+		if (state->inflight)
+			sphinxCancelQuery(state->rconn);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	return (Datum) 0;
+}
+
+
+/*
+ * Append the options object as "value AS name" arguments.  Option names go
+ * into the statement unquoted, so only identifiers are accepted.
+ */
+static void
+appendSnippetOptions(StringInfo buf, Jsonb *options)
+{
+	JsonbIterator *it;
+	JsonbValue	v;
+	JsonbIteratorToken r;
+	char	   *name = NULL;
+
+	if (!JB_ROOT_IS_OBJECT(options))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("snippet options must be a JSON object")));
+
+	it = JsonbIteratorInit(&options->root);
+	while ((r = JsonbIteratorNext(&it, &v, true)) != WJB_DONE)
+	{
+		if (r == WJB_KEY)
+		{
+			int			i;
+
+			name = pnstrdup(v.val.string.val, v.val.string.len);
+			for (i = 0; name[i]; i++)
+				if (!(name[i] == '_' || (name[i] >= 'a' && name[i] <= 'z') ||
+					  (i > 0 && name[i] >= '0' && name[i] <= '9')))
+					break;
+			if (i == 0 || name[i])
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("invalid snippet option name \"%s\"", name)));
+		}
+		else if (r == WJB_VALUE)
+		{
+			appendStringInfoString(buf, ", ");
+			switch (v.type)
+			{
+				case jbvString:
+					sphinxAppendEscapedString(buf,
+											  sphinxDatabaseToUTF8(pnstrdup(v.val.string.val,
+																			v.val.string.len)));
+					break;
+				case jbvNumeric:
+					appendStringInfoString(buf,
+										   DatumGetCString(DirectFunctionCall1(numeric_out,
+																			   NumericGetDatum(v.val.numeric))));
+					break;
+				case jbvBool:
+					appendStringInfoChar(buf, v.val.boolean ? '1' : '0');
+					break;
+				default:
+					ereport(ERROR,
+							(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+							 errmsg("value of snippet option \"%s\" must be a string, number or boolean",
+									name)));
+			}
+			appendStringInfo(buf, " AS %s", name);
+		}
+	}
+}
+
+
+/*
+ * Add a document, or a NULL, to the call being built.  A call that would
+ * grow past max_allowed_packet is sent first.
+ */
+static void
+addDocument(snippetState *state, const char *doc)
+{
+	state->position++;
+
+	if (!doc)
+	{
+		appendStringInfoChar(&state->order, 'n');
+		return;
+	}
+
+	resetStringInfo(&state->doc);
+	sphinxAppendEscapedString(&state->doc, sphinxDatabaseToUTF8(doc));
+
+	if (SNIPPETS_HEADER_LEN + state->doc.len + state->tail_len > state->max_packet)
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("document " INT64_FORMAT " does not fit into max_allowed_packet of %d bytes",
+						state->position, state->max_packet)));
+
+	if (state->ndocs > 0 &&
+		SNIPPETS_HEADER_LEN + state->docs.len + 1 + state->doc.len + state->tail_len > state->max_packet)
+		sendSnippets(state);
+
+	if (state->ndocs > 0)
+		appendStringInfoChar(&state->docs, ',');
+	appendBinaryStringInfo(&state->docs, state->doc.data, state->doc.len);
+	state->ndocs++;
+	appendStringInfoChar(&state->order, 'd');
+}
+
+
+/*
+ * Send the call built so far.  The answer to the previous one is read first,
+ * so that excerpts are stored in order.
+ */
+static void
+sendSnippets(snippetState *state)
+{
+	MYSQL	   *conn = state->rconn->conn;
+	StringInfoData swap;
+
+	if (state->inflight)
+		finishSnippets(state);
+
+	if (state->ndocs == 0)
+		return;
+
+	resetStringInfo(&state->stmt);
+	appendStringInfoString(&state->stmt, "CALL SNIPPETS(");
+	/* a list of one is sent as a plain string */
+	if (state->ndocs > 1)
+		appendStringInfoChar(&state->stmt, '(');
+	appendBinaryStringInfo(&state->stmt, state->docs.data, state->docs.len);
+	if (state->ndocs > 1)
+		appendStringInfoChar(&state->stmt, ')');
+	appendBinaryStringInfo(&state->stmt, state->tail, state->tail_len);
+
+	sphinxCheckIdle(state->rconn);
+	/* documents are escaped, so the statement has no NUL bytes */
+	if (sphinxSendQuery(conn, &state->rconn->options, state->stmt.data))
+	{
+		sphinxGroupReportError(state->rconn);
+		ereport(ERROR,
+				(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+				 errmsg("Could not execute query: %s", mysql_error(conn))));
+	}
+	state->inflight = true;
+
+	swap = state->sent_order;
+	state->sent_order = state->order;
+	state->order = swap;
+	resetStringInfo(&state->order);
+	resetStringInfo(&state->docs);
+	state->ndocs = 0;
+}
+
+
+/*
+ * Read the excerpts of the call in flight into the result, with the NULLs
+ * that were around its documents.
+ */
+static void
+finishSnippets(snippetState *state)
+{
+	MYSQL	   *conn = state->rconn->conn;
+	MYSQL_RES  *res;
+	const char *order;
+	int			ret;
+
+	ret = sphinxReadQueryResult(state->rconn);
+	state->inflight = false;
+	if (ret || !(res = mysql_store_result(conn)))
+	{
+		sphinxGroupReportError(state->rconn);
+		ereport(ERROR,
+				(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+				 errmsg("Could not execute query: %s", mysql_error(conn))));
+	}
+
+	for (order = state->sent_order.data; *order; order++)
+	{
+		MYSQL_ROW	row;
+		unsigned long *lengths;
+		Datum		value;
+		bool		isnull = false;
+
+		if (*order == 'n')
+		{
+			isnull = true;
+			value = (Datum) 0;
+		}
+		else if ((row = mysql_fetch_row(res)) != NULL)
+		{
+			lengths = mysql_fetch_lengths(res);
+			if (row[0])
+				value = sphinxConvertValue(state->plan, 0, row[0], lengths[0]);
+			else
+			{
+				isnull = true;
+				value = (Datum) 0;
+			}
+		}
+		else
+		{
+			mysql_free_result(res);
+			ereport(ERROR,
+					(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+					 errmsg("Sphinx returned fewer snippets than documents")));
+		}
+
+		tuplestore_putvalues(state->tupstore, state->tupdesc, &value, &isnull);
+	}
+	mysql_free_result(res);
+}
+
+
+/*
+ * Store the NULLs left after the last call
+ */
+static void
+storeNulls(snippetState *state, const char *order)
+{
+	Datum		value = (Datum) 0;
+	bool		isnull = true;
+
+	for (; *order; order++)
+		tuplestore_putvalues(state->tupstore, state->tupdesc, &value, &isnull);
+}
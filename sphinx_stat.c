@@ -0,0 +1,551 @@
+/*
+ * sphinx_stat.c
+ *
+ * Cumulative statistics of Sphinx queries in shared memory.
+ *
+ * With sphinxlink in shared_preload_libraries, every sphinx_query() call
+ * adds its counters and timings to an entry per connection name and
+ * host:port, shown by the sphinx_stat_connections view.  With
+ * sphinxlink.track_queries on, they are also aggregated per query text in
+ * sphinx_stat_queries, together with the time searchd reported in SHOW META
+ * for the last call.
+ *
+ * contrib/sphinxlink/sphinx_stat.c
+ */
+#include "postgres.h"
+
+#include "miscadmin.h"
+#include "funcapi.h"
+#include "catalog/pg_type.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#if (PG_VERSION_NUM >= 130000)
+#include "common/hashfn.h"
+#else
+#include "utils/hashutils.h"
+#define hash_bytes_extended(k, len, seed) DatumGetUInt64(hash_any_extended((k), (len), (seed)))
+#endif
+#include <sphinxlink.h>
+
+#define STAT_HOSTLEN		256
+#define STAT_QUERYLEN		1024
+#define STAT_HIST_BUCKETS	13
+
+/* Upper bounds of the latency histogram buckets, in milliseconds */
+static const double histBounds[STAT_HIST_BUCKETS - 1] = {
+	1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000
+};
+
+typedef struct statConnKey
+{
+	char		conname[NAMEDATALEN];	/* empty for queries by host and port */
+	char		host[STAT_HOSTLEN];
+	int32		port;
+} statConnKey;
+
+typedef struct statConnEntry
+{
+	statConnKey key;			/* hash key, must be first */
+	slock_t		mutex;			/* protects the counters */
+	int64		queries;
+	int64		errors;
+	int64		reconnects;
+	int64		rows;
+	int64		bytes;
+	double		wait_time;		/* ms */
+	double		fetch_time;
+	double		convert_time;
+	int64		hist[STAT_HIST_BUCKETS];
+} statConnEntry;
+
+typedef struct statQueryKey
+{
+	char		host[STAT_HOSTLEN];
+	int32		port;
+	uint64		queryid;		/* hash of the query text */
+	int32		seq;			/* tells apart texts with the same hash */
+} statQueryKey;
+
+typedef struct statQueryEntry
+{
+	statQueryKey key;			/* hash key, must be first */
+	slock_t		mutex;			/* protects the counters */
+	char		query[STAT_QUERYLEN];	/* set on creation, then constant */
+	int64		calls;
+	int64		errors;
+	int64		rows;
+	double		total_time;		/* ms */
+	double		max_time;
+	double		last_meta_time;	/* ms, negative if unknown */
+} statQueryEntry;
+
+/* GUC variables */
+static int	sphinx_stat_max_connections = 256;
+static int	sphinx_stat_max_queries = 1000;
+static bool sphinx_track_queries = false;
+
+static LWLock *statLock = NULL;	/* protects the hashes */
+static HTAB *connStats = NULL;
+static HTAB *queryStats = NULL;
+
+#if (PG_VERSION_NUM >= 150000)
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static void statShmemRequest(void);
+static void statShmemStartup(void);
+static statConnEntry *findConnEntry(statConnKey *key);
+static statQueryEntry *probeQueryEntry(statQueryKey *key, const char *query);
+static statQueryEntry *findQueryEntry(statQueryKey *key, const char *query);
+static Tuplestorestate *statInitSRF(FunctionCallInfo fcinfo, TupleDesc *tupdesc);
+
+
+/*
+ * Define the statistics GUCs and request shared memory for the counters.
+ * Only does anything from shared_preload_libraries.
+ */
+void
+sphinxStatInit(void)
+{
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	DefineCustomIntVariable("sphinxlink.stat_max_connections",
+							"Maximum number of connections tracked in sphinx_stat_connections.",
+							"Zero disables statistics.",
+							&sphinx_stat_max_connections,
+							256,
+							0,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("sphinxlink.stat_max_queries",
+							"Maximum number of query texts tracked in sphinx_stat_queries.",
+							NULL,
+							&sphinx_stat_max_queries,
+							1000,
+							0,
+							INT_MAX / 2,
+							PGC_POSTMASTER,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomBoolVariable("sphinxlink.track_queries",
+							 "Collect statistics per query text.",
+							 "Also runs SHOW META after each query to record the time searchd reports.",
+							 &sphinx_track_queries,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	if (sphinx_stat_max_connections == 0)
+		return;
+
+#if (PG_VERSION_NUM >= 150000)
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = statShmemRequest;
+#else
+	statShmemRequest();
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = statShmemStartup;
+}
+
+
+static void
+statShmemRequest(void)
+{
+#if (PG_VERSION_NUM >= 150000)
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	RequestAddinShmemSpace(hash_estimate_size(sphinx_stat_max_connections, sizeof(statConnEntry)));
+	RequestAddinShmemSpace(hash_estimate_size(Max(sphinx_stat_max_queries, 1), sizeof(statQueryEntry)));
+	RequestNamedLWLockTranche("sphinxlink_stat", 1);
+}
+
+
+static void
+statShmemStartup(void)
+{
+	HASHCTL		info;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+	statLock = &(GetNamedLWLockTranche("sphinxlink_stat"))->lock;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(statConnKey);
+	info.entrysize = sizeof(statConnEntry);
+	connStats = ShmemInitHash("sphinxlink connection stats",
+							  sphinx_stat_max_connections, sphinx_stat_max_connections,
+							  &info, HASH_ELEM | HASH_BLOBS);
+
+	info.keysize = sizeof(statQueryKey);
+	info.entrysize = sizeof(statQueryEntry);
+	queryStats = ShmemInitHash("sphinxlink query stats",
+							   Max(sphinx_stat_max_queries, 1), Max(sphinx_stat_max_queries, 1),
+							   &info, HASH_ELEM | HASH_BLOBS);
+
+	LWLockRelease(AddinShmemInitLock);
+}
+
+
+bool
+sphinxStatEnabled(void)
+{
+	return connStats != NULL;
+}
+
+
+bool
+sphinxStatTrackQueries(void)
+{
+	return connStats != NULL && sphinx_track_queries && sphinx_stat_max_queries > 0;
+}
+
+
+/*
+ * Find the entry for key, creating it zeroed if there is room left.  Called
+ * with statLock held in shared mode; returns with it held in some mode.
+ */
+static statConnEntry *
+findConnEntry(statConnKey *key)
+{
+	statConnEntry *entry;
+	bool		found;
+
+	if ((entry = hash_search(connStats, key, HASH_FIND, NULL)))
+		return entry;
+
+	LWLockRelease(statLock);
+	LWLockAcquire(statLock, LW_EXCLUSIVE);
+
+	if (hash_get_num_entries(connStats) >= sphinx_stat_max_connections &&
+		!hash_search(connStats, key, HASH_FIND, NULL))
+		return NULL;
+
+	entry = hash_search(connStats, key, HASH_ENTER_NULL, &found);
+	if (entry && !found)
+	{
+		memset((char *) entry + sizeof(statConnKey), 0,
+			   sizeof(statConnEntry) - sizeof(statConnKey));
+		SpinLockInit(&entry->mutex);
+	}
+
+	return entry;
+}
+
+
+/*
+ * Look for the entry of query among those with the hash in key, probing
+ * key->seq from zero until the stored text matches or no entry is left.
+ */
+static statQueryEntry *
+probeQueryEntry(statQueryKey *key, const char *query)
+{
+	statQueryEntry *entry;
+
+	for (key->seq = 0;; key->seq++)
+	{
+		if (!(entry = hash_search(queryStats, key, HASH_FIND, NULL)))
+			return NULL;
+		if (strncmp(entry->query, query, STAT_QUERYLEN - 1) == 0)
+			return entry;
+	}
+}
+
+
+/*
+ * Find the entry of query, or create it if there is room left.  Hashes
+ * may collide, so the stored text decides which entry is the query's.
+ * Called with statLock held in shared mode; returns with it held in some
+ * mode.
+ */
+static statQueryEntry *
+findQueryEntry(statQueryKey *key, const char *query)
+{
+	statQueryEntry *entry;
+
+	if ((entry = probeQueryEntry(key, query)))
+		return entry;
+
+	LWLockRelease(statLock);
+	LWLockAcquire(statLock, LW_EXCLUSIVE);
+
+	/* another backend may have created it meanwhile */
+	if ((entry = probeQueryEntry(key, query)))
+		return entry;
+	if (hash_get_num_entries(queryStats) >= sphinx_stat_max_queries)
+		return NULL;
+
+	/* key->seq is now the first free one */
+	entry = hash_search(queryStats, key, HASH_ENTER_NULL, NULL);
+	if (entry)
+	{
+		memset((char *) entry + sizeof(statQueryKey), 0,
+			   sizeof(statQueryEntry) - sizeof(statQueryKey));
+		SpinLockInit(&entry->mutex);
+		strlcpy(entry->query, query, STAT_QUERYLEN);
+		entry->last_meta_time = -1;
+	}
+
+	return entry;
+}
+
+
+/*
+ * Add the counters of a finished (or failed) query.  query is the text to
+ * aggregate per-query statistics by.
+ */
+void
+sphinxStatReport(const char *conname, const char *host, int port,
+				 const char *query, sphinxQueryStats *stats)
+{
+	statConnKey ckey;
+	statConnEntry *centry;
+	int			bucket;
+
+	if (!connStats)
+		return;
+
+	for (bucket = 0; bucket < STAT_HIST_BUCKETS - 1; bucket++)
+	{
+		if (stats->total_time < histBounds[bucket])
+			break;
+	}
+
+	memset(&ckey, 0, sizeof(ckey));
+	if (conname)
+		strlcpy(ckey.conname, conname, NAMEDATALEN);
+	strlcpy(ckey.host, host, STAT_HOSTLEN);
+	ckey.port = port;
+
+	LWLockAcquire(statLock, LW_SHARED);
+
+	centry = findConnEntry(&ckey);
+	if (centry)
+	{
+		SpinLockAcquire(&centry->mutex);
+		centry->queries++;
+		if (stats->error)
+			centry->errors++;
+		if (stats->reconnected)
+			centry->reconnects++;
+		centry->rows += stats->rows;
+		centry->bytes += stats->bytes;
+		centry->wait_time += stats->wait_time;
+		centry->fetch_time += stats->fetch_time;
+		centry->convert_time += stats->convert_time;
+		centry->hist[bucket]++;
+		SpinLockRelease(&centry->mutex);
+	}
+
+	if (query && sphinxStatTrackQueries())
+	{
+		statQueryKey qkey;
+		statQueryEntry *qentry;
+
+		memset(&qkey, 0, sizeof(qkey));
+		strlcpy(qkey.host, host, STAT_HOSTLEN);
+		qkey.port = port;
+		qkey.queryid = hash_bytes_extended((const unsigned char *) query, strlen(query), 0);
+
+		qentry = findQueryEntry(&qkey, query);
+		if (qentry)
+		{
+			SpinLockAcquire(&qentry->mutex);
+			qentry->calls++;
+			if (stats->error)
+				qentry->errors++;
+			qentry->rows += stats->rows;
+			qentry->total_time += stats->total_time;
+			qentry->max_time = Max(qentry->max_time, stats->total_time);
+			if (stats->meta_time >= 0)
+				qentry->last_meta_time = stats->meta_time;
+			SpinLockRelease(&qentry->mutex);
+		}
+	}
+
+	LWLockRelease(statLock);
+}
+
+
+/*
+ * Set up a materialized SRF result
+ */
+static Tuplestorestate *
+statInitSRF(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext oldcontext;
+	Tuplestorestate *tupstore;
+
+	if (!rsinfo || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	*tupdesc = CreateTupleDescCopy(*tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = *tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	return tupstore;
+}
+
+
+PG_FUNCTION_INFO_V1(sphinx_stat_connections);
+Datum
+sphinx_stat_connections(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore = statInitSRF(fcinfo, &tupdesc);
+	HASH_SEQ_STATUS status;
+	statConnEntry *entry;
+
+	if (!connStats)
+		return (Datum) 0;
+
+	LWLockAcquire(statLock, LW_SHARED);
+	hash_seq_init(&status, connStats);
+	while ((entry = hash_seq_search(&status)) != NULL)
+	{
+		statConnEntry tmp;
+		Datum		values[12];
+		bool		nulls[12];
+		Datum		hist[STAT_HIST_BUCKETS];
+		int			i = 0;
+		int			b;
+
+		SpinLockAcquire(&entry->mutex);
+		tmp = *entry;
+		SpinLockRelease(&entry->mutex);
+
+		memset(nulls, 0, sizeof(nulls));
+		if (tmp.key.conname[0])
+			values[i++] = CStringGetTextDatum(tmp.key.conname);
+		else
+			nulls[i++] = true;
+		values[i++] = CStringGetTextDatum(tmp.key.host);
+		values[i++] = Int32GetDatum(tmp.key.port);
+		values[i++] = Int64GetDatum(tmp.queries);
+		values[i++] = Int64GetDatum(tmp.errors);
+		values[i++] = Int64GetDatum(tmp.reconnects);
+		values[i++] = Int64GetDatum(tmp.rows);
+		values[i++] = Int64GetDatum(tmp.bytes);
+		values[i++] = Float8GetDatum(tmp.wait_time);
+		values[i++] = Float8GetDatum(tmp.fetch_time);
+		values[i++] = Float8GetDatum(tmp.convert_time);
+		for (b = 0; b < STAT_HIST_BUCKETS; b++)
+			hist[b] = Int64GetDatum(tmp.hist[b]);
+		values[i++] = PointerGetDatum(construct_array(hist, STAT_HIST_BUCKETS, INT8OID,
+													  sizeof(int64), FLOAT8PASSBYVAL, 'd'));
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	LWLockRelease(statLock);
+
+	return (Datum) 0;
+}
+
+
+PG_FUNCTION_INFO_V1(sphinx_stat_queries);
+Datum
+sphinx_stat_queries(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore = statInitSRF(fcinfo, &tupdesc);
+	HASH_SEQ_STATUS status;
+	statQueryEntry *entry;
+
+	if (!queryStats)
+		return (Datum) 0;
+
+	LWLockAcquire(statLock, LW_SHARED);
+	hash_seq_init(&status, queryStats);
+	while ((entry = hash_seq_search(&status)) != NULL)
+	{
+		statQueryEntry tmp;
+		Datum		values[10];
+		bool		nulls[10];
+		int			i = 0;
+
+		SpinLockAcquire(&entry->mutex);
+		tmp = *entry;
+		SpinLockRelease(&entry->mutex);
+
+		memset(nulls, 0, sizeof(nulls));
+		values[i++] = CStringGetTextDatum(tmp.key.host);
+		values[i++] = Int32GetDatum(tmp.key.port);
+		values[i++] = Int64GetDatum((int64) tmp.key.queryid);
+		values[i++] = CStringGetTextDatum(tmp.query);
+		values[i++] = Int64GetDatum(tmp.calls);
+		values[i++] = Int64GetDatum(tmp.errors);
+		values[i++] = Int64GetDatum(tmp.rows);
+		values[i++] = Float8GetDatum(tmp.total_time);
+		values[i++] = Float8GetDatum(tmp.max_time);
+		if (tmp.last_meta_time >= 0)
+			values[i++] = Float8GetDatum(tmp.last_meta_time);
+		else
+			nulls[i++] = true;
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	LWLockRelease(statLock);
+
+	return (Datum) 0;
+}
+
+
+PG_FUNCTION_INFO_V1(sphinx_stat_reset);
+Datum
+sphinx_stat_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS status;
+	void	   *entry;
+
+	if (!connStats)
+		PG_RETURN_VOID();
+
+	LWLockAcquire(statLock, LW_EXCLUSIVE);
+
+	hash_seq_init(&status, connStats);
+	while ((entry = hash_seq_search(&status)) != NULL)
+		hash_search(connStats, entry, HASH_REMOVE, NULL);
+
+	hash_seq_init(&status, queryStats);
+	while ((entry = hash_seq_search(&status)) != NULL)
+		hash_search(queryStats, entry, HASH_REMOVE, NULL);
+
+	LWLockRelease(statLock);
+
+	PG_RETURN_VOID();
+}
@@ -0,0 +1,1139 @@
+/*
+ * sphinx_sync.c
+ *
+ * Change feed that keeps Sphinx RT indexes in sync with tables.
+ *
+ * The library doubles as a logical decoding output plugin named
+ * "sphinxlink".  For the tables listed in its "tables" option it emits the
+ * document id of every inserted, updated or deleted row and a record for
+ * every truncation, followed by a commit record carrying the commit time of
+ * each transaction that touched them.
+ *
+ * With sphinxlink.sync_database set, a background worker connected to that
+ * database peeks the changes of the sphinxlink.sync_slot slot for the tables
+ * in sphinx_sync_map and coalesces them per document id.  Ids whose row is
+ * gone are removed from the index with DELETE, the others are written from
+ * the current row with REPLACE; a truncated table empties its index with
+ * TRUNCATE RTINDEX first.  Only then is the slot advanced, so after an error
+ * or a restart the same changes are applied again, which does no harm as all
+ * of these statements are idempotent.
+ *
+ * Deletes only carry the document id if the id column is part of the
+ * table's replica identity, so sphinx_sync_map rejects tables where it isn't.
+ *
+ * contrib/sphinxlink/sphinx_sync.c
+ */
+#include "postgres.h"
+
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "funcapi.h"
+#include "access/htup_details.h"
+#include "access/relation.h"
+#include "access/sysattr.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "catalog/pg_type.h"
+#include "commands/trigger.h"
+#include "executor/spi.h"
+#include "portability/instr_time.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "replication/logical.h"
+#include "replication/output_plugin.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "tcop/tcopprot.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/pg_lsn.h"
+#include "utils/rel.h"
+#include "utils/relcache.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+#include <sphinxlink.h>
+
+#define SYNC_ERRLEN			256
+#define SYNC_STATEMENT_ROWS	1000	/* rows per REPLACE, ids per DELETE */
+
+#define SLOT_QUERY \
+	"SELECT confirmed_flush_lsn, plugin FROM pg_catalog.pg_replication_slots WHERE slot_name = $1"
+
+#if (PG_VERSION_NUM >= 170000)
+#define CHANGE_TUPLE(t) (t)
+#else
+#define CHANGE_TUPLE(t) ((t) ? &(t)->tuple : NULL)
+#endif
+
+#if (PG_VERSION_NUM >= 150000)
+#define COMMIT_TIME(txn) ((txn)->xact_time.commit_time)
+#define FLUSH_PTR() GetFlushRecPtr(NULL)
+#else
+#define COMMIT_TIME(txn) ((txn)->commit_time)
+#define FLUSH_PTR() GetFlushRecPtr()
+#endif
+
+/* Table watched by the output plugin */
+typedef struct syncTable
+{
+	Oid			relid;
+	AttrNumber	attnum;			/* of the document id */
+} syncTable;
+
+typedef struct syncDecodingData
+{
+	syncTable  *tables;
+	int			ntables;
+	bool		xact_wrote;		/* current transaction emitted a change */
+} syncDecodingData;
+
+/* Row of sphinx_sync_map and the ids changed in it during a round */
+typedef struct syncMap
+{
+	Oid			relid;
+	char	   *relname;
+	char	   *host;
+	int			port;
+	char	   *index;
+	AttrNumber	attnum;
+	char	   *id_column;
+	char	   *columns;		/* select list, NULL for all columns */
+	int64	   *ids;
+	int			nids;
+	int			maxids;
+	bool		truncated;		/* the table was truncated during the round */
+} syncMap;
+
+typedef struct syncCounters
+{
+	int64		changes;
+	int64		replaced;
+	int64		deleted;
+	int64		statements;
+} syncCounters;
+
+/* Worker status in shared memory, shown by sphinx_sync_status */
+typedef struct syncState
+{
+	slock_t		mutex;
+	pid_t		pid;
+	XLogRecPtr	applied_lsn;
+	TimestampTz last_commit_time;	/* of the last applied transaction */
+	TimestampTz last_apply_time;
+	double		apply_lag;		/* ms from that commit until it was applied */
+	double		rate;			/* changes per second in the last busy round */
+	int64		changes;
+	int64		replaced;
+	int64		deleted;
+	int64		statements;
+	int64		errors;
+	TimestampTz last_error_time;
+	char		last_error[SYNC_ERRLEN];
+} syncState;
+
+/* GUC variables */
+static char *sphinx_sync_database = NULL;
+static char *sphinx_sync_slot = NULL;
+static int	sphinx_sync_naptime = 1000;
+static int	sphinx_sync_batch_size = 10000;
+
+static syncState *syncStatus = NULL;
+static MemoryContext syncContext = NULL;
+
+#if (PG_VERSION_NUM >= 150000)
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+PGDLLEXPORT void sphinx_sync_main(Datum main_arg);
+
+static void syncShmemRequest(void);
+static void syncShmemStartup(void);
+static void syncWorkerExit(int code, Datum arg);
+static bool syncRound(void);
+static bool applyChanges(void);
+static syncMap *loadMap(int *nmaps);
+static AttrNumber checkMapTable(Oid relid, const char *id_column);
+static XLogRecPtr ensureSlot(void);
+static uint64 peekChanges(syncMap *maps, int nmaps, XLogRecPtr upto, XLogRecPtr *last_lsn,
+						  TimestampTz *last_commit, syncCounters *counters);
+static void applyMap(syncMap *map, syncCounters *counters);
+static int	compareIds(const void *a, const void *b);
+
+static void syncStartup(LogicalDecodingContext *ctx, OutputPluginOptions *opt, bool is_init);
+static void syncBegin(LogicalDecodingContext *ctx, ReorderBufferTXN *txn);
+static void syncChange(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+					   Relation relation, ReorderBufferChange *change);
+static void syncCommit(LogicalDecodingContext *ctx, ReorderBufferTXN *txn, XLogRecPtr commit_lsn);
+static void syncTruncate(LogicalDecodingContext *ctx, ReorderBufferTXN *txn, int nrelations,
+						 Relation relations[], ReorderBufferChange *change);
+static void emitId(LogicalDecodingContext *ctx, Relation relation, syncTable *table,
+				   HeapTuple tuple);
+
+
+/*
+ * Define the change feed GUCs and start the worker if sync_database is set.
+ * Only does anything from shared_preload_libraries.
+ */
+void
+sphinxSyncInit(void)
+{
+	BackgroundWorker worker;
+
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	DefineCustomStringVariable("sphinxlink.sync_database",
+							   "Database whose tables are kept in sync with Sphinx RT indexes.",
+							   "Empty disables the change feed worker.",
+							   &sphinx_sync_database,
+							   "",
+							   PGC_POSTMASTER,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomStringVariable("sphinxlink.sync_slot",
+							   "Logical replication slot consumed by the change feed worker.",
+							   "The slot is created on first use.",
+							   &sphinx_sync_slot,
+							   "sphinxlink_sync",
+							   PGC_POSTMASTER,
+							   0,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	DefineCustomIntVariable("sphinxlink.sync_naptime",
+							"Sleep time of the change feed worker when there are no changes.",
+							NULL,
+							&sphinx_sync_naptime,
+							1000,
+							10,
+							INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_MS,
+							NULL,
+							NULL,
+							NULL);
+
+	DefineCustomIntVariable("sphinxlink.sync_batch_size",
+							"Number of changes the change feed worker applies at once.",
+							NULL,
+							&sphinx_sync_batch_size,
+							10000,
+							1,
+							INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL,
+							NULL,
+							NULL);
+
+	if (sphinx_sync_database[0] == '\0')
+		return;
+
+#if (PG_VERSION_NUM >= 150000)
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = syncShmemRequest;
+#else
+	syncShmemRequest();
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = syncShmemStartup;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = 5;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "sphinxlink");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "sphinx_sync_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "sphinxlink sync");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "sphinxlink sync");
+	RegisterBackgroundWorker(&worker);
+}
+
+
+static void
+syncShmemRequest(void)
+{
+#if (PG_VERSION_NUM >= 150000)
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	RequestAddinShmemSpace(sizeof(syncState));
+}
+
+
+static void
+syncShmemStartup(void)
+{
+	bool		found;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	syncStatus = ShmemInitStruct("sphinxlink sync", sizeof(syncState), &found);
+	if (!found)
+	{
+		memset(syncStatus, 0, sizeof(syncState));
+		SpinLockInit(&syncStatus->mutex);
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+
+/*
+ * Change feed worker entry point
+ */
+void
+sphinx_sync_main(Datum main_arg)
+{
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnection(sphinx_sync_database, NULL, 0);
+
+	syncContext = AllocSetContextCreate(TopMemoryContext,
+										"sphinxlink sync",
+										ALLOCSET_DEFAULT_SIZES);
+
+	SpinLockAcquire(&syncStatus->mutex);
+	syncStatus->pid = MyProcPid;
+	SpinLockRelease(&syncStatus->mutex);
+
+	before_shmem_exit(syncWorkerExit, (Datum) 0);
+
+	for (;;)
+	{
+		bool		more;
+
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending)
+		{
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		more = syncRound();
+
+		/* a full batch means there is more to apply right away */
+		if (!more)
+		{
+			(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+							 sphinx_sync_naptime, PG_WAIT_EXTENSION);
+			ResetLatch(MyLatch);
+		}
+	}
+}
+
+
+static void
+syncWorkerExit(int code, Datum arg)
+{
+	SpinLockAcquire(&syncStatus->mutex);
+	syncStatus->pid = 0;
+	SpinLockRelease(&syncStatus->mutex);
+}
+
+
+/*
+ * Apply one batch of changes.  An error is logged and recorded in the
+ * status, and the batch is retried after sync_naptime.
+ */
+static bool
+syncRound(void)
+{
+	bool		more = false;
+
+	PG_TRY();
+	{
+		more = applyChanges();
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		EmitErrorReport();
+		MemoryContextSwitchTo(syncContext);
+		edata = CopyErrorData();
+		FlushErrorState();
+		AbortCurrentTransaction();
+
+		SpinLockAcquire(&syncStatus->mutex);
+		syncStatus->errors++;
+		syncStatus->last_error_time = GetCurrentTimestamp();
+		strlcpy(syncStatus->last_error, edata->message, SYNC_ERRLEN);
+		SpinLockRelease(&syncStatus->mutex);
+	}
+	PG_END_TRY();
+
+	MemoryContextReset(syncContext);
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	return more;
+}
+
+
+/*
+ * Read up to sync_batch_size changes from the slot, write them to the
+ * indexes and advance the slot past them.  Returns true if the batch was
+ * full.
+ */
+static bool
+applyChanges(void)
+{
+	syncMap    *maps;
+	int			nmaps;
+	int			i;
+	syncCounters counters;
+	XLogRecPtr	confirmed;
+	XLogRecPtr	upto;
+	XLogRecPtr	target;
+	XLogRecPtr	last_lsn = InvalidXLogRecPtr;
+	TimestampTz last_commit = 0;
+	TimestampTz now;
+	bool		more;
+	instr_time	start;
+	instr_time	elapsed;
+
+	INSTR_TIME_SET_CURRENT(start);
+	memset(&counters, 0, sizeof(counters));
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	if (SPI_connect() != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed");
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "sphinxlink sync");
+
+	maps = loadMap(&nmaps);
+	if (nmaps == 0)
+	{
+		SPI_finish();
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+		return false;
+	}
+
+	confirmed = ensureSlot();
+
+	/*
+	 * Decoding up to the flushed end of WAL returns every transaction that
+	 * committed before it, so unless the batch is cut short the slot can be
+	 * moved there even if the last of them didn't touch mapped tables.
+	 */
+	upto = FLUSH_PTR();
+	more = peekChanges(maps, nmaps, upto, &last_lsn, &last_commit, &counters) >=
+		(uint64) sphinx_sync_batch_size;
+	target = more ? last_lsn : upto;
+
+	for (i = 0; i < nmaps; i++)
+	{
+		if (maps[i].nids > 0 || maps[i].truncated)
+			applyMap(&maps[i], &counters);
+	}
+
+	if (target > confirmed)
+	{
+		Oid			argtypes[2] = {NAMEOID, LSNOID};
+		Datum		values[2];
+
+		values[0] = DirectFunctionCall1(namein, CStringGetDatum(sphinx_sync_slot));
+		values[1] = LSNGetDatum(target);
+		if (SPI_execute_with_args("SELECT pg_catalog.pg_replication_slot_advance($1, $2)",
+								  2, argtypes, values, NULL, false, 0) != SPI_OK_SELECT)
+			elog(ERROR, "could not advance replication slot \"%s\"", sphinx_sync_slot);
+	}
+
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+
+	INSTR_TIME_SET_CURRENT(elapsed);
+	INSTR_TIME_SUBTRACT(elapsed, start);
+	now = GetCurrentTimestamp();
+
+	SpinLockAcquire(&syncStatus->mutex);
+	if (target > syncStatus->applied_lsn)
+		syncStatus->applied_lsn = target;
+	if (last_commit != 0)
+	{
+		syncStatus->last_commit_time = last_commit;
+		syncStatus->last_apply_time = now;
+		syncStatus->apply_lag = (double) (now - last_commit) / 1000.0;
+	}
+	if (counters.changes > 0)
+		syncStatus->rate = counters.changes / Max(INSTR_TIME_GET_DOUBLE(elapsed), 0.001);
+	syncStatus->changes += counters.changes;
+	syncStatus->replaced += counters.replaced;
+	syncStatus->deleted += counters.deleted;
+	syncStatus->statements += counters.statements;
+	SpinLockRelease(&syncStatus->mutex);
+
+	return more;
+}
+
+
+/*
+ * Read sphinx_sync_map.  Returns nothing while the extension isn't installed
+ * in the sync database.
+ */
+static syncMap *
+loadMap(int *nmaps)
+{
+	StringInfoData sql;
+	syncMap    *maps;
+	uint64		i;
+
+	*nmaps = 0;
+	if (SPI_execute("SELECT extnamespace::pg_catalog.regnamespace FROM pg_catalog.pg_extension "
+					"WHERE extname = 'sphinxlink'", true, 1) != SPI_OK_SELECT)
+		elog(ERROR, "could not read pg_extension");
+	if (SPI_processed == 0)
+		return NULL;
+
+	initStringInfo(&sql);
+	appendStringInfo(&sql,
+					 "SELECT relid, relid::pg_catalog.text, host, port, index, id_column, columns "
+					 "FROM %s.sphinx_sync_map",
+					 SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1));
+
+	if (SPI_execute(sql.data, true, 0) != SPI_OK_SELECT)
+		elog(ERROR, "could not read sphinx_sync_map");
+
+	maps = (syncMap *) palloc0(Max(SPI_processed, 1) * sizeof(syncMap));
+	for (i = 0; i < SPI_processed; i++)
+	{
+		HeapTuple	tuple = SPI_tuptable->vals[i];
+		TupleDesc	tupdesc = SPI_tuptable->tupdesc;
+		syncMap    *map = &maps[i];
+		bool		isnull;
+
+		map->relid = DatumGetObjectId(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+		map->relname = SPI_getvalue(tuple, tupdesc, 2);
+		map->host = SPI_getvalue(tuple, tupdesc, 3);
+		map->port = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 4, &isnull));
+		map->index = SPI_getvalue(tuple, tupdesc, 5);
+		map->id_column = SPI_getvalue(tuple, tupdesc, 6);
+		map->columns = SPI_getvalue(tuple, tupdesc, 7);
+
+		/* the replica identity may have changed since the row was added */
+		map->attnum = checkMapTable(map->relid, map->id_column);
+	}
+	*nmaps = (int) SPI_processed;
+
+	return maps;
+}
+
+
+/*
+ * Check that id_column of relid can serve as document id: it must be an
+ * integer, and part of the replica identity so that deletes are decoded
+ * with it.  Returns its attribute number.
+ */
+static AttrNumber
+checkMapTable(Oid relid, const char *id_column)
+{
+	Relation	rel;
+	AttrNumber	attnum;
+	Oid			atttypid;
+
+	rel = try_relation_open(relid, AccessShareLock);
+	if (!rel)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_TABLE),
+				 errmsg("relation with OID %u does not exist", relid)));
+
+	attnum = get_attnum(relid, id_column);
+	if (attnum == InvalidAttrNumber)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_COLUMN),
+				 errmsg("column \"%s\" of relation \"%s\" does not exist",
+						id_column, RelationGetRelationName(rel))));
+
+	atttypid = get_atttype(relid, attnum);
+	if (atttypid != INT2OID && atttypid != INT4OID && atttypid != INT8OID)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("document id column \"%s\" of relation \"%s\" must be of an integer type",
+						id_column, RelationGetRelationName(rel))));
+
+	if (rel->rd_rel->relreplident != REPLICA_IDENTITY_FULL &&
+		!bms_is_member(attnum - FirstLowInvalidHeapAttributeNumber,
+					   RelationGetIndexAttrBitmap(rel, INDEX_ATTR_BITMAP_IDENTITY_KEY)))
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("document id column \"%s\" of relation \"%s\" is not part of its replica identity",
+						id_column, RelationGetRelationName(rel)),
+				 errhint("Give the table a primary key or replica identity index that includes the column, "
+						 "or set REPLICA IDENTITY FULL.")));
+
+	relation_close(rel, AccessShareLock);
+
+	return attnum;
+}
+
+
+/*
+ * Trigger on sphinx_sync_map rejecting tables the worker can't keep in sync
+ */
+PG_FUNCTION_INFO_V1(sphinx_sync_map_check);
+Datum
+sphinx_sync_map_check(PG_FUNCTION_ARGS)
+{
+	TriggerData *trigdata = (TriggerData *) fcinfo->context;
+	HeapTuple	tuple;
+	TupleDesc	tupdesc;
+	bool		isnull;
+	Datum		relid;
+	Datum		id_column;
+
+	if (!CALLED_AS_TRIGGER(fcinfo) || !TRIGGER_FIRED_FOR_ROW(trigdata->tg_event))
+		elog(ERROR, "sphinx_sync_map_check must be called as a row trigger");
+
+	tuple = TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event) ?
+		trigdata->tg_newtuple : trigdata->tg_trigtuple;
+	tupdesc = RelationGetDescr(trigdata->tg_relation);
+
+	relid = heap_getattr(tuple, SPI_fnumber(tupdesc, "relid"), tupdesc, &isnull);
+	id_column = heap_getattr(tuple, SPI_fnumber(tupdesc, "id_column"), tupdesc, &isnull);
+	checkMapTable(DatumGetObjectId(relid), NameStr(*DatumGetName(id_column)));
+
+	return PointerGetDatum(tuple);
+}
+
+
+/*
+ * Create the slot if it doesn't exist yet and return how far it is confirmed
+ */
+static XLogRecPtr
+ensureSlot(void)
+{
+	Oid			argtype = NAMEOID;
+	Datum		value = DirectFunctionCall1(namein, CStringGetDatum(sphinx_sync_slot));
+	char	   *plugin;
+	bool		isnull;
+	Datum		lsn;
+
+	if (SPI_execute_with_args(SLOT_QUERY, 1, &argtype, &value, NULL, true, 1) != SPI_OK_SELECT)
+		elog(ERROR, "could not read pg_replication_slots");
+
+	if (SPI_processed == 0)
+	{
+		if (SPI_execute_with_args("SELECT pg_catalog.pg_create_logical_replication_slot($1, 'sphinxlink')",
+								  1, &argtype, &value, NULL, false, 1) != SPI_OK_SELECT)
+			elog(ERROR, "could not create replication slot \"%s\"", sphinx_sync_slot);
+		ereport(LOG,
+				(errmsg("sphinxlink sync created replication slot \"%s\"", sphinx_sync_slot)));
+
+		if (SPI_execute_with_args(SLOT_QUERY, 1, &argtype, &value, NULL, true, 1) != SPI_OK_SELECT ||
+			SPI_processed == 0)
+			elog(ERROR, "could not read pg_replication_slots");
+	}
+
+	plugin = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 2);
+	if (!plugin || strcmp(plugin, "sphinxlink") != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("replication slot \"%s\" does not use the sphinxlink output plugin",
+						sphinx_sync_slot)));
+
+	lsn = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
+
+	return isnull ? InvalidXLogRecPtr : DatumGetLSN(lsn);
+}
+
+
+/*
+ * Collect the ids changed up to upto into maps.  Returns the number of rows
+ * decoded; *last_lsn is set to the end of the last transaction returned.
+ */
+static uint64
+peekChanges(syncMap *maps, int nmaps, XLogRecPtr upto, XLogRecPtr *last_lsn,
+			TimestampTz *last_commit, syncCounters *counters)
+{
+	StringInfoData tables;
+	Oid			argtypes[4] = {NAMEOID, LSNOID, INT4OID, TEXTOID};
+	Datum		values[4];
+	uint64		i;
+	int			m;
+
+	initStringInfo(&tables);
+	for (m = 0; m < nmaps; m++)
+		appendStringInfo(&tables, "%s%u:%d", m ? "," : "", maps[m].relid, maps[m].attnum);
+
+	values[0] = DirectFunctionCall1(namein, CStringGetDatum(sphinx_sync_slot));
+	values[1] = LSNGetDatum(upto);
+	values[2] = Int32GetDatum(sphinx_sync_batch_size);
+	values[3] = CStringGetTextDatum(tables.data);
+
+	if (SPI_execute_with_args("SELECT lsn, data FROM pg_catalog.pg_logical_slot_peek_changes($1, $2, $3, "
+							  "'tables', $4)",
+							  4, argtypes, values, NULL, false, 0) != SPI_OK_SELECT)
+		elog(ERROR, "could not read changes from replication slot \"%s\"", sphinx_sync_slot);
+
+	for (i = 0; i < SPI_processed; i++)
+	{
+		HeapTuple	tuple = SPI_tuptable->vals[i];
+		bool		isnull;
+		XLogRecPtr	lsn = DatumGetLSN(SPI_getbinval(tuple, SPI_tuptable->tupdesc, 1, &isnull));
+		char	   *data = SPI_getvalue(tuple, SPI_tuptable->tupdesc, 2);
+		char	   *end;
+		Oid			relid;
+		int64		id;
+
+		/* "C <commit time>" ends a transaction */
+		if (data[0] == 'C')
+		{
+			*last_commit = (TimestampTz) strtoll(data + 2, NULL, 10);
+			*last_lsn = lsn;
+			continue;
+		}
+
+		/* "T <relid>" for a truncation */
+		if (data[0] == 'T')
+		{
+			relid = (Oid) strtoul(data + 2, NULL, 10);
+			counters->changes++;
+			for (m = 0; m < nmaps; m++)
+			{
+				if (maps[m].relid == relid)
+					maps[m].truncated = true;
+			}
+			continue;
+		}
+
+		/* "<relid> <id>" */
+		relid = (Oid) strtoul(data, &end, 10);
+		id = (int64) strtoll(end, NULL, 10);
+		counters->changes++;
+
+		for (m = 0; m < nmaps; m++)
+		{
+			syncMap    *map = &maps[m];
+
+			if (map->relid != relid)
+				continue;
+			if (map->nids == map->maxids)
+			{
+				map->maxids = Max(map->maxids * 2, 64);
+				map->ids = map->ids ?
+					(int64 *) repalloc(map->ids, map->maxids * sizeof(int64)) :
+					(int64 *) palloc(map->maxids * sizeof(int64));
+			}
+			map->ids[map->nids++] = id;
+			break;
+		}
+	}
+
+	return SPI_processed;
+}
+
+
+/*
+ * Bring the documents of map's changed ids up to date: delete those whose
+ * row is gone, then replace the rest from their current rows.  Deleting
+ * first means a row inserted in between is still written by the REPLACE;
+ * a row deleted in between shows up again in a later batch.  If the table
+ * was truncated the index is emptied before that; rows inserted after the
+ * truncation are among the changed ids and written again.
+ */
+static void
+applyMap(syncMap *map, syncCounters *counters)
+{
+	remoteConn *rconn = sphinxGetConnection(map->host, map->port);
+	const char *relname;
+	const char *idcol = quote_identifier(map->id_column);
+	Oid			argtype = INT8ARRAYOID;
+	Datum	   *elems;
+	Datum		ids;
+	StringInfoData sql;
+	SPIPlanPtr	plan;
+	Portal		portal;
+	sphinxBulkResult result;
+	SPITupleTable *tuptable;
+	uint64		ndeleted;
+	uint64		i;
+	int			nids = 0;
+	int			j;
+
+	if (!get_rel_name(map->relid))
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_TABLE),
+				 errmsg("relation with OID %u does not exist", map->relid)));
+	relname = quote_qualified_identifier(get_namespace_name(get_rel_namespace(map->relid)),
+										 get_rel_name(map->relid));
+
+	initStringInfo(&sql);
+	if (map->truncated)
+	{
+		appendStringInfoString(&sql, "TRUNCATE RTINDEX ");
+		sphinxAppendIdentifier(&sql, map->index);
+		if (sphinxExecQuery(rconn, sql.data) != 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+					 errmsg("Could not execute query: %s", mysql_error(rconn->conn))));
+		counters->statements++;
+		if (map->nids == 0)
+			return;
+	}
+
+	/* coalesce the changes per document */
+	qsort(map->ids, map->nids, sizeof(int64), compareIds);
+	elems = (Datum *) palloc(map->nids * sizeof(Datum));
+	for (j = 0; j < map->nids; j++)
+	{
+		if (j == 0 || map->ids[j] != map->ids[j - 1])
+			elems[nids++] = Int64GetDatum(map->ids[j]);
+	}
+	ids = PointerGetDatum(construct_array(elems, nids, INT8OID,
+										  sizeof(int64), FLOAT8PASSBYVAL, 'd'));
+
+	resetStringInfo(&sql);
+	appendStringInfo(&sql,
+					 "SELECT id FROM pg_catalog.unnest($1) AS id "
+					 "EXCEPT SELECT %s::pg_catalog.int8 FROM %s WHERE %s = ANY ($1)",
+					 idcol, relname, idcol);
+	if (SPI_execute_with_args(sql.data, 1, &argtype, &ids, NULL, true, 0) != SPI_OK_SELECT)
+		elog(ERROR, "SPI_execute(\"%s\") failed", sql.data);
+	tuptable = SPI_tuptable;
+	ndeleted = SPI_processed;
+
+	for (i = 0; i < ndeleted; i += SYNC_STATEMENT_ROWS)
+	{
+		uint64		k;
+
+		resetStringInfo(&sql);
+		appendStringInfoString(&sql, "DELETE FROM ");
+		sphinxAppendIdentifier(&sql, map->index);
+		appendStringInfoString(&sql, " WHERE id IN (");
+		for (k = i; k < ndeleted && k < i + SYNC_STATEMENT_ROWS; k++)
+		{
+			bool		isnull;
+
+			appendStringInfo(&sql, "%s" INT64_FORMAT, k > i ? "," : "",
+							 DatumGetInt64(SPI_getbinval(tuptable->vals[k],
+														 tuptable->tupdesc, 1, &isnull)));
+		}
+		appendStringInfoChar(&sql, ')');
+
+		if (sphinxExecQuery(rconn, sql.data) != 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+					 errmsg("Could not execute query: %s", mysql_error(rconn->conn))));
+		counters->deleted += (int64) mysql_affected_rows(rconn->conn);
+		counters->statements++;
+	}
+
+	resetStringInfo(&sql);
+	appendStringInfo(&sql, "SELECT %s FROM %s WHERE %s = ANY ($1)",
+					 map->columns ? map->columns : "*", relname, idcol);
+	if (!(plan = SPI_prepare(sql.data, 1, &argtype)))
+		elog(ERROR, "SPI_prepare(\"%s\") failed: %s", sql.data,
+			 SPI_result_code_string(SPI_result));
+	if (!(portal = SPI_cursor_open(NULL, plan, &ids, NULL, true)))
+		elog(ERROR, "SPI_cursor_open(\"%s\") failed: %s", sql.data,
+			 SPI_result_code_string(SPI_result));
+
+	SPI_freetuptable(tuptable);
+
+	sphinxBulkLoad(rconn, map->index, portal, SYNC_STATEMENT_ROWS, true, &result);
+	SPI_cursor_close(portal);
+
+	counters->replaced += result.rows;
+	counters->statements += result.statements;
+}
+
+
+static int
+compareIds(const void *a, const void *b)
+{
+	int64		x = *(const int64 *) a;
+	int64		y = *(const int64 *) b;
+
+	return (x > y) - (x < y);
+}
+
+
+PG_FUNCTION_INFO_V1(sphinx_sync_status);
+Datum
+sphinx_sync_status(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	syncState	tmp;
+	Datum		values[15];
+	bool		nulls[15];
+	int			i = 0;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (!syncStatus)
+		PG_RETURN_NULL();
+
+	SpinLockAcquire(&syncStatus->mutex);
+	tmp = *syncStatus;
+	SpinLockRelease(&syncStatus->mutex);
+
+	memset(nulls, 0, sizeof(nulls));
+	if (tmp.pid != 0)
+		values[i++] = Int32GetDatum(tmp.pid);
+	else
+		nulls[i++] = true;
+	values[i++] = CStringGetTextDatum(sphinx_sync_slot);
+	if (tmp.applied_lsn != InvalidXLogRecPtr)
+	{
+		XLogRecPtr	flush = FLUSH_PTR();
+
+		values[i++] = LSNGetDatum(tmp.applied_lsn);
+		values[i++] = Int64GetDatum(flush > tmp.applied_lsn ? (int64) (flush - tmp.applied_lsn) : 0);
+	}
+	else
+	{
+		nulls[i++] = true;
+		nulls[i++] = true;
+	}
+	if (tmp.last_commit_time != 0)
+	{
+		values[i++] = TimestampTzGetDatum(tmp.last_commit_time);
+		values[i++] = TimestampTzGetDatum(tmp.last_apply_time);
+		values[i++] = Float8GetDatum(tmp.apply_lag);
+	}
+	else
+	{
+		nulls[i++] = true;
+		nulls[i++] = true;
+		nulls[i++] = true;
+	}
+	values[i++] = Int64GetDatum(tmp.changes);
+	values[i++] = Int64GetDatum(tmp.replaced);
+	values[i++] = Int64GetDatum(tmp.deleted);
+	values[i++] = Int64GetDatum(tmp.statements);
+	values[i++] = Float8GetDatum(tmp.rate);
+	values[i++] = Int64GetDatum(tmp.errors);
+	if (tmp.errors > 0)
+	{
+		values[i++] = CStringGetTextDatum(tmp.last_error);
+		values[i++] = TimestampTzGetDatum(tmp.last_error_time);
+	}
+	else
+	{
+		nulls[i++] = true;
+		nulls[i++] = true;
+	}
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+
+/*
+ * Output plugin
+ */
+void
+_PG_output_plugin_init(OutputPluginCallbacks *cb)
+{
+	cb->startup_cb = syncStartup;
+	cb->begin_cb = syncBegin;
+	cb->change_cb = syncChange;
+	cb->truncate_cb = syncTruncate;
+	cb->commit_cb = syncCommit;
+}
+
+
+/*
+ * Parse the "tables" option, a comma separated list of relid:attnum pairs
+ * naming each table and its document id column.
+ */
+static void
+syncStartup(LogicalDecodingContext *ctx, OutputPluginOptions *opt, bool is_init)
+{
+	syncDecodingData *data;
+	ListCell   *lc;
+
+	data = (syncDecodingData *) MemoryContextAllocZero(ctx->context, sizeof(syncDecodingData));
+	opt->output_type = OUTPUT_PLUGIN_TEXTUAL_OUTPUT;
+
+	foreach(lc, ctx->output_plugin_options)
+	{
+		DefElem    *elem = (DefElem *) lfirst(lc);
+		const char *p;
+		int			n = 1;
+
+		if (strcmp(elem->defname, "tables") != 0 || elem->arg == NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("option \"%s\" is unknown", elem->defname)));
+
+		for (p = strVal(elem->arg); *p; p++)
+		{
+			if (*p == ',')
+				n++;
+		}
+		data->tables = (syncTable *) MemoryContextAlloc(ctx->context, n * sizeof(syncTable));
+		data->ntables = 0;
+
+		p = strVal(elem->arg);
+		while (*p)
+		{
+			syncTable  *table = &data->tables[data->ntables];
+			char	   *end;
+
+			table->relid = (Oid) strtoul(p, &end, 10);
+			if (end == p || *end != ':')
+				break;
+			p = end + 1;
+			table->attnum = (AttrNumber) strtol(p, &end, 10);
+			if (end == p || (*end != ',' && *end != '\0'))
+				break;
+			p = (*end == ',') ? end + 1 : end;
+			data->ntables++;
+		}
+		if (*p)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid value for option \"tables\": \"%s\"", strVal(elem->arg))));
+	}
+
+	ctx->output_plugin_private = data;
+}
+
+
+static void
+syncBegin(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
+{
+	((syncDecodingData *) ctx->output_plugin_private)->xact_wrote = false;
+}
+
+
+static void
+syncChange(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+		   Relation relation, ReorderBufferChange *change)
+{
+	syncDecodingData *data = (syncDecodingData *) ctx->output_plugin_private;
+	syncTable  *table = NULL;
+	int			i;
+
+	for (i = 0; i < data->ntables; i++)
+	{
+		if (data->tables[i].relid == RelationGetRelid(relation))
+		{
+			table = &data->tables[i];
+			break;
+		}
+	}
+	if (!table)
+		return;
+
+	switch (change->action)
+	{
+		case REORDER_BUFFER_CHANGE_INSERT:
+			emitId(ctx, relation, table, CHANGE_TUPLE(change->data.tp.newtuple));
+			break;
+		case REORDER_BUFFER_CHANGE_UPDATE:
+			/* the old key is only there if the update changed it */
+			emitId(ctx, relation, table, CHANGE_TUPLE(change->data.tp.newtuple));
+			emitId(ctx, relation, table, CHANGE_TUPLE(change->data.tp.oldtuple));
+			break;
+		case REORDER_BUFFER_CHANGE_DELETE:
+			emitId(ctx, relation, table, CHANGE_TUPLE(change->data.tp.oldtuple));
+			break;
+		default:
+			break;
+	}
+}
+
+
+/*
+ * Emit "T <relid>" for every watched table among relations
+ */
+static void
+syncTruncate(LogicalDecodingContext *ctx, ReorderBufferTXN *txn, int nrelations,
+			 Relation relations[], ReorderBufferChange *change)
+{
+	syncDecodingData *data = (syncDecodingData *) ctx->output_plugin_private;
+	int			r;
+	int			i;
+
+	for (r = 0; r < nrelations; r++)
+	{
+		for (i = 0; i < data->ntables; i++)
+		{
+			if (data->tables[i].relid != RelationGetRelid(relations[r]))
+				continue;
+
+			OutputPluginPrepareWrite(ctx, true);
+			appendStringInfo(ctx->out, "T %u", data->tables[i].relid);
+			OutputPluginWrite(ctx, true);
+			data->xact_wrote = true;
+			break;
+		}
+	}
+}
+
+
+/*
+ * Emit "<relid> <id>" for the document id of tuple
+ */
+static void
+emitId(LogicalDecodingContext *ctx, Relation relation, syncTable *table, HeapTuple tuple)
+{
+	TupleDesc	tupdesc = RelationGetDescr(relation);
+	Datum		value;
+	bool		isnull;
+	int64		id;
+
+	if (!tuple || table->attnum < 1 || table->attnum > tupdesc->natts)
+		return;
+
+	value = heap_getattr(tuple, table->attnum, tupdesc, &isnull);
+	if (isnull)
+		return;
+
+	switch (TupleDescAttr(tupdesc, table->attnum - 1)->atttypid)
+	{
+		case INT2OID:
+			id = DatumGetInt16(value);
+			break;
+		case INT4OID:
+			id = DatumGetInt32(value);
+			break;
+		case INT8OID:
+			id = DatumGetInt64(value);
+			break;
+		default:
+			return;
+	}
+
+	OutputPluginPrepareWrite(ctx, true);
+	appendStringInfo(ctx->out, "%u " INT64_FORMAT, table->relid, id);
+	OutputPluginWrite(ctx, true);
+
+	((syncDecodingData *) ctx->output_plugin_private)->xact_wrote = true;
+}
+
+
+/*
+ * Emit "C <commit time>" after the changes of a transaction
+ */
+static void
+syncCommit(LogicalDecodingContext *ctx, ReorderBufferTXN *txn, XLogRecPtr commit_lsn)
+{
+	if (!((syncDecodingData *) ctx->output_plugin_private)->xact_wrote)
+		return;
+
+	OutputPluginPrepareWrite(ctx, true);
+	appendStringInfo(ctx->out, "C " INT64_FORMAT, (int64) COMMIT_TIME(txn));
+	OutputPluginWrite(ctx, true);
+}
@@ -0,0 +1,273 @@
+/*
+ * sphinx_template.c
+ *
+ * Query templates for sphinx_prepare() and sphinx_execute().
+ *
+ * A template is parsed once into literal parts and parameter references, so
+ * executing it only has to append the parts and the formatted arguments to
+ * the output buffer.
+ *
+ * contrib/sphinxlink/sphinx_template.c
+ */
+#include "postgres.h"
+
+#include <ctype.h>
+
+#include "catalog/pg_type.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+#include <sphinxlink.h>
+
+static void addPart(sphinxTemplate *templ, int *maxparts, int offset, int len, int param);
+static void appendArray(StringInfo buf, ArrayType *array);
+
+
+/*
+ * Parse sql into templ.  Placeholders are either all ? (numbered in order
+ * of appearance) or all $n; those inside quoted strings are left alone.
+ * Everything is allocated in a new context, templ->cxt.
+ */
+void
+sphinxParseTemplate(sphinxTemplate *templ, const char *sql)
+{
+	MemoryContext oldcontext;
+	const char *p;
+	int			start = 0;
+	int			maxparts = 8;
+	int			nqmarks = 0;
+	bool		dollars = false;
+
+	templ->cxt = AllocSetContextCreate(TopMemoryContext,
+									   "sphinxlink template",
+									   ALLOCSET_SMALL_SIZES);
+	oldcontext = MemoryContextSwitchTo(templ->cxt);
+
+	PG_TRY();
+	{
+		templ->sql = pstrdup(sql);
+		templ->nparts = 0;
+		templ->nparams = 0;
+		templ->parts = (templatePart *) palloc(maxparts * sizeof(templatePart));
+
+		for (p = templ->sql; *p; p++)
+		{
+			int			param = 0;
+			const char *end = p + 1;
+
+			if (*p == '\'' || *p == '"' || *p == '`')
+			{
+				char		quote = *p;
+
+				for (p++; *p && *p != quote; p++)
+				{
+					if (*p == '\\' && p[1])
+						p++;
+				}
+				if (!*p)
+					ereport(ERROR,
+							(errcode(ERRCODE_SYNTAX_ERROR),
+							 errmsg("unterminated quoted string in template")));
+				continue;
+			}
+			else if (*p == '?')
+				param = ++nqmarks;
+			else if (*p == '$' && isdigit((unsigned char) p[1]))
+			{
+				char	   *endptr;
+				long		n = strtol(p + 1, &endptr, 10);
+
+				if (n < 1 || n > FUNC_MAX_ARGS)
+					ereport(ERROR,
+							(errcode(ERRCODE_UNDEFINED_PARAMETER),
+							 errmsg("there is no parameter $%ld", n)));
+				param = (int) n;
+				end = endptr;
+				dollars = true;
+			}
+			else
+				continue;
+
+			if (dollars && nqmarks > 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("template cannot mix ? and $n placeholders")));
+
+			addPart(templ, &maxparts, start, (p - templ->sql) - start, param);
+			templ->nparams = Max(templ->nparams, param);
+			start = end - templ->sql;
+			p = end - 1;
+		}
+		addPart(templ, &maxparts, start, (p - templ->sql) - start, 0);
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(oldcontext);
+		MemoryContextDelete(templ->cxt);
+		templ->cxt = NULL;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+
+static void
+addPart(sphinxTemplate *templ, int *maxparts, int offset, int len, int param)
+{
+	templatePart *part;
+
+	if (templ->nparts == *maxparts)
+	{
+		*maxparts *= 2;
+		templ->parts = (templatePart *) repalloc(templ->parts, *maxparts * sizeof(templatePart));
+	}
+
+	part = &templ->parts[templ->nparts++];
+	part->offset = offset;
+	part->len = len;
+	part->param = param;
+}
+
+
+/*
+ * Append templ with its placeholders replaced by args to buf.  Numbers are
+ * written as they are, strings quoted and escaped, timestamps as unix time
+ * and arrays as comma separated lists, to be used in IN (?).
+ */
+void
+sphinxFormatTemplate(StringInfo buf, sphinxTemplate *templ,
+					 Datum *args, Oid *types, bool *nulls)
+{
+	int			i;
+
+	for (i = 0; i < templ->nparts; i++)
+	{
+		templatePart *part = &templ->parts[i];
+		int			n = part->param - 1;
+
+		appendBinaryStringInfo(buf, templ->sql + part->offset, part->len);
+		if (part->param == 0)
+			continue;
+
+		if (nulls[n])
+			appendStringInfoString(buf, "NULL");
+		else
+			sphinxAppendValue(buf, args[n], types[n]);
+	}
+}
+
+
+/*
+ * Append a single non-NULL value as a SphinxQL literal.
+ */
+void
+sphinxAppendValue(StringInfo buf, Datum value, Oid type)
+{
+	char		num[32];
+	Oid			outfunc;
+	bool		isvarlena;
+
+	switch (type)
+	{
+		case INT2OID:
+			pg_lltoa(DatumGetInt16(value), num);
+			appendStringInfoString(buf, num);
+			return;
+		case INT4OID:
+			pg_lltoa(DatumGetInt32(value), num);
+			appendStringInfoString(buf, num);
+			return;
+		case INT8OID:
+			pg_lltoa(DatumGetInt64(value), num);
+			appendStringInfoString(buf, num);
+			return;
+		case BOOLOID:
+			appendStringInfoChar(buf, DatumGetBool(value) ? '1' : '0');
+			return;
+		case FLOAT4OID:
+		case FLOAT8OID:
+		case NUMERICOID:
+			{
+				char	   *str;
+
+				getTypeOutputInfo(type, &outfunc, &isvarlena);
+				str = OidOutputFunctionCall(outfunc, value);
+				if (!isdigit((unsigned char) str[strlen(str) - 1]))
+					ereport(ERROR,
+							(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+							 errmsg("cannot pass \"%s\" to Sphinx", str)));
+				appendStringInfoString(buf, str);
+				return;
+			}
+		case TIMESTAMPOID:
+			value = DirectFunctionCall1(timestamp_timestamptz, value);
+			/* FALLTHROUGH */
+		case TIMESTAMPTZOID:
+			{
+				TimestampTz ts = DatumGetTimestampTz(value);
+
+				if (TIMESTAMP_NOT_FINITE(ts))
+					ereport(ERROR,
+							(errcode(ERRCODE_DATETIME_VALUE_OUT_OF_RANGE),
+							 errmsg("cannot pass infinite timestamp to Sphinx")));
+				pg_lltoa((ts / USECS_PER_SEC) +
+						 (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY -
+						 (ts < 0 && ts % USECS_PER_SEC != 0 ? 1 : 0), num);
+				appendStringInfoString(buf, num);
+				return;
+			}
+		default:
+			break;
+	}
+
+	if (type_is_array(type))
+	{
+		appendArray(buf, DatumGetArrayTypeP(value));
+		return;
+	}
+
+	/* anything else is a string */
+	getTypeOutputInfo(type, &outfunc, &isvarlena);
+	sphinxAppendEscapedString(buf, OidOutputFunctionCall(outfunc, value));
+}
+
+
+static void
+appendArray(StringInfo buf, ArrayType *array)
+{
+	Oid			elemtype = ARR_ELEMTYPE(array);
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+	Datum	   *elems;
+	bool	   *nulls;
+	int			nelems;
+	int			i;
+
+	get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+	deconstruct_array(array, elemtype, typlen, typbyval, typalign,
+					  &elems, &nulls, &nelems);
+
+	/* IN () is a syntax error */
+	if (nelems == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("cannot pass an empty array to Sphinx")));
+
+	for (i = 0; i < nelems; i++)
+	{
+		if (i > 0)
+			appendStringInfoString(buf, ", ");
+		if (nulls[i])
+			appendStringInfoString(buf, "NULL");
+		else
+			sphinxAppendValue(buf, elems[i], elemtype);
+	}
+
+	pfree(elems);
+	pfree(nulls);
+}
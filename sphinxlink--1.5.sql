@@ -0,0 +1,293 @@
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION sphinxlink" to load this file. \quit
+
+CREATE FUNCTION sphinx_connect(text, text DEFAULT '127.0.0.1', int DEFAULT 9306, options text DEFAULT '')
+RETURNS text
+AS 'MODULE_PATHNAME','sphinx_connect'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION sphinx_disconnect(text)
+RETURNS text
+AS 'MODULE_PATHNAME', 'sphinx_disconnect'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION sphinx_connect_group(conname text, replicas text[], options text DEFAULT '')
+RETURNS text
+AS 'MODULE_PATHNAME', 'sphinx_connect_group'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION sphinx_replicas(conname text, OUT host text, OUT port integer, OUT active boolean,
+                                OUT healthy boolean, OUT latency float8, OUT errors integer,
+                                OUT queries bigint, OUT failures bigint, OUT hedges bigint)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'sphinx_replicas'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION sphinx_connections(OUT conname text, OUT host text, OUT port integer, OUT options text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'sphinx_connections'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION sphinx_query(text, text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'sphinx_query'
+LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+CREATE FUNCTION sphinx_query(text, text, text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'sphinx_query'
+LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+CREATE FUNCTION sphinx_query_json(text, text)
+RETURNS jsonb
+AS 'MODULE_PATHNAME', 'sphinx_query_json'
+LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+CREATE FUNCTION sphinx_query_json(text, text, text)
+RETURNS jsonb
+AS 'MODULE_PATHNAME', 'sphinx_query_json'
+LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+CREATE FUNCTION sphinx_send_query(conname text, query text)
+RETURNS integer
+AS 'MODULE_PATHNAME', 'sphinx_send_query'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION sphinx_send_query(conname text, query text, match_clause text)
+RETURNS integer
+AS 'MODULE_PATHNAME', 'sphinx_send_query'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION sphinx_is_busy(conname text)
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'sphinx_is_busy'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION sphinx_get_result(conname text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'sphinx_get_result'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION sphinx_query_params(text, integer, text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'sphinx_query'
+LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+CREATE FUNCTION sphinx_query_params(text, integer, text, text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'sphinx_query'
+LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+CREATE FUNCTION sphinx_query_support(internal)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'sphinx_query_support'
+LANGUAGE C STRICT;
+
+-- planner support functions exist since PostgreSQL 12
+DO $$
+BEGIN
+  IF current_setting('server_version_num')::integer >= 120000 THEN
+    ALTER FUNCTION sphinx_query(text, text) SUPPORT sphinx_query_support;
+    ALTER FUNCTION sphinx_query(text, text, text) SUPPORT sphinx_query_support;
+    ALTER FUNCTION sphinx_query_params(text, integer, text) SUPPORT sphinx_query_support;
+    ALTER FUNCTION sphinx_query_params(text, integer, text, text) SUPPORT sphinx_query_support;
+  END IF;
+END
+$$;
+
+CREATE FUNCTION sphinx_prepare(conname text, name text, query text)
+RETURNS text
+AS 'MODULE_PATHNAME', 'sphinx_prepare'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION sphinx_execute(conname text, name text)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'sphinx_execute'
+LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+CREATE FUNCTION sphinx_execute(conname text, name text, VARIADIC "any")
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'sphinx_execute'
+LANGUAGE C PARALLEL RESTRICTED;
+
+CREATE FUNCTION sphinx_query_batch(conname text, statements text[])
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'sphinx_query_batch'
+LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+CREATE FUNCTION sphinx_bulk_replace(conname text, index text, query text, batch_size integer DEFAULT 1000,
+                                    replace boolean DEFAULT true, OUT rows bigint, OUT affected bigint,
+                                    OUT statements bigint, OUT bytes bigint, OUT elapsed double precision,
+                                    OUT wait_time double precision)
+RETURNS record
+AS 'MODULE_PATHNAME', 'sphinx_bulk_replace'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION sphinx_bulk_replace(conname text, index text, cursor refcursor, batch_size integer DEFAULT 1000,
+                                    replace boolean DEFAULT true, OUT rows bigint, OUT affected bigint,
+                                    OUT statements bigint, OUT bytes bigint, OUT elapsed double precision,
+                                    OUT wait_time double precision)
+RETURNS record
+AS 'MODULE_PATHNAME', 'sphinx_bulk_replace'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION sphinx_queue_write(conname text, query text)
+RETURNS void
+AS 'MODULE_PATHNAME', 'sphinx_queue_write'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION sphinx_queue_write(conname text, index text, document record)
+RETURNS void
+AS 'MODULE_PATHNAME', 'sphinx_queue_write'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION sphinx_queue_delete(conname text, index text, id bigint)
+RETURNS void
+AS 'MODULE_PATHNAME', 'sphinx_queue_delete'
+LANGUAGE C STRICT;
+
+CREATE TABLE sphinx_sync_map (
+  relid regclass PRIMARY KEY,
+  host text NOT NULL DEFAULT '127.0.0.1',
+  port integer NOT NULL DEFAULT 9306,
+  index text NOT NULL,
+  id_column name NOT NULL DEFAULT 'id',
+  columns text
+);
+
+SELECT pg_catalog.pg_extension_config_dump('sphinx_sync_map', '');
+
+CREATE FUNCTION sphinx_sync_map_check()
+RETURNS trigger
+AS 'MODULE_PATHNAME', 'sphinx_sync_map_check'
+LANGUAGE C;
+
+CREATE TRIGGER sphinx_sync_map_check BEFORE INSERT OR UPDATE ON sphinx_sync_map
+  FOR EACH ROW EXECUTE FUNCTION sphinx_sync_map_check();
+
+CREATE FUNCTION sphinx_sync_status(OUT pid integer, OUT slot text, OUT applied_lsn pg_lsn, OUT lag_bytes bigint,
+                                   OUT last_commit_time timestamptz, OUT last_apply_time timestamptz,
+                                   OUT apply_lag double precision, OUT changes bigint, OUT replaced bigint,
+                                   OUT deleted bigint, OUT statements bigint, OUT changes_per_sec double precision,
+                                   OUT errors bigint, OUT last_error text, OUT last_error_time timestamptz)
+RETURNS record
+AS 'MODULE_PATHNAME', 'sphinx_sync_status'
+LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+CREATE VIEW sphinx_sync_status AS
+  SELECT * FROM sphinx_sync_status();
+
+CREATE FUNCTION sphinx_query_multi(connnames text[], query text, sort_key text DEFAULT NULL,
+                                   max_rows integer DEFAULT NULL, allow_partial boolean DEFAULT false)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'sphinx_query_multi'
+LANGUAGE C PARALLEL RESTRICTED;
+
+CREATE FUNCTION sphinx_query_all(conname text, query text, page_size integer DEFAULT 1000)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'sphinx_query_all'
+LANGUAGE C STRICT PARALLEL SAFE;
+
+CREATE FUNCTION sphinx_snippets(conname text, index text, docs text[], match text, options jsonb DEFAULT '{}')
+RETURNS SETOF text
+AS 'MODULE_PATHNAME', 'sphinx_snippets'
+LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+CREATE FUNCTION sphinx_snippets(conname text, index text, docs_query text, match text, options jsonb DEFAULT '{}')
+RETURNS SETOF text
+AS 'MODULE_PATHNAME', 'sphinx_snippets'
+LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+CREATE FUNCTION sphinx_cache_invalidate(pattern text DEFAULT NULL)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'sphinx_cache_invalidate'
+LANGUAGE C PARALLEL RESTRICTED;
+
+REVOKE ALL ON FUNCTION sphinx_cache_invalidate(text) FROM PUBLIC;
+
+CREATE FUNCTION sphinx_cache_stats(OUT entries bigint, OUT bytes bigint, OUT hits bigint,
+                                   OUT misses bigint, OUT inserts bigint, OUT evictions bigint,
+                                   OUT invalidations bigint)
+RETURNS record
+AS 'MODULE_PATHNAME', 'sphinx_cache_stats'
+LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+CREATE VIEW sphinx_cache_stats AS
+  SELECT * FROM sphinx_cache_stats();
+
+CREATE FUNCTION sphinx_stat_connections(OUT conname text, OUT host text, OUT port integer,
+                                        OUT queries bigint, OUT errors bigint, OUT reconnects bigint,
+                                        OUT rows bigint, OUT bytes bigint, OUT wait_time double precision,
+                                        OUT fetch_time double precision, OUT convert_time double precision,
+                                        OUT latency_histogram bigint[])
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'sphinx_stat_connections'
+LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+CREATE VIEW sphinx_stat_connections AS
+  SELECT * FROM sphinx_stat_connections();
+
+CREATE FUNCTION sphinx_stat_queries(OUT host text, OUT port integer, OUT queryid bigint, OUT query text,
+                                    OUT calls bigint, OUT errors bigint, OUT rows bigint,
+                                    OUT total_time double precision, OUT max_time double precision,
+                                    OUT last_meta_time double precision)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'sphinx_stat_queries'
+LANGUAGE C STRICT PARALLEL RESTRICTED;
+
+CREATE VIEW sphinx_stat_queries AS
+  SELECT * FROM sphinx_stat_queries();
+
+CREATE FUNCTION sphinx_stat_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'sphinx_stat_reset'
+LANGUAGE C PARALLEL RESTRICTED;
+
+REVOKE ALL ON FUNCTION sphinx_stat_reset() FROM PUBLIC;
+
+CREATE FUNCTION sphinx_meta(conname text)
+RETURNS TABLE (varname text, value text)
+AS
+$$
+BEGIN
+  RETURN QUERY
+    SELECT * FROM sphinx_query(conname, 'SHOW META') AS ss (varname text, value text);
+END;
+$$
+LANGUAGE plpgsql;
+
+CREATE FUNCTION sphinx_meta(host text, port integer)
+RETURNS TABLE (varname text, value text)
+AS
+$$
+BEGIN
+  RETURN QUERY
+    SELECT * FROM sphinx_query_params(host, port, 'SHOW META') AS ss (varname text, value text);
+END;
+$$
+LANGUAGE plpgsql;
+
+CREATE FUNCTION sphinx_fdw_handler()
+RETURNS fdw_handler
+AS 'MODULE_PATHNAME', 'sphinx_fdw_handler'
+LANGUAGE C STRICT;
+
+CREATE FUNCTION sphinx_fdw_validator(text[], oid)
+RETURNS void
+AS 'MODULE_PATHNAME', 'sphinx_fdw_validator'
+LANGUAGE C STRICT;
+
+CREATE FOREIGN DATA WRAPPER sphinx_fdw
+  HANDLER sphinx_fdw_handler
+  VALIDATOR sphinx_fdw_validator;
+
+CREATE FUNCTION sphinx_match(anyelement, text)
+RETURNS boolean
+AS 'MODULE_PATHNAME', 'sphinx_match'
+LANGUAGE C STRICT PARALLEL SAFE;
+
+CREATE OPERATOR ==> (
+  LEFTARG = anyelement,
+  RIGHTARG = text,
+  PROCEDURE = sphinx_match
+);
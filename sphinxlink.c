@@ -28,18 +28,45 @@
  *
  */
 #include "postgres.h"
+#include "access/parallel.h"
 #include "parser/scansup.h"
 #include "utils/builtins.h"
 #include "mb/pg_wchar.h"
 #include "miscadmin.h"
 #include "funcapi.h"
+#include "pgstat.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_type.h"
+#include "common/int.h"
+#include "executor/executor.h"
+#include "executor/tuptable.h"
+#include "portability/instr_time.h"
+#include "parser/parse_oper.h"
+#if (PG_VERSION_NUM >= 160000)
+#include "port/simd.h"
+#endif
+#include "storage/latch.h"
+#include "utils/array.h"
+#include "utils/jsonb.h"
+#include "utils/numeric.h"
+#include "utils/timestamp.h"
+#include "utils/tuplesort.h"
+#include "utils/guc.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sphinxlink.h>
 
 PG_MODULE_MAGIC;
 
-#define MAXHOSTLEN 1024
 #define NUMCONN 32
 
+/* port of replicas given without one to sphinx_connect_group() */
+#define DEFAULT_SPHINX_PORT 9306
+
+/* connect timeout of the side connection cancelling a query, in seconds */
+#define KILL_CONNECT_TIMEOUT 5
+
 #define safe_free(_ptr, _freed) \
 do { \
 	if ((_ptr) && (_freed)) \
@@ -47,25 +74,48 @@ do { \
 	(_ptr) = NULL; \
 } while (0)
 
-/* Global Module Structures */
-typedef struct remoteConn
-{
-	MYSQL	   *conn;				/* Hold the remote connection */
-	int			port;				/* Sphinx port for connection */
-	char		host[MAXHOSTLEN];	/* Host for connection */
-} remoteConn;
-
-
 typedef struct storeInfo
 {
 	FunctionCallInfo fcinfo;
 	Tuplestorestate *tuplestore;
-	AttInMetadata *attinmeta;
+	convPlan   *plan;
 	MemoryContext tmpcontext;
-	char	  **cstrs;
+	StringInfo	capture;		/* serialized rows for the result cache */
+	unsigned int capture_nfields;
+	sphinxQueryStats *stats;	/* counters for sphinx_stat.c, or NULL */
 } storeInfo;
 
 
+/* Add the time since start to a sinfo->stats field, if stats are on */
+#define STAT_TIMER_START(sinfo, start) \
+do { \
+	if ((sinfo)->stats) \
+		INSTR_TIME_SET_CURRENT(start); \
+} while (0)
+
+#define STAT_TIMER_ADD(sinfo, field, start) \
+do { \
+	if ((sinfo)->stats) \
+	{ \
+		instr_time	_end; \
+		INSTR_TIME_SET_CURRENT(_end); \
+		INSTR_TIME_SUBTRACT(_end, (start)); \
+		(sinfo)->stats->field += INSTR_TIME_GET_MILLISEC(_end); \
+	} \
+} while (0)
+
+
+/* One connection of sphinx_query_multi() */
+typedef struct multiNode
+{
+	char	   *name;			/* connection name */
+	remoteConn *rconn;
+	MYSQL	   *conn;
+	bool		pending;		/* query sent, result not read yet */
+	int			event_pos;		/* of its socket in the wait event set */
+} multiNode;
+
+
 typedef struct remoteConnHashEnt
 {
 	char		name[NAMEDATALEN];
@@ -87,17 +137,27 @@ do { \
 		pconn->conn = NULL; \
 		pconn->port = 0; \
 		pconn->host[0] = '\0'; \
+		memset(&pconn->options, 0, sizeof(sphinxConnOptions)); \
+		pconn->templates = NULL; \
+		pconn->max_packet = 0; \
+		pconn->pending = false; \
+		pconn->answered = false; \
+		pconn->answer = NIL; \
+		pconn->answer_error = NULL; \
+		pconn->group = NULL; \
+		pconn->api = NULL; \
 	} \
 } while (0)
 
 
-#define SPHINXLINK_GETCONN \
+/* a SphinxAPI connection has no conn, see sphinx_api.c */
+#define SPHINXLINK_GETANYCONN \
 do { \
 	conname = text_to_cstring(tconname); \
 	rconn = getConnectionByName(conname); \
 	if (rconn) \
 		conn = rconn->conn; \
-	if (!conn && conname) \
+	if (!conn && !(rconn && rconn->api) && conname) \
 	{ \
 		ereport(ERROR, \
 				(errcode(ERRCODE_CONNECTION_DOES_NOT_EXIST), \
@@ -106,23 +166,164 @@ do { \
 } while (0)
 
 
+#define SPHINXLINK_GETCONN \
+do { \
+	SPHINXLINK_GETANYCONN; \
+	checkSphinxQL(rconn, conname); \
+} while (0)
+
+
 /* Static functions declaration */
 static TupleDesc createTemplateTupleDescImpl(int nargs);
 static void prepTuplestoreResult(FunctionCallInfo fcinfo);
-static void materializeQueryResult(FunctionCallInfo fcinfo, MYSQL *conn, const char *sql, const char *match_clause);
-static void storeRow(volatile storeInfo *sinfo, MYSQL_ROW row, unsigned int nfields, bool first);
-static bool storeQueryResult(volatile storeInfo *sinfo, MYSQL *conn, const char *sql, const char *match_clause);
+static void materializeQueryResult(FunctionCallInfo fcinfo, const char *conname, remoteConn *rconn,
+								   const char *host, int port, const char *sql,
+								   const char *match_clause, const char *statquery);
+static void reportQueryStats(volatile storeInfo *sinfo, const char *conname, const char *host, int port,
+							 const char *statquery, instr_time start, bool error);
+static double fetchMetaTime(remoteConn *rconn);
+static char *formatMatchQuery(const char *sql, const char *match_clause);
+static void storeRow(volatile storeInfo *sinfo, MYSQL_ROW row, unsigned long *lengths, unsigned int nfields, bool first);
+static bool storeQueryResult(volatile storeInfo *sinfo, remoteConn *rconn, const char *query);
+static void storeResultSets(volatile storeInfo *sinfo, remoteConn *rconn);
+static void storePooledResult(volatile storeInfo *sinfo, const char *host, int port, const char *query);
+static void storeCachedResult(volatile storeInfo *sinfo, const char *rows, Size rowslen, unsigned int nfields);
+static void captureRow(volatile storeInfo *sinfo, MYSQL_ROW row, unsigned long *lengths, unsigned int nfields);
+static void initStoreResult(volatile storeInfo *sinfo);
+static void materializeBatchResult(FunctionCallInfo fcinfo, remoteConn *rconn, const char *sql,
+								   char **stmts, int nstmts);
+static void materializeAllResult(FunctionCallInfo fcinfo, const char *conname, remoteConn *rconn,
+								const char *sql, int page_size);
+static bool isKeywordAt(const char *ptr, const char *kw);
+static bool checkPagedQuery(const char *sql);
+static void formatPageQuery(StringInfo buf, const char *sql, int len, bool has_where,
+							const int64 *last_id, int page_size);
+static int	findIdColumn(MYSQL_RES *res);
+static void sendPageQuery(remoteConn *rconn, const char *query);
+static void storeBatchResult(volatile storeInfo *sinfo, remoteConn *rconn, const char *sql);
+static void storeBatchRow(volatile storeInfo *sinfo, int stmt, MYSQL_ROW row, unsigned long *lengths,
+						  unsigned int nfields);
+static void convertRow(convPlan *plan, MYSQL_ROW row, unsigned long *lengths, unsigned int nfields);
 static remoteConn *getConnectionByName(const char *name);
 static HTAB *createConnHash(void);
-static void createNewConnection(const char *name, const char *host, const int port);
+static void freeTemplates(remoteConn *rconn);
+static remoteConn *addConnection(const char *name, MYSQL *conn, const char *host, const int port,
+								 const sphinxConnOptions *options);
+static void createNewConnection(const char *name, const char *host, const int port,
+								const sphinxConnOptions *options);
+static void parseConnOptions(const char *str, sphinxConnOptions *options);
+static void formatConnOptions(StringInfo buf, const sphinxConnOptions *options);
+static void publishConnections(void);
+static void syncPublishedConnections(void);
+static void connectionsExecutorStart(QueryDesc *queryDesc, int eflags);
+static void appendEscapedField(StringInfo buf, const char *str);
+static char *nextEscapedField(char **str);
+static remoteConn *openPublishedConnection(const char *name);
+static int	parsePublishedAddress(const char *name, const char *host, const char *port);
+static remoteConn *openPublishedGroup(const char *name, char *replicas,
+									  const sphinxConnOptions *options);
+static remoteConn *addGroupConnection(const char *name, int nreplicas, char **hosts, int *ports,
+									  const sphinxConnOptions *options);
 static bool connectionExists(const char *name);
 static void deleteConnection(const char *name);
-static char *toMyDatabaseEncoding(const char *value);
-static char *toUTF8Encoding(const char *value);
+static convPlan *getConvPlan(FmgrInfo *flinfo, TupleDesc tupdesc);
+static bool parseInt64(const char *value, unsigned long length, int64 *result);
+static char *toMyDatabaseEncoding(convPlan *plan, char *value, unsigned long *length);
+static inline bool isAscii(const char *value, size_t length);
+static void abortQueryResult(MYSQL *conn, MYSQL_RES *res);
+static void materializeMultiResult(FunctionCallInfo fcinfo, multiNode *nodes, int nnodes, const char *sql,
+								   const char *sort_key, int max_rows, bool allow_partial);
+static Tuplesortstate *beginMultiSort(TupleDesc tupdesc, const char *sort_key, int max_rows);
+static WaitEventSet *createNodeWaitSet(multiNode *nodes, int nnodes);
+static multiNode *waitForAnyNode(WaitEventSet *set);
+static void reportNodeError(multiNode *node, bool allow_partial);
+static void discardPendingResult(MYSQL *conn);
+static void discardResultSets(MYSQL *conn);
+static void readAnswer(remoteConn *rconn);
+static void resetAnswer(remoteConn *rconn);
+static void waitForResult(remoteConn *rconn);
+static Jsonb *queryResultToJsonb(remoteConn *rconn, const char *query);
+static Jsonb *resultSetToJsonb(MYSQL *conn, MYSQL_RES *res, convPlan *plan);
+static void jsonbColumnValue(JsonbValue *v, MYSQL_FIELD *field, char *value, unsigned long length,
+							 convPlan *plan);
+static bool setKeepalives(MYSQL *conn, const sphinxConnOptions *options, char **errmsg);
+static void checkSphinxQL(remoteConn *rconn, const char *conname);
+static void storeApiResult(volatile storeInfo *sinfo, remoteConn *rconn, char **queries,
+						   int nqueries, bool batch);
+
+void _PG_init(void);
 
 /* Module variables declaration */
 static remoteConn *pconn = NULL;
 static HTAB *remoteConnHash = NULL;
+static StringInfo executeBuffer = NULL;	/* query text of sphinx_execute() */
+
+/* GUC variables */
+static bool sphinx_stream_results = true;
+static bool sphinx_typed_conversion = true;
+static char *sphinx_connections_desc = NULL;	/* see publishConnections() */
+
+/* what sphinxlink.connections should hold, see syncPublishedConnections() */
+static char *publishedConnections = NULL;
+static ExecutorStart_hook_type prev_ExecutorStart = NULL;
+
+
+/*
+ * Module load callback
+ */
+void
+_PG_init(void)
+{
+	DefineCustomBoolVariable("sphinxlink.stream_results",
+							 "Fetch rows from Sphinx one at a time instead of buffering the whole result set.",
+							 "When off, the full result set is received by the client library "
+							 "before the first row is stored.",
+							 &sphinx_stream_results,
+							 true,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable("sphinxlink.typed_conversion",
+							 "Parse numeric, boolean and timestamp columns without calling type input functions.",
+							 "When off, every column goes through its type input function.",
+							 &sphinx_typed_conversion,
+							 true,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomStringVariable("sphinxlink.connections",
+							   "Connections opened with sphinx_connect(), for parallel workers.",
+							   "Maintained by sphinx_connect() and sphinx_disconnect().",
+							   &sphinx_connections_desc,
+							   "",
+							   PGC_SUSET,
+							   GUC_NO_SHOW_ALL | GUC_NOT_IN_SAMPLE | GUC_NO_RESET_ALL,
+							   NULL,
+							   NULL,
+							   NULL);
+
+	sphinxPoolInit();
+	sphinxCacheInit();
+	sphinxStatInit();
+	sphinxSyncInit();
+	sphinxJoinInit();
+	sphinxEstimateInit();
+
+	prev_ExecutorStart = ExecutorStart_hook;
+	ExecutorStart_hook = connectionsExecutorStart;
+
+#if (PG_VERSION_NUM >= 150000)
+	MarkGUCPrefixReserved("sphinxlink");
+#else
+	EmitWarningsOnPlaceholders("sphinxlink");
+#endif
+}
 
 
 PG_FUNCTION_INFO_V1(sphinx_connect);
@@ -134,6 +335,7 @@ sphinx_connect(PG_FUNCTION_ARGS)
 	char	   *conname = NULL;
 	char	   *host = NULL;
 	int			port;
+	sphinxConnOptions options;
 
 	SPHINXLINK_INIT;
 
@@ -141,15 +343,113 @@ sphinx_connect(PG_FUNCTION_ARGS)
 	host = text_to_cstring(thost);
 	port = PG_GETARG_INT32(2);
 
+	/* the options argument is missing before version 1.5 */
+	memset(&options, 0, sizeof(options));
+	if (PG_NARGS() > 3)
+		parseConnOptions(text_to_cstring(PG_GETARG_TEXT_PP(3)), &options);
+
 	PG_FREE_IF_COPY(tconname, 0);
 	PG_FREE_IF_COPY(thost, 1);
 
+	if (options.hedge_delay || options.eject_errors || options.eject_time)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("hedge_delay, eject_errors and eject_time are options of replica groups"),
+				 errhint("Connect to replicas with sphinx_connect_group().")));
+	if (options.api && options.compress)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("compress is not an option of SphinxAPI connections")));
+
+	if (connectionExists(conname))
+		ereport(ERROR,
+				(errcode(ERRCODE_DUPLICATE_OBJECT),
+				 errmsg("duplicate connection name")));
+
+	createNewConnection(conname, host, port, &options);
+	publishConnections();
+
+	PG_RETURN_TEXT_P(cstring_to_text("OK"));
+}
+
+
+/*
+ * sphinx_connect_group(conname, replicas, options): one connection name for
+ * several replicas given as 'host:port', see sphinx_group.c
+ */
+PG_FUNCTION_INFO_V1(sphinx_connect_group);
+Datum
+sphinx_connect_group(PG_FUNCTION_ARGS)
+{
+	char	   *conname = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	ArrayType  *replicas = PG_GETARG_ARRAYTYPE_P(1);
+	sphinxConnOptions options;
+	Datum	   *elems;
+	bool	   *nulls;
+	int			nelems;
+	char	  **hosts;
+	int		   *ports;
+	int			i;
+
+	SPHINXLINK_INIT;
+
+	memset(&options, 0, sizeof(options));
+	parseConnOptions(text_to_cstring(PG_GETARG_TEXT_PP(2)), &options);
+	if (options.socket[0])
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("socket is not an option of replica groups")));
+	if (options.api)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("replica groups use the SphinxQL protocol")));
+
+	deconstruct_array(replicas, TEXTOID, -1, false, 'i', &elems, &nulls, &nelems);
+	if (nelems == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("a replica group needs at least one replica")));
+
+	hosts = (char **) palloc(nelems * sizeof(char *));
+	ports = (int *) palloc(nelems * sizeof(int));
+	for (i = 0; i < nelems; i++)
+	{
+		char	   *colon;
+		char	   *end;
+		long		port = DEFAULT_SPHINX_PORT;
+
+		if (nulls[i])
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("replicas must not be null")));
+
+		hosts[i] = TextDatumGetCString(elems[i]);
+		if ((colon = strrchr(hosts[i], ':')))
+		{
+			*colon = '\0';
+			errno = 0;
+			port = strtol(colon + 1, &end, 10);
+			if (errno || *end || end == colon + 1 || port <= 0 || port > 65535)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("invalid replica \"%s:%s\"", hosts[i], colon + 1),
+						 errhint("Replicas are given as host:port.")));
+		}
+		if (hosts[i][0] == '\0' || strlen(hosts[i]) >= MAXHOSTLEN)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid replica \"%s\"", TextDatumGetCString(elems[i])),
+					 errhint("Replicas are given as host:port.")));
+		ports[i] = (int) port;
+	}
+
 	if (connectionExists(conname))
 		ereport(ERROR,
 				(errcode(ERRCODE_DUPLICATE_OBJECT),
 				 errmsg("duplicate connection name")));
 
-	createNewConnection(conname, host, port);
+	addGroupConnection(conname, nelems, hosts, ports, &options);
+	publishConnections();
 
 	PG_RETURN_TEXT_P(cstring_to_text("OK"));
 }
@@ -165,14 +465,23 @@ sphinx_disconnect(PG_FUNCTION_ARGS)
 	MYSQL	   *conn = NULL;
 
 	SPHINXLINK_INIT;
-	SPHINXLINK_GETCONN;
+	SPHINXLINK_GETANYCONN;
 
-	mysql_close(conn);
+	/* conn is one of the replicas of a group */
+	if (rconn && rconn->group)
+		sphinxFreeGroup(rconn->group);
+	else if (rconn && rconn->api)
+		sphinxApiClose(rconn->api);
+	else
+		mysql_close(conn);
 	conn = NULL;
 	if (rconn)
 	{
 		deleteConnection(conname);
+		resetAnswer(rconn);
+		freeTemplates(rconn);
 		pfree(rconn);
+		publishConnections();
 	}
 	else
 		pconn->conn = NULL;
@@ -192,7 +501,7 @@ sphinx_connections(PG_FUNCTION_ARGS)
 	int					max_calls;
 	TupleDesc			tupdesc;
 	AttInMetadata	   *attinmeta;
-	char			   *values[3];
+	char			   *values[4];
 
 	/* stuff done only on the first call of the function */
 	if (SRF_IS_FIRSTCALL())
@@ -219,13 +528,15 @@ sphinx_connections(PG_FUNCTION_ARGS)
 		 * generate attribute metadata needed later to produce tuples from raw
 		 * C strings
 		 */
-		tupdesc = createTemplateTupleDescImpl(3);
+		tupdesc = createTemplateTupleDescImpl(4);
 		TupleDescInitEntry(tupdesc, (AttrNumber) 1, "connname",
 						   TEXTOID, -1, 0);
 		TupleDescInitEntry(tupdesc, (AttrNumber) 2, "host",
 						   TEXTOID, -1, 0);
 		TupleDescInitEntry(tupdesc, (AttrNumber) 3, "port",
 						   INT4OID, -1, 0);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 4, "options",
+						   TEXTOID, -1, 0);
 
 		attinmeta = TupleDescGetAttInMetadata(tupdesc);
 		funcctx->attinmeta = attinmeta;
@@ -246,6 +557,7 @@ sphinx_connections(PG_FUNCTION_ARGS)
 		Datum		result;
 		remoteConnHashEnt *entry;
 		HASH_SEQ_STATUS status;
+		StringInfoData options;
 		int			i = 0;
 		int			j = 0;
 
@@ -265,6 +577,9 @@ sphinx_connections(PG_FUNCTION_ARGS)
 		values[j++] = psprintf("%s", entry->name);
 		values[j++] = psprintf("%s", entry->rconn->host);
 		values[j++] = psprintf("%d", entry->rconn->port);
+		initStringInfo(&options);
+		formatConnOptions(&options, &entry->rconn->options);
+		values[j++] = options.data;
 
 		hash_seq_term(&status);
 
@@ -287,6 +602,9 @@ sphinx_query(FunctionCallInfo fcinfo)
 {
 	MYSQL	   *volatile conn = NULL;
 	remoteConn *rconn = NULL;
+	char	   *conname = NULL;
+	char	   *host = NULL;
+	int			port = 0;
 	char	   *match_clause = NULL;
 	char	   *sql = NULL;
 
@@ -298,25 +616,15 @@ sphinx_query(FunctionCallInfo fcinfo)
 		 (PG_NARGS() == 4)) && (get_fn_expr_argtype(fcinfo->flinfo, 1) == INT4OID))
 	{
 		/* text, int, text, text OR text, int, text */
-		StringInfoData	conntmppl;
-		char		   *host = text_to_cstring(PG_GETARG_TEXT_PP(0));
-		int				port = PG_GETARG_INT64(1);
-
-		initStringInfo(&conntmppl);
+		host = text_to_cstring(PG_GETARG_TEXT_PP(0));
+		port = PG_GETARG_INT32(1);
 
-		appendStringInfo(&conntmppl, "sph-%s-%d", host, port);
-
-		if (!(rconn = getConnectionByName(conntmppl.data)))
+		/* with the connection pool, the pool worker connects instead */
+		if (!sphinxPoolEnabled())
 		{
-			createNewConnection(conntmppl.data, host, port);
-			rconn = getConnectionByName(conntmppl.data);
-		}
-		if (strcmp(rconn->host, host) || (rconn->port != port))
-			ereport(ERROR,
-					(errcode(ERRCODE_INTERNAL_ERROR),
-					 errmsg("connection with name \"%s\" already exists, but creadentials are different", conntmppl.data)));
-		else
+			rconn = sphinxGetConnection(host, port);
 			conn = rconn->conn;
+		}
 
 		sql = text_to_cstring(PG_GETARG_TEXT_PP(2));
 		if (PG_NARGS() == 4)
@@ -326,9 +634,10 @@ sphinx_query(FunctionCallInfo fcinfo)
 			  (PG_NARGS() == 3)) && (get_fn_expr_argtype(fcinfo->flinfo, 1) == TEXTOID))
 	{
 		text	   *tconname = PG_GETARG_TEXT_PP(0);
-		char	   *conname = NULL;
 
-		SPHINXLINK_GETCONN;
+		SPHINXLINK_GETANYCONN;
+		host = rconn->host;
+		port = rconn->port;
 
 		sql = text_to_cstring(PG_GETARG_TEXT_PP(1));
 
@@ -340,7 +649,7 @@ sphinx_query(FunctionCallInfo fcinfo)
 
 	PG_TRY();
 	{
-		materializeQueryResult(fcinfo, conn, sql, match_clause);
+		materializeQueryResult(fcinfo, conname, rconn, host, port, sql, match_clause, sql);
 	}
 	PG_CATCH();
 	{
@@ -354,374 +663,3503 @@ sphinx_query(FunctionCallInfo fcinfo)
 
 
 /*
- * Verify function caller can handle a tuplestore result, and set up for that.
- *
- * Note: if the caller returns without actually creating a tuplestore, the
- * executor will treat the function result as an empty set.
+ * sphinx_query_json(conname, sql [, match]): the result as a jsonb array of
+ * objects, built straight from the received rows without a column definition
+ * list.  A query with FACET returns an object holding the matches and one
+ * array per facet.
  */
-void
-prepTuplestoreResult(FunctionCallInfo fcinfo)
+PG_FUNCTION_INFO_V1(sphinx_query_json);
+Datum
+sphinx_query_json(PG_FUNCTION_ARGS)
 {
-	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	text	   *tconname = PG_GETARG_TEXT_PP(0);
+	char	   *sql = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	char	   *match_clause = NULL;
+	char	   *conname = NULL;
+	remoteConn *rconn = NULL;
+	MYSQL	   *conn = NULL;
+	Jsonb	   *result;
 
-	/* check to see if query supports us returning a tuplestore */
-	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("set-valued function called in context that cannot accept a set")));
-	if (!(rsinfo->allowedModes & SFRM_Materialize))
-		ereport(ERROR,
-				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-				 errmsg("materialize mode required, but it is not allowed in this context")));
+	SPHINXLINK_INIT;
+	SPHINXLINK_GETCONN;
 
-	/* let the executor know we're sending back a tuplestore */
-	rsinfo->returnMode = SFRM_Materialize;
+	if (PG_NARGS() == 3)
+		match_clause = text_to_cstring(PG_GETARG_TEXT_PP(2));
 
-	/* caller must fill these to return a non-empty result */
-	rsinfo->setResult = NULL;
-	rsinfo->setDesc = NULL;
+	result = queryResultToJsonb(rconn, formatMatchQuery(sql, match_clause));
+
+	PG_FREE_IF_COPY(tconname, 0);
+
+	PG_RETURN_JSONB_P(result);
 }
 
 
 /*
- * Execute query, and send any result rows to sinfo->tuplestore.
+ * sphinx_send_query(conname, sql [, match]): send a query and return without
+ * waiting for the answer, which sphinx_get_result() reads later.
  */
-static bool
-storeQueryResult(volatile storeInfo *sinfo,
-				 MYSQL *conn,
-				 const char *sql,
-				 const char *match_clause)
+PG_FUNCTION_INFO_V1(sphinx_send_query);
+Datum
+sphinx_send_query(PG_FUNCTION_ARGS)
 {
-	bool		first = true;
-	unsigned int nfields = 0;
-	MYSQL_RES   *res;
-	const char  *query = NULL;
-	int			ret = 0;
+	text	   *tconname = PG_GETARG_TEXT_PP(0);
+	char	   *sql = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	char	   *match_clause = NULL;
+	char	   *conname = NULL;
+	remoteConn *rconn = NULL;
+	MYSQL	   *conn = NULL;
+	const char *query;
 
-	if (match_clause)
-	{
-		StringInfoData	buff;
-		char		   *pos = NULL;
-		char		   *escaped = NULL;
+	SPHINXLINK_INIT;
+	SPHINXLINK_GETCONN;
 
-		initStringInfo(&buff);
+	if (PG_NARGS() == 3)
+		match_clause = text_to_cstring(PG_GETARG_TEXT_PP(2));
 
-		if ((pos = strstr(sql, "MATCH(?)")))
-		{
-			int			length = strlen(match_clause);
-			int			encoded_length = 0;
+	sphinxCheckIdle(rconn);
 
-			appendBinaryStringInfo(&buff, sql, (pos - sql));
+	query = sphinxToUTF8Encoding(formatMatchQuery(sql, match_clause));
+	sphinxGroupChooseReplica(rconn, query);
+	conn = rconn->conn;
+	if (sphinxSendQuery(conn, &rconn->options, query))
+	{
+		sphinxGroupReportError(rconn);
+		ereport(ERROR,
+				(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+				 errmsg("Could not send query: %s", mysql_error(conn))));
+	}
+	rconn->pending = true;
 
-			escaped = (char *) palloc(length * 2 + 1);
+	PG_FREE_IF_COPY(tconname, 0);
 
-			if ((encoded_length = mysql_real_escape_string(conn, escaped, match_clause, length)) < 0)
-				ereport(ERROR,
-						(errcode(ERRCODE_INTERNAL_ERROR),
-						 errmsg("Could not escape clause \"%s\"", match_clause)));
-			appendStringInfo(&buff, "MATCH('%s')", escaped);
-			pos += 8;
-			if (pos)
-				appendStringInfoString(&buff, pos);
-			pfree(escaped);
-		}
-		query = buff.data;
-	}
-	else
-		query = sql;
+	PG_RETURN_INT32(1);
+}
 
-	if ((ret = mysql_query(conn, toUTF8Encoding(query))))
-		ereport(ERROR,
-				(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
-				 errmsg("Could not execute query: %s", mysql_error(conn))));
 
-	res = mysql_store_result(conn);
-	nfields = mysql_num_fields(res);
+/*
+ * sphinx_is_busy(conname): whether the answer to sphinx_send_query() is still
+ * to come, so that sphinx_get_result() would wait.  searchd only starts
+ * answering once the query is done, so as soon as the socket is readable
+ * the whole answer is read into client memory; sphinx_get_result() then
+ * returns it without waiting.
+ */
+PG_FUNCTION_INFO_V1(sphinx_is_busy);
+Datum
+sphinx_is_busy(PG_FUNCTION_ARGS)
+{
+	text	   *tconname = PG_GETARG_TEXT_PP(0);
+	char	   *conname = NULL;
+	remoteConn *rconn = NULL;
+	MYSQL	   *conn = NULL;
+	int			rc;
 
-	for (;;)
-	{
-		MYSQL_ROW	row = NULL;
+	SPHINXLINK_INIT;
+	SPHINXLINK_GETCONN;
 
-		CHECK_FOR_INTERRUPTS();
+	if (!rconn->pending || rconn->answered)
+		PG_RETURN_BOOL(false);
 
-		if (!(row = mysql_fetch_row(res)))
-			break;
+	rc = WaitLatchOrSocket(NULL, WL_SOCKET_READABLE | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						   sphinxGetSocket(conn), 0, sphinxWaitEvent());
+	if (rc & WL_SOCKET_READABLE)
+		readAnswer(rconn);
 
-		/* if empty resultset, fill tuplestore header */
-		storeRow(sinfo, row, nfields, first);
-		if (first)
-			first = false;
-	}
-	if (res)
-		mysql_free_result(res);
+	PG_FREE_IF_COPY(tconname, 0);
 
-	return true;
+	PG_RETURN_BOOL(!rconn->answered);
 }
 
 
 /*
- * Send single row to sinfo->tuplestore.
+ * Read the answer to sphinx_send_query() into rconn: all of its result sets,
+ * or the error it ended with.  If reading is cancelled the query is killed
+ * and the answer dropped.
  */
 static void
-storeRow(volatile storeInfo *sinfo, MYSQL_ROW row, unsigned int nfields, bool first)
+readAnswer(remoteConn *rconn)
 {
-	HeapTuple		tuple;
-	MemoryContext	oldcontext;
-	unsigned int	i;
+	MYSQL	   *conn = rconn->conn;
+	MemoryContext oldcontext;
+	MYSQL_RES  *res;
+	int			ret;
 
-	if (first)
+	PG_TRY();
 	{
-		/* Prepare for new result set */
-		ReturnSetInfo *rsinfo = (ReturnSetInfo *) sinfo->fcinfo->resultinfo;
-		TupleDesc	tupdesc;
+		ret = sphinxReadQueryResult(rconn);
+	}
+	PG_CATCH();
+	{
+		resetAnswer(rconn);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
 
-		/*
-		 * It's possible to get more than one result set if the query string
-		 * contained multiple SQL commands.  In that case, we follow PQexec's
-		 * traditional behavior of throwing away all but the last result.
-		 */
-		if (sinfo->tuplestore)
-			tuplestore_end(sinfo->tuplestore);
-		sinfo->tuplestore = NULL;
+	if (ret)
+		sphinxGroupReportError(rconn);
 
-		/* get a tuple descriptor for our result type */
-		switch (get_call_result_type(sinfo->fcinfo, NULL, &tupdesc))
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	rconn->answered = true;
+	if (ret == 0)
+	{
+		do
 		{
-			case TYPEFUNC_COMPOSITE:
-				/* success */
-				break;
-			case TYPEFUNC_RECORD:
-				/* failed to determine actual type of RECORD */
-				ereport(ERROR,
-						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-						 errmsg("function returning record called in context "
-								"that cannot accept type record")));
-				break;
-			default:
-				/* result type isn't composite */
-				elog(ERROR, "return type must be a row type");
+			if ((res = mysql_store_result(conn)))
+				rconn->answer = lappend(rconn->answer, res);
+			else if (mysql_field_count(conn) != 0)
+			{
+				rconn->answer_error = psprintf("Could not fetch result: %s", mysql_error(conn));
+				discardResultSets(conn);
 				break;
-		}
+			}
+		} while ((ret = mysql_next_result(conn)) == 0);
+	}
+	if (ret > 0 && !rconn->answer_error)
+		rconn->answer_error = psprintf("Could not execute query: %s", mysql_error(conn));
+	MemoryContextSwitchTo(oldcontext);
+}
 
-		/* make sure we have a persistent copy of the tupdesc */
-		tupdesc = CreateTupleDescCopy(tupdesc);
 
-		/* check result and tuple descriptor have the same number of columns */
-		if (nfields != tupdesc->natts)
-			ereport(ERROR,
-					(errcode(ERRCODE_DATATYPE_MISMATCH),
-					 errmsg("remote query result rowtype does not match "
-							"the specified FROM clause rowtype")));
+/*
+ * Forget the answer to sphinx_send_query(), read or not
+ */
+static void
+resetAnswer(remoteConn *rconn)
+{
+	ListCell   *lc;
+
+	foreach(lc, rconn->answer)
+		mysql_free_result((MYSQL_RES *) lfirst(lc));
+	list_free(rconn->answer);
+	rconn->answer = NIL;
+	if (rconn->answer_error)
+		pfree(rconn->answer_error);
+	rconn->answer_error = NULL;
+	rconn->answered = false;
+	rconn->pending = false;
+}
 
-		/* Prepare attinmeta for later data conversions */
-		sinfo->attinmeta = TupleDescGetAttInMetadata(tupdesc);
 
-		/* Create a new, empty tuplestore */
-		oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
-		sinfo->tuplestore = tuplestore_begin_heap(true, false, work_mem);
-		rsinfo->setResult = sinfo->tuplestore;
-		rsinfo->setDesc = tupdesc;
-		MemoryContextSwitchTo(oldcontext);
+/*
+ * sphinx_get_result(conname): the rows of the query sent by
+ * sphinx_send_query(), waiting for them if necessary
+ */
+PG_FUNCTION_INFO_V1(sphinx_get_result);
+Datum
+sphinx_get_result(PG_FUNCTION_ARGS)
+{
+	text	   *tconname = PG_GETARG_TEXT_PP(0);
+	char	   *conname = NULL;
+	remoteConn *rconn = NULL;
+	MYSQL	   *conn = NULL;
+	volatile storeInfo sinfo;
 
-		/* Done if empty resultset */
-		if (!row)
-			return;
+	prepTuplestoreResult(fcinfo);
 
-		/*
-		 * Set up sufficiently-wide string pointers array; this won't change
-		 * in size so it's easy to preallocate.
-		 */
-		if (sinfo->cstrs)
-			pfree(sinfo->cstrs);
-		sinfo->cstrs = (char **) palloc(nfields * sizeof(char *));
-	}
+	SPHINXLINK_INIT;
+	SPHINXLINK_GETCONN;
 
-	/*
-	 * Do the following work in a temp context that we reset after each tuple.
-	 * This cleans up not only the data we have direct access to, but any
-	 * cruft the I/O functions might leak.
-	 */
-	oldcontext = MemoryContextSwitchTo(sinfo->tmpcontext);
+	if (!rconn->pending)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("connection \"%s\" has no query in progress", conname),
+				 errhint("Send one with sphinx_send_query().")));
+
+	memset((void *) &sinfo, 0, sizeof(sinfo));
+	sinfo.fcinfo = fcinfo;
+	sinfo.tmpcontext = AllocSetContextCreate(CurrentMemoryContext,
+											 "sphinxlink temporary context",
+											 ALLOCSET_DEFAULT_SIZES);
 
 	/*
-	 * Fill cstrs with null-terminated strings of column values.
+	 * The answer is consumed whether or not this succeeds; whatever is left
+	 * of it on the connection is read and thrown away, so that the next
+	 * query gets its own answer.
 	 */
-	for (i = 0; i < nfields; i++)
+	PG_TRY();
 	{
-		char *value = row[i];
+		if (rconn->answer_error)
+			ereport(ERROR,
+					(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+					 errmsg("%s", rconn->answer_error)));
+		if (!rconn->answered && sphinxReadQueryResult(rconn))
+		{
+			sphinxGroupReportError(rconn);
+			ereport(ERROR,
+					(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+					 errmsg("Could not execute query: %s", mysql_error(conn))));
+		}
 
-		if (!value)
-			sinfo->cstrs[i] = NULL;
-		else
-			sinfo->cstrs[i] = toMyDatabaseEncoding(value);
+		storeResultSets(&sinfo, rconn);
+	}
+	PG_CATCH();
+	{
+		resetAnswer(rconn);
+		discardResultSets(conn);
+		PG_RE_THROW();
 	}
+	PG_END_TRY();
 
-	/* Convert row to a tuple, and add it to the tuplestore */
-	tuple = BuildTupleFromCStrings(sinfo->attinmeta, sinfo->cstrs);
+	resetAnswer(rconn);
+	MemoryContextDelete(sinfo.tmpcontext);
 
-	tuplestore_puttuple(sinfo->tuplestore, tuple);
+	PG_FREE_IF_COPY(tconname, 0);
 
-	/* Clean up */
-	MemoryContextSwitchTo(oldcontext);
-	MemoryContextReset(sinfo->tmpcontext);
+	return (Datum) 0;
 }
 
 
-
-/*
- * Execute the given SQL command and store its results into a tuplestore
- * to be returned as the result of the current function.
+PG_FUNCTION_INFO_V1(sphinx_prepare);
+Datum
+sphinx_prepare(PG_FUNCTION_ARGS)
+{
+	text	   *tconname = PG_GETARG_TEXT_PP(0);
+	char	   *name = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	char	   *sql = text_to_cstring(PG_GETARG_TEXT_PP(2));
+	char	   *conname = NULL;
+	remoteConn *rconn = NULL;
+	MYSQL	   *conn = NULL;
+	sphinxTemplate templ;
+	sphinxTemplate *entry;
+	bool		found;
+
+	SPHINXLINK_INIT;
+	SPHINXLINK_GETCONN;
+
+	if (strlen(name) >= NAMEDATALEN)
+		ereport(ERROR,
+				(errcode(ERRCODE_NAME_TOO_LONG),
+				 errmsg("template name \"%s\" is too long", name)));
+
+	/* parse before touching the hash, so a bad template changes nothing */
+	sphinxParseTemplate(&templ, sql);
+
+	if (!rconn->templates)
+	{
+		HASHCTL		ctl;
+
+		memset(&ctl, 0, sizeof(ctl));
+		ctl.keysize = NAMEDATALEN;
+		ctl.entrysize = sizeof(sphinxTemplate);
+#if (PG_VERSION_NUM >= 140000)
+		rconn->templates = hash_create("sphinxlink templates", 16, &ctl,
+									   HASH_ELEM | HASH_STRINGS);
+#else
+		rconn->templates = hash_create("sphinxlink templates", 16, &ctl, HASH_ELEM);
+#endif
+	}
+
+	entry = (sphinxTemplate *) hash_search(rconn->templates, name, HASH_ENTER, &found);
+	if (found)
+		MemoryContextDelete(entry->cxt);
+	strlcpy(templ.name, name, NAMEDATALEN);
+	memcpy(entry, &templ, sizeof(sphinxTemplate));
+
+	PG_RETURN_TEXT_P(cstring_to_text("OK"));
+}
+
+
+PG_FUNCTION_INFO_V1(sphinx_execute);
+Datum
+sphinx_execute(PG_FUNCTION_ARGS)
+{
+	text	   *tconname = PG_GETARG_TEXT_PP(0);
+	char	   *name = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	char	   *conname = NULL;
+	remoteConn *rconn = NULL;
+	MYSQL	   *conn = NULL;
+	sphinxTemplate *templ = NULL;
+	Datum	   *args = NULL;
+	Oid		   *types = NULL;
+	bool	   *nulls = NULL;
+	int			nargs = 0;
+
+	prepTuplestoreResult(fcinfo);
+
+	SPHINXLINK_INIT;
+	SPHINXLINK_GETCONN;
+
+	if (rconn->templates)
+		templ = (sphinxTemplate *) hash_search(rconn->templates, name, HASH_FIND, NULL);
+	if (!templ)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_PSTATEMENT),
+				 errmsg("template \"%s\" does not exist", name)));
+
+	if (PG_NARGS() > 2)
+		nargs = extract_variadic_args(fcinfo, 2, true, &args, &types, &nulls);
+	if (Max(nargs, 0) != templ->nparams)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("template \"%s\" requires %d parameters, %d given",
+						name, templ->nparams, Max(nargs, 0))));
+
+	/* format into the same buffer every time */
+	if (!executeBuffer)
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+
+		executeBuffer = makeStringInfo();
+		MemoryContextSwitchTo(oldcontext);
+	}
+	else
+		resetStringInfo(executeBuffer);
+
+	sphinxFormatTemplate(executeBuffer, templ, args, types, nulls);
+
+	materializeQueryResult(fcinfo, conname, rconn, rconn->host, rconn->port,
+						   executeBuffer->data, NULL, templ->sql);
+
+	return (Datum) 0;
+}
+
+
+PG_FUNCTION_INFO_V1(sphinx_query_batch);
+Datum
+sphinx_query_batch(PG_FUNCTION_ARGS)
+{
+	text	   *tconname = PG_GETARG_TEXT_PP(0);
+	ArrayType  *statements = PG_GETARG_ARRAYTYPE_P(1);
+	char	   *conname = NULL;
+	remoteConn *rconn = NULL;
+	MYSQL	   *conn = NULL;
+	Datum	   *elems;
+	bool	   *nulls;
+	int			nelems;
+	char	  **stmts;
+	StringInfoData sql;
+	int			i;
+
+	prepTuplestoreResult(fcinfo);
+
+	SPHINXLINK_INIT;
+	SPHINXLINK_GETANYCONN;
+
+	deconstruct_array(statements, TEXTOID, -1, false, 'i',
+					  &elems, &nulls, &nelems);
+	if (nelems == 0)
+		return (Datum) 0;
+
+	/* join the statements into one multi-statement query */
+	stmts = (char **) palloc(nelems * sizeof(char *));
+	initStringInfo(&sql);
+	for (i = 0; i < nelems; i++)
+	{
+		char	   *stmt;
+		int			len;
+
+		if (nulls[i])
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("statement %d of the batch is null", i + 1)));
+
+		/* a trailing semicolon would add an empty statement */
+		stmt = TextDatumGetCString(elems[i]);
+		len = strlen(stmt);
+		while (len > 0 && (stmt[len - 1] == ';' || scanner_isspace(stmt[len - 1])))
+			len--;
+		if (len == 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("statement %d of the batch is empty", i + 1)));
+
+		if (i > 0)
+			appendStringInfoChar(&sql, ';');
+		appendBinaryStringInfo(&sql, stmt, len);
+		stmts[i] = pnstrdup(stmt, len);
+	}
+
+	materializeBatchResult(fcinfo, rconn, sql.data, stmts, nelems);
+
+	return (Datum) 0;
+}
+
+
+PG_FUNCTION_INFO_V1(sphinx_query_multi);
+Datum
+sphinx_query_multi(PG_FUNCTION_ARGS)
+{
+	ArrayType  *connnames;
+	char	   *sql;
+	char	   *sort_key = NULL;
+	int			max_rows = 0;
+	bool		allow_partial = false;
+	Datum	   *names;
+	bool	   *nulls;
+	int			nnodes;
+	multiNode  *nodes;
+	int			i;
+
+	prepTuplestoreResult(fcinfo);
+
+	SPHINXLINK_INIT;
+
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("connection names and query must not be null")));
+
+	connnames = PG_GETARG_ARRAYTYPE_P(0);
+	sql = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	if (!PG_ARGISNULL(2))
+		sort_key = text_to_cstring(PG_GETARG_TEXT_PP(2));
+	if (!PG_ARGISNULL(3))
+	{
+		max_rows = PG_GETARG_INT32(3);
+		if (max_rows <= 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("max_rows must be greater than zero")));
+	}
+	if (!PG_ARGISNULL(4))
+		allow_partial = PG_GETARG_BOOL(4);
+
+	deconstruct_array(connnames, TEXTOID, -1, false, 'i',
+					  &names, &nulls, &nnodes);
+
+	nodes = (multiNode *) palloc0(nnodes * sizeof(multiNode));
+	for (i = 0; i < nnodes; i++)
+	{
+		remoteConn *rconn;
+		int			j;
+
+		if (nulls[i])
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("connection names must not be null")));
+
+		nodes[i].name = TextDatumGetCString(names[i]);
+		rconn = getConnectionByName(nodes[i].name);
+		if (rconn)
+			checkSphinxQL(rconn, nodes[i].name);
+		if (!rconn || !rconn->conn)
+			ereport(ERROR,
+					(errcode(ERRCODE_CONNECTION_DOES_NOT_EXIST),
+					 errmsg("connection \"%s\" is not available", nodes[i].name)));
+
+		/* a connection can only have one query in flight */
+		for (j = 0; j < i; j++)
+		{
+			if (nodes[j].rconn == rconn)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("connection \"%s\" is listed more than once", nodes[i].name)));
+		}
+		sphinxCheckIdle(rconn);
+		sphinxGroupChooseReplica(rconn, sql);
+		nodes[i].rconn = rconn;
+		nodes[i].conn = rconn->conn;
+	}
+
+	materializeMultiResult(fcinfo, nodes, nnodes, sql, sort_key, max_rows, allow_partial);
+
+	return (Datum) 0;
+}
+
+
+PG_FUNCTION_INFO_V1(sphinx_query_all);
+Datum
+sphinx_query_all(PG_FUNCTION_ARGS)
+{
+	text	   *tconname = PG_GETARG_TEXT_PP(0);
+	char	   *sql = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	int			page_size = PG_GETARG_INT32(2);
+	char	   *conname = NULL;
+	remoteConn *rconn = NULL;
+	MYSQL	   *conn = NULL;
+
+	prepTuplestoreResult(fcinfo);
+
+	SPHINXLINK_INIT;
+	SPHINXLINK_GETCONN;
+
+	if (page_size <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("page_size must be greater than zero")));
+
+	/* every page goes to the same replica */
+	sphinxGroupChooseReplica(rconn, sql);
+	materializeAllResult(fcinfo, conname, rconn, sql, page_size);
+
+	return (Datum) 0;
+}
+
+
+/*
+ * Verify function caller can handle a tuplestore result, and set up for that.
+ *
+ * Note: if the caller returns without actually creating a tuplestore, the
+ * executor will treat the function result as an empty set.
+ */
+void
+prepTuplestoreResult(FunctionCallInfo fcinfo)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+	/* check to see if query supports us returning a tuplestore */
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	/* let the executor know we're sending back a tuplestore */
+	rsinfo->returnMode = SFRM_Materialize;
+
+	/* caller must fill these to return a non-empty result */
+	rsinfo->setResult = NULL;
+	rsinfo->setDesc = NULL;
+}
+
+
+/*
+ * Substitute the escaped match_clause for MATCH(?) in sql.
+ */
+static char *
+formatMatchQuery(const char *sql, const char *match_clause)
+{
+	StringInfoData buff;
+	const char *pos;
+
+	if (!match_clause || !(pos = strstr(sql, "MATCH(?)")))
+		return pstrdup(sql);
+
+	initStringInfo(&buff);
+	appendBinaryStringInfo(&buff, sql, (pos - sql));
+	appendStringInfoString(&buff, "MATCH(");
+	sphinxAppendEscapedString(&buff, match_clause);
+	appendStringInfoChar(&buff, ')');
+	appendStringInfoString(&buff, pos + 8);
+
+	return buff.data;
+}
+
+
+/*
+ * Execute query, and send any result rows to sinfo->tuplestore.
+ */
+static bool
+storeQueryResult(volatile storeInfo *sinfo,
+				 remoteConn *rconn,
+				 const char *query)
+{
+	MYSQL	   *conn = rconn->conn;
+	int			ret = 0;
+	unsigned long thread_id = mysql_thread_id(conn);
+	instr_time	start;
+
+	INSTR_TIME_SET_ZERO(start);
+	STAT_TIMER_START(sinfo, start);
+
+	ret = sphinxExecQuery(rconn, sphinxToUTF8Encoding(query));
+
+	STAT_TIMER_ADD(sinfo, wait_time, start);
+	/*
+	 * The client library reconnects by itself, which changes the thread id.
+	 * A replica group may have answered from another replica.
+	 */
+	if (sinfo->stats && thread_id != 0 && rconn->conn == conn &&
+		mysql_thread_id(conn) != thread_id)
+		sinfo->stats->reconnected = true;
+
+	if (ret)
+		ereport(ERROR,
+				(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+				 errmsg("Could not execute query: %s", mysql_error(rconn->conn))));
+
+	storeResultSets(sinfo, rconn);
+
+	return true;
+}
+
+
+/*
+ * Send the rows of a query whose answer has arrived to sinfo->tuplestore.
  *
- * This is equivalent to PQexec followed by materializeResult, but we make
- * use of libpq's single-row mode to avoid accumulating the whole result
- * inside libpq before it gets transferred to the tuplestore.
+ * It's possible to get more than one result set if the query string
+ * contained multiple SQL commands.  In that case, we follow PQexec's
+ * traditional behavior of throwing away all but the last result; use
+ * sphinx_query_batch() to get all of them.
+ */
+static void
+storeResultSets(volatile storeInfo *sinfo, remoteConn *rconn)
+{
+	MYSQL	   *conn = rconn->conn;
+	bool		first = true;
+	unsigned int nfields = 0;
+	MYSQL_RES   *res;
+	int			ret = 0;
+	instr_time	start;
+
+	INSTR_TIME_SET_ZERO(start);
+
+	do
+	{
+		ReturnSetInfo *rsinfo = (ReturnSetInfo *) sinfo->fcinfo->resultinfo;
+
+		if (sinfo->tuplestore)
+		{
+			tuplestore_end(sinfo->tuplestore);
+			sinfo->tuplestore = NULL;
+			rsinfo->setResult = NULL;
+		}
+		if (sinfo->capture)
+			resetStringInfo(sinfo->capture);
+		first = true;
+
+		/*
+		 * In streaming mode rows are read from the socket as we go, so the
+		 * client library never holds more than the current row.  An answer
+		 * read by sphinx_is_busy() is already in client memory.
+		 */
+		STAT_TIMER_START(sinfo, start);
+		if (rconn->answered)
+		{
+			if (rconn->answer == NIL)
+				continue;
+			res = (MYSQL_RES *) linitial(rconn->answer);
+			rconn->answer = list_delete_first(rconn->answer);
+		}
+		else if (sphinx_stream_results)
+			res = mysql_use_result(conn);
+		else
+			res = mysql_store_result(conn);
+		STAT_TIMER_ADD(sinfo, fetch_time, start);
+
+		if (!res)
+		{
+			/* statement doesn't return rows (REPLACE, DELETE, SET, ...) */
+			if (mysql_field_count(conn) == 0)
+				continue;
+
+			ereport(ERROR,
+					(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+					 errmsg("Could not fetch result: %s", mysql_error(conn))));
+		}
+
+		nfields = mysql_num_fields(res);
+
+		PG_TRY();
+		{
+			for (;;)
+			{
+				MYSQL_ROW	row = NULL;
+
+				CHECK_FOR_INTERRUPTS();
+
+				STAT_TIMER_START(sinfo, start);
+				row = mysql_fetch_row(res);
+				STAT_TIMER_ADD(sinfo, fetch_time, start);
+				if (!row)
+					break;
+
+				/* if empty resultset, fill tuplestore header */
+				storeRow(sinfo, row, mysql_fetch_lengths(res), nfields, first);
+				if (first)
+					first = false;
+			}
+
+			/* in streaming mode a NULL row may also mean a network error */
+			if (mysql_errno(conn))
+				ereport(ERROR,
+						(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+						 errmsg("Could not fetch result: %s", mysql_error(conn))));
+		}
+		PG_CATCH();
+		{
+			abortQueryResult(conn, res);
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+
+		mysql_free_result(res);
+	} while (rconn->answered ? rconn->answer != NIL : (ret = mysql_next_result(conn)) == 0);
+
+	if (ret > 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+				 errmsg("Could not execute query: %s", mysql_error(conn))));
+}
+
+
+/*
+ * Execute query and build the jsonb of sphinx_query_json().  The first result
+ * set is the array of matches; result sets after it, as FACET returns them,
+ * are put next to it under the name of their first column.
+ */
+static Jsonb *
+queryResultToJsonb(remoteConn *rconn, const char *query)
+{
+	MYSQL	   *conn;
+	JsonbParseState *state = NULL;
+	JsonbValue *result = NULL;
+	Jsonb	   *matches = NULL;
+	List	   *keys = NIL;
+	convPlan	plan;
+	int			ret;
+
+	/* only the encoding part of a conversion plan is used */
+	memset(&plan, 0, sizeof(plan));
+	plan.encoding = GetDatabaseEncoding();
+	if (plan.encoding != PG_UTF8 && plan.encoding != PG_SQL_ASCII)
+	{
+		plan.convproc = FindDefaultConversionProc(PG_UTF8, plan.encoding);
+		initStringInfo(&plan.convbuf);
+	}
+
+	/* a replica group may switch rconn->conn to the replica that answered */
+	ret = sphinxExecQuery(rconn, sphinxToUTF8Encoding(query));
+	conn = rconn->conn;
+	if (ret)
+		ereport(ERROR,
+				(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+				 errmsg("Could not execute query: %s", mysql_error(conn))));
+
+	do
+	{
+		MYSQL_RES  *res;
+		Jsonb	   *set;
+		JsonbValue	v;
+		char	   *base;
+		char	   *key;
+		int			n = 1;
+
+		if (sphinx_stream_results)
+			res = mysql_use_result(conn);
+		else
+			res = mysql_store_result(conn);
+
+		if (!res)
+		{
+			/* statement doesn't return rows (REPLACE, DELETE, SET, ...) */
+			if (mysql_field_count(conn) == 0)
+				continue;
+
+			ereport(ERROR,
+					(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+					 errmsg("Could not fetch result: %s", mysql_error(conn))));
+		}
+
+		PG_TRY();
+		{
+			set = resultSetToJsonb(conn, res, &plan);
+		}
+		PG_CATCH();
+		{
+			abortQueryResult(conn, res);
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+
+		if (!matches)
+		{
+			matches = set;
+			mysql_free_result(res);
+			continue;
+		}
+
+		if (!state)
+		{
+			pushJsonbValue(&state, WJB_BEGIN_OBJECT, NULL);
+			v.type = jbvString;
+			v.val.string.val = "matches";
+			v.val.string.len = strlen("matches");
+			pushJsonbValue(&state, WJB_KEY, &v);
+			v.type = jbvBinary;
+			v.val.binary.data = &matches->root;
+			v.val.binary.len = VARSIZE(matches) - VARHDRSZ;
+			pushJsonbValue(&state, WJB_VALUE, &v);
+			keys = lappend(keys, makeString("matches"));
+		}
+
+		/* the same facet twice gets a numbered key */
+		base = mysql_num_fields(res) > 0 ? mysql_fetch_fields(res)[0].name : "facet";
+		key = pstrdup(base);
+		while (list_member(keys, makeString(key)))
+			key = psprintf("%s_%d", base, ++n);
+		keys = lappend(keys, makeString(key));
+		mysql_free_result(res);
+
+		v.type = jbvString;
+		v.val.string.val = key;
+		v.val.string.len = strlen(key);
+		pushJsonbValue(&state, WJB_KEY, &v);
+		v.type = jbvBinary;
+		v.val.binary.data = &set->root;
+		v.val.binary.len = VARSIZE(set) - VARHDRSZ;
+		pushJsonbValue(&state, WJB_VALUE, &v);
+	} while ((ret = mysql_next_result(conn)) == 0);
+
+	if (ret > 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+				 errmsg("Could not execute query: %s", mysql_error(conn))));
+
+	if (state)
+	{
+		result = pushJsonbValue(&state, WJB_END_OBJECT, NULL);
+		return JsonbValueToJsonb(result);
+	}
+	if (matches)
+		return matches;
+
+	/* nothing returned rows */
+	pushJsonbValue(&state, WJB_BEGIN_ARRAY, NULL);
+	return JsonbValueToJsonb(pushJsonbValue(&state, WJB_END_ARRAY, NULL));
+}
+
+
+/*
+ * Read the rows of res into a jsonb array of objects keyed by column name.
+ */
+static Jsonb *
+resultSetToJsonb(MYSQL *conn, MYSQL_RES *res, convPlan *plan)
+{
+	JsonbParseState *state = NULL;
+	MYSQL_FIELD *fields = mysql_fetch_fields(res);
+	unsigned int nfields = mysql_num_fields(res);
+	JsonbValue *names;
+	JsonbValue *result;
+	MYSQL_ROW	row;
+	unsigned int i;
+
+	names = (JsonbValue *) palloc(nfields * sizeof(JsonbValue));
+	for (i = 0; i < nfields; i++)
+	{
+		unsigned long length = strlen(fields[i].name);
+		char	   *name = toMyDatabaseEncoding(plan, fields[i].name, &length);
+
+		names[i].type = jbvString;
+		names[i].val.string.val = pnstrdup(name, length);
+		names[i].val.string.len = length;
+	}
+
+	pushJsonbValue(&state, WJB_BEGIN_ARRAY, NULL);
+	while ((row = mysql_fetch_row(res)))
+	{
+		unsigned long *lengths = mysql_fetch_lengths(res);
+
+		CHECK_FOR_INTERRUPTS();
+
+		pushJsonbValue(&state, WJB_BEGIN_OBJECT, NULL);
+		for (i = 0; i < nfields; i++)
+		{
+			JsonbValue	v;
+
+			jsonbColumnValue(&v, &fields[i], row[i], lengths[i], plan);
+			pushJsonbValue(&state, WJB_KEY, &names[i]);
+			pushJsonbValue(&state, WJB_VALUE, &v);
+		}
+		pushJsonbValue(&state, WJB_END_OBJECT, NULL);
+	}
+
+	/* in streaming mode a NULL row may also mean a network error */
+	if (mysql_errno(conn))
+		ereport(ERROR,
+				(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+				 errmsg("Could not fetch result: %s", mysql_error(conn))));
+
+	result = pushJsonbValue(&state, WJB_END_ARRAY, NULL);
+
+	return JsonbValueToJsonb(result);
+}
+
+
+/*
+ * Turn a column value into a jsonb scalar by the column type searchd sent.
+ * Integers are converted without a detour through the numeric input
+ * function; the row buffer is reused for the next row, so strings are copied.
+ */
+static void
+jsonbColumnValue(JsonbValue *v, MYSQL_FIELD *field, char *value, unsigned long length,
+				 convPlan *plan)
+{
+	int64		ival;
+	char	   *encoded;
+
+	if (!value)
+	{
+		v->type = jbvNull;
+		return;
+	}
+
+	switch (field->type)
+	{
+		case MYSQL_TYPE_TINY:
+		case MYSQL_TYPE_SHORT:
+		case MYSQL_TYPE_LONG:
+		case MYSQL_TYPE_INT24:
+		case MYSQL_TYPE_LONGLONG:
+			if (parseInt64(value, length, &ival))
+			{
+				v->type = jbvNumeric;
+#if (PG_VERSION_NUM >= 140000)
+				v->val.numeric = int64_to_numeric(ival);
+#else
+				v->val.numeric = DatumGetNumeric(DirectFunctionCall1(int8_numeric,
+																	 Int64GetDatum(ival)));
+#endif
+				return;
+			}
+			/* unsigned beyond int64 */
+			/* FALLTHROUGH */
+		case MYSQL_TYPE_FLOAT:
+		case MYSQL_TYPE_DOUBLE:
+		case MYSQL_TYPE_DECIMAL:
+		case MYSQL_TYPE_NEWDECIMAL:
+			/* numeric_in() would also take NaN and Infinity, which JSON hasn't */
+			encoded = (length > 0 && value[0] == '-') ? value + 1 : value;
+			if (encoded < value + length && *encoded >= '0' && *encoded <= '9')
+			{
+				v->type = jbvNumeric;
+				v->val.numeric = DatumGetNumeric(DirectFunctionCall3(numeric_in,
+																	 CStringGetDatum(pnstrdup(value, length)),
+																	 ObjectIdGetDatum(InvalidOid),
+																	 Int32GetDatum(-1)));
+				return;
+			}
+			break;
+		default:
+			break;
+	}
+
+	encoded = toMyDatabaseEncoding(plan, value, &length);
+	v->type = jbvString;
+	v->val.string.val = pnstrdup(encoded, length);
+	v->val.string.len = length;
+}
+
+
+/*
+ * Execute query through the connection pool, and send any result rows to
+ * sinfo->tuplestore.
+ */
+static void
+storePooledResult(volatile storeInfo *sinfo,
+				  const char *host,
+				  int port,
+				  const char *query)
+{
+	sphinxPoolRequest *req;
+	unsigned int nfields;
+	char	  **values;
+	unsigned long *lengths;
+	bool		first = true;
+	instr_time	start;
+
+	INSTR_TIME_SET_ZERO(start);
+	req = sphinxPoolSend(host, port, sphinxToUTF8Encoding(query));
+
+	PG_TRY();
+	{
+		for (;;)
+		{
+			bool		more;
+
+			CHECK_FOR_INTERRUPTS();
+
+			STAT_TIMER_START(sinfo, start);
+			more = sphinxPoolNextRow(req, &nfields, &values, &lengths);
+			STAT_TIMER_ADD(sinfo, fetch_time, start);
+			if (!more)
+				break;
+
+			storeRow(sinfo, values, lengths, nfields, first);
+			first = false;
+		}
+	}
+	PG_CATCH();
+	{
+		sphinxPoolRelease(req);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	sphinxPoolRelease(req);
+}
+
+
+/*
+ * Execute the statements of sphinx_query_batch(), sent as one multi-statement
+ * query, and store the rows of every result set into sinfo->tuplestore.
+ * Each row is prefixed with the 1-based number of its statement; columns
+ * beyond those a statement returns are set to NULL.
+ */
+static void
+storeBatchResult(volatile storeInfo *sinfo, remoteConn *rconn, const char *sql)
+{
+	MYSQL	   *conn;
+	MYSQL_RES  *volatile res = NULL;
+	int			stmt = 1;
+	int			status;
+
+	/* a replica group may switch rconn->conn to the replica that answered */
+	status = sphinxExecQuery(rconn, sphinxToUTF8Encoding(sql));
+	conn = rconn->conn;
+	if (status)
+		ereport(ERROR,
+				(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+				 errmsg("Could not execute statement %d of the batch: %s", stmt, mysql_error(conn))));
+
+	PG_TRY();
+	{
+		for (;;)
+		{
+			if (sphinx_stream_results)
+				res = mysql_use_result(conn);
+			else
+				res = mysql_store_result(conn);
+
+			if (res)
+			{
+				unsigned int nfields = mysql_num_fields(res);
+				MYSQL_ROW	row;
+
+				if (!sinfo->tuplestore)
+				{
+					initStoreResult(sinfo);
+					if (TupleDescAttr(sinfo->plan->tupdesc, 0)->atttypid != INT4OID)
+						ereport(ERROR,
+								(errcode(ERRCODE_DATATYPE_MISMATCH),
+								 errmsg("first column of sphinx_query_batch() result must be of type integer")));
+				}
+
+				if ((int) nfields >= sinfo->plan->tupdesc->natts)
+					ereport(ERROR,
+							(errcode(ERRCODE_DATATYPE_MISMATCH),
+							 errmsg("remote query result rowtype does not match "
+									"the specified FROM clause rowtype"),
+							 errdetail("Statement %d returned %u columns, but only %d are declared after the statement number.",
+									   stmt, nfields, sinfo->plan->tupdesc->natts - 1)));
+
+				while ((row = mysql_fetch_row(res)))
+				{
+					CHECK_FOR_INTERRUPTS();
+					storeBatchRow(sinfo, stmt, row, mysql_fetch_lengths(res), nfields);
+				}
+
+				/* in streaming mode a NULL row may also mean a network error */
+				if (mysql_errno(conn))
+					ereport(ERROR,
+							(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+							 errmsg("Could not fetch result of statement %d of the batch: %s",
+									stmt, mysql_error(conn))));
+
+				mysql_free_result(res);
+				res = NULL;
+			}
+			else if (mysql_field_count(conn) != 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+						 errmsg("Could not fetch result of statement %d of the batch: %s",
+								stmt, mysql_error(conn))));
+
+			if ((status = mysql_next_result(conn)) != 0)
+				break;
+			stmt++;
+		}
+
+		if (status > 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+					 errmsg("Could not execute statement %d of the batch: %s", stmt + 1, mysql_error(conn))));
+	}
+	PG_CATCH();
+	{
+		abortQueryResult(conn, res);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+}
+
+
+/*
+ * Run queries over the SphinxAPI connection of rconn and store their rows
+ * into a tuplestore; those of sphinx_query_batch() go behind the number of
+ * their statement, as storeBatchRow() does.
+ */
+static void
+storeApiResult(volatile storeInfo *sinfo, remoteConn *rconn, char **queries, int nqueries,
+			   bool batch)
+{
+	sphinxApiResult **results;
+	char	  **utf8 = (char **) palloc(nqueries * sizeof(char *));
+	int			first = batch ? 1 : 0;
+	int			i;
+
+	for (i = 0; i < nqueries; i++)
+		utf8[i] = sphinxToUTF8Encoding(queries[i]);
+	results = sphinxApiSearch(rconn->api, utf8, nqueries, sinfo->stats);
+
+	for (i = 0; i < nqueries; i++)
+	{
+		sphinxApiResult *res = results[i];
+		convPlan   *plan;
+
+		if (res->error && batch)
+			ereport(ERROR,
+					(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+					 errmsg("Could not execute statement %d of the batch: %s", i + 1, res->error)));
+		if (res->error)
+			ereport(ERROR,
+					(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+					 errmsg("Error when send query to Sphinx: %s", res->error)));
+
+		if (!sinfo->tuplestore)
+		{
+			initStoreResult(sinfo);
+			if (batch && TupleDescAttr(sinfo->plan->tupdesc, 0)->atttypid != INT4OID)
+				ereport(ERROR,
+						(errcode(ERRCODE_DATATYPE_MISMATCH),
+						 errmsg("first column of sphinx_query_batch() result must be of type integer")));
+		}
+		plan = sinfo->plan;
+
+		if (batch && res->ncolumns >= plan->tupdesc->natts)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATATYPE_MISMATCH),
+					 errmsg("remote query result rowtype does not match "
+							"the specified FROM clause rowtype"),
+					 errdetail("Statement %d returned %d columns, but only %d are declared after the statement number.",
+							   i + 1, res->ncolumns, plan->tupdesc->natts - 1)));
+		if (!batch && res->ncolumns != plan->tupdesc->natts)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATATYPE_MISMATCH),
+					 errmsg("remote query result rowtype does not match "
+							"the specified FROM clause rowtype")));
+
+		for (;;)
+		{
+			MemoryContext oldcontext;
+			instr_time	start;
+			int			j;
+
+			CHECK_FOR_INTERRUPTS();
+
+			oldcontext = MemoryContextSwitchTo(sinfo->tmpcontext);
+			STAT_TIMER_START(sinfo, start);
+			if (!sphinxApiNextRow(res, plan, first))
+			{
+				MemoryContextSwitchTo(oldcontext);
+				break;
+			}
+
+			if (batch)
+			{
+				plan->values[0] = Int32GetDatum(i + 1);
+				plan->nulls[0] = false;
+				for (j = res->ncolumns + 1; j < plan->tupdesc->natts; j++)
+				{
+					plan->values[j] = (Datum) 0;
+					plan->nulls[j] = true;
+				}
+			}
+			tuplestore_putvalues(sinfo->tuplestore, plan->tupdesc, plan->values, plan->nulls);
+			if (sinfo->stats)
+				sinfo->stats->rows++;
+			STAT_TIMER_ADD(sinfo, convert_time, start);
+
+			MemoryContextSwitchTo(oldcontext);
+			MemoryContextReset(sinfo->tmpcontext);
+		}
+	}
+}
+
+
+/*
+ * Discard an in-flight result after an error or a query cancel, so the
+ * connection can be used for the next query.
+ *
+ * The rest of a streamed result may be large, so it isn't read: the socket
+ * is shut down instead, which stops searchd sending, and the client library
+ * reconnects on the next query.  A stored result is complete and just freed,
+ * along with the result sets of the remaining statements of a
+ * multi-statement query.
+ */
+static void
+abortQueryResult(MYSQL *conn, MYSQL_RES *res)
+{
+	if (res && !mysql_eof(res))
+	{
+		shutdown(sphinxGetSocket(conn), SHUT_RDWR);
+		mysql_free_result(res);
+		return;
+	}
+
+	if (res)
+		mysql_free_result(res);
+	while (mysql_more_results(conn) && mysql_next_result(conn) == 0)
+	{
+		if ((res = mysql_store_result(conn)))
+			mysql_free_result(res);
+	}
+}
+
+
+/*
+ * Send single row to sinfo->tuplestore.
+ */
+static void
+storeRow(volatile storeInfo *sinfo, MYSQL_ROW row, unsigned long *lengths,
+		 unsigned int nfields, bool first)
+{
+	MemoryContext	oldcontext;
+	instr_time	start;
+
+	if (sinfo->capture)
+		captureRow(sinfo, row, lengths, nfields);
+
+	if (first)
+	{
+		/* Prepare for new result set */
+		initStoreResult(sinfo);
+
+		/* check result and tuple descriptor have the same number of columns */
+		if (nfields != sinfo->plan->tupdesc->natts)
+			ereport(ERROR,
+					(errcode(ERRCODE_DATATYPE_MISMATCH),
+					 errmsg("remote query result rowtype does not match "
+							"the specified FROM clause rowtype")));
+
+		/* Done if empty resultset */
+		if (!row)
+			return;
+	}
+
+	/*
+	 * Do the following work in a temp context that we reset after each tuple.
+	 * This cleans up not only the data we have direct access to, but any
+	 * cruft the I/O functions might leak.
+	 */
+	oldcontext = MemoryContextSwitchTo(sinfo->tmpcontext);
+
+	if (sinfo->stats)
+	{
+		unsigned int i;
+
+		sinfo->stats->rows++;
+		for (i = 0; i < nfields; i++)
+			sinfo->stats->bytes += lengths[i];
+		INSTR_TIME_SET_CURRENT(start);
+	}
+	else
+		INSTR_TIME_SET_ZERO(start);
+
+	/* Convert column values to Datums and add the row to the tuplestore */
+	convertRow(sinfo->plan, row, lengths, nfields);
+	tuplestore_putvalues(sinfo->tuplestore, sinfo->plan->tupdesc,
+						 sinfo->plan->values, sinfo->plan->nulls);
+
+	STAT_TIMER_ADD(sinfo, convert_time, start);
+
+	/* Clean up */
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextReset(sinfo->tmpcontext);
+}
+
+
+/*
+ * Send a row of sphinx_query_batch() to sinfo->tuplestore.
+ */
+static void
+storeBatchRow(volatile storeInfo *sinfo, int stmt, MYSQL_ROW row, unsigned long *lengths,
+			  unsigned int nfields)
+{
+	convPlan   *plan = sinfo->plan;
+	MemoryContext	oldcontext;
+	int			i;
+
+	oldcontext = MemoryContextSwitchTo(sinfo->tmpcontext);
+
+	plan->values[0] = Int32GetDatum(stmt);
+	plan->nulls[0] = false;
+	for (i = 1; i < plan->tupdesc->natts; i++)
+	{
+		if (i > (int) nfields || !row[i - 1])
+		{
+			plan->values[i] = (Datum) 0;
+			plan->nulls[i] = true;
+		}
+		else
+		{
+			plan->values[i] = sphinxConvertValue(plan, i, row[i - 1], lengths[i - 1]);
+			plan->nulls[i] = false;
+		}
+	}
+	tuplestore_putvalues(sinfo->tuplestore, plan->tupdesc, plan->values, plan->nulls);
+
+	MemoryContextSwitchTo(oldcontext);
+	MemoryContextReset(sinfo->tmpcontext);
+}
+
+
+/*
+ * Keep a copy of a row for the result cache, unless the result has grown
+ * too big to be cached.
+ */
+static void
+captureRow(volatile storeInfo *sinfo, MYSQL_ROW row, unsigned long *lengths, unsigned int nfields)
+{
+	StringInfo	capture = sinfo->capture;
+	int32		rowlen = 0;
+	int			start;
+
+	appendBinaryStringInfo(capture, (char *) &rowlen, sizeof(rowlen));
+	start = capture->len;
+	sphinxSerializeRow(capture, row, lengths, nfields);
+	rowlen = capture->len - start;
+	memcpy(capture->data + start - sizeof(rowlen), &rowlen, sizeof(rowlen));
+	sinfo->capture_nfields = nfields;
+
+	if (capture->len > sphinxCacheMaxEntrySize())
+	{
+		pfree(capture->data);
+		pfree(capture);
+		sinfo->capture = NULL;
+	}
+}
+
+
+/*
+ * Fill sinfo->tuplestore from a cached result.
+ */
+static void
+storeCachedResult(volatile storeInfo *sinfo, const char *rows, Size rowslen, unsigned int nfields)
+{
+	const char *ptr = rows;
+	const char *end = rows + rowslen;
+	char	  **values = (char **) palloc((nfields + 1) * sizeof(char *));
+	unsigned long *lengths = (unsigned long *) palloc((nfields + 1) * sizeof(unsigned long));
+	bool		first = true;
+
+	while (ptr < end)
+	{
+		int32		rowlen;
+
+		CHECK_FOR_INTERRUPTS();
+
+		memcpy(&rowlen, ptr, sizeof(rowlen));
+		ptr += sizeof(rowlen);
+		sphinxDeserializeRow(ptr, rowlen, nfields, values, lengths);
+		storeRow(sinfo, values, lengths, nfields, first);
+		first = false;
+		ptr += rowlen;
+	}
+}
+
+
+/*
+ * Set up sinfo for a new result set: look up the result rowtype and create
+ * an empty tuplestore.  Callers check the number of columns.
+ */
+static void
+initStoreResult(volatile storeInfo *sinfo)
+{
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) sinfo->fcinfo->resultinfo;
+	TupleDesc		tupdesc;
+	MemoryContext	oldcontext;
+
+	if (sinfo->tuplestore)
+		tuplestore_end(sinfo->tuplestore);
+	sinfo->tuplestore = NULL;
+
+	/* get a tuple descriptor for our result type */
+	switch (get_call_result_type(sinfo->fcinfo, NULL, &tupdesc))
+	{
+		case TYPEFUNC_COMPOSITE:
+			/* success */
+			break;
+		case TYPEFUNC_RECORD:
+			/* failed to determine actual type of RECORD */
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("function returning record called in context "
+							"that cannot accept type record")));
+			break;
+		default:
+			/* result type isn't composite */
+			elog(ERROR, "return type must be a row type");
+			break;
+	}
+
+	/* make sure we have a persistent copy of the tupdesc */
+	tupdesc = CreateTupleDescCopy(tupdesc);
+
+	/* Prepare conversion plan for later data conversions */
+	sinfo->plan = getConvPlan(sinfo->fcinfo->flinfo, tupdesc);
+
+	/* Create a new, empty tuplestore */
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	sinfo->tuplestore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->setResult = sinfo->tuplestore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+}
+
+
+/*
+ * Convert a remote row into plan->values and plan->nulls.
+ */
+static void
+convertRow(convPlan *plan, MYSQL_ROW row, unsigned long *lengths, unsigned int nfields)
+{
+	unsigned int	i;
+
+	for (i = 0; i < nfields; i++)
+	{
+		if (!row[i])
+		{
+			plan->values[i] = (Datum) 0;
+			plan->nulls[i] = true;
+		}
+		else
+		{
+			plan->values[i] = sphinxConvertValue(plan, i, row[i], lengths[i]);
+			plan->nulls[i] = false;
+		}
+	}
+}
+
+
+/*
+ * Build (or fetch from fn_extra) the conversion plan for the given rowtype.
+ *
+ * The column definition list of a call site doesn't change between calls, so
+ * the plan normally survives for the whole query.
+ */
+static convPlan *
+getConvPlan(FmgrInfo *flinfo, TupleDesc tupdesc)
+{
+	convPlan	   *plan = (convPlan *) flinfo->fn_extra;
+	MemoryContext	oldcontext;
+
+	if (plan && plan->typed == sphinx_typed_conversion &&
+		equalTupleDescs(plan->tupdesc, tupdesc))
+		return plan;
+
+	oldcontext = MemoryContextSwitchTo(flinfo->fn_mcxt);
+	plan = sphinxCreateConvPlan(tupdesc);
+	MemoryContextSwitchTo(oldcontext);
+
+	flinfo->fn_extra = plan;
+
+	return plan;
+}
+
+
+/*
+ * Create a conversion plan for the given rowtype in the current memory
+ * context.
+ */
+convPlan *
+sphinxCreateConvPlan(TupleDesc tupdesc)
+{
+	convPlan	   *plan;
+	int				natts = tupdesc->natts;
+	int				i;
+
+	plan = (convPlan *) palloc0(sizeof(convPlan));
+	plan->tupdesc = CreateTupleDescCopy(tupdesc);
+	plan->typed = sphinx_typed_conversion;
+	plan->attinmeta = TupleDescGetAttInMetadata(plan->tupdesc);
+	plan->kinds = (convKind *) palloc0(natts * sizeof(convKind));
+	plan->values = (Datum *) palloc0(natts * sizeof(Datum));
+	plan->nulls = (bool *) palloc0(natts * sizeof(bool));
+
+	plan->encoding = GetDatabaseEncoding();
+	if (plan->encoding != PG_UTF8 && plan->encoding != PG_SQL_ASCII)
+	{
+		plan->convproc = FindDefaultConversionProc(PG_UTF8, plan->encoding);
+		initStringInfo(&plan->convbuf);
+	}
+
+	/*
+	 * Integers in timestamp columns are unix time either way; the rest of
+	 * the fast path only saves the type input function.
+	 */
+	for (i = 0; i < natts; i++)
+	{
+		Form_pg_attribute att = TupleDescAttr(plan->tupdesc, i);
+
+		if (!plan->typed && att->atttypid != TIMESTAMPOID &&
+			att->atttypid != TIMESTAMPTZOID)
+			continue;
+
+		switch (att->atttypid)
+		{
+			case TEXTOID:
+				plan->kinds[i] = CONV_TEXT;
+				break;
+			case INT4OID:
+				plan->kinds[i] = CONV_INT4;
+				break;
+			case INT8OID:
+				plan->kinds[i] = CONV_INT8;
+				break;
+			case FLOAT4OID:
+				plan->kinds[i] = CONV_FLOAT4;
+				break;
+			case FLOAT8OID:
+				plan->kinds[i] = CONV_FLOAT8;
+				break;
+			case BOOLOID:
+				plan->kinds[i] = CONV_BOOL;
+				break;
+			case TIMESTAMPOID:
+				plan->kinds[i] = CONV_TIMESTAMP;
+				break;
+			case TIMESTAMPTZOID:
+				plan->kinds[i] = CONV_TIMESTAMPTZ;
+				break;
+			default:
+				plan->kinds[i] = CONV_INPUT;
+				break;
+		}
+	}
+
+	return plan;
+}
+
+
+/*
+ * Convert a single non-NULL column value to a Datum.
+ *
+ * Sphinx sends numbers as plain ASCII and timestamps as unix time, so the
+ * common cases are parsed here directly.  The fast path only takes values
+ * the type input function would turn into the same Datum; anything else
+ * goes to the input function, which also produces the usual error messages
+ * for bad input.
+ */
+Datum
+sphinxConvertValue(convPlan *plan, int attnum, char *value, unsigned long length)
+{
+	AttInMetadata  *attinmeta = plan->attinmeta;
+	int64			ival;
+	double			dval;
+	char		   *end;
+	char		   *encoded;
+
+	switch (plan->kinds[attnum])
+	{
+		case CONV_TEXT:
+			encoded = toMyDatabaseEncoding(plan, value, &length);
+			/* the input function stops at a NUL byte */
+			if (memchr(encoded, '\0', length))
+				return InputFunctionCall(&attinmeta->attinfuncs[attnum], encoded,
+										 attinmeta->attioparams[attnum],
+										 attinmeta->atttypmods[attnum]);
+			return PointerGetDatum(cstring_to_text_with_len(encoded, length));
+
+		case CONV_INT4:
+			if (parseInt64(value, length, &ival) &&
+				ival >= PG_INT32_MIN && ival <= PG_INT32_MAX)
+				return Int32GetDatum((int32) ival);
+			break;
+
+		case CONV_INT8:
+			if (parseInt64(value, length, &ival))
+				return Int64GetDatum(ival);
+			break;
+
+		case CONV_FLOAT4:
+			if (length > 0)
+			{
+				float4		fval;
+
+				errno = 0;
+				fval = strtof(value, &end);
+				if (errno == 0 && end == value + length)
+					return Float4GetDatum(fval);
+			}
+			break;
+
+		case CONV_FLOAT8:
+			if (length > 0)
+			{
+				errno = 0;
+				dval = strtod(value, &end);
+				if (errno == 0 && end == value + length)
+					return Float8GetDatum(dval);
+			}
+			break;
+
+		case CONV_BOOL:
+			if (length == 1 && (value[0] == '0' || value[0] == '1'))
+				return BoolGetDatum(value[0] == '1');
+			break;
+
+		case CONV_TIMESTAMP:
+		case CONV_TIMESTAMPTZ:
+			/* timestamp attributes come as seconds since the unix epoch */
+			if (parseInt64(value, length, &ival) &&
+				!pg_sub_s64_overflow(ival,
+									 (int64) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY,
+									 &ival) &&
+				!pg_mul_s64_overflow(ival, USECS_PER_SEC, &ival) &&
+				IS_VALID_TIMESTAMP(ival))
+			{
+				if (plan->kinds[attnum] == CONV_TIMESTAMPTZ)
+					return TimestampTzGetDatum((TimestampTz) ival);
+				return DirectFunctionCall1(timestamptz_timestamp,
+										   TimestampTzGetDatum((TimestampTz) ival));
+			}
+			break;
+
+		case CONV_INPUT:
+			break;
+	}
+
+	return InputFunctionCall(&attinmeta->attinfuncs[attnum],
+							 toMyDatabaseEncoding(plan, value, &length),
+							 attinmeta->attioparams[attnum],
+							 attinmeta->atttypmods[attnum]);
+}
+
+
+/*
+ * Parse a decimal integer of known length.  Returns false on anything that
+ * isn't an optionally signed run of digits fitting into int64.
+ */
+static bool
+parseInt64(const char *value, unsigned long length, int64 *result)
+{
+	const char *ptr = value;
+	const char *end = value + length;
+	bool		neg = false;
+	uint64		acc = 0;
+
+	if (ptr < end && (*ptr == '-' || *ptr == '+'))
+	{
+		neg = (*ptr == '-');
+		ptr++;
+	}
+	if (ptr == end)
+		return false;
+
+	for (; ptr < end; ptr++)
+	{
+		unsigned int digit = (unsigned char) *ptr - '0';
+
+		if (digit > 9)
+			return false;
+		if (acc > (PG_UINT64_MAX - digit) / 10)
+			return false;
+		acc = acc * 10 + digit;
+	}
+
+	if (neg)
+	{
+		if (acc > (uint64) PG_INT64_MAX + 1)
+			return false;
+		*result = (acc == (uint64) PG_INT64_MAX + 1) ? PG_INT64_MIN : -(int64) acc;
+	}
+	else
+	{
+		if (acc > (uint64) PG_INT64_MAX)
+			return false;
+		*result = (int64) acc;
+	}
+
+	return true;
+}
+
+
+/*
+ * Execute the given SQL command and store its results into a tuplestore
+ * to be returned as the result of the current function.
+ *
+ * Unless sphinxlink.stream_results is off, we use mysql_use_result() to
+ * avoid accumulating the whole result inside the client library before it
+ * gets transferred to the tuplestore.  Without rconn, the query goes to host
+ * and port through the connection pool.  Results of SELECT statements are
+ * looked up in and added to the shared result cache, if there is one.
+ *
+ * Queries that reach Sphinx are counted in the statistics of conname and
+ * host:port, and per-query ones under statquery.
+ */
+static void
+materializeQueryResult(FunctionCallInfo fcinfo,
+					   const char *conname,
+					   remoteConn *rconn,
+					   const char *host,
+					   int port,
+					   const char *sql,
+					   const char *match_clause,
+					   const char *statquery)
+{
+	volatile storeInfo sinfo;
+	char	   *query = formatMatchQuery(sql, match_clause);
+	bool		cacheable = !(rconn && rconn->api) && sphinxCacheUsable(query);
+	char	   *volatile cached = NULL;
+	Size		cachedlen = 0;
+	unsigned int cachednfields = 0;
+	sphinxQueryStats stats;
+	instr_time	start;
+	instr_time	elapsed;
+
+	/* initialize storeInfo to empty */
+	memset((void *) &sinfo, 0, sizeof(sinfo));
+	sinfo.fcinfo = fcinfo;
+
+	/* the duration feeds the planner estimates too, see sphinx_estimate.c */
+	INSTR_TIME_SET_CURRENT(start);
+	if (sphinxStatEnabled())
+	{
+		memset(&stats, 0, sizeof(stats));
+		stats.meta_time = -1;
+		sinfo.stats = &stats;
+	}
+
+	PG_TRY();
+	{
+		/* Create short-lived memory context for data conversions */
+		sinfo.tmpcontext = AllocSetContextCreate(CurrentMemoryContext,
+												 "sphinxlink temporary context",
+												 ALLOCSET_DEFAULT_SIZES);
+
+		/* a cache hit doesn't go to Sphinx at all */
+		if (cacheable)
+		{
+			cached = sphinxCacheLookup(host, port, sphinxToUTF8Encoding(query),
+									   &cachednfields, &cachedlen);
+			if (!cached)
+				sinfo.capture = makeStringInfo();
+		}
+
+		/* execute query, collecting any tuples into the tuplestore */
+		if (cached)
+			storeCachedResult(&sinfo, cached, cachedlen, cachednfields);
+		else if (!rconn)
+			storePooledResult(&sinfo, host, port, query);
+		else if (rconn->api)
+			storeApiResult(&sinfo, rconn, &query, 1, false);
+		else if (!storeQueryResult(&sinfo, rconn, query))
+		{
+			char	   *err = pstrdup(mysql_error(rconn->conn));
+
+			ereport(ERROR,
+					(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+					 errmsg("Error when send query to Sphinx: %s", err)));
+		}
+
+		if (sinfo.capture)
+			sphinxCacheStore(host, port, sphinxToUTF8Encoding(query), sinfo.capture_nfields,
+							 sinfo.capture->data, sinfo.capture->len);
+
+		INSTR_TIME_SET_CURRENT(elapsed);
+		INSTR_TIME_SUBTRACT(elapsed, start);
+		sphinxEstimateRecord(sql, match_clause,
+							 sinfo.tuplestore ? (double) tuplestore_tuple_count(sinfo.tuplestore) : 0,
+							 cached ? -1 : INSTR_TIME_GET_MILLISEC(elapsed));
+
+		/* cache hits never reached Sphinx */
+		if (sinfo.stats && !cached)
+		{
+			/* a SphinxAPI result carries the time itself */
+			if (rconn && !rconn->api && sphinxStatTrackQueries())
+				sinfo.stats->meta_time = fetchMetaTime(rconn);
+			reportQueryStats(&sinfo, conname, host, port, statquery, start, false);
+		}
+
+		/* clean up data conversion short-lived memory context */
+		if (sinfo.tmpcontext != NULL)
+			MemoryContextDelete(sinfo.tmpcontext);
+		sinfo.tmpcontext = NULL;
+	}
+	PG_CATCH();
+	{
+		if (sinfo.stats && !cached)
+			reportQueryStats(&sinfo, conname, host, port, statquery, start, true);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+}
+
+
+/*
+ * Add the counters of a sphinx_query() call to the shared statistics.
+ */
+static void
+reportQueryStats(volatile storeInfo *sinfo, const char *conname, const char *host, int port,
+				 const char *statquery, instr_time start, bool error)
+{
+	instr_time	end;
+
+	INSTR_TIME_SET_CURRENT(end);
+	INSTR_TIME_SUBTRACT(end, start);
+	sinfo->stats->total_time = INSTR_TIME_GET_MILLISEC(end);
+	sinfo->stats->error = error;
+
+	sphinxStatReport(conname, host, port, statquery, sinfo->stats);
+}
+
+
+/*
+ * Return the time searchd reports in SHOW META for the last query, in ms,
+ * or -1 if it doesn't.
+ */
+static double
+fetchMetaTime(remoteConn *rconn)
+{
+	MYSQL_RES  *res;
+	MYSQL_ROW	row;
+	double		result = -1;
+
+	if (sphinxExecQuery(rconn, "SHOW META") || !(res = mysql_store_result(rconn->conn)))
+		return -1;
+
+	while ((row = mysql_fetch_row(res)))
+	{
+		if (row[0] && row[1] && strcmp(row[0], "time") == 0)
+		{
+			result = strtod(row[1], NULL) * 1000.0;
+			break;
+		}
+	}
+	mysql_free_result(res);
+
+	return result;
+}
+
+
+/*
+ * Execute the joined statements of sphinx_query_batch() and store the rows of
+ * all their result sets into a tuplestore.  A SphinxAPI connection sends the
+ * statements as the queries of one request instead.
+ */
+static void
+materializeBatchResult(FunctionCallInfo fcinfo, remoteConn *rconn, const char *sql,
+					   char **stmts, int nstmts)
+{
+	volatile storeInfo sinfo;
+
+	/* initialize storeInfo to empty */
+	memset((void *) &sinfo, 0, sizeof(sinfo));
+	sinfo.fcinfo = fcinfo;
+	sinfo.tmpcontext = AllocSetContextCreate(CurrentMemoryContext,
+											 "sphinxlink temporary context",
+											 ALLOCSET_DEFAULT_SIZES);
+
+	if (rconn->api)
+		storeApiResult(&sinfo, rconn, stmts, nstmts, true);
+	else
+		storeBatchResult(&sinfo, rconn, sql);
+
+	MemoryContextDelete(sinfo.tmpcontext);
+	sinfo.tmpcontext = NULL;
+}
+
+
+/*
+ * Fetch every match of sql for sphinx_query_all() and store it into a
+ * tuplestore.
+ *
+ * The query is run in pages of page_size rows ordered by id, each page
+ * starting after the last id of the previous one, so no page is slower than
+ * the first and max_matches never caps the result.  As soon as a page has
+ * arrived the query for the next one is sent, and searchd works on it while
+ * we convert and store the current rows.  At most one page is held in
+ * client memory; the tuplestore spills to disk beyond work_mem.
+ */
+static void
+materializeAllResult(FunctionCallInfo fcinfo, const char *conname, remoteConn *rconn,
+					 const char *sql, int page_size)
+{
+	volatile storeInfo sinfo;
+	MYSQL	   *conn = rconn->conn;
+	MYSQL_RES  *volatile res = NULL;
+	volatile bool pending = false;
+	bool		has_where = checkPagedQuery(sql);
+	int			len = strlen(sql);
+	StringInfoData query;
+	sphinxQueryStats stats;
+	instr_time	start;
+	instr_time	wait;
+
+	/* a trailing semicolon would end up before the added clauses */
+	while (len > 0 && (sql[len - 1] == ';' || scanner_isspace(sql[len - 1])))
+		len--;
+
+	memset((void *) &sinfo, 0, sizeof(sinfo));
+	sinfo.fcinfo = fcinfo;
+	sinfo.tmpcontext = AllocSetContextCreate(CurrentMemoryContext,
+											 "sphinxlink temporary context",
+											 ALLOCSET_DEFAULT_SIZES);
+
+	INSTR_TIME_SET_ZERO(start);
+	INSTR_TIME_SET_ZERO(wait);
+	if (sphinxStatEnabled())
+	{
+		memset(&stats, 0, sizeof(stats));
+		stats.meta_time = -1;
+		sinfo.stats = &stats;
+		INSTR_TIME_SET_CURRENT(start);
+	}
+
+	initStringInfo(&query);
+
+	PG_TRY();
+	{
+		bool		first = true;
+
+		formatPageQuery(&query, sql, len, has_where, NULL, page_size);
+		sendPageQuery(rconn, query.data);
+		pending = true;
+
+		while (pending)
+		{
+			unsigned int nfields;
+			int			idcol;
+			MYSQL_ROW	row;
+
+			STAT_TIMER_START(&sinfo, wait);
+			if (sphinxReadQueryResult(rconn))
+			{
+				sphinxGroupReportError(rconn);
+				ereport(ERROR,
+						(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+						 errmsg("Could not execute query: %s", mysql_error(conn))));
+			}
+			pending = false;
+			res = mysql_store_result(conn);
+			STAT_TIMER_ADD(&sinfo, wait_time, wait);
+			if (!res)
+				ereport(ERROR,
+						(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+						 errmsg("Could not fetch result: %s", mysql_error(conn))));
+
+			nfields = mysql_num_fields(res);
+			idcol = findIdColumn(res);
+
+			/* a full page: ask for the next one before storing this one */
+			if (mysql_num_rows(res) == (my_ulonglong) page_size)
+			{
+				int64		last_id;
+
+				mysql_data_seek(res, page_size - 1);
+				row = mysql_fetch_row(res);
+				if (!row[idcol] || !parseInt64(row[idcol], mysql_fetch_lengths(res)[idcol], &last_id))
+					ereport(ERROR,
+							(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+							 errmsg("invalid document id in the result of sphinx_query_all()")));
+				mysql_data_seek(res, 0);
+
+				formatPageQuery(&query, sql, len, has_where, &last_id, page_size);
+				sendPageQuery(rconn, query.data);
+				pending = true;
+			}
+
+			while ((row = mysql_fetch_row(res)))
+			{
+				CHECK_FOR_INTERRUPTS();
+				storeRow(&sinfo, row, mysql_fetch_lengths(res), nfields, first);
+				first = false;
+			}
+
+			mysql_free_result(res);
+			res = NULL;
+		}
+
+		if (sinfo.stats)
+			reportQueryStats(&sinfo, conname, rconn->host, rconn->port, sql, start, false);
+	}
+	PG_CATCH();
+	{
+		if (res)
+			mysql_free_result(res);
+		if (pending)
+			sphinxCancelQuery(rconn);
+		if (sinfo.stats)
+			reportQueryStats(&sinfo, conname, rconn->host, rconn->port, sql, start, true);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	MemoryContextDelete(sinfo.tmpcontext);
+	sinfo.tmpcontext = NULL;
+}
+
+
+/*
+ * Is the word at ptr the keyword kw?
+ */
+static bool
+isKeywordAt(const char *ptr, const char *kw)
+{
+	int			len = strlen(kw);
+
+	return pg_strncasecmp(ptr, kw, len) == 0 &&
+		!isalnum((unsigned char) ptr[len]) && ptr[len] != '_';
+}
+
+
+/*
+ * Check that sql can be paged by id: a SELECT without ORDER BY, GROUP BY,
+ * LIMIT, OPTION or FACET, as those are added or would break the pages.
+ * Returns whether it has a WHERE clause.
+ *
+ * A word is taken for a clause only outside parentheses and quotes, and
+ * only if what follows it fits the clause, so attributes named like one
+ * (as in "WHERE limit > 5" or "SELECT group, order FROM ...") are fine.
+ *
+ * Pages after the first append "AND id > last" to the condition, which
+ * only restricts all of it if it has no OR outside parentheses.
+ */
+static bool
+checkPagedQuery(const char *sql)
+{
+	const char *ptr = sql;
+	const char *clause = NULL;
+	bool		has_where = false;
+	int			depth = 0;
+
+	while (*ptr)
+	{
+		const char *word = ptr;
+		const char *next;
+		int			len;
+
+		/* skip quoted strings and names */
+		if (*ptr == '\'' || *ptr == '"' || *ptr == '`')
+		{
+			char		quote = *ptr++;
+
+			while (*ptr && *ptr != quote)
+			{
+				if (*ptr == '\\' && ptr[1])
+					ptr++;
+				ptr++;
+			}
+			if (*ptr)
+				ptr++;
+			continue;
+		}
+
+		if (!isalpha((unsigned char) *ptr) && *ptr != '_')
+		{
+			if (*ptr == '(')
+				depth++;
+			else if (*ptr == ')' && depth > 0)
+				depth--;
+			ptr++;
+			continue;
+		}
+
+		while (isalnum((unsigned char) *ptr) || *ptr == '_')
+			ptr++;
+		if (depth > 0)
+			continue;
+
+		len = ptr - word;
+		next = ptr;
+		while (isspace((unsigned char) *next))
+			next++;
+
+		if (len == 5 && pg_strncasecmp(word, "WHERE", 5) == 0)
+			has_where = true;
+		else if (has_where && len == 2 && pg_strncasecmp(word, "OR", 2) == 0)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("condition of sphinx_query_all() must not have OR outside parentheses"),
+					 errhint("Put the alternatives in parentheses, as in WHERE (a = 1 OR b = 2).")));
+		else if (len == 5 && pg_strncasecmp(word, "ORDER", 5) == 0)
+		{
+			if (isKeywordAt(next, "BY"))
+				clause = "ORDER BY";
+		}
+		else if (len == 5 && pg_strncasecmp(word, "GROUP", 5) == 0)
+		{
+			/* WITHIN GROUP ORDER BY is found by its ORDER */
+			if (isKeywordAt(next, "BY"))
+				clause = "GROUP BY";
+		}
+		else if (len == 5 && pg_strncasecmp(word, "LIMIT", 5) == 0)
+		{
+			if (isdigit((unsigned char) *next))
+				clause = "LIMIT";
+		}
+		else if (len == 6 && pg_strncasecmp(word, "OPTION", 6) == 0)
+		{
+			/* OPTION name = value */
+			const char *eq = next;
+
+			while (isalnum((unsigned char) *eq) || *eq == '_')
+				eq++;
+			while (isspace((unsigned char) *eq))
+				eq++;
+			if (eq > next && *eq == '=' && eq[1] != '=')
+				clause = "OPTION";
+		}
+		else if (len == 5 && pg_strncasecmp(word, "FACET", 5) == 0)
+		{
+			/* FACET expr, but not an attribute in a condition */
+			if ((isalpha((unsigned char) *next) || *next == '_' || *next == '`') &&
+				!isKeywordAt(next, "IN") && !isKeywordAt(next, "NOT") &&
+				!isKeywordAt(next, "BETWEEN") && !isKeywordAt(next, "AND") &&
+				!isKeywordAt(next, "OR") && !isKeywordAt(next, "IS"))
+				clause = "FACET";
+		}
+
+		if (clause)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("query of sphinx_query_all() must not contain %s", clause),
+					 errhint("Rows are returned ordered by id, in pages of page_size rows.")));
+	}
+
+	return has_where;
+}
+
+
+/*
+ * Build the query for the page after last_id (the first page if NULL)
+ */
+static void
+formatPageQuery(StringInfo buf, const char *sql, int len, bool has_where,
+				const int64 *last_id, int page_size)
+{
+	resetStringInfo(buf);
+	appendBinaryStringInfo(buf, sql, len);
+	if (last_id)
+		appendStringInfo(buf, " %s id > " INT64_FORMAT, has_where ? "AND" : "WHERE", *last_id);
+	appendStringInfo(buf, " ORDER BY id ASC LIMIT %d OPTION max_matches=%d", page_size, page_size);
+}
+
+
+static int
+findIdColumn(MYSQL_RES *res)
+{
+	MYSQL_FIELD *fields = mysql_fetch_fields(res);
+	unsigned int i;
+
+	for (i = 0; i < mysql_num_fields(res); i++)
+	{
+		if (pg_strcasecmp(fields[i].name, "id") == 0)
+			return (int) i;
+	}
+
+	ereport(ERROR,
+			(errcode(ERRCODE_DATATYPE_MISMATCH),
+			 errmsg("result of sphinx_query_all() must include the id column")));
+	return -1;					/* keep compiler quiet */
+}
+
+
+static void
+sendPageQuery(remoteConn *rconn, const char *query)
+{
+	const char *utf8 = sphinxToUTF8Encoding(query);
+
+	sphinxCheckIdle(rconn);
+	if (sphinxSendQuery(rconn->conn, &rconn->options, utf8))
+	{
+		sphinxGroupReportError(rconn);
+		ereport(ERROR,
+				(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+				 errmsg("Could not execute query: %s", mysql_error(rconn->conn))));
+	}
+}
+
+
+/*
+ * Execute sql on every node of sphinx_query_multi() and store the combined
+ * result into a tuplestore.
+ *
+ * The query is sent to all nodes before we wait for any of them, and results
+ * are read in the order nodes answer, so the total latency is that of the
+ * slowest node rather than the sum.  With a sort key rows go through a
+ * tuplesort, bounded to max_rows (a top-K heap) if that is given; without
+ * one we stop once max_rows have been stored, and the queries still running
+ * on the other nodes are killed.
+ */
+static void
+materializeMultiResult(FunctionCallInfo fcinfo,
+					   multiNode *nodes,
+					   int nnodes,
+					   const char *sql,
+					   const char *sort_key,
+					   int max_rows,
+					   bool allow_partial)
+{
+	volatile storeInfo sinfo;
+	Tuplesortstate *volatile sortstate = NULL;
+	TupleTableSlot *volatile slot = NULL;
+	MYSQL_RES  *volatile res = NULL;
+	WaitEventSet *volatile set = NULL;
+	const char *query = sphinxToUTF8Encoding(sql);
+	int64		nstored = 0;
+	int			npending = 0;
+	int			i;
+
+	/* initialize storeInfo to empty */
+	memset((void *) &sinfo, 0, sizeof(sinfo));
+	sinfo.fcinfo = fcinfo;
+	sinfo.tmpcontext = AllocSetContextCreate(CurrentMemoryContext,
+											 "sphinxlink temporary context",
+											 ALLOCSET_DEFAULT_SIZES);
+
+	PG_TRY();
+	{
+		/* send the query everywhere before waiting for anything */
+		for (i = 0; i < nnodes; i++)
+		{
+			if (sphinxSendQuery(nodes[i].conn, &nodes[i].rconn->options, query))
+				reportNodeError(&nodes[i], allow_partial);
+			else
+			{
+				nodes[i].pending = true;
+				npending++;
+			}
+		}
+
+		set = createNodeWaitSet(nodes, nnodes);
+		while (npending > 0 && (sortstate || max_rows <= 0 || nstored < max_rows))
+		{
+			multiNode  *node = waitForAnyNode(set);
+			unsigned int nfields;
+			MYSQL_ROW	row;
+
+			node->pending = false;
+			npending--;
+			ModifyWaitEvent(set, node->event_pos, 0, NULL);
+
+			if (mysql_read_query_result(node->conn) ||
+				(!(res = mysql_store_result(node->conn)) && mysql_field_count(node->conn) != 0))
+			{
+				reportNodeError(node, allow_partial);
+				continue;
+			}
+			if (!res)
+				continue;
+
+			nfields = mysql_num_fields(res);
+			if (!sinfo.tuplestore)
+				initStoreResult(&sinfo);
+			if (nfields != sinfo.plan->tupdesc->natts)
+				ereport(ERROR,
+						(errcode(ERRCODE_DATATYPE_MISMATCH),
+						 errmsg("remote query result rowtype does not match "
+								"the specified FROM clause rowtype"),
+						 errdetail("Connection \"%s\" returned %u columns.", node->name, nfields)));
+			if (sort_key && !sortstate)
+			{
+				sortstate = beginMultiSort(sinfo.plan->tupdesc, sort_key, max_rows);
+				slot = MakeSingleTupleTableSlot(sinfo.plan->tupdesc, &TTSOpsMinimalTuple);
+			}
+
+			while ((row = mysql_fetch_row(res)))
+			{
+				MemoryContext oldcontext;
+
+				CHECK_FOR_INTERRUPTS();
+
+				if (!sortstate && max_rows > 0 && nstored >= max_rows)
+					break;
+
+				oldcontext = MemoryContextSwitchTo(sinfo.tmpcontext);
+				convertRow(sinfo.plan, row, mysql_fetch_lengths(res), nfields);
+				if (sortstate)
+				{
+					ExecClearTuple(slot);
+					memcpy(slot->tts_values, sinfo.plan->values, nfields * sizeof(Datum));
+					memcpy(slot->tts_isnull, sinfo.plan->nulls, nfields * sizeof(bool));
+					ExecStoreVirtualTuple(slot);
+					tuplesort_puttupleslot(sortstate, slot);
+				}
+				else
+					tuplestore_putvalues(sinfo.tuplestore, sinfo.plan->tupdesc,
+										 sinfo.plan->values, sinfo.plan->nulls);
+				MemoryContextSwitchTo(oldcontext);
+				MemoryContextReset(sinfo.tmpcontext);
+				nstored++;
+			}
+			mysql_free_result(res);
+			res = NULL;
+
+			/* drop any extra result sets */
+			while (mysql_next_result(node->conn) == 0)
+			{
+				if ((res = mysql_store_result(node->conn)))
+					mysql_free_result(res);
+				res = NULL;
+			}
+		}
+		FreeWaitEventSet(set);
+		set = NULL;
+
+		/* max_rows are stored, the other answers aren't needed */
+		for (i = 0; i < nnodes; i++)
+		{
+			if (nodes[i].pending)
+				sphinxCancelQuery(nodes[i].rconn);
+			nodes[i].pending = false;
+		}
+
+		if (sortstate)
+		{
+			tuplesort_performsort(sortstate);
+			while (tuplesort_gettupleslot(sortstate, true, false, slot, NULL))
+				tuplestore_puttupleslot(sinfo.tuplestore, slot);
+			tuplesort_end(sortstate);
+			ExecDropSingleTupleTableSlot(slot);
+		}
+
+		MemoryContextDelete(sinfo.tmpcontext);
+		sinfo.tmpcontext = NULL;
+	}
+	PG_CATCH();
+	{
+		if (res)
+			mysql_free_result(res);
+		if (set)
+			FreeWaitEventSet(set);
+
+		/* stop the queries still running and keep the connections in sync */
+		for (i = 0; i < nnodes; i++)
+		{
+			if (nodes[i].pending)
+				sphinxCancelQuery(nodes[i].rconn);
+			nodes[i].pending = false;
+		}
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+}
+
+
+/*
+ * Set up a tuplesort for the sort key of sphinx_query_multi(): a result
+ * column name, optionally followed by ASC or DESC.
+ */
+static Tuplesortstate *
+beginMultiSort(TupleDesc tupdesc, const char *sort_key, int max_rows)
+{
+	char	   *spec = pstrdup(sort_key);
+	char	   *saveptr = NULL;
+	char	   *colname;
+	char	   *dir = NULL;
+	AttrNumber	attno = InvalidAttrNumber;
+	Form_pg_attribute att;
+	Oid			sortop;
+	Oid			collation;
+	bool		desc;
+	bool		nullsfirst;
+	Tuplesortstate *state;
+	int			i;
+
+	colname = strtok_r(spec, " \t", &saveptr);
+	if (colname)
+		dir = strtok_r(NULL, " \t", &saveptr);
+	if (!colname || (dir && strtok_r(NULL, " \t", &saveptr)) ||
+		(dir && pg_strcasecmp(dir, "asc") != 0 && pg_strcasecmp(dir, "desc") != 0))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid sort key \"%s\"", sort_key),
+				 errhint("Sort key must be a result column name, optionally followed by ASC or DESC.")));
+	desc = (dir && pg_strcasecmp(dir, "desc") == 0);
+
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		if (strcmp(NameStr(TupleDescAttr(tupdesc, i)->attname), colname) == 0)
+		{
+			attno = i + 1;
+			break;
+		}
+	}
+	if (attno == InvalidAttrNumber)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_COLUMN),
+				 errmsg("sort key column \"%s\" does not exist in the result", colname)));
+
+	att = TupleDescAttr(tupdesc, attno - 1);
+	if (desc)
+		get_sort_group_operators(att->atttypid, false, false, true,
+								 NULL, NULL, &sortop, NULL);
+	else
+		get_sort_group_operators(att->atttypid, true, false, false,
+								 &sortop, NULL, NULL, NULL);
+	collation = att->attcollation;
+	nullsfirst = desc;
+
+	state = tuplesort_begin_heap(tupdesc, 1, &attno, &sortop, &collation,
+								 &nullsfirst, work_mem, NULL,
+#if (PG_VERSION_NUM >= 150000)
+								 TUPLESORT_NONE);
+#else
+								 false);
+#endif
+	if (max_rows > 0)
+		tuplesort_set_bound(state, max_rows);
+
+	return state;
+}
+
+
+/*
+ * Wait event set for the sockets of the nodes with a query in flight.  A
+ * node's socket is taken out of it by clearing its events once the node has
+ * answered.
+ */
+static WaitEventSet *
+createNodeWaitSet(multiNode *nodes, int nnodes)
+{
+	WaitEventSet *set;
+	int			i;
+
+#if (PG_VERSION_NUM >= 170000)
+	set = CreateWaitEventSet(CurrentResourceOwner, nnodes + 2);
+#else
+	set = CreateWaitEventSet(CurrentMemoryContext, nnodes + 2);
+#endif
+	AddWaitEventToSet(set, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+	AddWaitEventToSet(set, WL_EXIT_ON_PM_DEATH, PGINVALID_SOCKET, NULL, NULL);
+	for (i = 0; i < nnodes; i++)
+	{
+		if (nodes[i].pending)
+			nodes[i].event_pos = AddWaitEventToSet(set, WL_SOCKET_READABLE,
+												   sphinxGetSocket(nodes[i].conn),
+												   NULL, &nodes[i]);
+	}
+
+	return set;
+}
+
+
+/*
+ * Wait until one of the nodes with a query in flight has data to read.
+ */
+static multiNode *
+waitForAnyNode(WaitEventSet *set)
+{
+	for (;;)
+	{
+		WaitEvent	event;
+		int			rc;
+
+		rc = WaitEventSetWait(set, -1, &event, 1, sphinxWaitEvent());
+
+		if (rc > 0 && (event.events & WL_SOCKET_READABLE))
+			return (multiNode *) event.user_data;
+
+		if (rc > 0 && (event.events & WL_LATCH_SET))
+		{
+			ResetLatch(MyLatch);
+			CHECK_FOR_INTERRUPTS();
+		}
+	}
+}
+
+
+static void
+reportNodeError(multiNode *node, bool allow_partial)
+{
+	sphinxGroupReportError(node->rconn);
+	ereport(allow_partial ? WARNING : ERROR,
+			(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+			 errmsg("Could not execute query on connection \"%s\": %s",
+					node->name, mysql_error(node->conn))));
+}
+
+
+/*
+ * Read and throw away the answer to a query sent with mysql_send_query(),
+ * so the connection can be used again.
+ */
+static void
+discardPendingResult(MYSQL *conn)
+{
+	MYSQL_RES  *res;
+
+	if (mysql_read_query_result(conn))
+		return;
+
+	do
+	{
+		if ((res = mysql_store_result(conn)))
+			mysql_free_result(res);
+	} while (mysql_next_result(conn) == 0);
+}
+
+
+/*
+ * Read and throw away the result sets still to come after the current one
+ * of a multi-statement answer.
+ */
+static void
+discardResultSets(MYSQL *conn)
+{
+	MYSQL_RES  *res;
+
+	while (mysql_more_results(conn) && mysql_next_result(conn) == 0)
+	{
+		if ((res = mysql_store_result(conn)))
+			mysql_free_result(res);
+	}
+}
+
+
+/*
+ * Wait event reported while waiting for searchd
+ */
+uint32
+sphinxWaitEvent(void)
+{
+#if (PG_VERSION_NUM >= 170000)
+	static uint32 wait_event = 0;
+
+	if (wait_event == 0)
+		wait_event = WaitEventExtensionNew("SphinxQuery");
+	return wait_event;
+#else
+	return PG_WAIT_EXTENSION;
+#endif
+}
+
+
+/*
+ * Like mysql_query(), but wait for the answer on the latch so that query
+ * cancel and statement_timeout work while searchd is busy.  A query that is
+ * cancelled or runs into the read_timeout of the connection is killed on the
+ * server.  Returns zero on success.
+ */
+int
+sphinxExecQuery(remoteConn *rconn, const char *query)
+{
+	sphinxCheckIdle(rconn);
+
+	if (rconn->group)
+		return sphinxGroupExecQuery(rconn, query);
+
+	if (sphinxSendQuery(rconn->conn, &rconn->options, query))
+		return 1;
+
+	return sphinxReadQueryResult(rconn);
+}
+
+
+/*
+ * mysql_send_query(), keeping the keepalive options of the connection across
+ * reconnects.  Returns zero on success.
+ */
+int
+sphinxSendQuery(MYSQL *conn, const sphinxConnOptions *options, const char *query)
+{
+	unsigned long thread_id = mysql_thread_id(conn);
+	char	   *errmsg;
+
+	if (mysql_send_query(conn, query, strlen(query)))
+		return 1;
+
+	/* the client library reconnected: the new socket needs its keepalives */
+	if (mysql_thread_id(conn) != thread_id &&
+		!setKeepalives(conn, options, &errmsg))
+		ereport(WARNING,
+				(errcode(ERRCODE_CONNECTION_FAILURE),
+				 errmsg("%s", errmsg)));
+
+	return 0;
+}
+
+
+/*
+ * Refuse to send a query on a connection whose sphinx_send_query() answer is
+ * still unread; the client library would mix up the two answers.
+ */
+void
+sphinxCheckIdle(remoteConn *rconn)
+{
+	if (rconn->pending)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("another query is in progress on this connection"),
+				 errhint("Read its result with sphinx_get_result() first.")));
+}
+
+
+/*
+ * Wait for and read the answer to a query sent with mysql_send_query(), the
+ * second half of sphinxExecQuery().
+ */
+int
+sphinxReadQueryResult(remoteConn *rconn)
+{
+	PG_TRY();
+	{
+		waitForResult(rconn);
+	}
+	PG_CATCH();
+	{
+		sphinxCancelQuery(rconn);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	return mysql_read_query_result(rconn->conn);
+}
+
+
+static void
+waitForResult(remoteConn *rconn)
+{
+	TimestampTz deadline = 0;
+
+	if (rconn->options.read_timeout > 0)
+		deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+											   rconn->options.read_timeout * 1000L);
+
+	for (;;)
+	{
+		int			events = WL_LATCH_SET | WL_SOCKET_READABLE | WL_EXIT_ON_PM_DEATH;
+		long		timeout = -1;
+		int			rc;
+
+		if (deadline)
+		{
+			timeout = (deadline - GetCurrentTimestamp()) / 1000;
+			if (timeout <= 0)
+				ereport(ERROR,
+						(errcode(ERRCODE_QUERY_CANCELED),
+						 errmsg("Sphinx query timed out after %d s", rconn->options.read_timeout)));
+			events |= WL_TIMEOUT;
+		}
+
+		rc = WaitLatchOrSocket(MyLatch, events, sphinxGetSocket(rconn->conn),
+							   timeout, sphinxWaitEvent());
+
+		if (rc & WL_SOCKET_READABLE)
+			return;
+
+		if (rc & WL_LATCH_SET)
+		{
+			ResetLatch(MyLatch);
+			CHECK_FOR_INTERRUPTS();
+		}
+	}
+}
+
+
+/*
+ * Stop the query in flight on rconn and get the connection back in sync.
+ * Once the query is killed searchd answers right away; if it can't be killed,
+ * the socket is shut down rather than waiting for the answer, and the client
+ * library reconnects on the next query.
+ */
+void
+sphinxCancelQuery(remoteConn *rconn)
+{
+	if (sphinxKillQuery(rconn->host, rconn->port, mysql_thread_id(rconn->conn),
+						&rconn->options))
+		discardPendingResult(rconn->conn);
+	else
+		shutdown(sphinxGetSocket(rconn->conn), SHUT_RDWR);
+}
+
+
+/*
+ * Kill the query running on the searchd connection with the given thread id,
+ * through a connection of its own.  Doesn't throw; problems are reported as
+ * warnings.
+ */
+bool
+sphinxKillQuery(const char *host, int port, unsigned long thread_id,
+				const sphinxConnOptions *options)
+{
+	sphinxConnOptions killoptions;
+	MYSQL	   *conn;
+	char	   *errmsg;
+	char		query[64];
+	bool		result;
+
+	/* don't let a cancel hang on an unreachable searchd */
+	memset(&killoptions, 0, sizeof(killoptions));
+	killoptions.connect_timeout = KILL_CONNECT_TIMEOUT;
+	if (options && options->connect_timeout > 0)
+		killoptions.connect_timeout = options->connect_timeout;
+	killoptions.read_timeout = killoptions.write_timeout = killoptions.connect_timeout;
+	if (options)
+		strlcpy(killoptions.socket, options->socket, MAXPGPATH);
+
+	if (!(conn = sphinxConnect(host, port, &killoptions, &errmsg)))
+	{
+		ereport(WARNING,
+				(errcode(ERRCODE_CONNECTION_FAILURE),
+				 errmsg("Could not cancel Sphinx query: %s", errmsg)));
+		return false;
+	}
+
+	snprintf(query, sizeof(query), "KILL QUERY %lu", thread_id);
+	result = (mysql_query(conn, query) == 0);
+	if (!result)
+		ereport(WARNING,
+				(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
+				 errmsg("Could not cancel Sphinx query: %s", mysql_error(conn))));
+	mysql_close(conn);
+
+	return result;
+}
+
+
+/*
+ * Socket of a connection, for waiting on it with the latch machinery.
+ */
+pgsocket
+sphinxGetSocket(MYSQL *conn)
+{
+#if defined(MARIADB_PACKAGE_VERSION) || defined(MARIADB_BASE_VERSION)
+	return (pgsocket) mysql_get_socket(conn);
+#else
+	return (pgsocket) conn->net.fd;
+#endif
+}
+
+
+TupleDesc
+createTemplateTupleDescImpl(int nargs)
+{
+#if (PG_VERSION_NUM >= 120000)
+	return CreateTemplateTupleDesc(nargs);
+#else
+	return CreateTemplateTupleDesc(nargs, false);
+#endif
+}
+
+
+/*
+ * Look up a connection opened with sphinx_connect(), failing if there is
+ * none.
+ */
+remoteConn *
+sphinxGetNamedConnection(const char *conname)
+{
+	remoteConn *rconn = getConnectionByName(conname);
+
+	if (rconn)
+		checkSphinxQL(rconn, conname);
+	if (!rconn || !rconn->conn)
+		ereport(ERROR,
+				(errcode(ERRCODE_CONNECTION_DOES_NOT_EXIST),
+				 errmsg("connection \"%s\" is not available", conname)));
+
+	return rconn;
+}
+
+
+/*
+ * Refuse a SphinxAPI connection to what needs SphinxQL
+ */
+static void
+checkSphinxQL(remoteConn *rconn, const char *conname)
+{
+	if (rconn && rconn->api)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("connection \"%s\" uses the SphinxAPI protocol", conname),
+				 errhint("SphinxAPI connections only run sphinx_query() and sphinx_query_batch().")));
+}
+
+
+remoteConn *
+getConnectionByName(const char *name)
+{
+	remoteConnHashEnt *hentry;
+	char	   *key;
+
+	if (!remoteConnHash)
+		remoteConnHash = createConnHash();
+
+	key = pstrdup(name);
+	truncate_identifier(key, strlen(key), false);
+	hentry = (remoteConnHashEnt *) hash_search(remoteConnHash,
+											   key, HASH_FIND, NULL);
+
+	if (hentry)
+		return hentry->rconn;
+
+	/* a parallel worker opens the leader's connection on first use */
+	if (IsParallelWorker())
+		return openPublishedConnection(key);
+
+	return NULL;
+}
+
+
+/*
+ * Get the connection to host:port used by sphinx_query_params() and the
+ * foreign data wrapper, opening it on first use.
+ */
+remoteConn *
+sphinxGetConnection(const char *host, int port)
+{
+	StringInfoData	conntmppl;
+	remoteConn	   *rconn;
+
+	initStringInfo(&conntmppl);
+
+	appendStringInfo(&conntmppl, "sph-%s-%d", host, port);
+
+	if (!(rconn = getConnectionByName(conntmppl.data)))
+	{
+		createNewConnection(conntmppl.data, host, port, NULL);
+		rconn = getConnectionByName(conntmppl.data);
+	}
+	if (strcmp(rconn->host, host) || (rconn->port != port))
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("connection with name \"%s\" already exists, but creadentials are different", conntmppl.data)));
+
+	pfree(conntmppl.data);
+
+	return rconn;
+}
+
+
+HTAB *
+createConnHash(void)
+{
+	HASHCTL		ctl;
+
+	ctl.keysize = NAMEDATALEN;
+	ctl.entrysize = sizeof(remoteConnHashEnt);
+
+	return hash_create("Remote Con hash", NUMCONN, &ctl, HASH_ELEM);
+}
+
+
+/*
+ * Open a connection to searchd.  On failure returns NULL and sets *errmsg
+ * instead of throwing, so the pool worker can use it too.  options may be
+ * NULL.
+ */
+MYSQL *
+sphinxConnect(const char *host, int port, const sphinxConnOptions *options, char **errmsg)
+{
+	MYSQL	   *conn;
+	int			reconnect = 1;
+	my_bool		disabled = 0;
+
+	*errmsg = NULL;
+
+	conn = mysql_init(NULL);
+	if (!conn)
+	{
+		*errmsg = pstrdup("failed to initialise MySQL connection object");
+		return NULL;
+	}
+
+	/* Sphinx only works with UTF8, so make connection with it */
+	mysql_options(conn, MYSQL_SET_CHARSET_NAME, "UTF8");
+	mysql_options(conn, MYSQL_OPT_RECONNECT, &reconnect);
+	/* MDEV-31857: enable MYSQL_OPT_SSL_VERIFY_SERVER_CERT by default */
+	mysql_options(conn, MYSQL_OPT_SSL_VERIFY_SERVER_CERT, &disabled);
+
+	if (options)
+	{
+		unsigned int timeout;
+
+		if ((timeout = options->connect_timeout) > 0)
+			mysql_options(conn, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+		if ((timeout = options->read_timeout) > 0)
+			mysql_options(conn, MYSQL_OPT_READ_TIMEOUT, &timeout);
+		if ((timeout = options->write_timeout) > 0)
+			mysql_options(conn, MYSQL_OPT_WRITE_TIMEOUT, &timeout);
+		if (options->compress)
+			mysql_options(conn, MYSQL_OPT_COMPRESS, NULL);
+		if (options->socket[0])
+		{
+			unsigned int protocol = MYSQL_PROTOCOL_SOCKET;
+
+			mysql_options(conn, MYSQL_OPT_PROTOCOL, &protocol);
+		}
+	}
+
+	/* sphinx_query_batch() sends several statements at once */
+	if (!mysql_real_connect(conn, host, NULL, NULL, NULL, port,
+							options && options->socket[0] ? options->socket : NULL,
+							CLIENT_MULTI_STATEMENTS))
+	{
+		*errmsg = psprintf("failed to connect to Sphinx: %s", mysql_error(conn));
+		mysql_close(conn);
+		return NULL;
+	}
+
+	if (!setKeepalives(conn, options, errmsg))
+	{
+		mysql_close(conn);
+		return NULL;
+	}
+
+	return conn;
+}
+
+
+/*
+ * Apply the TCP keepalive options to the socket of a connection.  Nothing to
+ * do for Unix sockets or when no keepalive option is set.  On failure returns
+ * false and sets *errmsg.
+ */
+static bool
+setKeepalives(MYSQL *conn, const sphinxConnOptions *options, char **errmsg)
+{
+	if (!options || options->socket[0] ||
+		(options->keepalives_idle == 0 && options->keepalives_interval == 0 &&
+		 options->keepalives_count == 0))
+		return true;
+
+	return sphinxSetKeepalives(sphinxGetSocket(conn), options, errmsg);
+}
+
+
+/*
+ * The same for a socket of our own, see sphinx_api.c
+ */
+bool
+sphinxSetKeepalives(pgsocket sock, const sphinxConnOptions *options, char **errmsg)
+{
+	int			on = 1;
+
+	if (!options || options->socket[0] ||
+		(options->keepalives_idle == 0 && options->keepalives_interval == 0 &&
+		 options->keepalives_count == 0))
+		return true;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) < 0)
+		goto fail;
+#ifdef TCP_KEEPIDLE
+	if (options->keepalives_idle > 0 &&
+		setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE,
+				   &options->keepalives_idle, sizeof(int)) < 0)
+		goto fail;
+#endif
+#ifdef TCP_KEEPINTVL
+	if (options->keepalives_interval > 0 &&
+		setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL,
+				   &options->keepalives_interval, sizeof(int)) < 0)
+		goto fail;
+#endif
+#ifdef TCP_KEEPCNT
+	if (options->keepalives_count > 0 &&
+		setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT,
+				   &options->keepalives_count, sizeof(int)) < 0)
+		goto fail;
+#endif
+	return true;
+
+fail:
+	*errmsg = psprintf("could not set TCP keepalive on Sphinx connection: %m");
+	return false;
+}
+
+
+void
+createNewConnection(const char *name,
+					const char *host,
+					const int port,
+					const sphinxConnOptions *options)
+{
+	MYSQL	   *conn;
+	sphinxApiConn *api;
+	char	   *msg;
+
+	if (options && options->api)
+	{
+		if (!(api = sphinxApiConnect(host, port, options, &msg)))
+			ereport(ERROR,
+					(errcode(ERRCODE_CONNECTION_FAILURE),
+					 errmsg("%s", msg)));
+		addConnection(name, NULL, host, port, options)->api = api;
+		return;
+	}
+
+	if (!(conn = sphinxConnect(host, port, options, &msg)))
+		ereport(ERROR,
+				(errcode(ERRCODE_CONNECTION_FAILURE),
+				 errmsg("%s", msg)));
+
+	addConnection(name, conn, host, port, options);
+}
+
+
+/*
+ * Enter an open connection into the hash table under name.
+ */
+static remoteConn *
+addConnection(const char *name,
+			  MYSQL *conn,
+			  const char *host,
+			  const int port,
+			  const sphinxConnOptions *options)
+{
+	remoteConnHashEnt *hentry;
+	bool			found;
+	char		   *key;
+	remoteConn	   *rconn = NULL;
+
+	if (!remoteConnHash)
+		remoteConnHash = createConnHash();
+
+	/* create hash entry */
+	rconn = (remoteConn *) MemoryContextAlloc(TopMemoryContext,
+											  sizeof(remoteConn));
+
+	rconn->conn = conn;
+	snprintf(rconn->host, MAXHOSTLEN - 1, "%s", host);
+	rconn->port = port;
+	if (options)
+		rconn->options = *options;
+	else
+		memset(&rconn->options, 0, sizeof(sphinxConnOptions));
+	rconn->templates = NULL;
+	rconn->max_packet = 0;
+	rconn->pending = false;
+	rconn->answered = false;
+	rconn->answer = NIL;
+	rconn->answer_error = NULL;
+	rconn->group = NULL;
+	rconn->api = NULL;
+
+	/* add it to hash map */
+	key = pstrdup(name);
+	truncate_identifier(key, strlen(key), true);
+	hentry = (remoteConnHashEnt *) hash_search(remoteConnHash, key,
+											   HASH_ENTER, &found);
+
+	hentry->rconn = rconn;
+	strlcpy(hentry->name, name, sizeof(hentry->name));
+
+	return rconn;
+}
+
+
+/*
+ * Parse the options of sphinx_connect(), a list of key=value pairs separated
+ * by spaces or commas.  Timeouts and keepalive intervals take time units and
+ * default to seconds.
  */
 static void
-materializeQueryResult(FunctionCallInfo fcinfo,
-					   MYSQL *conn,
-					   const char *sql,
-					   const char *match_clause)
+parseConnOptions(const char *str, sphinxConnOptions *options)
 {
-	volatile storeInfo sinfo;
-
-	/* initialize storeInfo to empty */
-	memset((void *) &sinfo, 0, sizeof(sinfo));
-	sinfo.fcinfo = fcinfo;
+	char	   *buf = pstrdup(str);
+	char	   *opt;
+	char	   *saveptr = NULL;
 
-	PG_TRY();
+	for (opt = strtok_r(buf, " \t\n,", &saveptr); opt; opt = strtok_r(NULL, " \t\n,", &saveptr))
 	{
-		/* Create short-lived memory context for data conversions */
-		sinfo.tmpcontext = AllocSetContextCreate(CurrentMemoryContext,
-												 "sphinxlink temporary context",
-												 ALLOCSET_DEFAULT_SIZES);
+		char	   *value = strchr(opt, '=');
+		int		   *target;
+		int			flags = GUC_UNIT_S;
+		int			result;
+		const char *hintmsg = NULL;
 
-		/* execute query, collecting any tuples into the tuplestore */
-		if (!storeQueryResult(&sinfo, conn, sql, match_clause))
+		if (!value)
+			ereport(ERROR,
+					(errcode(ERRCODE_SYNTAX_ERROR),
+					 errmsg("invalid connection option \"%s\"", opt),
+					 errhint("Options are given as key=value.")));
+		*value++ = '\0';
+
+		if (strcmp(opt, "connect_timeout") == 0)
+			target = &options->connect_timeout;
+		else if (strcmp(opt, "read_timeout") == 0)
+			target = &options->read_timeout;
+		else if (strcmp(opt, "write_timeout") == 0)
+			target = &options->write_timeout;
+		else if (strcmp(opt, "keepalives_idle") == 0)
+			target = &options->keepalives_idle;
+		else if (strcmp(opt, "keepalives_interval") == 0)
+			target = &options->keepalives_interval;
+		else if (strcmp(opt, "keepalives_count") == 0)
+		{
+			target = &options->keepalives_count;
+			flags = 0;
+		}
+		else if (strcmp(opt, "hedge_delay") == 0)
+		{
+			target = &options->hedge_delay;
+			flags = GUC_UNIT_MS;
+		}
+		else if (strcmp(opt, "eject_errors") == 0)
+		{
+			target = &options->eject_errors;
+			flags = 0;
+		}
+		else if (strcmp(opt, "eject_time") == 0)
+			target = &options->eject_time;
+		else if (strcmp(opt, "socket") == 0)
+		{
+			if (value[0] != '/' || strlen(value) >= MAXPGPATH)
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("invalid value for connection option \"%s\": \"%s\"", opt, value),
+						 errhint("The socket is given as an absolute path.")));
+			strlcpy(options->socket, value, MAXPGPATH);
+			continue;
+		}
+		else if (strcmp(opt, "compress") == 0)
 		{
-			char	   *err = pstrdup(mysql_error(conn));
+			if (!parse_bool(value, &options->compress))
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("invalid value for connection option \"%s\": \"%s\"", opt, value)));
+			continue;
+		}
+		else if (strcmp(opt, "protocol") == 0)
+		{
+			if (pg_strcasecmp(value, "sphinxql") == 0)
+				options->api = false;
+			else if (pg_strcasecmp(value, "api") == 0)
+				options->api = true;
+			else
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+						 errmsg("invalid value for connection option \"%s\": \"%s\"", opt, value),
+						 errhint("The protocol is sphinxql or api.")));
+			continue;
+		}
+		else
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("unrecognized connection option \"%s\"", opt),
+					 errhint("Valid options are connect_timeout, read_timeout, write_timeout, socket, "
+							 "compress, keepalives_idle, keepalives_interval, keepalives_count, "
+							 "hedge_delay, eject_errors, eject_time and protocol.")));
 
+		if (!parse_int(value, &result, flags, &hintmsg) || result < 0)
 			ereport(ERROR,
-					(errcode(ERRCODE_SQL_ROUTINE_EXCEPTION),
-					 errmsg("Error when send query to Sphinx: %s", err)));
-		}
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid value for connection option \"%s\": \"%s\"", opt, value),
+					 hintmsg ? errhint("%s", _(hintmsg)) : 0));
+		*target = result;
+	}
 
-		/* clean up data conversion short-lived memory context */
-		if (sinfo.tmpcontext != NULL)
-			MemoryContextDelete(sinfo.tmpcontext);
-		sinfo.tmpcontext = NULL;
+	pfree(buf);
+}
+
+
+/*
+ * Append the options that differ from the defaults, in the form
+ * parseConnOptions() reads back.
+ */
+static void
+formatConnOptions(StringInfo buf, const sphinxConnOptions *options)
+{
+	const char *sep = "";
+
+#define APPEND_INT_OPTION(name) \
+	do { \
+		if (options->name > 0) \
+		{ \
+			appendStringInfo(buf, "%s" #name "=%d", sep, options->name); \
+			sep = ","; \
+		} \
+	} while (0)
+
+	APPEND_INT_OPTION(connect_timeout);
+	APPEND_INT_OPTION(read_timeout);
+	APPEND_INT_OPTION(write_timeout);
+	if (options->socket[0])
+	{
+		appendStringInfo(buf, "%ssocket=%s", sep, options->socket);
+		sep = ",";
 	}
-	PG_CATCH();
+	if (options->compress)
 	{
-		PG_RE_THROW();
+		appendStringInfo(buf, "%scompress=on", sep);
+		sep = ",";
 	}
-	PG_END_TRY();
+	APPEND_INT_OPTION(keepalives_idle);
+	APPEND_INT_OPTION(keepalives_interval);
+	APPEND_INT_OPTION(keepalives_count);
+	APPEND_INT_OPTION(hedge_delay);
+	APPEND_INT_OPTION(eject_errors);
+	APPEND_INT_OPTION(eject_time);
+	if (options->api)
+		appendStringInfo(buf, "%sprotocol=api", sep);
+
+#undef APPEND_INT_OPTION
 }
 
 
-TupleDesc
-createTemplateTupleDescImpl(int nargs)
+/*
+ * Describe the open connections in sphinxlink.connections.  Parallel
+ * workers get the leader's settings, so they can open connections of their
+ * own under the same names; see openPublishedConnection().  Connections are
+ * separated by ';', their name, host, port, options and, for a replica
+ * group, its replicas as host:port,host:port by spaces.
+ */
+static void
+publishConnections(void)
 {
-#if (PG_VERSION_NUM >= 120000)
-	return CreateTemplateTupleDesc(nargs);
-#else
-	return CreateTemplateTupleDesc(nargs, false);
-#endif
+	StringInfoData buf;
+	HASH_SEQ_STATUS status;
+	remoteConnHashEnt *entry;
+
+	initStringInfo(&buf);
+	hash_seq_init(&status, remoteConnHash);
+	while ((entry = (remoteConnHashEnt *) hash_seq_search(&status)) != NULL)
+	{
+		sphinxGroup *group = entry->rconn->group;
+		StringInfoData options;
+
+		if (buf.len > 0)
+			appendStringInfoChar(&buf, ';');
+		appendEscapedField(&buf, entry->name);
+		appendStringInfoChar(&buf, ' ');
+		appendEscapedField(&buf, entry->rconn->host);
+		appendStringInfo(&buf, " %d ", entry->rconn->port);
+
+		initStringInfo(&options);
+		formatConnOptions(&options, &entry->rconn->options);
+		appendEscapedField(&buf, options.data);
+		if (group)
+		{
+			int			i;
+
+			resetStringInfo(&options);
+			for (i = 0; i < group->nreplicas; i++)
+				appendStringInfo(&options, "%s%s:%d", i > 0 ? "," : "",
+								 group->replicas[i].host, group->replicas[i].port);
+			appendStringInfoChar(&buf, ' ');
+			appendEscapedField(&buf, options.data);
+		}
+		pfree(options.data);
+	}
+
+	if (publishedConnections)
+		pfree(publishedConnections);
+	publishedConnections = MemoryContextStrdup(TopMemoryContext, buf.data);
+	pfree(buf.data);
+
+	syncPublishedConnections();
 }
 
 
-remoteConn *
-getConnectionByName(const char *name)
+/*
+ * Set sphinxlink.connections to what publishConnections() put together.  It
+ * is set again whenever it differs: settings made in a transaction that
+ * aborts are taken back, and a superuser can change it.  It can't be set
+ * during a parallel operation, and doesn't need to be.
+ */
+static void
+syncPublishedConnections(void)
 {
-	remoteConnHashEnt *hentry;
-	char	   *key;
+	if (!publishedConnections || IsInParallelMode())
+		return;
 
-	if (!remoteConnHash)
-		remoteConnHash = createConnHash();
+	if (!sphinx_connections_desc || strcmp(sphinx_connections_desc, publishedConnections) != 0)
+		SetConfigOption("sphinxlink.connections", publishedConnections, PGC_SUSET, PGC_S_SESSION);
+}
 
-	key = pstrdup(name);
-	truncate_identifier(key, strlen(key), false);
-	hentry = (remoteConnHashEnt *) hash_search(remoteConnHash,
-											   key, HASH_FIND, NULL);
 
-	if (hentry)
-		return hentry->rconn;
+/*
+ * ExecutorStart hook: parallel workers copy the settings of the leader when
+ * they start, so sphinxlink.connections must be current before the executor
+ * runs.
+ */
+static void
+connectionsExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+	syncPublishedConnections();
 
-	return NULL;
+	if (prev_ExecutorStart)
+		prev_ExecutorStart(queryDesc, eflags);
+	else
+		standard_ExecutorStart(queryDesc, eflags);
 }
 
 
-HTAB *
-createConnHash(void)
+static void
+appendEscapedField(StringInfo buf, const char *str)
 {
-	HASHCTL		ctl;
+	for (; *str; str++)
+	{
+		if (*str == '\\' || *str == ' ' || *str == ';')
+			appendStringInfoChar(buf, '\\');
+		appendStringInfoChar(buf, *str);
+	}
+}
 
-	ctl.keysize = NAMEDATALEN;
-	ctl.entrysize = sizeof(remoteConnHashEnt);
 
-	return hash_create("Remote Con hash", NUMCONN, &ctl, HASH_ELEM);
+/*
+ * Unescape the field at *str in place and advance *str past its separator.
+ * Returns NULL at the end of a connection.
+ */
+static char *
+nextEscapedField(char **str)
+{
+	char	   *field = *str;
+	char	   *src = *str;
+	char	   *dst = *str;
+
+	if (*src == '\0' || *src == ';')
+		return NULL;
+
+	while (*src && *src != ' ' && *src != ';')
+	{
+		if (*src == '\\' && src[1])
+			src++;
+		*dst++ = *src++;
+	}
+	if (*src == ' ')
+		src++;
+	*str = src;
+	*dst = '\0';
+
+	return field;
 }
 
 
-void
-createNewConnection(const char *name,
-					const char *host,
-					const int port)
+/*
+ * Open the connection the leader has under name, as published in
+ * sphinxlink.connections.  Returns NULL if there is none.
+ */
+static remoteConn *
+openPublishedConnection(const char *name)
 {
-	remoteConnHashEnt *hentry;
-	bool			found;
-	char		   *key;
-	MYSQL		   *conn = NULL;
-	remoteConn	   *rconn = NULL;
-	int				reconnect = 1;
-	my_bool			disabled = 0;
+	char	   *buf;
+	char	   *pos;
 
-	if (!remoteConnHash)
-		remoteConnHash = createConnHash();
+	if (!sphinx_connections_desc || !*sphinx_connections_desc)
+		return NULL;
 
-	conn = mysql_init(NULL);
-	if (!conn)
+	buf = pstrdup(sphinx_connections_desc);
+	pos = buf;
+	while (*pos)
 	{
-		safe_free(rconn, true);
-		ereport(ERROR,
-				(errcode(ERRCODE_INTERNAL_ERROR),
-				 errmsg("failed to initialise MySQL connection object")));
+		char	   *conname = nextEscapedField(&pos);
+		char	   *host = nextEscapedField(&pos);
+		char	   *port = nextEscapedField(&pos);
+		char	   *options = nextEscapedField(&pos);
+		char	   *replicas = options ? nextEscapedField(&pos) : NULL;
+
+		/* skip anything left of the connection */
+		while (nextEscapedField(&pos))
+			;
+		if (*pos == ';')
+			pos++;
+
+		/* options are empty for a connection with the defaults */
+		if (conname && host && port && strcmp(conname, name) == 0)
+		{
+			sphinxConnOptions opts;
+			remoteConn *rconn;
+
+			memset(&opts, 0, sizeof(opts));
+			if (options)
+				parseConnOptions(options, &opts);
+			if (replicas && *replicas)
+				rconn = openPublishedGroup(conname, replicas, &opts);
+			else
+			{
+				createNewConnection(conname, host,
+									parsePublishedAddress(conname, host, port), &opts);
+				rconn = getConnectionByName(conname);
+			}
+			pfree(buf);
+			return rconn;
+		}
 	}
 
-	/* Sphinx only works with UTF8, so make connection with it */
-	mysql_options(conn, MYSQL_SET_CHARSET_NAME, "UTF8");
-	mysql_options(conn, MYSQL_OPT_RECONNECT, &reconnect);
-	/* MDEV-31857: enable MYSQL_OPT_SSL_VERIFY_SERVER_CERT by default */
-	mysql_options(conn, MYSQL_OPT_SSL_VERIFY_SERVER_CERT, &disabled);
+	pfree(buf);
+	return NULL;
+}
 
-	if (!mysql_real_connect(conn, host, NULL, NULL, NULL, port, NULL, 0))
-	{
-		char	   *msg;
 
-		msg = pstrdup(mysql_error(conn));
-		mysql_close(conn);
-		safe_free(rconn, true);
+/*
+ * Check a host and port published in sphinxlink.connections, which a
+ * superuser may have set by hand, and return the port.
+ */
+static int
+parsePublishedAddress(const char *name, const char *host, const char *port)
+{
+	char	   *end;
+	long		value;
 
+	errno = 0;
+	value = strtol(port, &end, 10);
+	if (errno || *end || end == port || value <= 0 || value > 65535 ||
+		host[0] == '\0' || strlen(host) >= MAXHOSTLEN)
 		ereport(ERROR,
-				(errcode(ERRCODE_CONNECTION_FAILURE),
-				 errmsg("failed to connect to Sphinx: %s", msg)));
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid address \"%s:%s\" of connection \"%s\" in sphinxlink.connections",
+						host, port, name),
+				 errhint("Addresses are given as host:port.")));
+
+	return (int) value;
+}
+
+
+/*
+ * Open a replica group published as host:port,host:port under name.  The
+ * worker keeps its own latency and health counters for the replicas.
+ */
+static remoteConn *
+openPublishedGroup(const char *name, char *replicas, const sphinxConnOptions *options)
+{
+	int			nreplicas = 1;
+	char	  **hosts;
+	int		   *ports;
+	char	   *pos;
+	int			i;
+
+	for (pos = replicas; *pos; pos++)
+		if (*pos == ',')
+			nreplicas++;
+
+	hosts = (char **) palloc(nreplicas * sizeof(char *));
+	ports = (int *) palloc(nreplicas * sizeof(int));
+	pos = replicas;
+	for (i = 0; i < nreplicas; i++)
+	{
+		char	   *colon;
+
+		hosts[i] = pos;
+		if ((pos = strchr(pos, ',')))
+			*pos++ = '\0';
+		if ((colon = strrchr(hosts[i], ':')))
+			*colon++ = '\0';
+		ports[i] = parsePublishedAddress(name, hosts[i], colon ? colon : "");
 	}
 
-	/* create hash entry */
-	rconn = (remoteConn *) MemoryContextAlloc(TopMemoryContext,
-											  sizeof(remoteConn));
+	return addGroupConnection(name, nreplicas, hosts, ports, options);
+}
 
-	rconn->conn = conn;
-	snprintf(rconn->host, MAXHOSTLEN - 1, "%s", host);
-	rconn->port = port;
 
-	/* add it to hash map */
-	key = pstrdup(name);
-	truncate_identifier(key, strlen(key), true);
-	hentry = (remoteConnHashEnt *) hash_search(remoteConnHash, key,
-											   HASH_ENTER, &found);
+/*
+ * Connect to the replicas of a group and enter it into the hash table under
+ * name.
+ */
+static remoteConn *
+addGroupConnection(const char *name, int nreplicas, char **hosts, int *ports,
+				   const sphinxConnOptions *options)
+{
+	sphinxGroup *group = sphinxCreateGroup(nreplicas, hosts, ports, options);
+	sphinxReplica *replica = &group->replicas[group->current];
+	remoteConn *rconn;
 
-	hentry->rconn = rconn;
-	strlcpy(hentry->name, name, sizeof(hentry->name));
+	rconn = addConnection(name, replica->conn, replica->host, replica->port, options);
+	rconn->group = group;
+
+	return rconn;
+}
+
+
+static void
+freeTemplates(remoteConn *rconn)
+{
+	HASH_SEQ_STATUS status;
+	sphinxTemplate *templ;
+
+	if (!rconn->templates)
+		return;
+
+	hash_seq_init(&status, rconn->templates);
+	while ((templ = (sphinxTemplate *) hash_seq_search(&status)) != NULL)
+		MemoryContextDelete(templ->cxt);
+	hash_destroy(rconn->templates);
+	rconn->templates = NULL;
 }
 
 
@@ -767,32 +4205,209 @@ deleteConnection(const char *name)
 }
 
 
-char *
-toMyDatabaseEncoding(const char *value)
+/*
+ * Convert a column value from UTF8 to the database encoding, updating
+ * *length.  ASCII values, most of what Sphinx sends, are the same in every
+ * server encoding and are returned as they are.  Others are converted into
+ * plan->convbuf, which the caller has to consume before the next call.
+ */
+static char *
+toMyDatabaseEncoding(convPlan *plan, char *value, unsigned long *length)
 {
-	int		encoding = GetDatabaseEncoding();
-	char   *encoded = NULL;
+	char	   *encoded;
 
-	if (encoding == PG_UTF8)
-		return (char *) value;
+	if (plan->encoding == PG_UTF8 || plan->encoding == PG_SQL_ASCII ||
+		isAscii(value, *length))
+		return value;
+
+#if (PG_VERSION_NUM >= 140000)
+	if (OidIsValid(plan->convproc) &&
+		*length < (MaxAllocSize - 1) / MAX_CONVERSION_GROWTH)
+	{
+		resetStringInfo(&plan->convbuf);
+		enlargeStringInfo(&plan->convbuf, *length * MAX_CONVERSION_GROWTH + 1);
+		pg_do_encoding_conversion_buf(plan->convproc, PG_UTF8, plan->encoding,
+									  (unsigned char *) value, *length,
+									  (unsigned char *) plan->convbuf.data,
+									  plan->convbuf.maxlen, false);
+		*length = strlen(plan->convbuf.data);
+		return plan->convbuf.data;
+	}
+#endif
 
 	encoded = (char *) pg_do_encoding_conversion((unsigned char *) value,
-												 strlen(value),
+												 *length,
 												 PG_UTF8,
-												 encoding);
+												 plan->encoding);
+	if (encoded != value)
+		*length = strlen(encoded);
 	return encoded;
 }
 
+
+/*
+ * Check that no byte of value has the high bit set, a vector at a time.
+ */
+static inline bool
+isAscii(const char *value, size_t length)
+{
+	const unsigned char *ptr = (const unsigned char *) value;
+	const unsigned char *end = ptr + length;
+	uint64		accum = 0;
+
+#if (PG_VERSION_NUM >= 160000)
+	if (length >= sizeof(Vector8))
+	{
+		Vector8		vaccum = vector8_broadcast(0);
+
+		for (; ptr + sizeof(Vector8) <= end; ptr += sizeof(Vector8))
+		{
+			Vector8		chunk;
+
+			vector8_load(&chunk, ptr);
+			vaccum = vector8_or(vaccum, chunk);
+		}
+		if (vector8_is_highbit_set(vaccum))
+			return false;
+	}
+#endif
+
+	for (; ptr + sizeof(uint64) <= end; ptr += sizeof(uint64))
+	{
+		uint64		chunk;
+
+		memcpy(&chunk, ptr, sizeof(uint64));
+		accum |= chunk;
+	}
+	for (; ptr < end; ptr++)
+		accum |= *ptr;
+
+	return (accum & UINT64CONST(0x8080808080808080)) == 0;
+}
+
+
+/*
+ * Convert text of the database, such as column values and names, to UTF8.
+ * Unlike sphinxToUTF8Encoding() this doesn't depend on client_encoding.
+ */
+char *
+sphinxDatabaseToUTF8(const char *value)
+{
+	int			encoding = GetDatabaseEncoding();
+	size_t		length;
+
+	if (encoding == PG_UTF8)
+		return (char *) value;
+
+	length = strlen(value);
+	if (isAscii(value, length))
+		return (char *) value;
+
+	return (char *) pg_do_encoding_conversion((unsigned char *) value,
+											  length,
+											  encoding,
+											  PG_UTF8);
+}
+
+
+/*
+ * Append an index or attribute name to buf, in backticks unless it is a
+ * plain name that isn't a reserved word of SphinxQL.
+ */
+void
+sphinxAppendIdentifier(StringInfo buf, const char *ident)
+{
+	static const char *const reserved[] = {
+		"and", "as", "by", "div", "facet", "false", "from", "in", "is", "limit",
+		"mod", "not", "null", "or", "order", "select", "true"
+	};
+	const char *ptr;
+	bool		plain = (ident[0] != '\0' && !isdigit((unsigned char) ident[0]));
+	int			i;
+
+	for (ptr = ident; *ptr && plain; ptr++)
+		plain = !IS_HIGHBIT_SET(*ptr) && (isalnum((unsigned char) *ptr) || *ptr == '_');
+	for (i = 0; i < lengthof(reserved) && plain; i++)
+		plain = (pg_strcasecmp(ident, reserved[i]) != 0);
+
+	if (plain)
+	{
+		appendStringInfoString(buf, ident);
+		return;
+	}
+
+	if (ident[0] == '\0' || strchr(ident, '`'))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_NAME),
+				 errmsg("\"%s\" is not a valid Sphinx identifier", ident)));
+
+	appendStringInfoChar(buf, '`');
+	appendStringInfoString(buf, sphinxDatabaseToUTF8(ident));
+	appendStringInfoChar(buf, '`');
+}
+
+
+/*
+ * Append a quoted SphinxQL string literal to buf.
+ *
+ * This escapes the same characters as mysql_real_escape_string() does for
+ * UTF8, but doesn't need a connection and writes straight into buf.
+ */
+void
+sphinxAppendEscapedString(StringInfo buf, const char *str)
+{
+	const char *ptr = str;
+
+	appendStringInfoChar(buf, '\'');
+	for (;;)
+	{
+		/* copy the run of characters that need no escaping at once */
+		size_t		run = strcspn(ptr, "'\\\"\n\r\032");
+
+		appendBinaryStringInfo(buf, ptr, run);
+		ptr += run;
+		if (!*ptr)
+			break;
+
+		switch (*ptr)
+		{
+			case '\n':
+				appendStringInfoString(buf, "\\n");
+				break;
+			case '\r':
+				appendStringInfoString(buf, "\\r");
+				break;
+			case '\032':
+				appendStringInfoString(buf, "\\Z");
+				break;
+			default:
+				appendStringInfoChar(buf, '\\');
+				appendStringInfoChar(buf, *ptr);
+				break;
+		}
+		ptr++;
+	}
+	appendStringInfoChar(buf, '\'');
+}
+
+
 char *
-toUTF8Encoding(const char *value)
+sphinxToUTF8Encoding(const char *value)
 {
 	int		encoding = GetDatabaseEncoding();
 	char   *encoded = NULL;
+	size_t	length;
 
 	if ((encoding == PG_UTF8) || (pg_get_client_encoding() != PG_UTF8))
 		return (char *) value;
+
+	/* queries are mostly ASCII, which needs no conversion */
+	length = strlen(value);
+	if (isAscii(value, length))
+		return (char *) value;
+
 	encoded = (char *) pg_do_encoding_conversion((unsigned char *) value,
-												 strlen(value),
+												 length,
 												 encoding,
 												 PG_UTF8);
 	return encoded;
@@ -1,3 +1,19 @@
+/*
+ * sphinxlink.h
+ *
+ * Declarations shared between sphinxlink modules
+ *
+ * contrib/sphinxlink/sphinxlink.h
+ */
+#ifndef SPHINXLINK_H
+#define SPHINXLINK_H
+
+#include "funcapi.h"
+#include "lib/stringinfo.h"
+#include "utils/hsearch.h"
+#include "utils/portal.h"
+#include "utils/timestamp.h"
+
 #define list_length mysql_list_length
 #define list_delete mysql_list_delete
 #define list_free mysql_list_free
@@ -6,3 +22,270 @@
 #undef list_length
 #undef list_delete
 #undef list_free
+
+#define MAXHOSTLEN 1024
+
+/* Options of sphinx_connect(), times in seconds (0 for no limit or default) */
+typedef struct sphinxConnOptions
+{
+	int			connect_timeout;
+	int			read_timeout;
+	int			write_timeout;
+	char		socket[MAXPGPATH];	/* Unix socket instead of host:port, or "" */
+	bool		compress;		/* compressed client/server protocol */
+	int			keepalives_idle;	/* TCP keepalive settings */
+	int			keepalives_interval;
+	int			keepalives_count;
+	int			hedge_delay;	/* replica groups: ms before a hedged query */
+	int			eject_errors;	/* failures in a row that eject a replica */
+	int			eject_time;		/* for how long */
+	bool		api;			/* SphinxAPI protocol instead of SphinxQL */
+} sphinxConnOptions;
+
+/* Connection speaking the SphinxAPI protocol, see sphinx_api.c */
+typedef struct sphinxApiConn sphinxApiConn;
+
+/* Result of one query of a SphinxAPI request */
+typedef struct sphinxApiResult
+{
+	char	   *error;			/* message of a failed query, or NULL */
+	int			ncolumns;
+	int		   *columns;		/* attribute of each column, or negative for id and weight */
+	int			nattrs;
+	uint32	   *types;			/* type of each attribute */
+	bool		id64;			/* 64-bit document ids */
+	int			nmatches;
+	int			match;			/* matches returned so far */
+	const char *pos;			/* next match in the response */
+	const char *end;
+	char	  **meta;			/* name and value pairs of a local SHOW META */
+} sphinxApiResult;
+
+/* Replica of a group, see sphinx_group.c */
+typedef struct sphinxReplica
+{
+	char		host[MAXHOSTLEN];
+	int			port;
+	MYSQL	   *conn;			/* NULL until connected */
+	bool		draining;		/* lost a hedge, its answer is still unread */
+	double		latency;		/* moving average of query time in ms, or 0 */
+	int			errors;			/* failures in a row */
+	TimestampTz ejected_until;	/* not used before this time, or 0 */
+	int64		queries;
+	int64		failures;
+	int64		hedges;			/* hedged duplicates sent to it */
+} sphinxReplica;
+
+typedef struct sphinxGroup
+{
+	int			current;		/* replica the connection uses now */
+	int			nreplicas;
+	sphinxReplica replicas[FLEXIBLE_ARRAY_MEMBER];
+} sphinxGroup;
+
+/* Global Module Structures */
+typedef struct remoteConn
+{
+	MYSQL	   *conn;				/* Hold the remote connection */
+	int			port;				/* Sphinx port for connection */
+	char		host[MAXHOSTLEN];	/* Host for connection */
+	sphinxConnOptions options;
+	HTAB	   *templates;			/* sphinx_prepare() templates, or NULL */
+	int			max_packet;			/* max_allowed_packet of searchd, or 0 */
+	bool		pending;			/* sphinx_send_query() answer not read yet */
+	bool		answered;			/* that answer was read by sphinx_is_busy() */
+	List	   *answer;				/* its result sets */
+	char	   *answer_error;		/* or the error it ended with */
+	sphinxGroup *group;			/* replicas behind conn, or NULL */
+	sphinxApiConn *api;			/* used instead of conn, or NULL */
+} remoteConn;
+
+
+/* Literal text of a template followed by a placeholder */
+typedef struct templatePart
+{
+	int			offset;			/* literal text in sql */
+	int			len;
+	int			param;			/* 1-based parameter after it, or 0 */
+} templatePart;
+
+
+/* Parsed query template, an entry of remoteConn.templates */
+typedef struct sphinxTemplate
+{
+	char		name[NAMEDATALEN];	/* hash key, must be first */
+	MemoryContext cxt;			/* holds everything below */
+	char	   *sql;
+	int			nparts;
+	templatePart *parts;
+	int			nparams;
+} sphinxTemplate;
+
+
+/* How a result column is turned into a Datum */
+typedef enum convKind
+{
+	CONV_INPUT = 0,				/* type input function */
+	CONV_TEXT,
+	CONV_INT4,
+	CONV_INT8,
+	CONV_FLOAT4,
+	CONV_FLOAT8,
+	CONV_BOOL,
+	CONV_TIMESTAMP,
+	CONV_TIMESTAMPTZ
+} convKind;
+
+
+/* Row conversion plan for a result rowtype, cached in fn_extra */
+typedef struct convPlan
+{
+	TupleDesc	tupdesc;		/* rowtype the plan was built for */
+	bool		typed;			/* value of sphinxlink.typed_conversion */
+	AttInMetadata *attinmeta;	/* input functions for the fallback path */
+	convKind   *kinds;			/* per-column conversion */
+	Datum	   *values;			/* work arrays for one row */
+	bool	   *nulls;
+	int			encoding;		/* database encoding */
+	Oid			convproc;		/* conversion from UTF8, or InvalidOid */
+	StringInfoData convbuf;		/* value converted to the database encoding */
+} convPlan;
+
+
+/* Counters of one sphinx_query() call, see sphinx_stat.c */
+typedef struct sphinxQueryStats
+{
+	int64		rows;
+	int64		bytes;			/* received column data */
+	double		wait_time;		/* ms until the result header arrived */
+	double		fetch_time;		/* ms reading rows */
+	double		convert_time;	/* ms converting and storing rows */
+	double		total_time;
+	double		meta_time;		/* ms reported by SHOW META, or -1 */
+	bool		reconnected;
+	bool		error;
+} sphinxQueryStats;
+
+
+/* Counters of one sphinxBulkLoad() call, see sphinx_bulk.c */
+typedef struct sphinxBulkResult
+{
+	int64		rows;
+	int64		affected;
+	int64		statements;
+	int64		bytes;
+	double		wait_time;		/* ms blocked on searchd */
+} sphinxBulkResult;
+
+/* How a column is written by sphinx_bulk_replace(), see sphinx_bulk.c */
+typedef enum bulkKind
+{
+	BULK_INT = 0,				/* int2, int4, int8 */
+	BULK_BOOL,
+	BULK_STRING,				/* anything written through its output function */
+	BULK_ARRAY,					/* multi-value attribute */
+	BULK_OTHER					/* numbers and timestamps, see sphinxAppendValue() */
+} bulkKind;
+
+typedef struct bulkColumn
+{
+	bulkKind	kind;
+	Oid			type;
+	FmgrInfo	outfunc;		/* for BULK_STRING */
+} bulkColumn;
+
+/* Request handed over to the connection pool, see sphinx_pool.c */
+typedef struct sphinxPoolRequest sphinxPoolRequest;
+
+
+/* sphinxlink.c */
+extern remoteConn *sphinxGetConnection(const char *host, int port);
+extern remoteConn *sphinxGetNamedConnection(const char *conname);
+extern MYSQL *sphinxConnect(const char *host, int port, const sphinxConnOptions *options,
+							char **errmsg);
+extern pgsocket sphinxGetSocket(MYSQL *conn);
+extern uint32 sphinxWaitEvent(void);
+extern int	sphinxExecQuery(remoteConn *rconn, const char *query);
+extern int	sphinxSendQuery(MYSQL *conn, const sphinxConnOptions *options, const char *query);
+extern int	sphinxReadQueryResult(remoteConn *rconn);
+extern void sphinxCheckIdle(remoteConn *rconn);
+extern void sphinxCancelQuery(remoteConn *rconn);
+extern bool sphinxKillQuery(const char *host, int port, unsigned long thread_id,
+							const sphinxConnOptions *options);
+extern convPlan *sphinxCreateConvPlan(TupleDesc tupdesc);
+extern Datum sphinxConvertValue(convPlan *plan, int attnum, char *value, unsigned long length);
+extern void sphinxAppendEscapedString(StringInfo buf, const char *str);
+extern char *sphinxToUTF8Encoding(const char *value);
+extern char *sphinxDatabaseToUTF8(const char *value);
+extern void sphinxAppendIdentifier(StringInfo buf, const char *ident);
+extern bool sphinxSetKeepalives(pgsocket sock, const sphinxConnOptions *options, char **errmsg);
+
+/* sphinx_pool.c */
+extern void sphinxPoolInit(void);
+extern bool sphinxPoolEnabled(void);
+extern sphinxPoolRequest *sphinxPoolSend(const char *host, int port, const char *query);
+extern bool sphinxPoolNextRow(sphinxPoolRequest *req, unsigned int *nfields,
+							  char ***values, unsigned long **lengths);
+extern void sphinxPoolRelease(sphinxPoolRequest *req);
+extern void sphinxSerializeRow(StringInfo buf, MYSQL_ROW row, unsigned long *lengths,
+							   unsigned int nfields);
+extern void sphinxDeserializeRow(const char *data, Size len, unsigned int nfields,
+								 char **values, unsigned long *lengths);
+
+/* sphinx_template.c */
+extern void sphinxParseTemplate(sphinxTemplate *templ, const char *sql);
+extern void sphinxFormatTemplate(StringInfo buf, sphinxTemplate *templ,
+								 Datum *args, Oid *types, bool *nulls);
+extern void sphinxAppendValue(StringInfo buf, Datum value, Oid type);
+
+/* sphinx_cache.c */
+extern void sphinxCacheInit(void);
+extern bool sphinxCacheUsable(const char *query);
+extern Size sphinxCacheMaxEntrySize(void);
+extern char *sphinxCacheLookup(const char *host, int port, const char *query,
+							   unsigned int *nfields, Size *rowslen);
+extern void sphinxCacheStore(const char *host, int port, const char *query,
+							 unsigned int nfields, const char *rows, Size rowslen);
+
+/* sphinx_stat.c */
+extern void sphinxStatInit(void);
+extern bool sphinxStatEnabled(void);
+extern bool sphinxStatTrackQueries(void);
+extern void sphinxStatReport(const char *conname, const char *host, int port,
+							 const char *query, sphinxQueryStats *stats);
+
+/* sphinx_bulk.c */
+extern void sphinxBulkLoad(remoteConn *rconn, const char *index, Portal portal, int batch_size,
+						   bool replace, sphinxBulkResult *result);
+extern int	sphinxGetMaxPacket(remoteConn *rconn);
+extern bulkColumn *sphinxBulkColumns(TupleDesc tupdesc, StringInfo names);
+extern void sphinxFormatBulkRow(StringInfo buf, bulkColumn *columns, TupleDesc tupdesc,
+								HeapTuple tuple);
+
+/* sphinx_sync.c */
+extern void sphinxSyncInit(void);
+
+/* sphinx_group.c */
+extern sphinxGroup *sphinxCreateGroup(int nreplicas, char **hosts, int *ports,
+									  const sphinxConnOptions *options);
+extern void sphinxFreeGroup(sphinxGroup *group);
+extern int	sphinxGroupExecQuery(remoteConn *rconn, const char *query);
+extern void sphinxGroupChooseReplica(remoteConn *rconn, const char *query);
+extern void sphinxGroupReportError(remoteConn *rconn);
+
+/* sphinx_join.c */
+extern void sphinxJoinInit(void);
+
+/* sphinx_estimate.c */
+extern void sphinxEstimateInit(void);
+extern void sphinxEstimateRecord(const char *sql, const char *match_clause, double rows, double time);
+
+/* sphinx_api.c */
+extern sphinxApiConn *sphinxApiConnect(const char *host, int port, const sphinxConnOptions *options,
+									   char **errmsg);
+extern void sphinxApiClose(sphinxApiConn *conn);
+extern sphinxApiResult **sphinxApiSearch(sphinxApiConn *conn, char **queries, int nqueries,
+										 sphinxQueryStats *stats);
+extern bool sphinxApiNextRow(sphinxApiResult *res, convPlan *plan, int first);
+
+#endif							/* SPHINXLINK_H */
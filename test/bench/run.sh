@@ -0,0 +1,189 @@
+#!/bin/bash
+#
+# Benchmarks of sphinxlink against test/mock_searchd.py.
+#
+# Runs pgbench on a set of scenarios and prints rows/sec, p50/p99 latency and
+# the peak memory a backend gained running the query once.  The server is
+# reached through the usual PG* environment variables; memory is read from
+# /proc through pg_read_file(), so it needs a superuser on the same host and
+# is shown as n/a otherwise.
+#
+#   DURATION   seconds per run (default 10)
+#   CLIENTS    backends of the concurrent scenario (default 16)
+#   MOCK_PORT  port of the stand-in searchd (default 19307)
+#   SCENARIOS  space separated subset of: stream typed wide encoding small concurrent paged
+#              transport
+#
+
+set -e
+
+cd "$(dirname "$0")"
+DURATION=${DURATION:-10}
+CLIENTS=${CLIENTS:-16}
+MOCK_PORT=${MOCK_PORT:-19307}
+MOCK_PYTHON=${MOCK_PYTHON:-python3}
+SCENARIOS=${SCENARIOS:-"stream typed wide encoding small concurrent paged transport"}
+DB=sphinxlink_bench
+DB_WIN1251=sphinxlink_bench_win1251
+
+WORK=$(mktemp -d)
+trap 'kill $(cat "$WORK/mock.pid" 2>/dev/null) 2>/dev/null; rm -rf "$WORK"' EXIT
+
+"$MOCK_PYTHON" ../mock_searchd.py --port "$MOCK_PORT" --socket "$WORK/mock.sock" --daemon --pidfile "$WORK/mock.pid"
+
+for db in $DB $DB_WIN1251; do
+	if ! psql -qAt -d postgres -c "SELECT 1 FROM pg_database WHERE datname = '$db'" | grep -q 1; then
+		if [ $db = $DB_WIN1251 ]; then
+			createdb -T template0 -E WIN1251 --lc-collate=C --lc-ctype=C $db
+		else
+			createdb $db
+		fi
+	fi
+	psql -q -d $db -c "CREATE EXTENSION IF NOT EXISTS sphinxlink"
+done
+
+# column definition list for <index family> <number of columns>
+coldefs()
+{
+	local family=$1 ncols=$2 i kinds defs="id bigint"
+
+	case $family in
+		bench) kinds=(bigint float8 text) ;;
+		num) kinds=(bigint float8) ;;
+		*) kinds=(text) ;;
+	esac
+	for ((i = 1; i < ncols; i++)); do
+		defs="$defs, c$i ${kinds[$(((i - 1) % ${#kinds[@]}))]}"
+	done
+	echo "$defs"
+}
+
+# write a pgbench script reading all rows of <index> into a count(*)
+query_script()
+{
+	local name=$1 family=$2 nrows=$3 ncols=$4 suffix=$5
+	local index="${family}_${nrows}_${ncols}${suffix}"
+
+	cat > "$WORK/$name.sql" <<EOF
+SELECT count(*) FROM sphinx_query_params('127.0.0.1', :port,
+    'SELECT * FROM $index LIMIT $nrows OPTION max_matches=$nrows')
+    AS t ($(coldefs $family $ncols));
+EOF
+}
+
+# percentile <p> of the latencies (microseconds) in the pgbench logs
+percentile()
+{
+	cat "$WORK"/log.* | awk '{print $3}' | sort -n |
+		awk -v p=$1 '{v[NR] = $1} END {i = int(NR * p / 100 + 0.5); if (i < 1) i = 1; printf "%.2f", v[i] / 1000}'
+}
+
+# peak memory (kB) a backend gains running the script once
+peak_memory()
+{
+	local db=$1 script=$2
+	local hwm="SELECT (regexp_match(pg_read_file('/proc/' || pg_backend_pid() || '/status'), 'VmHWM:\\s+(\\d+)'))[1]::bigint AS hwm \\gset"
+
+	{
+		echo "$hwm"
+		echo "\\set before :hwm"
+		cat "$script"
+		echo "$hwm"
+		echo "SELECT :hwm - :before AS gained \\gset"
+		echo "\\echo :gained"
+	} | psql -qAt -d $db -v port=$MOCK_PORT -f - 2>/dev/null | tail -1 | grep -E '^[0-9-]+$' || echo n/a
+}
+
+printf "%-12s %-22s %10s %12s %9s %9s %10s\n" scenario variant tps rows/s "p50 ms" "p99 ms" "mem kB"
+
+# run <scenario> <variant> <database> <rows per transaction> <clients> <script> [PGOPTIONS]
+run()
+{
+	local scenario=$1 variant=$2 db=$3 rows=$4 clients=$5 script=$6 options=$7
+	local jobs=$((clients < 4 ? clients : 4)) tps mem
+
+	rm -f "$WORK"/log.*
+	export PGOPTIONS="$options"
+	tps=$(pgbench -n -d $db -f "$script" -T $DURATION -c $clients -j $jobs -D port=$MOCK_PORT \
+		--log --log-prefix="$WORK/log" 2>&1 | awk '/^tps = / {print $3; exit}')
+	mem=$(peak_memory $db "$script")
+	unset PGOPTIONS
+	printf "%-12s %-22s %10.1f %12.0f %9s %9s %10s\n" "$scenario" "$variant" "$tps" \
+		"$(echo "$tps * $rows" | bc)" "$(percentile 50)" "$(percentile 99)" "$mem"
+}
+
+for scenario in $SCENARIOS; do
+	case $scenario in
+		stream)
+			# a large result, held by the client library or read row by row
+			query_script stream bench 100000 4
+			run stream store $DB 100000 1 "$WORK/stream.sql" "-c sphinxlink.stream_results=off"
+			run stream stream $DB 100000 1 "$WORK/stream.sql" "-c sphinxlink.stream_results=on"
+			;;
+		typed)
+			# numeric-heavy rows through the typed parsers or the input functions
+			query_script typed num 20000 16
+			run typed input_functions $DB 20000 1 "$WORK/typed.sql" "-c sphinxlink.typed_conversion=off"
+			run typed typed $DB 20000 1 "$WORK/typed.sql" "-c sphinxlink.typed_conversion=on"
+			;;
+		wide)
+			query_script wide bench 10000 64
+			run wide 64_columns $DB 10000 1 "$WORK/wide.sql"
+			;;
+		encoding)
+			# ASCII and Cyrillic text in a UTF8 and a WIN1251 database
+			query_script ascii text 20000 8
+			query_script cyrillic utf8 20000 8
+			run encoding ascii_utf8 $DB 20000 1 "$WORK/ascii.sql"
+			run encoding ascii_win1251 $DB_WIN1251 20000 1 "$WORK/ascii.sql"
+			run encoding cyrillic_utf8 $DB 20000 1 "$WORK/cyrillic.sql"
+			run encoding cyrillic_win1251 $DB_WIN1251 20000 1 "$WORK/cyrillic.sql"
+			;;
+		small)
+			# many small queries: per-query overhead
+			query_script small bench 10 4
+			run small 10_rows $DB 10 1 "$WORK/small.sql"
+			;;
+		concurrent)
+			# backends waiting on a searchd with 2 ms of latency per query
+			query_script concurrent bench 1000 8 _2ms
+			run concurrent "${CLIENTS}_clients" $DB 1000 $CLIENTS "$WORK/concurrent.sql"
+			;;
+		paged)
+			# sphinx_query_all() reading past max_matches in pages
+			for page in 1000 10000; do
+				cat > "$WORK/paged.sql" <<EOF
+SELECT sphinx_connect('bench', '127.0.0.1', :port)
+    WHERE NOT EXISTS (SELECT 1 FROM sphinx_connections() WHERE conname = 'bench');
+SELECT count(*) FROM sphinx_query_all('bench', 'SELECT * FROM bench_100000_4', $page)
+    AS t ($(coldefs bench 4));
+EOF
+				run paged "page_size_$page" $DB 100000 1 "$WORK/paged.sql"
+			done
+			;;
+		transport)
+			# small and large results over TCP and the Unix socket, plain and compressed
+			for variant in tcp socket tcp_compressed socket_compressed; do
+				case $variant in
+					tcp) options= ;;
+					socket) options="socket=$WORK/mock.sock" ;;
+					tcp_compressed) options="compress=on" ;;
+					socket_compressed) options="socket=$WORK/mock.sock compress=on" ;;
+				esac
+				for rows in 10 10000; do
+					cat > "$WORK/transport.sql" <<EOF
+SELECT sphinx_connect('bench', '127.0.0.1', :port, '$options')
+    WHERE NOT EXISTS (SELECT 1 FROM sphinx_connections() WHERE conname = 'bench');
+SELECT count(*) FROM sphinx_query('bench', 'SELECT * FROM bench_${rows}_4 LIMIT $rows OPTION max_matches=$rows')
+    AS t ($(coldefs bench 4));
+EOF
+					run transport "${variant}_$rows" $DB $rows 1 "$WORK/transport.sql"
+				done
+			done
+			;;
+		*)
+			echo "unknown scenario $scenario" >&2
+			exit 1
+			;;
+	esac
+done
@@ -0,0 +1,1710 @@
+#!/usr/bin/env python3
+#
+# mock_searchd.py
+#
+# A stand-in for searchd speaking the MySQL wire protocol, used by the
+# regression tests and benchmarks of sphinxlink.  It understands the part of
+# SphinxQL the extension sends: SELECT with MATCH(), filters, GROUP BY,
+# ORDER BY, LIMIT, OPTION and FACET, SHOW META/VARIABLES/STATUS, REPLACE, INSERT,
+# DELETE and UPDATE on real-time indexes, CALL SNIPPETS, KILL and SET.
+# "SET GLOBAL max_allowed_packet = n" changes the largest query accepted.
+#
+# Indexes:
+#   docs                  ten fixed documents (id, title, gid, price, tags)
+#   bench_<rows>_<cols>   generated rows of uint, float and string columns
+#   num_<rows>_<cols>     generated rows of uint and float columns only
+#   text_<rows>_<cols>    generated rows of ASCII strings
+#   utf8_<rows>_<cols>    generated rows of Cyrillic strings
+#   anything else         a real-time index, created by the first REPLACE/INSERT
+#
+# Appending _<n>ms to an index name delays every query on it by n
+# milliseconds (e.g. docs_200ms, bench_1000_8_2ms); KILL QUERY ends the wait.
+# "SHOW MOCK QUERIES" returns the statements other than SET received since its
+# previous call, so that tests can check what was sent to searchd.
+# "SHOW MOCK SESSION" tells the transport and compression of the connection.
+#
+# Every --replica-port is another listener on the same indexes, standing in
+# for a replica: its statements are logged separately, and on any port
+# "SET GLOBAL mock_latency = ms" delays the statements of that port and
+# "SET GLOBAL mock_down = 1" makes it drop connections on every statement
+# other than SET.  "SHOW MOCK PORT" tells the port of the connection.
+#
+# --api-port speaks the binary SphinxAPI protocol instead, answering search
+# requests on the same indexes; each request is logged as "SEARCH" followed
+# by the indexes of its queries.  A search on mock_oversized is answered with
+# a header claiming a 4G response and nothing else.
+#
+# Usage: mock_searchd.py --port 19306 [--socket PATH] [--replica-port PORT ...]
+#                        [--api-port PORT] [--daemon --pidfile FILE] [--idle-exit SEC]
+#
+
+import argparse
+import errno
+import os
+import re
+import signal
+import socket
+import socketserver
+import struct
+import sys
+import threading
+import time
+import zlib
+
+SERVER_VERSION = b"2.2.11-id64-release (mock)"
+
+# capability flags
+CLIENT_LONG_PASSWORD = 0x00000001
+CLIENT_FOUND_ROWS = 0x00000002
+CLIENT_LONG_FLAG = 0x00000004
+CLIENT_CONNECT_WITH_DB = 0x00000008
+CLIENT_COMPRESS = 0x00000020
+CLIENT_PROTOCOL_41 = 0x00000200
+CLIENT_TRANSACTIONS = 0x00002000
+CLIENT_SECURE_CONNECTION = 0x00008000
+CLIENT_MULTI_STATEMENTS = 0x00010000
+CLIENT_MULTI_RESULTS = 0x00020000
+CLIENT_PLUGIN_AUTH = 0x00080000
+
+SERVER_CAPABILITIES = (CLIENT_LONG_PASSWORD | CLIENT_FOUND_ROWS | CLIENT_LONG_FLAG |
+                       CLIENT_CONNECT_WITH_DB | CLIENT_COMPRESS | CLIENT_PROTOCOL_41 | CLIENT_TRANSACTIONS |
+                       CLIENT_SECURE_CONNECTION | CLIENT_MULTI_STATEMENTS |
+                       CLIENT_MULTI_RESULTS | CLIENT_PLUGIN_AUTH)
+
+SERVER_STATUS_AUTOCOMMIT = 0x0002
+SERVER_MORE_RESULTS_EXISTS = 0x0008
+
+COM_QUIT = 0x01
+COM_INIT_DB = 0x02
+COM_QUERY = 0x03
+COM_PING = 0x0e
+
+UTF8_GENERAL_CI = 33
+BINARY_CHARSET = 63
+
+# column types
+TYPE_FLOAT = 0x04
+TYPE_LONG = 0x03
+TYPE_LONGLONG = 0x08
+TYPE_STRING = 0xfe
+
+ER_PARSE_ERROR = 1064
+ER_NET_PACKET_TOO_LARGE = 1153
+ER_UNKNOWN_ERROR = 1105
+ER_QUERY_INTERRUPTED = 1317
+
+DEFAULT_LIMIT = 20
+DEFAULT_MAX_MATCHES = 1000
+
+
+class MockError(Exception):
+    def __init__(self, message, code=ER_PARSE_ERROR):
+        Exception.__init__(self, message)
+        self.code = code
+
+
+class Killed(Exception):
+    pass
+
+
+# ---------------------------------------------------------------------------
+# indexes
+
+DOCS = [
+    (1, "The quick brown fox", 1, 9.99, (1, 2)),
+    (2, "Lazy dog sleeps", 1, 19.5, (2,)),
+    (3, "Quick thinking fox", 2, 5.25, (3,)),
+    (4, "Zürich travel guide", 2, 45.0, (1, 3)),
+    (5, "Привет мир", 3, 12.0, (2, 3)),
+    (6, "It's a fox's world", 3, 7.75, (1,)),
+    (7, "Brown bear facts", 1, 3.5, ()),
+    (8, "Fox and hound", 2, 15.0, (2,)),
+    (9, "Back\\slash story", 3, 1.0, (3,)),
+    (10, "Café au lait", 1, 4.2, (1, 2, 3)),
+]
+
+CYRILLIC = "абвгдежзиклмнопрстуфхцчшщэюя"
+
+
+class Index(object):
+    """A set of documents with a schema of (name, kind) pairs"""
+
+    generated = False
+    latency = 0.0
+
+    def __init__(self, name, schema):
+        self.name = name
+        self.schema = schema
+
+    def kind(self, column):
+        for name, kind in self.schema:
+            if name == column:
+                return kind
+        return None
+
+    def rows(self, lo, hi):
+        raise NotImplementedError
+
+    def count(self, lo, hi, filters):
+        """Number of rows in [lo, hi] passing filters on id"""
+        return sum(1 for row in self.rows(lo, hi)
+                   if all(compare(row["id"], c[0], c[2]) for c in filters))
+
+
+class StaticIndex(Index):
+    def __init__(self, name, schema, rows):
+        Index.__init__(self, name, schema)
+        self.docs = dict((row["id"], row) for row in rows)
+
+    def rows(self, lo, hi):
+        for docid in sorted(self.docs):
+            if lo <= docid <= hi:
+                yield self.docs[docid]
+
+
+class RTIndex(StaticIndex):
+    def __init__(self, name):
+        StaticIndex.__init__(self, name, [("id", "bigint")], [])
+
+    def add_column(self, column, value):
+        if self.kind(column) is None:
+            if isinstance(value, (list, tuple)):
+                kind = "mva"
+            elif isinstance(value, float):
+                kind = "float"
+            elif isinstance(value, int):
+                kind = "uint" if 0 <= value < 2 ** 32 else "bigint"
+            else:
+                kind = "string"
+            self.schema.append((column, kind))
+
+    def default(self, column):
+        return {"mva": (), "string": "", "float": 0.0}.get(self.kind(column), 0)
+
+
+class GeneratedIndex(Index):
+    """Rows computed from the id, so any size costs no memory"""
+
+    generated = True
+
+    def __init__(self, name, family, nrows, ncols):
+        kinds = {"bench": ("uint", "float", "string"),
+                 "num": ("uint", "float"),
+                 "text": ("string",),
+                 "utf8": ("string",)}[family]
+        schema = [("id", "bigint")]
+        for i in range(1, ncols):
+            schema.append(("c%d" % i, kinds[(i - 1) % len(kinds)]))
+        Index.__init__(self, name, schema)
+        self.family = family
+        self.nrows = nrows
+
+    def rows(self, lo, hi):
+        for docid in range(max(lo, 1), min(hi, self.nrows) + 1):
+            row = {"id": docid}
+            for i, (column, kind) in enumerate(self.schema[1:], 1):
+                if kind == "uint":
+                    row[column] = (docid * 7 + i) % 100000
+                elif kind == "float":
+                    row[column] = ((docid * 13 + i) % 10000) / 100.0
+                elif self.family == "utf8":
+                    row[column] = "".join(CYRILLIC[(docid + i + k) % len(CYRILLIC)] for k in range(12))
+                else:
+                    row[column] = "value_%d_%d" % (docid, i)
+            yield row
+
+    def count(self, lo, hi, filters):
+        if any(c[0] not in (">", ">=", "<", "<=", "=", "between") for c in filters):
+            return Index.count(self, lo, hi, filters)
+        return max(0, min(hi, self.nrows) - max(lo, 1) + 1)
+
+
+class Catalog(object):
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.rt = {}
+        self.docs = StaticIndex("docs", [("id", "bigint"), ("title", "string"), ("gid", "uint"),
+                                         ("price", "float"), ("tags", "mva")],
+                                [dict(zip(("id", "title", "gid", "price", "tags"), doc)) for doc in DOCS])
+
+    def lookup(self, name, create=False):
+        """Return the index called name, or raise MockError"""
+        latency = 0.0
+        base = name.lower()
+        m = re.match(r"^(.*)_(\d+)ms$", base)
+        if m:
+            base, latency = m.group(1), int(m.group(2)) / 1000.0
+
+        m = re.match(r"^(bench|num|text|utf8)_(\d+)_(\d+)$", base)
+        if base == "docs":
+            index = self.docs
+        elif m:
+            index = GeneratedIndex(base, m.group(1), int(m.group(2)), max(1, int(m.group(3))))
+        else:
+            with self.lock:
+                index = self.rt.get(base)
+                if index is None and create:
+                    index = self.rt[base] = RTIndex(base)
+            if index is None:
+                raise MockError("unknown local index '%s' in search request" % name, ER_UNKNOWN_ERROR)
+        if create and not isinstance(index, RTIndex):
+            raise MockError("index '%s' does not support INSERT" % name, ER_UNKNOWN_ERROR)
+
+        if latency:
+            view = Index.__new__(type(index))
+            view.__dict__.update(index.__dict__)
+            view.latency = latency
+            return view
+        return index
+
+
+# ---------------------------------------------------------------------------
+# SphinxQL parsing
+
+TOKEN_RE = re.compile(r"""
+    (?P<space>\s+)
+  | (?P<str>'(?:[^'\\]|\\.|'')*')
+  | (?P<quoted>`[^`]*`)
+  | (?P<num>\d+\.\d*(?:[eE][-+]?\d+)?|\.\d+(?:[eE][-+]?\d+)?|\d+(?:[eE][-+]?\d+)?)
+  | (?P<ident>@@?[A-Za-z_][A-Za-z0-9_.]*|[A-Za-z_][A-Za-z0-9_]*)
+  | (?P<op><=|>=|!=|<>|=|<|>|\(|\)|,|\*|;|-|\+|/)
+""", re.VERBOSE | re.DOTALL)
+
+
+def unquote(text):
+    body = text[1:-1].replace("''", "'")
+    return re.sub(r"\\(.)", lambda m: {"n": "\n", "t": "\t", "r": "\r", "0": "\0"}.get(m.group(1), m.group(1)),
+                  body, flags=re.DOTALL)
+
+
+def tokenize(sql):
+    tokens = []
+    pos = 0
+    while pos < len(sql):
+        m = TOKEN_RE.match(sql, pos)
+        if not m:
+            raise MockError("sphinxql: syntax error, unexpected '%s' near '%s'" % (sql[pos], sql[pos:pos + 20]))
+        kind = m.lastgroup
+        text = m.group(kind)
+        if kind == "str":
+            tokens.append(("str", unquote(text), m.start()))
+        elif kind == "quoted":
+            tokens.append(("ident", text[1:-1], m.start()))
+        elif kind != "space":
+            tokens.append((kind, text, m.start()))
+        pos = m.end()
+    return tokens
+
+
+def split_statements(sql):
+    """Split a multi-statement query on the semicolons outside strings"""
+    statements = []
+    start = 0
+    for kind, text, pos in tokenize(sql):
+        if kind == "op" and text == ";":
+            statements.append(sql[start:pos])
+            start = pos + 1
+    statements.append(sql[start:])
+    return [s.strip() for s in statements if s.strip()]
+
+
+class Parser(object):
+    def __init__(self, sql):
+        self.sql = sql
+        self.tokens = tokenize(sql)
+        self.pos = 0
+
+    def peek(self, offset=0):
+        if self.pos + offset < len(self.tokens):
+            return self.tokens[self.pos + offset]
+        return (None, None, len(self.sql))
+
+    def error(self):
+        kind, text, pos = self.peek()
+        if kind is None:
+            raise MockError("sphinxql: syntax error, unexpected $end near ''")
+        raise MockError("sphinxql: syntax error, unexpected '%s' near '%s'" % (text, self.sql[pos:pos + 30]))
+
+    def at_end(self):
+        return self.pos >= len(self.tokens)
+
+    def next(self):
+        token = self.peek()
+        if token[0] is None:
+            self.error()
+        self.pos += 1
+        return token
+
+    def is_kw(self, *words, **kw):
+        kind, text, _ = self.peek(kw.get("offset", 0))
+        return kind == "ident" and text.upper() in words
+
+    def accept_kw(self, *words):
+        if self.is_kw(*words):
+            return self.next()[1].upper()
+        return None
+
+    def expect_kw(self, *words):
+        if not self.is_kw(*words):
+            self.error()
+        return self.next()[1].upper()
+
+    def accept_op(self, op):
+        kind, text, _ = self.peek()
+        if kind == "op" and text == op:
+            self.pos += 1
+            return True
+        return False
+
+    def expect_op(self, op):
+        if not self.accept_op(op):
+            self.error()
+
+    def ident(self):
+        kind, text, _ = self.peek()
+        if kind != "ident":
+            self.error()
+        self.pos += 1
+        return text
+
+    def value(self):
+        """A constant: number, string or (mva, list)"""
+        kind, text, _ = self.peek()
+        if kind == "op" and text == "-":
+            self.pos += 1
+            return -self.value()
+        if kind == "num":
+            self.pos += 1
+            return float(text) if re.search(r"[.eE]", text) else int(text)
+        if kind == "str":
+            self.pos += 1
+            return text
+        if kind == "op" and text == "(":
+            self.pos += 1
+            values = []
+            if not self.accept_op(")"):
+                values.append(self.value())
+                while self.accept_op(","):
+                    values.append(self.value())
+                self.expect_op(")")
+            return tuple(values)
+        if kind == "ident" and text.upper() == "NULL":
+            self.pos += 1
+            return None
+        self.error()
+
+    def expr(self):
+        """A select item or sort key: column, function call or constant"""
+        kind, text, start = self.peek()
+        if kind == "ident" and self.peek(1)[0] == "op" and self.peek(1)[1] == "(":
+            self.pos += 2
+            depth = 1
+            while depth:
+                tkind, ttext, tpos = self.next()
+                if tkind == "op" and ttext == "(":
+                    depth += 1
+                elif tkind == "op" and ttext == ")":
+                    depth -= 1
+            end = tpos + 1
+            return ("func", text.lower(), re.sub(r"\s+", "", self.sql[start:end]).lower())
+        if kind == "ident":
+            self.pos += 1
+            return ("column", text.lower(), text)
+        if kind in ("num", "str") or (kind == "op" and text == "-"):
+            value = self.value()
+            return ("const", value, self.sql[start:self.peek()[2]].strip())
+        self.error()
+
+
+class Select(object):
+    pass
+
+
+def parse_select(p):
+    q = Select()
+    q.items = []
+    p.expect_kw("SELECT")
+    while True:
+        if p.accept_op("*"):
+            q.items.append(("star", None))
+        else:
+            item = p.expr()
+            alias = None
+            if p.accept_kw("AS"):
+                alias = p.ident()
+            q.items.append((item, alias))
+        if not p.accept_op(","):
+            break
+
+    q.indexes = []
+    if p.accept_kw("FROM"):
+        q.indexes.append(p.ident())
+        while p.accept_op(","):
+            q.indexes.append(p.ident())
+
+    q.conds = []
+    if p.accept_kw("WHERE"):
+        q.conds = parse_conditions(p)
+
+    q.group_by = None
+    if p.accept_kw("GROUP"):
+        p.expect_kw("BY")
+        q.group_by = p.ident().lower()
+
+    q.order_by = []
+    if p.accept_kw("ORDER"):
+        p.expect_kw("BY")
+        while True:
+            key = p.expr()
+            desc = p.accept_kw("ASC", "DESC") == "DESC"
+            q.order_by.append((key, desc))
+            if not p.accept_op(","):
+                break
+
+    q.offset, q.limit = 0, DEFAULT_LIMIT
+    if p.accept_kw("LIMIT"):
+        first = p.value()
+        if p.accept_op(","):
+            q.offset, q.limit = first, p.value()
+        else:
+            q.limit = first
+            if p.accept_kw("OFFSET"):
+                q.offset = p.value()
+
+    q.options = {}
+    if p.accept_kw("OPTION"):
+        while True:
+            name = p.ident().lower()
+            p.expect_op("=")
+            if p.peek()[0] == "ident":
+                q.options[name] = p.ident()
+            else:
+                q.options[name] = p.value()
+            if not p.accept_op(","):
+                break
+
+    # FACET <column> [LIMIT n], counted over all matches, most frequent first
+    q.facets = []
+    while p.accept_kw("FACET"):
+        column = p.ident().lower()
+        limit = DEFAULT_LIMIT
+        if p.accept_kw("LIMIT"):
+            limit = p.value()
+        q.facets.append((column, limit))
+    if not p.at_end():
+        p.error()
+    return q
+
+
+def parse_conditions(p):
+    conds = []
+    while True:
+        if p.accept_kw("MATCH"):
+            p.expect_op("(")
+            kind, text, _ = p.next()
+            if kind != "str":
+                p.error()
+            p.expect_op(")")
+            conds.append(("match", text))
+        else:
+            column = p.expr()
+            if p.accept_kw("NOT"):
+                p.expect_kw("IN")
+                conds.append(("notin", column, p.value()))
+            elif p.accept_kw("IN"):
+                conds.append(("in", column, p.value()))
+            elif p.accept_kw("BETWEEN"):
+                low = p.value()
+                p.expect_kw("AND")
+                conds.append(("between", column, (low, p.value())))
+            else:
+                kind, op, _ = p.next()
+                if kind != "op" or op not in ("=", "!=", "<>", "<", "<=", ">", ">="):
+                    p.pos -= 1
+                    p.error()
+                conds.append((op, column, p.value()))
+        if not p.accept_kw("AND"):
+            return conds
+
+
+# ---------------------------------------------------------------------------
+# query evaluation
+
+def words(text):
+    return re.findall(r"\w+", text.lower(), re.UNICODE)
+
+
+def match_weight(query, row, index):
+    """Weight of row for a full-text query, or 0 if it does not match"""
+    fields = [row[c] for c, kind in index.schema if kind == "string"]
+    text = words(" ".join(fields))
+    best = 0
+    for alternative in query.split("|"):
+        terms = words(alternative)
+        if not terms:
+            continue
+        weight = 0
+        for term in terms:
+            if term not in text:
+                weight = 0
+                break
+            weight += 1000 + 1000 // (text.index(term) + 1)
+        best = max(best, weight)
+    return best
+
+
+def compare(value, op, arg):
+    if isinstance(value, (list, tuple)):
+        if op in ("!=", "<>"):
+            return all(compare(v, "=", arg) is False for v in value)
+        return any(compare(v, op, arg) for v in value)
+    if op == "in":
+        return any(compare(value, "=", a) for a in arg)
+    if op == "notin":
+        return not compare(value, "in", arg)
+    if op == "between":
+        return arg[0] <= value <= arg[1]
+    if op in ("range", "notrange"):
+        # range filters of SphinxAPI, on floats stored in single precision
+        if isinstance(value, float):
+            value = struct.unpack("<f", struct.pack("<f", value))[0]
+        return (arg[0] <= value <= arg[1]) == (op == "range")
+    try:
+        if isinstance(value, str) or isinstance(arg, str):
+            value, arg = str(value), str(arg)
+        return {"=": value == arg, "!=": value != arg, "<>": value != arg,
+                "<": value < arg, "<=": value <= arg, ">": value > arg, ">=": value >= arg}[op]
+    except TypeError:
+        return False
+
+
+def id_bounds(conds):
+    """Narrow the id range scanned from filters on id"""
+    lo, hi = 1, 2 ** 63 - 1
+    for cond in conds:
+        if cond[0] == "match" or cond[1][:2] != ("column", "id"):
+            continue
+        op, arg = cond[0], cond[2]
+        if not isinstance(arg, (int, tuple)):
+            continue
+        if op == "=":
+            lo, hi = max(lo, arg), min(hi, arg)
+        elif op == ">":
+            lo = max(lo, arg + 1)
+        elif op == ">=":
+            lo = max(lo, arg)
+        elif op == "<":
+            hi = min(hi, arg - 1)
+        elif op == "<=":
+            hi = min(hi, arg)
+        elif op == "between":
+            lo, hi = max(lo, arg[0]), min(hi, arg[1])
+        elif op == "in" and arg and all(isinstance(a, int) for a in arg):
+            lo, hi = max(lo, min(arg)), min(hi, max(arg))
+    return lo, hi
+
+
+def item_value(item, row, index):
+    kind, name, text = item
+    if kind == "const":
+        return name
+    if kind == "func":
+        if name == "weight":
+            return row["@weight"]
+        if name == "count":
+            return row.get("@count", 1)
+        raise MockError("unknown function '%s'" % name)
+    if name in ("@weight", "weight"):
+        return row["@weight"]
+    if name in ("@count", "count"):
+        return row.get("@count", 1)
+    if name == "@id":
+        return row["id"]
+    if name not in row:
+        raise MockError("index %s: parse error: unknown column: %s" % (index.name, text))
+    return row[name]
+
+
+def item_kind(item, index):
+    kind, name, _ = item
+    if kind == "func" or name in ("@weight", "weight", "@count", "count", "@id"):
+        return "bigint" if name in ("@id",) else "uint"
+    if kind == "const":
+        return "float" if isinstance(name, float) else ("string" if isinstance(name, str) else "bigint")
+    return index.kind(name) or "string"
+
+
+def run_select(q, catalog, session):
+    if not q.indexes:
+        # SELECT @@version_comment and the like, sent by some clients
+        names = [alias or item[2] for item, alias in q.items if item != "star"]
+        values = []
+        for item, alias in q.items:
+            if item[0] == "column" and item[1].startswith("@@"):
+                values.append(session.server.variables.get(item[1][2:], ""))
+            elif item[0] == "const":
+                values.append(item[1])
+            else:
+                raise MockError("sphinxql: syntax error, unexpected $end, expecting FROM")
+        return Result([(n, "string") for n in names], [values])
+
+    indexes = [catalog.lookup(name) for name in q.indexes]
+    index = indexes[0]
+    latency = max(i.latency for i in indexes)
+    if latency:
+        session.sleep(latency)
+
+    match = [c[1] for c in q.conds if c[0] == "match"]
+    filters = [c for c in q.conds if c[0] != "match"]
+    lo, hi = id_bounds(filters)
+
+    aggregate = any(item != "star" and item[0] == "func" and item[1] == "count" for item, _ in q.items)
+
+    # Rows come out of an index by id, so a scan ordered by id alone can stop
+    # once the page is complete; the sphinx_query_all() benchmarks need that.
+    by_id = (not match and not q.group_by and not aggregate and len(indexes) == 1 and
+             all(c[1][:2] == ("column", "id") for c in filters) and
+             (not q.order_by or (len(q.order_by) == 1 and q.order_by[0] == (("column", "id", q.order_by[0][0][2]), False))))
+    wanted = q.offset + q.limit
+
+    rows = []
+    found = 0
+    for idx in indexes:
+        for row in idx.rows(lo, hi):
+            weight = 1
+            if match:
+                weight = match_weight(match[0], row, idx)
+                if not weight:
+                    continue
+            row = dict(row)
+            row["@weight"] = weight
+            if not all(compare(item_value(c[1], row, idx), c[0], c[2]) for c in filters):
+                continue
+            rows.append(row)
+            found += 1
+            if by_id and found >= wanted:
+                found = idx.count(lo, hi, filters)
+                break
+    facets = []
+    for column, limit in q.facets:
+        counts = {}
+        for row in rows:
+            value = item_value(("column", column, column), row, index)
+            value = tuple(value) if isinstance(value, list) else value
+            counts[value] = counts.get(value, 0) + 1
+        ordered = sorted(counts.items(), key=lambda kv: (-kv[1], kv[0]))[:limit]
+        facets.append(Result([(column, index.kind(column) or "string"), ("count(*)", "uint")],
+                             [[value, count] for value, count in ordered]))
+
+    if q.group_by or aggregate:
+        groups = {}
+        order = []
+        for row in rows:
+            key = item_value(("column", q.group_by, q.group_by), row, index) if q.group_by else None
+            if isinstance(key, list):
+                key = tuple(key)
+            if key not in groups:
+                groups[key] = dict(row, **{"@count": 0})
+                order.append(key)
+            groups[key]["@count"] += 1
+        rows = [groups[k] for k in order]
+        if q.group_by and not q.order_by:
+            rows.sort(key=lambda r: (-r["@count"], r["id"]))
+        found = len(rows)
+
+    aliases = dict((alias.lower(), item) for item, alias in q.items if alias)
+    if q.order_by:
+        for key, desc in reversed(q.order_by):
+            if key[0] == "column" and key[1] in aliases:
+                key = aliases[key[1]]
+            rows.sort(key=lambda r, k=key: item_value(k, r, index), reverse=desc)
+    elif not (q.group_by or aggregate):
+        rows.sort(key=lambda r: (-r["@weight"], r["id"]))
+
+    max_matches = int(q.options.get("max_matches", DEFAULT_MAX_MATCHES))
+    rows = rows[:max_matches]
+    total = max(0, min(len(rows) - q.offset, q.limit))
+    rows = rows[q.offset:q.offset + q.limit]
+
+    columns = []
+    getters = []
+    for item, alias in q.items:
+        if item == "star":
+            for name, kind in index.schema:
+                columns.append((name, kind))
+                getters.append(("column", name, name))
+        else:
+            columns.append((alias or item[2], item_kind(item, index)))
+            getters.append(item)
+
+    result = Result(columns, [[item_value(g, row, index) for g in getters] for row in rows])
+    if facets:
+        result = Results([result] + facets)
+    session.meta = [("total", str(total)), ("total_found", str(found)), ("time", "%.3f" % latency)]
+    for i, term in enumerate(words(match[0]) if match else []):
+        docs = sum(1 for idx in indexes for row in idx.rows(1, 2 ** 63 - 1)
+                   if term in words(" ".join(row[c] for c, k in idx.schema if k == "string")))
+        session.meta += [("keyword[%d]" % i, term), ("docs[%d]" % i, str(docs)), ("hits[%d]" % i, str(docs))]
+    return result
+
+
+def run_insert(p, catalog, session, replace):
+    p.expect_kw("INTO")
+    index = catalog.lookup(p.ident(), create=True)
+    columns = []
+    if p.accept_op("("):
+        columns.append(p.ident().lower())
+        while p.accept_op(","):
+            columns.append(p.ident().lower())
+        p.expect_op(")")
+    else:
+        columns = [name for name, _ in index.schema]
+    if "id" not in columns:
+        raise MockError("column list must contain an 'id' column", ER_UNKNOWN_ERROR)
+    p.expect_kw("VALUES")
+
+    tuples = []
+    while True:
+        values = p.value()
+        if not isinstance(values, tuple) or len(values) != len(columns):
+            raise MockError("wrong number of values here", ER_PARSE_ERROR)
+        tuples.append(values)
+        if not p.accept_op(","):
+            break
+    if not p.at_end():
+        p.error()
+
+    with catalog.lock:
+        for values in tuples:
+            row = dict(zip(columns, values))
+            docid = row["id"]
+            if not isinstance(docid, int) or docid <= 0:
+                raise MockError("'id' column must be a positive integer", ER_UNKNOWN_ERROR)
+            if not replace and docid in index.docs:
+                raise MockError("duplicate id '%d'" % docid, ER_UNKNOWN_ERROR)
+            for column, value in row.items():
+                index.add_column(column, value)
+        for values in tuples:
+            row = dict(zip(columns, values))
+            for column, _ in index.schema:
+                if row.get(column) is None:
+                    row[column] = index.default(column)
+            index.docs[row["id"]] = row
+    return OK(len(tuples))
+
+
+def run_delete(p, catalog, session):
+    p.expect_kw("FROM")
+    index = catalog.lookup(p.ident(), create=True)
+    p.expect_kw("WHERE")
+    conds = parse_conditions(p)
+    if not p.at_end():
+        p.error()
+    with catalog.lock:
+        doomed = [row["id"] for row in index.rows(*id_bounds(conds))
+                  if all(compare(item_value(c[1], dict(row, **{"@weight": 1}), index), c[0], c[2])
+                         for c in conds if c[0] != "match")]
+        for docid in doomed:
+            del index.docs[docid]
+    return OK(len(doomed))
+
+
+def run_update(p, catalog, session):
+    index = catalog.lookup(p.ident(), create=True)
+    p.expect_kw("SET")
+    changes = []
+    while True:
+        column = p.ident().lower()
+        p.expect_op("=")
+        changes.append((column, p.value()))
+        if not p.accept_op(","):
+            break
+    p.expect_kw("WHERE")
+    conds = parse_conditions(p)
+    with catalog.lock:
+        for column, _ in changes:
+            if index.kind(column) is None:
+                raise MockError("attribute '%s' not found" % column, ER_UNKNOWN_ERROR)
+        updated = 0
+        for row in index.rows(*id_bounds(conds)):
+            if all(compare(item_value(c[1], dict(row, **{"@weight": 1}), index), c[0], c[2])
+                   for c in conds if c[0] != "match"):
+                row.update(changes)
+                updated += 1
+    return OK(updated)
+
+
+def like(pattern, value):
+    regex = "^" + "".join(".*" if c == "%" else "." if c == "_" else re.escape(c) for c in pattern) + "$"
+    return re.match(regex, value, re.IGNORECASE) is not None
+
+
+def run_show(p, catalog, session):
+    what = p.expect_kw("META", "VARIABLES", "STATUS", "TABLES", "MOCK", "WARNINGS")
+    if what == "MOCK":
+        if p.accept_kw("SESSION"):
+            transport = "tcp" if session.request.family in (socket.AF_INET, socket.AF_INET6) else "unix"
+            return Result([("transport", "string"), ("compressed", "string")],
+                          [[transport, "yes" if session.compressed else "no"]])
+        if p.accept_kw("PORT"):
+            return Result([("port", "uint")], [[session.server.server_address[1]]])
+        p.expect_kw("QUERIES")
+        with session.server.log_lock:
+            log, session.server.log[:] = list(session.server.log), []
+        return Result([("query", "string")], [[q] for q in log])
+    if what == "WARNINGS":
+        return Result([("Level", "string"), ("Code", "uint"), ("Message", "string")], [])
+
+    pattern = None
+    if p.accept_kw("LIKE"):
+        kind, pattern, _ = p.next()
+    if what == "META":
+        rows = session.meta
+    elif what == "VARIABLES":
+        rows = sorted(session.server.variables.items())
+    elif what == "STATUS":
+        server = session.server
+        rows = [("uptime", str(int(time.time() - server.started))),
+                ("connections", str(server.connections)),
+                ("queries", str(server.queries))]
+    else:
+        names = ["docs"] + sorted(catalog.rt)
+        rows = [(name, "rt" if name in catalog.rt else "local") for name in names]
+        return Result([("Index", "string"), ("Type", "string")],
+                      [list(r) for r in rows if pattern is None or like(pattern, r[0])])
+    return Result([("Variable_name", "string"), ("Value", "string")],
+                  [list(r) for r in rows if pattern is None or like(pattern, r[0])])
+
+
+SNIPPET_OPTIONS = {"before_match": "<b>", "after_match": "</b>", "chunk_separator": " ... ", "limit": 256,
+                   "around": 5, "exact_phrase": 0, "use_boundaries": 0, "weight_order": 0, "query_mode": 0,
+                   "force_all_words": 0, "limit_passages": 0, "limit_words": 0, "start_passage_id": 1,
+                   "load_files": 0, "html_strip_mode": "index", "allow_empty": 0, "passage_boundary": "",
+                   "emit_zones": 0}
+
+
+def run_call(p, catalog, session):
+    p.expect_kw("SNIPPETS")
+    p.expect_op("(")
+    docs = p.value()
+    if not isinstance(docs, tuple):
+        docs = (docs,)
+    p.expect_op(",")
+    catalog.lookup(p.value())
+    p.expect_op(",")
+    terms = set(words(p.value()))
+    options = dict(SNIPPET_OPTIONS)
+    while p.accept_op(","):
+        value = p.value()
+        p.expect_kw("AS")
+        name = p.ident().lower()
+        if name not in options:
+            raise MockError("unknown option %s" % name)
+        options[name] = value
+    p.expect_op(")")
+
+    def highlight(match):
+        word = match.group(0)
+        if word.lower() in terms:
+            return "%s%s%s" % (options["before_match"], word, options["after_match"])
+        return word
+
+    rows = []
+    for doc in docs:
+        doc = str(doc)
+        suffix = ""
+        if len(doc) > int(options["limit"]):
+            doc = doc[:int(options["limit"])].rsplit(" ", 1)[0]
+            suffix = options["chunk_separator"]
+        rows.append([re.sub(r"\w+", highlight, doc, flags=re.UNICODE) + suffix])
+    return Result([("snippet", "string")], rows)
+
+
+def execute(sql, catalog, session):
+    p = Parser(sql)
+    if p.is_kw("SELECT"):
+        return run_select(parse_select(p), catalog, session)
+    if p.is_kw("SHOW"):
+        p.next()
+        return run_show(p, catalog, session)
+    if p.accept_kw("REPLACE"):
+        return run_insert(p, catalog, session, True)
+    if p.accept_kw("INSERT"):
+        return run_insert(p, catalog, session, False)
+    if p.accept_kw("DELETE"):
+        return run_delete(p, catalog, session)
+    if p.accept_kw("UPDATE"):
+        return run_update(p, catalog, session)
+    if p.accept_kw("DESCRIBE", "DESC"):
+        index = catalog.lookup(p.ident())
+        return Result([("Field", "string"), ("Type", "string")], [list(c) for c in index.schema])
+    if p.accept_kw("TRUNCATE"):
+        p.expect_kw("RTINDEX")
+        index = catalog.lookup(p.ident(), create=True)
+        with catalog.lock:
+            index.docs.clear()
+        return OK(0)
+    if p.accept_kw("CALL"):
+        return run_call(p, catalog, session)
+    if p.accept_kw("KILL"):
+        p.accept_kw("QUERY", "CONNECTION")
+        session.server.kill(p.value())
+        return OK(0)
+    if p.is_kw("SET") and p.is_kw("GLOBAL", offset=1) and p.is_kw("MAX_ALLOWED_PACKET", offset=2):
+        p.pos += 3
+        p.expect_op("=")
+        session.server.variables["max_allowed_packet"] = str(p.value())
+        return OK(0)
+    if p.is_kw("SET") and p.is_kw("GLOBAL", offset=1) and p.is_kw("MOCK_LATENCY", "MOCK_DOWN", offset=2):
+        name = p.peek(2)[1].upper()
+        p.pos += 3
+        p.expect_op("=")
+        if name == "MOCK_LATENCY":
+            session.server.latency = float(p.value()) / 1000.0
+        else:
+            session.server.down = bool(int(p.value()))
+        return OK(0)
+    if p.accept_kw("SET", "BEGIN", "COMMIT", "ROLLBACK", "START"):
+        return OK(0)
+    p.error()
+
+
+# ---------------------------------------------------------------------------
+# wire protocol
+
+def lenenc_int(n):
+    if n < 251:
+        return struct.pack("<B", n)
+    if n < 1 << 16:
+        return b"\xfc" + struct.pack("<H", n)
+    if n < 1 << 24:
+        return b"\xfd" + struct.pack("<I", n)[:3]
+    return b"\xfe" + struct.pack("<Q", n)
+
+
+def lenenc_str(b):
+    return lenenc_int(len(b)) + b
+
+
+def format_value(value):
+    if value is None:
+        return None
+    if isinstance(value, (list, tuple)):
+        return ",".join(str(v) for v in value).encode()
+    if isinstance(value, float):
+        return ("%f" % value).encode()
+    return str(value).encode("utf-8")
+
+
+COLUMN_TYPES = {"bigint": (TYPE_LONGLONG, 20, BINARY_CHARSET),
+                "uint": (TYPE_LONG, 10, BINARY_CHARSET),
+                "float": (TYPE_FLOAT, 12, BINARY_CHARSET),
+                "string": (TYPE_STRING, 255, UTF8_GENERAL_CI),
+                "mva": (TYPE_STRING, 255, UTF8_GENERAL_CI)}
+
+
+class Result(object):
+    def __init__(self, columns, rows):
+        self.columns = columns
+        self.rows = rows
+
+    def packets(self, status):
+        out = [lenenc_int(len(self.columns))]
+        for name, kind in self.columns:
+            ctype, length, charset = COLUMN_TYPES.get(kind, COLUMN_TYPES["string"])
+            name = name.encode("utf-8")
+            out.append(lenenc_str(b"def") + lenenc_str(b"") + lenenc_str(b"") + lenenc_str(b"") +
+                       lenenc_str(name) + lenenc_str(name) + b"\x0c" +
+                       struct.pack("<HIBHB", charset, length, ctype, 0, 0) + b"\x00\x00")
+        out.append(b"\xfe" + struct.pack("<HH", 0, status & ~SERVER_MORE_RESULTS_EXISTS))
+        for row in self.rows:
+            parts = []
+            for value in row:
+                value = format_value(value)
+                parts.append(b"\xfb" if value is None else lenenc_str(value))
+            out.append(b"".join(parts))
+        out.append(b"\xfe" + struct.pack("<HH", 0, status))
+        return out
+
+
+class Results(object):
+    """Several result sets of one statement, as FACET returns them"""
+
+    def __init__(self, results):
+        self.results = results
+
+    def packets(self, status):
+        out = []
+        for result in self.results[:-1]:
+            out.extend(result.packets(status | SERVER_MORE_RESULTS_EXISTS))
+        out.extend(self.results[-1].packets(status))
+        return out
+
+
+class OK(object):
+    def __init__(self, affected):
+        self.affected = affected
+
+    def packets(self, status):
+        return [b"\x00" + lenenc_int(self.affected) + lenenc_int(0) + struct.pack("<HH", status, 0)]
+
+
+def error_packet(code, message):
+    return b"\xff" + struct.pack("<H", code) + b"#42000" + message.encode("utf-8")[:512]
+
+
+class Session(socketserver.BaseRequestHandler):
+    """One client connection"""
+
+    def setup(self):
+        self.server.register(self)
+        self.meta = []
+        self.killed = threading.Event()
+        self.buffer = b""
+        self.raw = b""
+        self.compressed = False
+        self.cseq = 0
+
+    def finish(self):
+        self.server.unregister(self)
+
+    def recv_raw(self, n):
+        while len(self.raw) < n:
+            chunk = self.request.recv(max(65536, n - len(self.raw)))
+            if not chunk:
+                raise EOFError
+            self.raw += chunk
+        data, self.raw = self.raw[:n], self.raw[n:]
+        return data
+
+    def recv_exact(self, n):
+        if not self.compressed:
+            return self.recv_raw(n)
+        # compressed protocol: 3 bytes of compressed length, the sequence id
+        # and 3 bytes of uncompressed length, 0 when sent as is
+        while len(self.buffer) < n:
+            header = self.recv_raw(7)
+            length = struct.unpack("<I", header[:3] + b"\x00")[0]
+            self.cseq = header[3] + 1
+            ulength = struct.unpack("<I", header[4:] + b"\x00")[0]
+            payload = self.recv_raw(length)
+            self.buffer += zlib.decompress(payload) if ulength else payload
+        data, self.buffer = self.buffer[:n], self.buffer[n:]
+        return data
+
+    def read_packet(self):
+        payload = b""
+        while True:
+            header = self.recv_exact(4)
+            length = struct.unpack("<I", header[:3] + b"\x00")[0]
+            self.seq = header[3] + 1
+            payload += self.recv_exact(length)
+            if length < 0xffffff:
+                return payload
+
+    def send_packets(self, packets):
+        out = []
+        for payload in packets:
+            while True:
+                chunk, payload = payload[:0xffffff], payload[0xffffff:]
+                out.append(struct.pack("<I", len(chunk))[:3] + struct.pack("<B", self.seq & 0xff) + chunk)
+                self.seq += 1
+                if len(chunk) < 0xffffff:
+                    break
+        data = b"".join(out)
+        if self.compressed:
+            data = self.compress(data)
+        self.request.sendall(data)
+
+    def compress(self, data):
+        out = []
+        while data:
+            chunk, data = data[:0xffffff], data[0xffffff:]
+            packed = zlib.compress(chunk) if len(chunk) >= 50 else chunk
+            if len(packed) >= len(chunk):
+                packed, ulength = chunk, 0
+            else:
+                ulength = len(chunk)
+            out.append(struct.pack("<I", len(packed))[:3] + struct.pack("<B", self.cseq & 0xff) +
+                       struct.pack("<I", ulength)[:3] + packed)
+            self.cseq += 1
+        return b"".join(out)
+
+    def sleep(self, seconds):
+        self.killed.clear()
+        if self.killed.wait(seconds):
+            raise Killed()
+
+    def handle(self):
+        if self.request.family in (socket.AF_INET, socket.AF_INET6):
+            self.request.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        scramble = os.urandom(20).replace(b"\x00", b"\x01")
+        self.seq = 0
+        self.send_packets([b"\x0a" + SERVER_VERSION + b"\x00" + struct.pack("<I", self.conn_id) +
+                           scramble[:8] + b"\x00" +
+                           struct.pack("<HBHH", SERVER_CAPABILITIES & 0xffff, UTF8_GENERAL_CI,
+                                       SERVER_STATUS_AUTOCOMMIT, SERVER_CAPABILITIES >> 16) +
+                           struct.pack("<B", 21) + b"\x00" * 10 + scramble[8:] + b"\x00" +
+                           b"mysql_native_password\x00"])
+        try:
+            response = self.read_packet()
+            client_flags = struct.unpack("<I", response[:4])[0] if len(response) >= 4 else 0
+            self.send_packets(OK(0).packets(SERVER_STATUS_AUTOCOMMIT))
+            # both sides switch to the compressed protocol after the OK
+            self.compressed = bool(client_flags & CLIENT_COMPRESS)
+            while True:
+                packet = self.read_packet()
+                self.server.touch()
+                command = packet[:1]
+                if command == bytes([COM_QUIT]):
+                    return
+                if command == bytes([COM_QUERY]):
+                    if len(packet) > int(self.server.variables["max_allowed_packet"]):
+                        self.send_packets([error_packet(ER_NET_PACKET_TOO_LARGE, "packet too large (%d > %s)" % (
+                            len(packet), self.server.variables["max_allowed_packet"]))])
+                        continue
+                    self.query(packet[1:].decode("utf-8", "replace"))
+                elif command in (bytes([COM_PING]), bytes([COM_INIT_DB])):
+                    self.send_packets(OK(0).packets(SERVER_STATUS_AUTOCOMMIT))
+                else:
+                    self.send_packets([error_packet(ER_UNKNOWN_ERROR, "unknown command (code=%d)" % packet[0])])
+        except (EOFError, ConnectionError):
+            return
+
+    def query(self, sql):
+        server = self.server
+        if server.down and not re.match(r"(?i)\s*SET\b", sql):
+            raise EOFError()
+        try:
+            statements = split_statements(sql)
+        except MockError as e:
+            self.send_packets([error_packet(e.code, str(e))])
+            return
+        if not statements:
+            self.send_packets([error_packet(ER_PARSE_ERROR, "sphinxql: syntax error, unexpected $end near ''")])
+            return
+
+        packets = []
+        for i, statement in enumerate(statements):
+            status = SERVER_STATUS_AUTOCOMMIT
+            if i < len(statements) - 1:
+                status |= SERVER_MORE_RESULTS_EXISTS
+            if server.latency:
+                self.sleep_quietly(server.latency)
+            if not re.match(r"(?i)\s*(SHOW\s+MOCK|SET)\b", statement):
+                with server.log_lock:
+                    server.log.append(statement)
+            with server.log_lock:
+                server.queries += 1
+            try:
+                key = (statement, status) if statement.upper().startswith("SELECT") else None
+                cached = server.cache_get(key) if key else None
+                if cached is not None:
+                    result_packets, self.meta, latency = cached
+                    if latency:
+                        self.sleep(latency)
+                    packets.extend(result_packets)
+                    continue
+                result = execute(statement, server.catalog, self)
+                result_packets = result.packets(status)
+                names = re.findall(r"(?i)\bFROM\s+(\w+)", statement)
+                if key and names and all(server.catalog.lookup(name).generated for name in names):
+                    latency = max(server.catalog.lookup(name).latency for name in names)
+                    server.cache_put(key, (result_packets, self.meta, latency))
+                packets.extend(result_packets)
+            except Killed:
+                packets.append(error_packet(ER_QUERY_INTERRUPTED, "query was killed"))
+                break
+            except MockError as e:
+                packets.append(error_packet(e.code, str(e)))
+                break
+            except Exception as e:
+                packets.append(error_packet(ER_UNKNOWN_ERROR, "internal error: %s" % e))
+                break
+        self.send_packets(packets)
+
+    def sleep_quietly(self, seconds):
+        try:
+            self.sleep(seconds)
+        except Killed:
+            pass
+
+
+class Server(socketserver.ThreadingMixIn, socketserver.TCPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+    request_queue_size = 256
+
+    def __init__(self, address, args):
+        socketserver.TCPServer.__init__(self, address, Session, bind_and_activate=True)
+        self.catalog = Catalog()
+        self.latency = args.latency / 1000.0
+        self.down = False
+        self.lock = threading.Lock()
+        self.sessions = {}
+        self.next_id = 1
+        self.connections = 0
+        self.queries = 0
+        self.started = time.time()
+        self.last_activity = time.time()
+        self.log = []
+        self.log_lock = threading.Lock()
+        self.cache = {}
+        self.cache_bytes = 0
+        self.variables = {"autocommit": "1",
+                          "character_set_client": "utf8",
+                          "character_set_connection": "utf8",
+                          "max_allowed_packet": str(args.max_allowed_packet),
+                          "version_comment": "mock searchd"}
+
+    def register(self, session):
+        with self.lock:
+            session.conn_id = self.next_id
+            self.next_id += 1
+            self.connections += 1
+            self.sessions[session.conn_id] = session
+        self.touch()
+
+    def unregister(self, session):
+        with self.lock:
+            self.sessions.pop(session.conn_id, None)
+        self.touch()
+
+    def kill(self, conn_id):
+        with self.lock:
+            session = self.sessions.get(conn_id)
+        if session is not None:
+            session.killed.set()
+
+    def touch(self):
+        self.last_activity = time.time()
+
+    # Whole responses to SELECTs on generated indexes are kept, so that the
+    # benchmarks measure sphinxlink rather than this script.
+    def cache_get(self, key):
+        with self.lock:
+            return self.cache.get(key)
+
+    def cache_put(self, key, entry):
+        size = sum(len(p) for p in entry[0])
+        if size > 64 << 20:
+            return
+        with self.lock:
+            if self.cache_bytes + size > 256 << 20:
+                self.cache.clear()
+                self.cache_bytes = 0
+            self.cache[key] = entry
+            self.cache_bytes += size
+
+
+class SocketServer(socketserver.ThreadingMixIn, socketserver.UnixStreamServer):
+    """Listens on a Unix socket and shares everything else with the TCP server"""
+    daemon_threads = True
+    request_queue_size = 256
+
+    def __init__(self, path, server):
+        self.server = server
+        if os.path.exists(path):
+            os.unlink(path)
+        socketserver.UnixStreamServer.__init__(self, path, Session, bind_and_activate=True)
+
+    def __getattr__(self, name):
+        return getattr(self.server, name)
+
+
+class ReplicaServer(socketserver.ThreadingMixIn, socketserver.TCPServer):
+    """Listens on another port, with a latency, state and log of its own"""
+    daemon_threads = True
+    allow_reuse_address = True
+    request_queue_size = 256
+
+    def __init__(self, address, server):
+        self.server = server
+        self.latency = 0.0
+        self.down = False
+        self.queries = 0
+        self.log = []
+        self.log_lock = threading.Lock()
+        socketserver.TCPServer.__init__(self, address, Session, bind_and_activate=True)
+
+    def __getattr__(self, name):
+        return getattr(self.server, name)
+
+
+# ---------------------------------------------------------------------------
+# SphinxAPI protocol
+
+SEARCHD_COMMAND_SEARCH = 0
+SEARCHD_COMMAND_PERSIST = 4
+VER_COMMAND_SEARCH = 0x11E
+
+SEARCHD_OK = 0
+SEARCHD_ERROR = 1
+
+SPH_FILTER_VALUES = 0
+SPH_FILTER_RANGE = 1
+SPH_FILTER_FLOATRANGE = 2
+SPH_FILTER_STRING = 3
+
+API_ATTR_TYPES = {"uint": 1, "bigint": 6, "float": 5, "string": 7, "mva": 0x40000001}
+
+
+class ApiReader(object):
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def take(self, n):
+        if self.pos + n > len(self.data):
+            raise MockError("malformed search request")
+        chunk = self.data[self.pos:self.pos + n]
+        self.pos += n
+        return chunk
+
+    def uint(self):
+        return struct.unpack(">I", self.take(4))[0]
+
+    def int64(self):
+        return struct.unpack(">q", self.take(8))[0]
+
+    def float(self):
+        return struct.unpack(">f", self.take(4))[0]
+
+    def string(self):
+        return self.take(self.uint()).decode("utf-8")
+
+
+def api_string(text):
+    data = text.encode("utf-8")
+    return struct.pack(">I", len(data)) + data
+
+
+def read_api_query(r):
+    """Decode one query of a search request, in the format of version 0x11E"""
+    q = {}
+    r.uint()                                    # flags
+    q["offset"], q["limit"] = r.uint(), r.uint()
+    r.uint()                                    # matching mode
+    r.uint()                                    # ranker
+    r.uint()                                    # sort mode
+    q["sortby"], q["query"] = r.string(), r.string()
+    for _ in range(r.uint()):
+        r.uint()
+    q["indexes"] = r.string()
+    if r.uint():
+        r.int64(), r.int64()                    # id range
+    q["filters"] = []
+    for _ in range(r.uint()):
+        attr, ftype = r.string(), r.uint()
+        if ftype == SPH_FILTER_VALUES:
+            arg = tuple(r.int64() for _ in range(r.uint()))
+        elif ftype == SPH_FILTER_RANGE:
+            arg = (r.int64(), r.int64())
+        elif ftype == SPH_FILTER_FLOATRANGE:
+            arg = (r.float(), r.float())
+        elif ftype == SPH_FILTER_STRING:
+            arg = r.string()
+        else:
+            raise MockError("unknown filter type %d" % ftype)
+        q["filters"].append((attr, ftype, arg, bool(r.uint())))
+    r.uint()                                    # group function
+    if r.string():
+        raise MockError("grouping is not supported over SphinxAPI by this mock")
+    q["max_matches"] = r.uint()
+    r.string()                                  # group sort
+    r.uint(), r.uint(), r.uint()                # cutoff, retry count and delay
+    r.string()                                  # group distinct
+    if r.uint():
+        raise MockError("geo anchors are not supported by this mock")
+    for _ in range(r.uint()):
+        r.string(), r.uint()                    # index weights
+    r.uint()                                    # max query time
+    for _ in range(r.uint()):
+        r.string(), r.uint()                    # field weights
+    r.string()                                  # comment
+    if r.uint():
+        raise MockError("attribute overrides are not supported by this mock")
+    q["select"] = r.string()
+    r.string(), r.uint(), r.uint(), r.uint()    # outer select
+    return q
+
+
+def run_api_query(req, catalog, session):
+    """Run a decoded query, returning its result in the SphinxAPI format"""
+    q = parse_select(Parser("SELECT %s FROM %s" % (req["select"] or "*", req["indexes"])))
+    index = catalog.lookup(q.indexes[0])
+
+    # id and weight come with every match, the other items as attributes
+    named = set((alias or item[2]).lower() for item, alias in q.items if item != "star")
+    attrs = []
+    for item, alias in q.items:
+        if item == "star":
+            attrs += [(("column", name, name), None) for name, _ in index.schema
+                      if name != "id" and name not in named]
+        elif not (item[0] == "column" and item[1] in ("id", "@id") and not alias):
+            attrs.append((item, alias))
+    q.items = [(("column", "id", "id"), None), (("func", "weight", "weight()"), None)] + attrs
+
+    q.conds = [("match", req["query"])] if req["query"] else []
+    for attr, ftype, arg, exclude in req["filters"]:
+        column = ("column", "id", "id") if attr == "@id" else ("column", attr.lower(), attr)
+        if ftype == SPH_FILTER_VALUES:
+            q.conds.append(("notin" if exclude else "in", column, arg))
+        elif ftype == SPH_FILTER_STRING:
+            q.conds.append(("!=" if exclude else "=", column, arg))
+        else:
+            q.conds.append(("notrange" if exclude else "range", column, arg))
+
+    q.order_by = []
+    for key in filter(None, (k.strip() for k in req["sortby"].split(","))):
+        name, _, direction = key.partition(" ")
+        name = {"@id": "id"}.get(name.lower(), name.lower())
+        q.order_by.append((("column", name, name), direction.strip().upper() == "DESC"))
+    q.offset, q.limit = req["offset"], req["limit"]
+    q.options = {"max_matches": req["max_matches"]}
+
+    result = run_select(q, catalog, session)
+
+    columns = result.columns[2:]
+    fields = [name for name, kind in index.schema if kind == "string"]
+    out = [struct.pack(">I", SEARCHD_OK), struct.pack(">I", len(fields))]
+    out += [api_string(name) for name in fields]
+    out.append(struct.pack(">I", len(columns)))
+    for name, kind in columns:
+        out.append(api_string(name) + struct.pack(">I", API_ATTR_TYPES.get(kind, API_ATTR_TYPES["string"])))
+    out.append(struct.pack(">II", len(result.rows), 1))
+    for row in result.rows:
+        out.append(struct.pack(">qI", row[0], row[1]))
+        for (_, kind), value in zip(columns, row[2:]):
+            if kind == "bigint":
+                out.append(struct.pack(">q", value))
+            elif kind == "float":
+                out.append(struct.pack(">f", value))
+            elif kind == "uint":
+                out.append(struct.pack(">I", int(value) & 0xffffffff))
+            elif kind == "mva":
+                out.append(struct.pack(">I%dI" % len(value), len(value), *value))
+            else:
+                out.append(api_string(str(value)))
+
+    meta = dict(session.meta)
+    nwords = sum(1 for name, _ in session.meta if name.startswith("keyword["))
+    out.append(struct.pack(">IIII", int(meta["total"]), int(meta["total_found"]),
+                           int(round(float(meta["time"]) * 1000)), nwords))
+    for i in range(nwords):
+        out.append(api_string(meta["keyword[%d]" % i]) +
+                   struct.pack(">II", int(meta["docs[%d]" % i]), int(meta["hits[%d]" % i])))
+    return b"".join(out)
+
+
+class ApiSession(socketserver.BaseRequestHandler):
+    """One SphinxAPI client connection"""
+
+    def setup(self):
+        self.meta = []
+        self.killed = threading.Event()
+
+    def recv_exact(self, n):
+        data = b""
+        while len(data) < n:
+            chunk = self.request.recv(n - len(data))
+            if not chunk:
+                raise EOFError
+            data += chunk
+        return data
+
+    def sleep(self, seconds):
+        time.sleep(seconds)
+
+    def handle(self):
+        self.request.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        persistent = False
+        try:
+            # both sides start with their protocol version
+            self.request.sendall(struct.pack(">I", 1))
+            self.recv_exact(4)
+            while True:
+                command, version, length = struct.unpack(">HHI", self.recv_exact(8))
+                body = self.recv_exact(length)
+                self.server.touch()
+                if command == SEARCHD_COMMAND_PERSIST:
+                    persistent = True
+                    continue
+                if command != SEARCHD_COMMAND_SEARCH or version != VER_COMMAND_SEARCH:
+                    self.reply(SEARCHD_ERROR, version, api_string("unknown command %d, version 0x%x" % (command, version)))
+                else:
+                    self.search(body)
+                if not persistent:
+                    return
+        except (EOFError, ConnectionError):
+            return
+
+    def search(self, body):
+        server = self.server
+        try:
+            r = ApiReader(body)
+            r.uint()                            # master version
+            queries = [read_api_query(r) for _ in range(r.uint())]
+        except MockError as e:
+            self.reply(SEARCHD_ERROR, VER_COMMAND_SEARCH, api_string(str(e)))
+            return
+        with server.log_lock:
+            server.log.append("SEARCH " + "; ".join(q["indexes"] for q in queries))
+            server.queries += 1
+        if any(q["indexes"] == "mock_oversized" for q in queries):
+            self.request.sendall(struct.pack(">HHI", SEARCHD_OK, VER_COMMAND_SEARCH, 0xFFFFFFFF))
+            return
+
+        out = []
+        for q in queries:
+            try:
+                out.append(run_api_query(q, server.catalog, self))
+            except MockError as e:
+                out.append(struct.pack(">I", SEARCHD_ERROR) + api_string(str(e)))
+            except Exception as e:
+                out.append(struct.pack(">I", SEARCHD_ERROR) + api_string("internal error: %s" % e))
+        self.reply(SEARCHD_OK, VER_COMMAND_SEARCH, b"".join(out))
+
+    def reply(self, status, version, body):
+        self.request.sendall(struct.pack(">HHI", status, version, len(body)) + body)
+
+
+class ApiServer(socketserver.ThreadingMixIn, socketserver.TCPServer):
+    """Listens for SphinxAPI clients and shares everything else with the SphinxQL server"""
+    daemon_threads = True
+    allow_reuse_address = True
+    request_queue_size = 256
+
+    def __init__(self, address, server):
+        self.server = server
+        self.queries = 0
+        socketserver.TCPServer.__init__(self, address, ApiSession, bind_and_activate=True)
+
+    def __getattr__(self, name):
+        return getattr(self.server, name)
+
+
+def stop_previous(pidfile):
+    """Stop the server a previous run left behind, so that data starts fresh"""
+    try:
+        with open(pidfile) as f:
+            pid = int(f.read().strip())
+    except (IOError, ValueError):
+        return
+    try:
+        os.kill(pid, signal.SIGTERM)
+    except OSError:
+        return
+    for _ in range(50):
+        try:
+            os.kill(pid, 0)
+        except OSError:
+            return
+        time.sleep(0.1)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="MySQL-protocol stand-in for searchd")
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=19306)
+    parser.add_argument("--socket", help="also listen on this Unix socket")
+    parser.add_argument("--replica-port", type=int, action="append", default=[],
+                        help="also listen on this port, as a replica")
+    parser.add_argument("--api-port", type=int, help="also listen on this port for SphinxAPI clients")
+    parser.add_argument("--latency", type=float, default=0, help="delay every statement by this many ms")
+    parser.add_argument("--max-allowed-packet", type=int, default=8 << 20)
+    parser.add_argument("--idle-exit", type=float, default=0,
+                        help="exit after this many seconds without a query (0 = never)")
+    parser.add_argument("--daemon", action="store_true", help="detach once listening")
+    parser.add_argument("--pidfile")
+    parser.add_argument("--logfile", default=os.devnull)
+    args = parser.parse_args()
+
+    if args.pidfile:
+        stop_previous(args.pidfile)
+
+    try:
+        server = Server((args.host, args.port), args)
+    except socket.error as e:
+        sys.stderr.write("mock_searchd: could not listen on %s:%d: %s\n" % (args.host, args.port, e))
+        return 1
+    unix_server = None
+    if args.socket:
+        try:
+            unix_server = SocketServer(args.socket, server)
+        except socket.error as e:
+            sys.stderr.write("mock_searchd: could not listen on %s: %s\n" % (args.socket, e))
+            return 1
+    replica_servers = []
+    for port in args.replica_port:
+        try:
+            replica_servers.append(ReplicaServer((args.host, port), server))
+        except socket.error as e:
+            sys.stderr.write("mock_searchd: could not listen on %s:%d: %s\n" % (args.host, port, e))
+            return 1
+    api_servers = []
+    if args.api_port:
+        try:
+            api_servers.append(ApiServer((args.host, args.api_port), server))
+        except socket.error as e:
+            sys.stderr.write("mock_searchd: could not listen on %s:%d: %s\n" % (args.host, args.api_port, e))
+            return 1
+
+    if args.daemon:
+        pid = os.fork()
+        if pid:
+            if args.pidfile:
+                with open(args.pidfile, "w") as f:
+                    f.write("%d\n" % pid)
+            return 0
+        os.setsid()
+        fd = os.open(args.logfile, os.O_WRONLY | os.O_CREAT | os.O_APPEND, 0o644)
+        null = os.open(os.devnull, os.O_RDONLY)
+        os.dup2(null, 0)
+        os.dup2(fd, 1)
+        os.dup2(fd, 2)
+    elif args.pidfile:
+        with open(args.pidfile, "w") as f:
+            f.write("%d\n" % os.getpid())
+
+    for extra in ([unix_server] if unix_server else []) + replica_servers + api_servers:
+        threading.Thread(target=extra.serve_forever, kwargs={"poll_interval": 0.2},
+                         daemon=True).start()
+
+    def shutdown(*_):
+        threading.Thread(target=server.shutdown).start()
+
+    signal.signal(signal.SIGTERM, shutdown)
+    signal.signal(signal.SIGINT, shutdown)
+
+    if args.idle_exit > 0:
+        def watchdog():
+            while True:
+                time.sleep(1)
+                if time.time() - server.last_activity > args.idle_exit:
+                    server.shutdown()
+                    return
+        threading.Thread(target=watchdog, daemon=True).start()
+
+    try:
+        server.serve_forever(poll_interval=0.2)
+    finally:
+        server.server_close()
+        if unix_server:
+            unix_server.shutdown()
+            unix_server.server_close()
+            os.unlink(args.socket)
+        for extra in replica_servers + api_servers:
+            extra.shutdown()
+            extra.server_close()
+        if args.pidfile:
+            try:
+                os.unlink(args.pidfile)
+            except OSError as e:
+                if e.errno != errno.ENOENT:
+                    raise
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,47 @@
+SELECT sphinx_connect('mock', '127.0.0.1', 19306);
+SELECT sphinx_connect('api', '127.0.0.1', 19312, 'protocol=api');
+SELECT * FROM sphinx_connections() ORDER BY conname;
+SELECT * FROM sphinx_query('api', 'SELECT id, title, gid, price, tags FROM docs WHERE MATCH(''fox'')')
+    AS t (id bigint, title text, gid integer, price float8, tags text);
+-- attributes arrive in binary, yet convert to what SphinxQL gives
+SELECT count(*) FROM (
+    SELECT * FROM sphinx_query('api', 'SELECT * FROM docs') AS a (id bigint, title text, gid integer, price float8, tags text)
+    EXCEPT
+    SELECT * FROM sphinx_query('mock', 'SELECT * FROM docs') AS m (id bigint, title text, gid integer, price float8, tags text)) d;
+SELECT * FROM sphinx_query('api',
+    'SELECT id, gid FROM docs WHERE gid IN (1, 3) AND id > 2 AND price < 10 ORDER BY gid DESC, id ASC LIMIT 1, 3')
+    AS t (id bigint, gid integer);
+SELECT * FROM sphinx_query('api', 'SELECT id FROM docs ORDER BY id DESC OPTION max_matches = 3, ranker = bm25')
+    AS t (id integer);
+SELECT * FROM sphinx_query('api',
+    'SELECT id, weight() AS w FROM docs WHERE MATCH(''fox'') ORDER BY weight() DESC, id DESC LIMIT 3')
+    AS t (id bigint, w integer);
+SELECT * FROM sphinx_query('api', 'SHOW META') AS t (name text, value text);
+-- the statements of a batch go out in one request
+SELECT count(*) >= 0 AS cleared FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+SELECT * FROM sphinx_query_batch('api', ARRAY[
+    'SELECT id FROM docs WHERE MATCH(''fox'') LIMIT 2',
+    'SELECT id, title FROM docs WHERE id = 5',
+    'SHOW META'
+]) AS t (stmt integer, col1 text, col2 text);
+SELECT * FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+SELECT * FROM sphinx_query_batch('api', ARRAY['SELECT id FROM docs LIMIT 1', 'SELECT id FROM nosuch'])
+    AS t (stmt integer, id bigint);
+SELECT * FROM sphinx_query('api', 'SELECT id FROM nosuch') AS t (id bigint);
+-- a response too large to be real is refused, and the connection opened again
+SELECT * FROM sphinx_query('api', 'SELECT id FROM mock_oversized') AS t (id bigint);
+SELECT * FROM sphinx_query('api', 'SELECT id FROM docs LIMIT 1') AS t (id bigint);
+-- what SphinxAPI can't express is refused before anything is sent
+SELECT * FROM sphinx_query('api', 'SELECT gid, COUNT(*) FROM docs GROUP BY gid') AS t (gid integer, n integer);
+SELECT * FROM sphinx_query('api', 'SELECT id FROM docs WHERE gid + 1 = 2') AS t (id bigint);
+SELECT * FROM sphinx_query('api', 'SELECT id FROM docs WHERE') AS t (id bigint);
+SELECT sphinx_query_json('api', 'SELECT id FROM docs');
+SELECT sphinx_connect('bad', '127.0.0.1', 19312, 'protocol=http');
+SELECT sphinx_connect('bad', '127.0.0.1', 19312, 'protocol=api compress=on');
+-- a query that runs into read_timeout drops the connection, which is opened again
+SELECT sphinx_connect('slow', '127.0.0.1', 19312, 'protocol=api, read_timeout=1');
+SELECT * FROM sphinx_query('slow', 'SELECT id FROM docs_5000ms') AS t (id bigint);
+SELECT * FROM sphinx_query('slow', 'SELECT id FROM docs LIMIT 1') AS t (id bigint);
+SELECT sphinx_disconnect('slow');
+SELECT sphinx_disconnect('api');
+SELECT sphinx_disconnect('mock');
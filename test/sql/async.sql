@@ -0,0 +1,29 @@
+SELECT sphinx_connect('mock', '127.0.0.1', 19306);
+SELECT sphinx_connect('other', '127.0.0.1', 19306);
+-- a query runs on searchd while the backend does something else
+SELECT sphinx_send_query('mock', 'SELECT id FROM docs_500ms WHERE MATCH(?) ORDER BY id ASC', 'fox');
+SELECT sphinx_is_busy('mock');
+SELECT * FROM sphinx_query('mock', 'SELECT id FROM docs') AS t (id bigint);
+SELECT sphinx_send_query('other', 'SELECT id FROM docs WHERE id = 1');
+SELECT pg_sleep(1);
+SELECT sphinx_is_busy('mock');
+SELECT * FROM sphinx_get_result('mock') AS t (id bigint);
+SELECT * FROM sphinx_get_result('other') AS t (id bigint);
+SELECT sphinx_is_busy('mock');
+SELECT * FROM sphinx_get_result('mock') AS t (id bigint);
+-- errors of searchd come with the result
+SELECT sphinx_send_query('mock', 'SELECT id FROM nosuch');
+SELECT * FROM sphinx_get_result('mock') AS t (id bigint);
+SELECT * FROM sphinx_query('mock', 'SELECT id FROM docs WHERE id = 2') AS t (id bigint);
+-- also when sphinx_is_busy() read the answer first
+SELECT sphinx_send_query('mock', 'SELECT id FROM nosuch');
+SELECT pg_sleep(0.2);
+SELECT sphinx_is_busy('mock');
+SELECT * FROM sphinx_get_result('mock') AS t (id bigint);
+SELECT sphinx_is_busy('mock');
+-- an answer that fails to convert is consumed all the same
+SELECT sphinx_send_query('mock', 'SELECT title FROM docs LIMIT 1; SELECT id FROM docs LIMIT 1');
+SELECT * FROM sphinx_get_result('mock') AS t (id integer);
+SELECT * FROM sphinx_query('mock', 'SELECT id FROM docs WHERE id = 3') AS t (id bigint);
+SELECT sphinx_disconnect('other');
+SELECT sphinx_disconnect('mock');
@@ -0,0 +1,36 @@
+SELECT sphinx_connect('mock', '127.0.0.1', 19306);
+SELECT sphinx_connect('mock2', '127.0.0.1', 19306);
+SELECT * FROM sphinx_query_batch('mock', ARRAY[
+    'SELECT id FROM docs WHERE MATCH(''fox'') LIMIT 2',
+    'SELECT gid, COUNT(*) FROM docs GROUP BY gid',
+    'SHOW META'
+]) AS t (stmt integer, col1 text, col2 text);
+SELECT * FROM sphinx_query_batch('mock', ARRAY['SELECT id FROM docs LIMIT 1', 'SELECT id FROM nosuch'])
+    AS t (stmt integer, id bigint);
+SELECT * FROM sphinx_query_batch('mock', ARRAY['SELECT id FROM docs', ' ; ']) AS t (stmt integer, id bigint);
+-- several connections at once
+SELECT * FROM sphinx_query_multi(ARRAY['mock', 'mock2'],
+    'SELECT id, WEIGHT() AS w FROM docs WHERE MATCH(''fox'') LIMIT 3', 'w DESC', 4)
+    AS t (id bigint, w integer);
+SELECT * FROM sphinx_query_multi(ARRAY['mock', 'mock'], 'SELECT id FROM docs') AS t (id bigint);
+-- every match, past max_matches, in pages ordered by id
+SELECT count(*) FROM sphinx_query('mock', 'SELECT id FROM bench_2500_4 LIMIT 5000') AS t (id bigint);
+SELECT count(*), count(DISTINCT id), min(id), max(id)
+    FROM sphinx_query_all('mock', 'SELECT id, c1 FROM bench_2500_4', 1000) AS t (id bigint, c1 integer);
+SELECT count(*) >= 0 AS cleared FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+SELECT * FROM sphinx_query_all('mock', 'SELECT id, title FROM docs WHERE MATCH(''fox'');', 2)
+    AS t (id bigint, title text);
+SELECT * FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+SELECT * FROM sphinx_query_all('mock', 'SELECT id FROM docs ORDER BY id', 10) AS t (id bigint);
+SELECT * FROM sphinx_query_all('mock', 'SELECT id FROM docs WHERE MATCH(''fox'') OPTION ranker=none', 10) AS t (id bigint);
+-- another condition is ANDed to pages after the first, so a top-level OR is refused
+SELECT * FROM sphinx_query_all('mock', 'SELECT id FROM docs WHERE gid = 1 OR gid = 2', 2) AS t (id bigint);
+-- attributes named like a clause are not taken for one
+SELECT rows FROM sphinx_bulk_replace('mock', 'rt_clauses',
+    'SELECT g::bigint AS id, g % 2 AS "group", g * 10 AS "limit", 1 AS "option" FROM generate_series(1, 5) g');
+SELECT * FROM sphinx_query_all('mock', 'SELECT id, group, limit FROM rt_clauses WHERE limit > 10 AND option = 1 AND `group` = 1', 1)
+    AS t (id bigint, "group" integer, "limit" integer);
+SELECT * FROM sphinx_query_all('mock', 'SELECT title FROM docs', 10) AS t (title text);
+SELECT * FROM sphinx_query_all('mock', 'SELECT id FROM docs', 0) AS t (id bigint);
+SELECT sphinx_disconnect('mock2');
+SELECT sphinx_disconnect('mock');
@@ -0,0 +1,20 @@
+SELECT sphinx_connect('mock', '127.0.0.1', 19306);
+SELECT rows, affected, statements FROM sphinx_bulk_replace('mock', 'rt_test',
+    'SELECT g::bigint AS id, ''doc '' || g AS title, g * 10 AS price, ARRAY[g, g + 1] AS tags
+     FROM generate_series(1, 25) g', 10);
+SELECT * FROM sphinx_query('mock', 'SELECT id, title, price, tags FROM rt_test WHERE id > 22')
+    AS t (id bigint, title text, price integer, tags text);
+-- rows of an open cursor, NULLs become zeroes and empty strings
+BEGIN;
+DECLARE c CURSOR FOR SELECT 2::bigint AS id, NULL::text AS title, NULL::integer AS price;
+SELECT rows, affected, statements FROM sphinx_bulk_replace('mock', 'rt_test', 'c'::refcursor);
+COMMIT;
+SELECT * FROM sphinx_query('mock', 'SELECT id, title, price FROM rt_test WHERE id = 2')
+    AS t (id bigint, title text, price integer);
+SELECT rows FROM sphinx_bulk_replace('mock', 'rt_test', 'SELECT 1::bigint AS id, ''again'' AS title', replace => false);
+SELECT rows FROM sphinx_bulk_replace('mock', 'rt_test', 'SELECT 1::bigint AS id', 0);
+-- names that are not plain SphinxQL identifiers are quoted
+SELECT count(*) >= 0 AS cleared FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+SELECT rows FROM sphinx_bulk_replace('mock', 'rt_test', 'SELECT 3::bigint AS id, 1 AS "limit", 2 AS "unit price"');
+SELECT * FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+SELECT sphinx_disconnect('mock');
@@ -0,0 +1,37 @@
+--
+-- Tests run against test/mock_searchd.py, started by "make installcheck"
+--
+CREATE EXTENSION sphinxlink;
+SELECT sphinx_connect('mock', '127.0.0.1', 19306);
+SELECT * FROM sphinx_connections();
+SELECT sphinx_connect('mock', '127.0.0.1', 19306);
+SELECT sphinx_connect('opts', '127.0.0.1', 19306, 'connect_timeout=2, read_timeout=1min');
+SELECT sphinx_connect('bad', '127.0.0.1', 19306, 'timeout=2');
+SELECT sphinx_connect('bad', '127.0.0.1', 19306, 'read_timeout');
+SELECT sphinx_connect('bad', '127.0.0.1', 19306, 'read_timeout=-1');
+SELECT sphinx_connect('bad', '127.0.0.1', 19306, 'compress=maybe');
+SELECT sphinx_connect('bad', 'localhost', 0, 'socket=sphinx.sock');
+-- transport options
+SELECT sphinx_connect('sock', 'localhost', 0, 'socket=/tmp/sphinxlink_mock.sock');
+SELECT * FROM sphinx_query('sock', 'SHOW MOCK SESSION') AS t (transport text, compressed text);
+SELECT sphinx_connect('zip', '127.0.0.1', 19306,
+    'compress=on keepalives_idle=30 keepalives_interval=5s keepalives_count=3');
+SELECT * FROM sphinx_query('zip', 'SHOW MOCK SESSION') AS t (transport text, compressed text);
+SELECT count(*), sum(id) FROM sphinx_query('zip', 'SELECT * FROM bench_5000_4 LIMIT 5000 OPTION max_matches=5000')
+    AS t (id bigint, c1 bigint, c2 float8, c3 text);
+SELECT * FROM sphinx_connections() ORDER BY conname;
+SELECT sphinx_disconnect('sock');
+SELECT sphinx_disconnect('zip');
+SELECT sphinx_disconnect('opts');
+SELECT * FROM sphinx_query('opts', 'SELECT id FROM docs') AS t (id bigint);
+-- a query that runs into read_timeout is killed on the server
+SELECT sphinx_connect('slow', '127.0.0.1', 19306, 'read_timeout=1');
+SELECT * FROM sphinx_query('slow', 'SELECT id FROM docs_5000ms') AS t (id bigint);
+SELECT * FROM sphinx_query('slow', 'SELECT id FROM docs LIMIT 1') AS t (id bigint);
+-- and so is a cancelled one
+SET statement_timeout = '300ms';
+SELECT * FROM sphinx_query('slow', 'SELECT id FROM docs_5000ms') AS t (id bigint);
+RESET statement_timeout;
+SELECT * FROM sphinx_query('slow', 'SELECT id FROM docs LIMIT 1') AS t (id bigint);
+SELECT sphinx_disconnect('slow');
+SELECT sphinx_disconnect('mock');
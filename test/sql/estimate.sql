@@ -0,0 +1,46 @@
+SELECT sphinx_connect('mock', '127.0.0.1', 19306);
+-- rows the planner expects from a function scan
+CREATE FUNCTION estimated_rows(query text) RETURNS bigint LANGUAGE plpgsql AS $$
+DECLARE
+    plan json;
+BEGIN
+    EXECUTE 'EXPLAIN (FORMAT JSON) ' || query INTO plan;
+    RETURN (plan->0->'Plan'->>'Plan Rows')::bigint;
+END
+$$;
+-- a query not run before gets sphinxlink.estimated_rows
+SELECT estimated_rows('SELECT * FROM sphinx_query(''mock'', ''SELECT id FROM docs WHERE MATCH(''''fox'''')'') AS t (id bigint)');
+SELECT count(*) FROM sphinx_query('mock', 'SELECT id FROM docs WHERE MATCH(''fox'')') AS t (id bigint);
+SELECT estimated_rows('SELECT * FROM sphinx_query(''mock'', ''SELECT id FROM docs WHERE MATCH(''''fox'''')'') AS t (id bigint)');
+-- other literals in the same query shape get the estimate of the shape
+SELECT estimated_rows('SELECT * FROM sphinx_query(''mock'', ''SELECT id FROM docs WHERE MATCH(''''bear'''')'') AS t (id bigint)');
+SELECT count(*) FROM sphinx_query('mock', 'SELECT id FROM docs WHERE id = 2') AS t (id bigint);
+SELECT estimated_rows('SELECT * FROM sphinx_query(''mock'', ''SELECT id FROM docs WHERE id = 7'') AS t (id bigint)');
+-- match clauses
+SELECT count(*) FROM sphinx_query('mock', 'SELECT id FROM docs WHERE MATCH(?) LIMIT 2', 'fox') AS t (id bigint);
+SELECT estimated_rows('SELECT * FROM sphinx_query(''mock'', ''SELECT id FROM docs WHERE MATCH(?) LIMIT 2'', ''fox'') AS t (id bigint)');
+SELECT estimated_rows('SELECT t.* FROM (VALUES (''dog'')) v (m), LATERAL sphinx_query(''mock'', ''SELECT id FROM docs WHERE MATCH(?) LIMIT 2'', v.m) AS t (id bigint)');
+-- sphinx_query_params() too
+SELECT estimated_rows('SELECT * FROM sphinx_query_params(''127.0.0.1'', 19306, ''SELECT id FROM docs'') AS t (id bigint)');
+SELECT count(*) FROM sphinx_query_params('127.0.0.1', 19306, 'SELECT id FROM docs') AS t (id bigint);
+SELECT estimated_rows('SELECT * FROM sphinx_query_params(''127.0.0.1'', 19306, ''SELECT id FROM docs'') AS t (id bigint)');
+-- the fallback
+SET sphinxlink.estimated_rows = 50;
+SELECT estimated_rows('SELECT * FROM sphinx_query(''mock'', ''SHOW TABLES'') AS t (name text, type text)');
+RESET sphinxlink.estimated_rows;
+-- a slow query costs more than a fast one
+SELECT count(*) FROM sphinx_query('mock', 'SELECT id FROM docs_200ms WHERE id = 1') AS t (id bigint);
+CREATE FUNCTION startup_cost(query text) RETURNS float8 LANGUAGE plpgsql AS $$
+DECLARE
+    plan json;
+BEGIN
+    EXECUTE 'EXPLAIN (FORMAT JSON) ' || query INTO plan;
+    RETURN (plan->0->'Plan'->>'Startup Cost')::float8;
+END
+$$;
+SELECT startup_cost('SELECT * FROM sphinx_query(''mock'', ''SELECT id FROM docs_200ms WHERE id = 1'') AS t (id bigint)')
+    > 10 * startup_cost('SELECT * FROM sphinx_query(''mock'', ''SELECT id FROM docs WHERE id = 1'') AS t (id bigint)')
+    AS slower;
+DROP FUNCTION startup_cost(text);
+DROP FUNCTION estimated_rows(text);
+SELECT sphinx_disconnect('mock');
@@ -0,0 +1,69 @@
+SELECT sphinx_connect('mock', '127.0.0.1', 19306);
+CREATE SERVER mock_sphinx FOREIGN DATA WRAPPER sphinx_fdw OPTIONS (host '127.0.0.1', port '19306');
+CREATE FOREIGN TABLE docs_idx (id bigint, title text, gid integer, price float8,
+                               weight integer OPTIONS (column_name 'weight()'))
+    SERVER mock_sphinx OPTIONS (index 'docs');
+SELECT count(*) >= 0 AS cleared FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+SELECT id, title FROM docs_idx WHERE docs_idx ==> 'fox' AND gid IN (2, 3) ORDER BY weight DESC LIMIT 2;
+SELECT id, price FROM docs_idx WHERE gid = 1 AND price > 4;
+-- float equality is checked locally
+SELECT id FROM docs_idx WHERE price = 45;
+SELECT * FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+-- a scan without LIMIT fails rather than return only max_matches rows
+CREATE FOREIGN TABLE docs_few (id bigint)
+    SERVER mock_sphinx OPTIONS (index 'docs', max_matches '5');
+SELECT id FROM docs_few;
+SELECT count(*) FROM docs_few WHERE docs_few ==> 'fox';
+SELECT id FROM docs_few LIMIT 6;
+-- expression columns may be NULL and are not filtered on remotely
+CREATE FOREIGN TABLE docs_expr (id bigint, doubled float8 OPTIONS (column_name 'price*2'),
+                                cheap boolean OPTIONS (column_name 'price<5'))
+    SERVER mock_sphinx OPTIONS (index 'docs');
+EXPLAIN (COSTS OFF) SELECT id, doubled FROM docs_expr ORDER BY doubled DESC LIMIT 2;
+EXPLAIN (COSTS OFF) SELECT id, doubled FROM docs_expr ORDER BY doubled DESC NULLS LAST LIMIT 2;
+EXPLAIN (COSTS OFF) SELECT id FROM docs_expr WHERE cheap;
+DROP FOREIGN TABLE docs_expr;
+DROP FOREIGN TABLE docs_few;
+-- partitioned scans
+CREATE FOREIGN TABLE docs_parts (id bigint, title text)
+    SERVER mock_sphinx OPTIONS (index 'docs', id_partitions '3');
+ALTER FOREIGN TABLE docs_parts OPTIONS (SET id_partitions '0');
+SET max_parallel_workers_per_gather = 0;
+SELECT count(*) >= 0 AS cleared FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+SELECT id, title FROM docs_parts WHERE docs_parts ==> 'fox';
+SELECT * FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+SET max_parallel_workers_per_gather = 2;
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+EXPLAIN (COSTS OFF) SELECT id, title FROM docs_parts;
+SELECT count(*), min(id), max(id) FROM docs_parts;
+CREATE FUNCTION workers_launched(query text) RETURNS SETOF text LANGUAGE plpgsql AS $$
+DECLARE
+    line text;
+BEGIN
+    FOR line IN EXECUTE 'EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF, SUMMARY OFF) ' || query LOOP
+        IF line ~ 'Workers Launched' THEN
+            RETURN NEXT trim(line);
+        END IF;
+    END LOOP;
+END
+$$;
+SELECT workers_launched('SELECT count(*) FROM docs_parts WHERE docs_parts ==> ''fox''');
+SELECT count(*) FROM docs_parts WHERE docs_parts ==> 'fox';
+-- workers reopen named connections, also ones opened in an aborted transaction
+BEGIN;
+SELECT sphinx_connect('late', '127.0.0.1', 19306);
+ROLLBACK;
+SELECT workers_launched('SELECT count(*) FROM docs_parts d
+    JOIN sphinx_query_all(''late'', ''SELECT id FROM docs WHERE MATCH(''''fox'''')'') AS s (id bigint) USING (id)');
+SELECT count(*) FROM docs_parts d
+    JOIN sphinx_query_all('late', 'SELECT id FROM docs WHERE MATCH(''fox'')') AS s (id bigint) USING (id);
+DROP FUNCTION workers_launched(text);
+SELECT sphinx_disconnect('late');
+RESET max_parallel_workers_per_gather;
+RESET parallel_setup_cost;
+RESET parallel_tuple_cost;
+DROP FOREIGN TABLE docs_parts;
+DROP FOREIGN TABLE docs_idx;
+DROP SERVER mock_sphinx;
+SELECT sphinx_disconnect('mock');
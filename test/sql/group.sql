@@ -0,0 +1,77 @@
+-- the mock searchd listens on port 19306 and, as a replica, on 19307
+SELECT sphinx_connect('r1', '127.0.0.1', 19306);
+SELECT sphinx_connect('r2', '127.0.0.1', 19307);
+SELECT count(*) >= 0 AS cleared FROM sphinx_query('r1', 'SHOW MOCK QUERIES') AS t (query text);
+SELECT sphinx_connect_group('bad', ARRAY['127.0.0.1:x']);
+SELECT sphinx_connect_group('bad', ARRAY[]::text[]);
+SELECT sphinx_connect_group('bad', ARRAY['127.0.0.1:19306'], 'socket=/tmp/sphinxlink_mock.sock');
+SELECT sphinx_connect('bad', '127.0.0.1', 19306, 'hedge_delay=10');
+SELECT * FROM sphinx_replicas('r1');
+-- an unreachable replica is ejected from the start
+\set VERBOSITY terse
+SELECT sphinx_connect_group('half', ARRAY['127.0.0.1:19309', '127.0.0.1:19306']);
+SELECT sphinx_connect_group('none', ARRAY['127.0.0.1:19309']);
+\set VERBOSITY default
+SELECT * FROM sphinx_query('half', 'SELECT id FROM docs WHERE id = 1') AS t (id bigint);
+SELECT host, port, active, healthy, latency > 0 AS measured, errors, queries, failures, hedges
+    FROM sphinx_replicas('half');
+SELECT sphinx_disconnect('half');
+SELECT * FROM sphinx_query('r1', 'SHOW MOCK QUERIES') AS t (query text);
+-- a slow replica is hedged: the query goes to the other one as well
+SELECT count(*) FROM sphinx_query_batch('r1', ARRAY['SET GLOBAL mock_latency = 300']) AS t (stmt integer);
+SELECT sphinx_connect_group('grp', ARRAY['127.0.0.1:19306', '127.0.0.1:19307'],
+    'hedge_delay=50ms eject_errors=2 eject_time=1');
+SELECT * FROM sphinx_query('grp', 'SELECT id FROM docs WHERE id = 1') AS t (id bigint);
+SELECT host, port, active, healthy, latency > 0 AS measured, errors, queries, failures, hedges
+    FROM sphinx_replicas('grp');
+-- and the faster replica gets the next one
+SELECT * FROM sphinx_query('grp', 'SELECT id FROM docs WHERE id = 2') AS t (id bigint);
+SELECT * FROM sphinx_query('r1', 'SHOW MOCK QUERIES') AS t (query text);
+SELECT * FROM sphinx_query('r2', 'SHOW MOCK QUERIES') AS t (query text);
+-- a read fails over to the next replica when its replica goes down
+SELECT count(*) FROM sphinx_query_batch('r1', ARRAY['SET GLOBAL mock_latency = 0']) AS t (stmt integer);
+SELECT count(*) FROM sphinx_query_batch('r2', ARRAY['SET GLOBAL mock_down = 1']) AS t (stmt integer);
+SELECT * FROM sphinx_query('grp', 'SELECT id FROM docs WHERE id = 3') AS t (id bigint);
+-- and eject_errors failures in a row eject it
+\set VERBOSITY terse
+SELECT * FROM sphinx_query('grp', 'SELECT id FROM docs WHERE id = 4') AS t (id bigint);
+\set VERBOSITY default
+SELECT host, port, active, healthy, latency > 0 AS measured, errors, queries, failures, hedges
+    FROM sphinx_replicas('grp');
+SELECT * FROM sphinx_query('grp', 'SELECT id FROM docs WHERE id = 5') AS t (id bigint);
+-- it is back after eject_time
+SELECT count(*) FROM sphinx_query_batch('r2', ARRAY['SET GLOBAL mock_down = 0']) AS t (stmt integer);
+SELECT pg_sleep(1.2);
+SELECT * FROM sphinx_query('grp', 'SELECT id FROM docs WHERE id = 6') AS t (id bigint);
+SELECT host, port, active, healthy, latency > 0 AS measured, errors, queries, failures, hedges
+    FROM sphinx_replicas('grp');
+SELECT conname, host, port, options FROM sphinx_connections() WHERE conname = 'grp';
+-- asynchronous and multi-connection queries pick the replica and eject it too
+SELECT count(*) >= 0 AS cleared FROM sphinx_query('r1', 'SHOW MOCK QUERIES') AS t (query text);
+SELECT count(*) FROM sphinx_query_batch('r2', ARRAY['SET GLOBAL mock_down = 1']) AS t (stmt integer);
+\set VERBOSITY terse
+DO $$ BEGIN
+    PERFORM sphinx_send_query('grp', 'SELECT id FROM docs WHERE id = 7');
+    PERFORM * FROM sphinx_get_result('grp') AS t (id bigint);
+EXCEPTION WHEN OTHERS THEN RAISE NOTICE 'failed';
+END $$;
+DO $$ BEGIN
+    PERFORM sphinx_send_query('grp', 'SELECT id FROM docs WHERE id = 8');
+    PERFORM * FROM sphinx_get_result('grp') AS t (id bigint);
+EXCEPTION WHEN OTHERS THEN RAISE NOTICE 'failed';
+END $$;
+\set VERBOSITY default
+SELECT sphinx_send_query('grp', 'SELECT id FROM docs WHERE id = 9');
+SELECT * FROM sphinx_get_result('grp') AS t (id bigint);
+SELECT * FROM sphinx_query_multi(ARRAY['grp', 'r1'], 'SELECT id FROM docs WHERE id = 10') AS t (id bigint);
+SELECT * FROM sphinx_query('r1', 'SHOW MOCK QUERIES') AS t (query text);
+SELECT count(*) FROM sphinx_query_batch('r2', ARRAY['SET GLOBAL mock_down = 0']) AS t (stmt integer);
+-- sphinx_query_multi() stops at max_rows and drops the answers still to come
+SELECT count(*) FROM sphinx_query_batch('r2', ARRAY['SET GLOBAL mock_latency = 500']) AS t (stmt integer);
+SELECT * FROM sphinx_query_multi(ARRAY['r1', 'r2'], 'SELECT id FROM docs ORDER BY id ASC LIMIT 3', NULL, 2)
+    AS t (id bigint);
+SELECT count(*) FROM sphinx_query_batch('r2', ARRAY['SET GLOBAL mock_latency = 0']) AS t (stmt integer);
+SELECT * FROM sphinx_query('r2', 'SELECT id FROM docs WHERE id = 4') AS t (id bigint);
+SELECT sphinx_disconnect('grp');
+SELECT sphinx_disconnect('r2');
+SELECT sphinx_disconnect('r1');
@@ -0,0 +1,34 @@
+LOAD 'sphinxlink';
+SELECT sphinx_connect('mock', '127.0.0.1', 19306);
+CREATE TABLE docs (id bigint PRIMARY KEY, title text);
+INSERT INTO docs SELECT g, 'document ' || g FROM generate_series(1, 10) g;
+ANALYZE docs;
+SET enable_hashjoin = off;
+SET enable_mergejoin = off;
+SET enable_nestloop = off;
+EXPLAIN (COSTS OFF)
+SELECT t.id, t.title, s.w FROM docs t
+    JOIN sphinx_query('mock', 'SELECT id, WEIGHT() AS w FROM docs WHERE MATCH(''fox'')')
+         AS s (id bigint, w integer) ON t.id = s.id
+    ORDER BY s.w DESC, s.id LIMIT 3;
+SELECT t.id, t.title, s.w FROM docs t
+    JOIN sphinx_query('mock', 'SELECT id, WEIGHT() AS w FROM docs WHERE MATCH(''fox'')')
+         AS s (id bigint, w integer) ON t.id = s.id
+    ORDER BY s.w DESC, s.id LIMIT 3;
+-- conditions on the table are checked as rows are found
+SELECT t.id, s.w FROM docs t
+    JOIN sphinx_query('mock', 'SELECT id, WEIGHT() AS w FROM docs WHERE MATCH(''fox'')')
+         AS s (id bigint, w integer) ON t.id = s.id
+    WHERE t.id <> 3 ORDER BY s.w DESC, s.id;
+-- a cast function between the columns is not looked through
+CREATE TABLE nums (id numeric PRIMARY KEY);
+INSERT INTO nums SELECT g FROM generate_series(1, 10) g;
+SELECT t.id FROM nums t
+    JOIN sphinx_query('mock', 'SELECT id FROM docs WHERE MATCH(''fox'')') AS s (id bigint) ON t.id = s.id
+    ORDER BY t.id;
+DROP TABLE nums;
+RESET enable_hashjoin;
+RESET enable_mergejoin;
+RESET enable_nestloop;
+DROP TABLE docs;
+SELECT sphinx_disconnect('mock');
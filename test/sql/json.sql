@@ -0,0 +1,16 @@
+SELECT sphinx_connect('mock', '127.0.0.1', 19306);
+-- rows as jsonb objects, numbers by the column type searchd sent
+SELECT jsonb_array_elements(sphinx_query_json('mock', 'SELECT id, title, price, tags FROM docs WHERE id IN (1, 5, 9)')) AS doc;
+SELECT jsonb_typeof(doc->'id') AS id, jsonb_typeof(doc->'price') AS price, jsonb_typeof(doc->'title') AS title
+    FROM jsonb_array_elements(sphinx_query_json('mock', 'SELECT id, price, title FROM docs LIMIT 1')) AS doc;
+SELECT count(*), sum((doc->>'price')::numeric)
+    FROM jsonb_array_elements(sphinx_query_json('mock', 'SELECT id, price FROM docs')) AS doc;
+-- MATCH(?) is replaced with the escaped match clause
+SELECT sphinx_query_json('mock', 'SELECT id FROM docs WHERE MATCH(?) ORDER BY id ASC', 'fox''s');
+-- result sets of FACET are put next to the matches
+SELECT * FROM jsonb_each(sphinx_query_json('mock',
+    'SELECT id FROM docs WHERE MATCH(''fox'') ORDER BY id ASC LIMIT 2 FACET gid FACET gid LIMIT 1'));
+-- no rows
+SELECT sphinx_query_json('mock', 'SELECT id FROM docs WHERE id = 100');
+SELECT sphinx_query_json('mock', 'SELECT id FROM nosuch');
+SELECT sphinx_disconnect('mock');
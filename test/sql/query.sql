@@ -0,0 +1,50 @@
+SELECT sphinx_connect('mock', '127.0.0.1', 19306);
+SELECT * FROM sphinx_query('mock', 'SELECT id, title, gid, price FROM docs LIMIT 5')
+    AS t (id bigint, title text, gid integer, price float8);
+-- searchd returns 20 rows unless told otherwise
+SELECT count(*) FROM sphinx_query('mock', 'SELECT id FROM bench_100_2') AS t (id bigint);
+-- types without a fast path go through their input function
+SELECT * FROM sphinx_query('mock', 'SELECT id, price, tags FROM docs WHERE gid = 1')
+    AS t (id integer, price numeric, tags text);
+SET TimeZone = 'UTC';
+SET DateStyle = 'ISO';
+SELECT * FROM sphinx_query('mock', 'SELECT id, 1700000000 AS ts, 1 AS flag FROM docs LIMIT 1')
+    AS t (id bigint, ts timestamptz, flag boolean);
+-- the same without the fast path
+SET sphinxlink.typed_conversion = off;
+SELECT * FROM sphinx_query('mock', 'SELECT id, 1700000000 AS ts, 1 AS flag FROM docs LIMIT 1')
+    AS t (id bigint, ts timestamp, flag boolean);
+RESET sphinxlink.typed_conversion;
+RESET TimeZone;
+RESET DateStyle;
+SET sphinxlink.typed_conversion = off;
+SELECT * FROM sphinx_query('mock', 'SELECT id, gid, price FROM docs WHERE id <= 2')
+    AS t (id bigint, gid integer, price float8);
+RESET sphinxlink.typed_conversion;
+SELECT * FROM sphinx_query('mock', 'SELECT id, gid FROM docs') AS t (id bigint);
+SELECT * FROM sphinx_query('mock', 'SELECT title FROM docs LIMIT 1') AS t (title integer);
+SELECT * FROM sphinx_query('mock', 'SELECT id FROM nosuch') AS t (id bigint);
+-- MATCH(?) is replaced with the escaped match clause
+SELECT count(*) >= 0 AS cleared FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+SELECT * FROM sphinx_query('mock', 'SELECT id, title FROM docs WHERE MATCH(?)', 'fox''s') AS t (id bigint, title text);
+SELECT * FROM sphinx_query('mock', 'SELECT id, title FROM docs WHERE MATCH(?)', 'back\slash') AS t (id bigint, title text);
+SELECT * FROM sphinx_query_params('127.0.0.1', 19306, 'SELECT id, title FROM docs WHERE MATCH(?)', 'привет')
+    AS t (id bigint, title text);
+SELECT * FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+SELECT * FROM sphinx_query('mock', 'SELECT id, WEIGHT() AS w FROM docs WHERE MATCH(''fox'') LIMIT 2')
+    AS t (id bigint, w integer);
+SELECT * FROM sphinx_meta('mock');
+-- templates
+SELECT sphinx_prepare('mock', 'search', 'SELECT id FROM docs WHERE MATCH(?) AND gid IN (?) LIMIT ?');
+SELECT * FROM sphinx_execute('mock', 'search', 'fox', ARRAY[2, 3], 2) AS t (id bigint);
+SELECT sphinx_prepare('mock', 'by_gid', 'SELECT id FROM docs WHERE gid = $2 AND id > $1');
+SELECT * FROM sphinx_execute('mock', 'by_gid', 5, 1) AS t (id bigint);
+-- string arguments are quoted and escaped once
+SELECT sphinx_prepare('mock', 'by_title', 'SELECT id FROM docs WHERE title = ?');
+SELECT count(*) >= 0 AS cleared FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+SELECT * FROM sphinx_execute('mock', 'by_title', 'It''s a fox''s world') AS t (id bigint);
+SELECT * FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+SELECT * FROM sphinx_execute('mock', 'search', 'fox') AS t (id bigint);
+SELECT * FROM sphinx_execute('mock', 'nosuch') AS t (id bigint);
+SELECT sphinx_prepare('mock', 'bad', 'SELECT id FROM docs WHERE id = ? AND gid = $1');
+SELECT sphinx_disconnect('mock');
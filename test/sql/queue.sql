@@ -0,0 +1,63 @@
+SELECT sphinx_connect('mock', '127.0.0.1', 19306);
+CREATE TABLE items (id bigint PRIMARY KEY, title text, price integer);
+CREATE FUNCTION items_to_sphinx() RETURNS trigger LANGUAGE plpgsql AS $$
+BEGIN
+    IF TG_OP = 'DELETE' THEN
+        PERFORM sphinx_queue_delete('mock', 'rt_queue', OLD.id);
+        RETURN OLD;
+    END IF;
+    PERFORM sphinx_queue_write('mock', 'rt_queue', NEW);
+    RETURN NEW;
+END
+$$;
+CREATE TRIGGER items_to_sphinx AFTER INSERT OR UPDATE OR DELETE ON items
+    FOR EACH ROW EXECUTE PROCEDURE items_to_sphinx();
+SELECT count(*) >= 0 AS cleared FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+-- writes wait for the commit, a document written twice is sent once
+BEGIN;
+INSERT INTO items VALUES (1, 'one', 10), (2, 'two', 20), (3, 'three', 30);
+UPDATE items SET price = 11 WHERE id = 1;
+SELECT * FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+COMMIT;
+SELECT * FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+SELECT * FROM sphinx_query('mock', 'SELECT id, title, price FROM rt_queue') AS t (id bigint, title text, price integer);
+-- a rollback drops them
+SELECT count(*) >= 0 AS cleared FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+BEGIN;
+UPDATE items SET title = 'uno' WHERE id = 1;
+ROLLBACK;
+SELECT * FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+-- and so does the rollback of a subtransaction
+BEGIN;
+UPDATE items SET title = 'uno' WHERE id = 1;
+SAVEPOINT s;
+UPDATE items SET title = 'eins' WHERE id = 1;
+DELETE FROM items WHERE id = 2;
+ROLLBACK TO SAVEPOINT s;
+SAVEPOINT t;
+UPDATE items SET price = 33 WHERE id = 3;
+RELEASE SAVEPOINT t;
+COMMIT;
+SELECT * FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+-- statements queued as text run in their place
+BEGIN;
+DELETE FROM items WHERE id = 3;
+DELETE FROM items WHERE id = 2;
+SELECT sphinx_queue_write('mock', 'UPDATE rt_queue SET price = 12 WHERE id = 1');
+INSERT INTO items VALUES (4, 'four', 40);
+COMMIT;
+SELECT * FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+SELECT * FROM sphinx_query('mock', 'SELECT id, title, price FROM rt_queue') AS t (id bigint, title text, price integer);
+-- a failing write makes the commit fail
+BEGIN;
+SELECT sphinx_queue_write('mock', 'UPDATE rt_queue SET nosuch = 1 WHERE id = 1');
+INSERT INTO items VALUES (5, 'five', 50);
+COMMIT;
+SELECT count(*) FROM items WHERE id = 5;
+-- bad documents
+SELECT sphinx_queue_write('mock', 'rt_queue', ROW(1, 'x'));
+SELECT sphinx_queue_write('mock', 'rt_queue', d) FROM (SELECT NULL::bigint AS id, 'x' AS title) d;
+SELECT sphinx_queue_write('nosuch', 'UPDATE rt_queue SET price = 1 WHERE id = 1');
+DROP TABLE items;
+DROP FUNCTION items_to_sphinx();
+SELECT sphinx_disconnect('mock');
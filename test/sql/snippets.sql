@@ -0,0 +1,33 @@
+SELECT sphinx_connect('mock', '127.0.0.1', 19306);
+SELECT count(*) >= 0 AS cleared FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+-- all documents in one CALL SNIPPETS, excerpts in their order; max_allowed_packet
+-- is asked once per connection
+SELECT * FROM sphinx_snippets('mock', 'docs',
+    ARRAY['The quick brown fox', 'Lazy dog sleeps', NULL, 'Fox and hound'], 'fox')
+    WITH ORDINALITY AS s (snippet, n);
+SELECT * FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+SELECT * FROM sphinx_snippets('mock', 'docs', ARRAY['Quick thinking fox is quick'], 'quick',
+    '{"before_match": "[", "after_match": "]", "limit": 20, "allow_empty": true}');
+SELECT * FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+SELECT * FROM sphinx_snippets('mock', 'docs', ARRAY[]::text[], 'fox');
+-- documents from a query
+SELECT * FROM sphinx_snippets('mock', 'docs',
+    'SELECT title FROM (VALUES (1, ''Brown bear facts''), (2, NULL), (3, ''Quick thinking fox'')) v (id, title) ORDER BY id',
+    'fox brown');
+SELECT * FROM sphinx_snippets('mock', 'docs', 'SELECT 1, 2', 'fox');
+-- bad options
+SELECT * FROM sphinx_snippets('mock', 'docs', ARRAY['fox'], 'fox', '[1]');
+SELECT * FROM sphinx_snippets('mock', 'docs', ARRAY['fox'], 'fox', '{"limit; DROP": 1}');
+SELECT * FROM sphinx_snippets('mock', 'docs', ARRAY['fox'], 'fox', '{"limit": [1]}');
+SELECT * FROM sphinx_snippets('mock', 'docs', ARRAY['fox'], 'fox', '{"bogus": 1}');
+SELECT * FROM sphinx_snippets('mock', 'nosuch', ARRAY['fox'], 'fox');
+-- calls are split to fit into max_allowed_packet
+SELECT count(*) FROM sphinx_query_batch('mock', ARRAY['SET GLOBAL max_allowed_packet = 120']) AS t (stmt integer);
+SELECT sphinx_connect('small', '127.0.0.1', 19306);
+SELECT count(*) >= 0 AS cleared FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+SELECT * FROM sphinx_snippets('small', 'docs', ARRAY['one fox one fox one fox one fox', 'one fox one fox one fox one fox', 'one fox one fox one fox one fox'], 'fox');
+SELECT * FROM sphinx_query('mock', 'SHOW MOCK QUERIES') AS t (query text);
+SELECT * FROM sphinx_snippets('small', 'docs', ARRAY['fox', repeat('x', 100)], 'fox');
+SELECT sphinx_disconnect('small');
+SELECT count(*) FROM sphinx_query_batch('mock', ARRAY['SET GLOBAL max_allowed_packet = 8388608']) AS t (stmt integer);
+SELECT sphinx_disconnect('mock');
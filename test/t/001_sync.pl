@@ -0,0 +1,146 @@
+# Changes of a mapped table reach the RT index through the sync worker.
+# searchd is played by test/mock_searchd.py.
+
+use strict;
+use warnings;
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+use Time::HiRes qw(usleep);
+
+my $port = PostgreSQL::Test::Cluster::get_free_port();
+my $pidfile = "${PostgreSQL::Test::Utils::tmp_check}/mock_searchd.pid";
+
+system_or_bail('python3', 'test/mock_searchd.py', '--port', $port,
+	'--daemon', '--pidfile', $pidfile);
+
+END
+{
+	if (defined $pidfile && open(my $fh, '<', $pidfile))
+	{
+		my $pid = <$fh>;
+		close($fh);
+		kill 'TERM', $pid if $pid;
+	}
+}
+
+my $node = PostgreSQL::Test::Cluster->new('sync');
+$node->init(allows_streaming => 'logical');
+$node->append_conf(
+	'postgresql.conf', qq{
+shared_preload_libraries = 'sphinxlink'
+sphinxlink.sync_database = 'postgres'
+sphinxlink.sync_naptime = 100
+});
+$node->start;
+
+$node->safe_psql(
+	'postgres', qq{
+CREATE EXTENSION sphinxlink;
+CREATE TABLE items (id bigint PRIMARY KEY, title text, price integer, secret text);
+INSERT INTO sphinx_sync_map (relid, port, index, columns)
+	VALUES ('items', $port, 'items_rt', 'id, title, price');
+});
+
+# the index as searchd sees it
+sub index_contents
+{
+	return $node->safe_psql('postgres',
+		    "SELECT string_agg(id || ':' || title || ':' || price, ',' ORDER BY id) "
+		  . "FROM sphinx_query_params('127.0.0.1', $port, "
+		  . "'SELECT id, title, price FROM items_rt LIMIT 1000') AS t (id bigint, title text, price integer)"
+	);
+}
+
+sub wait_for_index
+{
+	my ($expected, $name) = @_;
+	my $contents;
+
+	foreach (1 .. 10 * $PostgreSQL::Test::Utils::timeout_default)
+	{
+		$contents = eval { index_contents() };
+		last if defined $contents && $contents eq $expected;
+		usleep(100_000);
+	}
+	is($contents, $expected, $name);
+}
+
+# the worker creates the slot on its first round; rows from then on are sent
+$node->poll_query_until('postgres',
+	"SELECT count(*) = 1 FROM pg_replication_slots WHERE slot_name = 'sphinxlink_sync'")
+  or die "sync slot was not created";
+
+$node->safe_psql('postgres',
+	"INSERT INTO items SELECT g, 'item ' || g, g * 10, 'x' FROM generate_series(1, 5) g");
+wait_for_index('1:item 1:10,2:item 2:20,3:item 3:30,4:item 4:40,5:item 5:50',
+	'inserted rows are replaced into the index');
+
+$node->safe_psql(
+	'postgres', q{
+UPDATE items SET price = price + 1 WHERE id = 2;
+UPDATE items SET id = 6 WHERE id = 3;
+DELETE FROM items WHERE id = 5;
+UPDATE items SET secret = 'y' WHERE id = 1;
+});
+wait_for_index('1:item 1:10,2:item 2:21,4:item 4:40,6:item 3:30',
+	'updates, key changes and deletes are applied');
+
+# nothing of a rolled back transaction arrives
+$node->safe_psql(
+	'postgres', q{
+BEGIN;
+INSERT INTO items VALUES (7, 'item 7', 70);
+ROLLBACK;
+INSERT INTO items VALUES (8, 'item 8', 80);
+});
+wait_for_index('1:item 1:10,2:item 2:21,4:item 4:40,6:item 3:30,8:item 8:80',
+	'rolled back rows are not sent');
+
+my $status = $node->safe_psql('postgres',
+	"SELECT errors, replaced > 0, deleted > 0, applied_lsn IS NOT NULL FROM sphinx_sync_status");
+is($status, '0|t|t|t', 'sphinx_sync_status reports the work done');
+
+# a truncation empties the index; rows inserted after it are sent again
+$node->safe_psql(
+	'postgres', q{
+BEGIN;
+TRUNCATE items;
+INSERT INTO items VALUES (9, 'item 9', 90);
+COMMIT;
+});
+wait_for_index('9:item 9:90', 'a truncation is applied');
+
+$node->safe_psql('postgres', 'TRUNCATE items');
+wait_for_index('', 'a truncation empties the index');
+$node->safe_psql('postgres',
+	"INSERT INTO items SELECT g, 'item ' || g, g * 10, 'x' FROM generate_series(1, 8) g; "
+	  . "DELETE FROM items WHERE id IN (1, 3, 5, 7)");
+
+# deletes can't be decoded without the id in the replica identity
+my ($ret, $stdout, $stderr) = $node->psql(
+	'postgres', qq{
+CREATE TABLE notes (id bigint, body text);
+INSERT INTO sphinx_sync_map (relid, port, index) VALUES ('notes', $port, 'notes_rt');
+});
+isnt($ret, 0, 'a table without replica identity is rejected');
+like($stderr, qr/document id column "id" of relation "notes" is not part of its replica identity/,
+	'the rejection names the column');
+$node->safe_psql(
+	'postgres', qq{
+ALTER TABLE notes REPLICA IDENTITY FULL;
+INSERT INTO sphinx_sync_map (relid, port, index) VALUES ('notes', $port, 'notes_rt');
+DELETE FROM sphinx_sync_map WHERE relid = 'notes'::regclass;
+});
+pass('a table with REPLICA IDENTITY FULL is accepted');
+
+# the worker picks up where it left off after a restart
+$node->stop;
+$node->start;
+$node->safe_psql('postgres', "DELETE FROM items WHERE id = 2");
+wait_for_index('4:item 4:40,6:item 6:60,8:item 8:80',
+	'the worker resumes from the slot after a restart');
+
+$node->stop;
+
+done_testing();
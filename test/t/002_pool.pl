@@ -0,0 +1,110 @@
+# Queries by host and port go through the connection pool worker.
+# searchd is played by test/mock_searchd.py.
+
+use strict;
+use warnings;
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+use Time::HiRes qw(time);
+
+my $port = PostgreSQL::Test::Cluster::get_free_port();
+my $pidfile = "${PostgreSQL::Test::Utils::tmp_check}/mock_searchd_pool.pid";
+
+system_or_bail('python3', 'test/mock_searchd.py', '--port', $port,
+	'--daemon', '--pidfile', $pidfile);
+
+END
+{
+	if (defined $pidfile && open(my $fh, '<', $pidfile))
+	{
+		my $pid = <$fh>;
+		close($fh);
+		kill 'TERM', $pid if $pid;
+	}
+}
+
+my $node = PostgreSQL::Test::Cluster->new('pool');
+$node->init;
+$node->append_conf(
+	'postgresql.conf', qq{
+shared_preload_libraries = 'sphinxlink'
+sphinxlink.pool_size = 1
+});
+$node->start;
+
+$node->safe_psql('postgres', 'CREATE EXTENSION sphinxlink');
+
+sub wait_for_worker
+{
+	$node->poll_query_until('postgres',
+		"SELECT count(*) = 1 FROM pg_stat_activity WHERE backend_type = 'sphinxlink pool'")
+	  or die "pool worker did not start";
+}
+
+sub pooled_query
+{
+	my ($query, $columns) = @_;
+	$query =~ s/'/''/g;
+	return "SELECT * FROM sphinx_query_params('127.0.0.1', $port, '$query') AS t ($columns)";
+}
+
+# connections searchd has accepted so far
+sub connections
+{
+	return $node->safe_psql('postgres',
+		'SELECT value FROM ('
+		  . pooled_query('SHOW STATUS', 'name text, value text')
+		  . ") s WHERE name = 'connections'");
+}
+
+my $count_docs = 'SELECT count(*) FROM (' . pooled_query('SELECT id FROM docs', 'id bigint') . ') s';
+
+wait_for_worker();
+
+my $before = connections();
+is($node->safe_psql('postgres', $count_docs), '10', "a backend's query runs in the pool")
+  foreach (1 .. 5);
+is(connections(), $before, 'backends share the pooled connection');
+
+# the worker hands errors back and keeps the connection
+my ($ret, $stdout, $stderr) = $node->psql('postgres',
+	pooled_query('SELECT id FROM nosuch', 'id bigint'));
+isnt($ret, 0, 'a failing pooled query fails');
+like($stderr, qr/unknown local index 'nosuch'/, "searchd's error is reported");
+is($node->safe_psql('postgres', $count_docs), '10', 'the pool works after an error');
+is(connections(), $before, 'a query error does not close the connection');
+
+# SHOW META describes the backend's previous query
+is( $node->safe_psql(
+		'postgres',
+		'SELECT count(*) FROM ('
+		  . pooled_query("SELECT id FROM docs WHERE MATCH('fox')", 'id bigint')
+		  . ') s;'
+		  . pooled_query('SHOW META', 'name text, value text')
+		  . " WHERE name = 'total_found'"),
+	"4\ntotal_found|4",
+	'SHOW META follows the query of the same backend');
+
+# a cancelled query doesn't hold up the next one
+($ret, $stdout, $stderr) = $node->psql('postgres',
+	"SET statement_timeout = '300ms';"
+	  . pooled_query('SELECT id FROM docs_5000ms', 'id bigint'));
+like($stderr, qr/canceling statement due to statement timeout/,
+	'a pooled query can be cancelled');
+my $start = time();
+is($node->safe_psql('postgres', $count_docs), '10', 'the pool works after a cancel');
+cmp_ok(time() - $start, '<', 4, 'the cancelled query does not hold up the next one');
+
+# backends use a restarted worker
+$node->safe_psql('postgres',
+	"SELECT pg_terminate_backend(pid) FROM pg_stat_activity WHERE backend_type = 'sphinxlink pool'");
+$node->poll_query_until('postgres',
+	"SELECT count(*) = 0 FROM pg_stat_activity WHERE backend_type = 'sphinxlink pool'")
+  or die "pool worker did not exit";
+wait_for_worker();
+is($node->safe_psql('postgres', $count_docs), '10', 'queries go to a restarted worker');
+
+$node->stop;
+
+done_testing();
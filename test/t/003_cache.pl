@@ -0,0 +1,95 @@
+# Results of SELECT statements are shared between backends by the result cache.
+# searchd is played by test/mock_searchd.py.
+
+use strict;
+use warnings;
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+use Time::HiRes qw(usleep);
+
+my $port = PostgreSQL::Test::Cluster::get_free_port();
+my $pidfile = "${PostgreSQL::Test::Utils::tmp_check}/mock_searchd_cache.pid";
+
+system_or_bail('python3', 'test/mock_searchd.py', '--port', $port,
+	'--daemon', '--pidfile', $pidfile);
+
+END
+{
+	if (defined $pidfile && open(my $fh, '<', $pidfile))
+	{
+		my $pid = <$fh>;
+		close($fh);
+		kill 'TERM', $pid if $pid;
+	}
+}
+
+my $node = PostgreSQL::Test::Cluster->new('cache');
+$node->init;
+$node->append_conf(
+	'postgresql.conf', qq{
+shared_preload_libraries = 'sphinxlink'
+sphinxlink.cache_size = 1MB
+});
+$node->start;
+
+$node->safe_psql('postgres', 'CREATE EXTENSION sphinxlink');
+
+sub count_query
+{
+	my ($query) = @_;
+	$query =~ s/'/''/g;
+	return "SELECT count(*) FROM sphinx_query_params('127.0.0.1', $port, '$query') AS t (id bigint)";
+}
+
+# statements searchd received since the last call
+sub mock_log
+{
+	return $node->safe_psql('postgres',
+		    "SELECT string_agg(query, ';') FROM sphinx_query_params('127.0.0.1', $port, "
+		  . "'SHOW MOCK QUERIES') AS t (query text)");
+}
+
+sub cache_stats
+{
+	return $node->safe_psql('postgres',
+		'SELECT entries, hits, misses, inserts, invalidations FROM sphinx_cache_stats');
+}
+
+my $all = 'SELECT id FROM docs';
+my $fox = "SELECT id FROM docs WHERE MATCH('fox')";
+
+mock_log();
+is($node->safe_psql('postgres', count_query($all)), '10', 'a miss returns the result');
+is($node->safe_psql('postgres', count_query($all)), '10', 'a hit returns the same result');
+is(mock_log(), $all, 'the hit does not reach searchd');
+is(cache_stats(), '1|1|1|1|0', 'sphinx_cache_stats counts the hit and the miss');
+
+# sphinxlink.cache_ttl = 0 bypasses the cache
+is($node->safe_psql('postgres', 'SET sphinxlink.cache_ttl = 0;' . count_query($all)),
+	'10', 'a query bypassing the cache returns the result');
+is(mock_log(), $all, 'a query bypassing the cache reaches searchd');
+
+# an entry expires after the TTL of the session that stored it
+is($node->safe_psql('postgres', 'SET sphinxlink.cache_ttl = 200;' . count_query($fox)),
+	'4', 'a result is stored with a short TTL');
+usleep(400_000);
+is($node->safe_psql('postgres', count_query($fox)), '4', 'an expired entry is not returned');
+is(mock_log(), "$fox;$fox", 'an expired entry is fetched again');
+is($node->safe_psql('postgres', count_query($fox)), '4', 'the new entry is returned');
+is(mock_log(), '', 'the new entry is used');
+
+# invalidation by pattern and of everything
+is($node->safe_psql('postgres', "SELECT sphinx_cache_invalidate('MATCH(')"),
+	'1', 'sphinx_cache_invalidate removes the entries matching the pattern');
+$node->safe_psql('postgres', count_query($fox) . ';' . count_query($all));
+is(mock_log(), $fox, 'only the invalidated entry is fetched again');
+is($node->safe_psql('postgres', 'SELECT sphinx_cache_invalidate()'),
+	'2', 'sphinx_cache_invalidate() removes all entries');
+$node->safe_psql('postgres', count_query($all));
+is(mock_log(), $all, 'an invalidated entry is fetched again');
+is(cache_stats(), '1|3|5|5|3', 'sphinx_cache_stats counts everything');
+
+$node->stop;
+
+done_testing();
@@ -0,0 +1,86 @@
+# Queries are counted per connection and per query text in shared memory.
+# searchd is played by test/mock_searchd.py.
+
+use strict;
+use warnings;
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $port = PostgreSQL::Test::Cluster::get_free_port();
+my $pidfile = "${PostgreSQL::Test::Utils::tmp_check}/mock_searchd_stat.pid";
+
+system_or_bail('python3', 'test/mock_searchd.py', '--port', $port,
+	'--daemon', '--pidfile', $pidfile);
+
+END
+{
+	if (defined $pidfile && open(my $fh, '<', $pidfile))
+	{
+		my $pid = <$fh>;
+		close($fh);
+		kill 'TERM', $pid if $pid;
+	}
+}
+
+my $node = PostgreSQL::Test::Cluster->new('stat');
+$node->init;
+$node->append_conf(
+	'postgresql.conf', qq{
+shared_preload_libraries = 'sphinxlink'
+sphinxlink.track_queries = on
+});
+$node->start;
+
+$node->safe_psql('postgres', 'CREATE EXTENSION sphinxlink');
+
+my $connect = "SELECT sphinx_connect('s', '127.0.0.1', $port);";
+
+$node->safe_psql(
+	'postgres', qq{
+$connect
+SELECT count(*) FROM sphinx_query('s', 'SELECT id FROM docs') AS t (id bigint);
+SELECT count(*) FROM sphinx_query('s', 'SELECT id FROM docs') AS t (id bigint);
+SELECT count(*) FROM sphinx_query('s', 'SELECT id FROM docs WHERE MATCH(?)', 'fox') AS t (id bigint);
+SELECT count(*) FROM sphinx_query_params('127.0.0.1', $port, 'SELECT id FROM docs') AS t (id bigint);
+});
+my ($ret, $stdout, $stderr) = $node->psql('postgres',
+	$connect . "SELECT * FROM sphinx_query('s', 'SELECT id FROM nosuch') AS t (id bigint)");
+isnt($ret, 0, 'a query on a missing index fails');
+
+is( $node->safe_psql(
+		'postgres', q{
+SELECT coalesce(conname, '-'), queries, errors, rows, bytes > 0, wait_time >= 0,
+       (SELECT sum(n) FROM unnest(latency_histogram) n) = queries
+FROM sphinx_stat_connections ORDER BY conname NULLS FIRST}),
+	"-|1|0|10|t|t|t\ns|4|1|24|t|t|t",
+	'sphinx_stat_connections counts the queries of every connection');
+
+is( $node->safe_psql(
+		'postgres', q{
+SELECT query, calls, errors, rows, total_time >= max_time, last_meta_time IS NOT NULL
+FROM sphinx_stat_queries ORDER BY query}),
+	"SELECT id FROM docs|3|0|30|t|t\n"
+	  . "SELECT id FROM docs WHERE MATCH(?)|1|0|4|t|t\n"
+	  . "SELECT id FROM nosuch|1|1|0|t|f",
+	'sphinx_stat_queries counts the queries of every text');
+
+# both views are shared between backends
+is( $node->safe_psql(
+		'postgres', qq{
+$connect
+SELECT count(*) FROM sphinx_query('s', 'SELECT id FROM docs WHERE MATCH(?)', 'dog') AS t (id bigint);
+SELECT calls FROM sphinx_stat_queries WHERE query LIKE '%MATCH(?)%'}),
+	"OK\n1\n2",
+	'calls differing in the match clause share a row');
+
+$node->safe_psql('postgres', 'SELECT sphinx_stat_reset()');
+is( $node->safe_psql(
+		'postgres',
+		'SELECT (SELECT count(*) FROM sphinx_stat_connections), (SELECT count(*) FROM sphinx_stat_queries)'),
+	'0|0',
+	'sphinx_stat_reset() clears both views');
+
+$node->stop;
+
+done_testing();
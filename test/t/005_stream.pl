@@ -0,0 +1,62 @@
+# Streamed and stored results are the same, and a streamed query can be
+# cancelled without losing the connection.
+# searchd is played by test/mock_searchd.py.
+
+use strict;
+use warnings;
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $port = PostgreSQL::Test::Cluster::get_free_port();
+my $pidfile = "${PostgreSQL::Test::Utils::tmp_check}/mock_searchd_stream.pid";
+
+system_or_bail('python3', 'test/mock_searchd.py', '--port', $port,
+	'--daemon', '--pidfile', $pidfile);
+
+END
+{
+	if (defined $pidfile && open(my $fh, '<', $pidfile))
+	{
+		my $pid = <$fh>;
+		close($fh);
+		kill 'TERM', $pid if $pid;
+	}
+}
+
+my $node = PostgreSQL::Test::Cluster->new('stream');
+$node->init;
+$node->start;
+
+$node->safe_psql('postgres', 'CREATE EXTENSION sphinxlink');
+
+my $connect = "SELECT sphinx_connect('m', '127.0.0.1', $port);";
+my $summary =
+    "SELECT count(*), sum(c1), md5(string_agg(c3, ',' ORDER BY id)) FROM sphinx_query('m', "
+  . "'SELECT * FROM bench_200000_4 LIMIT 200000 OPTION max_matches=200000') "
+  . "AS t (id bigint, c1 bigint, c2 float8, c3 text);";
+
+my $stored = $node->safe_psql('postgres',
+	"SET sphinxlink.stream_results = off;" . $connect . $summary);
+my $streamed = $node->safe_psql('postgres',
+	"SET sphinxlink.stream_results = on;" . $connect . $summary);
+like($streamed, qr/^OK\n200000\|/, 'a streamed result has all rows');
+is($streamed, $stored, 'streamed and stored results are the same');
+
+# cancel while the rows arrive; the next query on the connection gets its own result
+my ($ret, $stdout, $stderr) = $node->psql(
+	'postgres',
+	"SET sphinxlink.stream_results = on;"
+	  . $connect
+	  . "SET statement_timeout = '50ms';"
+	  . $summary
+	  . "RESET statement_timeout;"
+	  . "SELECT count(*) FROM sphinx_query('m', 'SELECT id FROM docs') AS t (id bigint);",
+	on_error_stop => 0);
+like($stderr, qr/canceling statement due to statement timeout/,
+	'a streamed query can be cancelled');
+is($stdout, "OK\n10", 'the connection works after a cancelled streamed query');
+
+$node->stop;
+
+done_testing();